@@ -0,0 +1,201 @@
+#!/usr/bin/env bash
+#
+# benches/loopback.sh:
+#   End-to-end loopback throughput and latency benchmark
+#
+# Copyright (C) 2015 Emilio Cobos Álvarez <emiliocobos@usal.es>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Starts a server and BENCH_CLIENTS clients on the loopback interface with a
+# synthetic catalog (--synthetic) of BENCH_EVENTS events, with description
+# sizes drawn from BENCH_SIZE_DIST (uniform:16-254 bytes by default) and
+# periods from BENCH_PERIOD_DIST (zipf:1-10 seconds by default: mostly fast
+# events, and a tail of slow ones), for BENCH_DURATION seconds. They take any
+# of the server's distributions, and BENCH_SIZE and BENCH_PERIOD are shorthands
+# for fixed ones.
+#
+# The server sends framed events (--framed), so the clients can measure the
+# latency from the dispatch to the receive. The result is written as JSON to
+# $BENCH_OUTPUT (target/bench/loopback.json by default), along with how late
+# the server dispatched the events, so runs with different BENCH_SERVER_FLAGS
+# (say "--shards 1" and "--shards 1 --realtime") or BENCH_CLIENT_FLAGS (say ""
+# and "--busy-poll --busy-poll-cpu 3") can be compared.
+#
+# It's done twice: a "burst" run with BENCH_SERVER_FLAGS alone, where every
+# event is first due at the same time, and a "paced" one with
+# BENCH_PACED_FLAGS too ("--spread --max-pps 20000" by default), which spreads
+# the first dispatches over the periods and caps the rate. Set
+# BENCH_PACED_FLAGS to "" to skip it. For both, the clients report the
+# percentiles of the time between the datagrams they get ("gap_us"), which
+# tells how bursty the traffic was, next to the loss it caused.
+#
+# The loss of a client is the share of the events the server sent that it
+# didn't get (parity and repairs aside). The "loss" of its own stats only sees
+# the gaps between the sequence numbers it got, so it's left out. The CPU time
+# per packet is the one of the whole process (getrusage(), every thread), as
+# written by the server and the clients in their stats.
+#
+# The loopback interface has to accept multicast traffic. On Linux:
+#
+#   ip link set lo multicast on
+#   ip route add 224.0.0.0/4 dev lo         # for IPv4 groups
+#   ip -6 route add ff00::/8 dev lo table local  # for IPv6 groups
+#
+# Needs python3 to put the report together. Run it with `make bench`, or
+# directly from the root of the repository.
+set -e
+
+BENCH_ADDRESS=${BENCH_ADDRESS:-239.255.77.1}
+BENCH_INTERFACE=${BENCH_INTERFACE:-lo}
+BENCH_PORT=${BENCH_PORT:-8765}
+BENCH_CLIENTS=${BENCH_CLIENTS:-2}
+BENCH_EVENTS=${BENCH_EVENTS:-5000}
+BENCH_DURATION=${BENCH_DURATION:-5}
+[ -n "$BENCH_SIZE" ] && BENCH_SIZE_DIST=${BENCH_SIZE_DIST:-fixed:$BENCH_SIZE}
+[ -n "$BENCH_PERIOD" ] && BENCH_PERIOD_DIST=${BENCH_PERIOD_DIST:-fixed:$BENCH_PERIOD}
+BENCH_SIZE_DIST=${BENCH_SIZE_DIST:-uniform:16-254}
+BENCH_PERIOD_DIST=${BENCH_PERIOD_DIST:-zipf:1-10}
+BENCH_SERVER_FLAGS=${BENCH_SERVER_FLAGS:---shards 1}
+BENCH_PACED_FLAGS=${BENCH_PACED_FLAGS---spread --max-pps 20000}
+BENCH_CLIENT_FLAGS=${BENCH_CLIENT_FLAGS:-}
+BENCH_DIR=${BENCH_DIR:-target/bench}
+BENCH_OUTPUT=${BENCH_OUTPUT:-$BENCH_DIR/loopback.json}
+
+SERVER=${SERVER:-target/server}
+CLIENT=${CLIENT:-target/client}
+
+# Run the server with the flags in $2 against the clients, leaving their
+# stats and logs in $BENCH_DIR/$1.
+run_bench() {
+    local dir="$BENCH_DIR/$1"
+    mkdir -p "$dir"
+    rm -f "$dir"/server.json "$dir"/client-*.json
+
+    local client_pids=()
+    for i in $(seq 1 "$BENCH_CLIENTS"); do
+        "$CLIENT" -a "$BENCH_ADDRESS" -i "$BENCH_INTERFACE" -p "$BENCH_PORT" \
+            --quiet --stats-json "$dir/client-$i.json" $BENCH_CLIENT_FLAGS \
+            2> "$dir/client-$i.log" &
+        client_pids+=($!)
+    done
+
+    # Give the clients time to join the group.
+    sleep 0.5
+
+    "$SERVER" -a "$BENCH_ADDRESS" -i "$BENCH_INTERFACE" -p "$BENCH_PORT" \
+        --synthetic "$BENCH_EVENTS" --synthetic-size "$BENCH_SIZE_DIST" \
+        --synthetic-period "$BENCH_PERIOD_DIST" --framed --stats-json "$dir/server.json" \
+        $2 2> "$dir/server.log" &
+    local server_pid=$!
+
+    sleep "$BENCH_DURATION"
+
+    if ! kill -INT $server_pid 2> /dev/null; then
+        echo "The server exited early:" >&2
+        cat "$dir/server.log" >&2
+        kill -INT "${client_pids[@]}"
+        exit 1
+    fi
+    wait $server_pid || true
+
+    # Let the last datagrams arrive.
+    sleep 0.2
+    for pid in "${client_pids[@]}"; do
+        kill -INT $pid
+        wait $pid || true
+    done
+}
+
+RUNS="burst"
+run_bench burst "$BENCH_SERVER_FLAGS"
+if [ -n "$BENCH_PACED_FLAGS" ]; then
+    RUNS="$RUNS paced"
+    run_bench paced "$BENCH_SERVER_FLAGS $BENCH_PACED_FLAGS"
+fi
+
+BENCH_ADDRESS="$BENCH_ADDRESS" BENCH_CLIENTS="$BENCH_CLIENTS" \
+BENCH_EVENTS="$BENCH_EVENTS" BENCH_SIZE_DIST="$BENCH_SIZE_DIST" \
+BENCH_PERIOD_DIST="$BENCH_PERIOD_DIST" BENCH_DURATION="$BENCH_DURATION" \
+BENCH_SERVER_FLAGS="$BENCH_SERVER_FLAGS" BENCH_PACED_FLAGS="$BENCH_PACED_FLAGS" \
+BENCH_CLIENT_FLAGS="$BENCH_CLIENT_FLAGS" BENCH_DIR="$BENCH_DIR" RUNS="$RUNS" \
+python3 - > "$BENCH_OUTPUT" <<'PYTHON'
+import json
+import os
+
+env = os.environ
+
+
+def load(run, name):
+    with open(os.path.join(env["BENCH_DIR"], run, name)) as f:
+        return json.load(f)
+
+
+def per_packet(cpu_us, packets):
+    return round(cpu_us / packets, 3) if packets else 0
+
+
+def report_run(run):
+    server = load(run, "server.json")
+    # Parity datagrams aren't events, nobody would count them as received.
+    sent = server["packets"] - server["parity"]
+
+    clients = []
+    for i in range(1, int(env["BENCH_CLIENTS"]) + 1):
+        stats = load(run, "client-%d.json" % i)
+        received = stats["framed"]
+        clients.append({
+            "received": received,
+            "pps": stats["pps"],
+            "loss": round((sent - received) / sent, 6) if sent else 0,
+            "cpu_us_per_packet": per_packet(stats["cpu_us"],
+                                            stats["payloads"]),
+            "peak_rss_kb": stats["peak_rss_kb"],
+            "latency_us": stats["latency_us"],
+            "gap_us": stats["gap_us"],
+        })
+
+    return {
+        "server": {
+            "sent": sent,
+            "parity": server["parity"],
+            "pps": server["pps"],
+            "cpu_us_per_packet": per_packet(server["cpu_us"],
+                                            server["packets"]),
+            "peak_rss_kb": server["peak_rss_kb"],
+            "lateness_us": server["lateness_us"],
+        },
+        "clients": clients,
+    }
+
+
+report = {
+    "config": {
+        "address": env["BENCH_ADDRESS"],
+        "clients": int(env["BENCH_CLIENTS"]),
+        "events": int(env["BENCH_EVENTS"]),
+        "size": env["BENCH_SIZE_DIST"],
+        "period_sec": env["BENCH_PERIOD_DIST"],
+        "duration_sec": float(env["BENCH_DURATION"]),
+        "server_flags": env["BENCH_SERVER_FLAGS"],
+        "paced_flags": env["BENCH_PACED_FLAGS"],
+        "client_flags": env["BENCH_CLIENT_FLAGS"],
+    },
+    "runs": {run: report_run(run) for run in env["RUNS"].split()},
+}
+
+print(json.dumps(report, indent=2))
+PYTHON
+
+cat "$BENCH_OUTPUT"
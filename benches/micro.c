@@ -0,0 +1,511 @@
+/**
+ * micro.c:
+ *   Microbenchmarks for the event list, the config parser and the send path
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Every benchmark runs once to warm up, and then `--reps` times, and we report
+ * the minimum and the median of the repetitions. The minimum is the one to
+ * compare across changes, the median tells how noisy the machine was.
+ *
+ * Build with `make release bench-micro` for numbers that mean something.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "event.h"
+#include "config.h"
+#include "logger.h"
+#include "scheduler.h"
+#include "sender.h"
+#include "socket-utils.h"
+
+typedef struct bench_config {
+    size_t reps;
+    size_t max_size;
+    size_t max_ordered_size;
+    size_t config_lines;
+    size_t sends;
+    size_t segments;
+} bench_config_t;
+
+/**
+ * A benchmark runs `n` operations over `context` and returns how long the
+ * timed part took, in nanoseconds.
+ */
+typedef uint64_t (*bench_fn)(size_t n, void* context);
+
+void show_usage(int _argc, char** argv) {
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -h, --help\t Display this message and exit\n");
+    fprintf(stderr, "  --reps [n]\t Repetitions after the warm-up (default 5)\n");
+    fprintf(stderr, "  --max-size [n]\t Biggest event list (default 10000000)\n");
+    fprintf(stderr, "  --max-ordered-size [n]\t Biggest list built with\n"
+                    "\t\t event_list_push_ordered, which is quadratic (default 10000)\n");
+    fprintf(stderr, "  --config-lines [n]\t Lines of the parsed config (default 10000)\n");
+    fprintf(stderr, "  --sends [n]\t Datagrams sent per repetition (default 100000)\n");
+    fprintf(stderr, "  --segments [n]\t Datagrams per GSO send (default 16, at most %d)\n",
+            SENDER_MAX_GSO_SEGMENTS);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Author(s):\n");
+    fprintf(stderr, "  Emilio Cobos Álvarez (<emiliocobos@usal.es>)\n");
+}
+
+/** xorshift64, so every run works with the same data */
+static uint64_t random_next(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+/** Warm up, run the benchmark `reps` times, and sort the samples */
+static void run(const bench_config_t* config,
+                bench_fn fn,
+                size_t n,
+                void* context,
+                uint64_t* samples) {
+    fn(n, context);
+    for (size_t i = 0; i < config->reps; ++i)
+        samples[i] = fn(n, context);
+    qsort(samples, config->reps, sizeof(uint64_t), compare_u64);
+}
+
+/** Report nanoseconds per operation */
+static void report_latency(const char* name,
+                           size_t n,
+                           const uint64_t* samples,
+                           size_t reps) {
+    printf("%-28s %10zu %12.1f %12.1f  ns/op\n", name, n,
+           (double) samples[0] / n, (double) samples[reps / 2] / n);
+    fflush(stdout);
+}
+
+/** Report MB/s, for `bytes` processed per repetition */
+static void report_throughput(const char* name,
+                              size_t n,
+                              size_t bytes,
+                              const uint64_t* samples,
+                              size_t reps) {
+    // The fastest repetition is the biggest throughput.
+    printf("%-28s %10zu %12.1f %12.1f  MB/s\n", name, n,
+           bytes * 1e3 / samples[0], bytes * 1e3 / samples[reps / 2]);
+    fflush(stdout);
+}
+
+/** Whether a list of `n` events fits comfortably in the available memory */
+static bool list_fits_in_memory(size_t n) {
+    long pages = sysconf(_SC_AVPHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages < 0 || page_size < 0)
+        return true;
+
+    // Plus malloc's bookkeeping.
+    double needed = (double) n * (sizeof(event_list_node_t) + 16);
+    return needed < 0.8 * pages * page_size;
+}
+
+/// The events pushed into the lists, with random periods.
+static event_t* EVENTS = NULL;
+
+static void build_list(event_list_t* list, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        event_list_push(list, &EVENTS[i]);
+}
+
+static uint64_t bench_push(size_t n, void* _context) {
+    event_list_t list = EVENT_LIST_INITIALIZER;
+
+    uint64_t start = monotonic_now();
+    build_list(&list, n);
+    uint64_t elapsed = monotonic_now() - start;
+
+    event_list_destroy(&list);
+    return elapsed;
+}
+
+static uint64_t bench_push_ordered(size_t n, void* _context) {
+    event_list_t list = EVENT_LIST_INITIALIZER;
+
+    uint64_t start = monotonic_now();
+    for (size_t i = 0; i < n; ++i)
+        event_list_push_ordered(&list, &EVENTS[i]);
+    uint64_t elapsed = monotonic_now() - start;
+
+    event_list_destroy(&list);
+    return elapsed;
+}
+
+static uint64_t bench_pop(size_t n, void* _context) {
+    event_list_t list = EVENT_LIST_INITIALIZER;
+    build_list(&list, n);
+
+    event_t event;
+    uint64_t start = monotonic_now();
+    while (event_list_pop(&list, &event))
+        ;
+    uint64_t elapsed = monotonic_now() - start;
+
+    assert(event_list_is_empty(&list));
+    return elapsed;
+}
+
+/** Remove every other node while walking the list, so n / 2 operations */
+static uint64_t bench_remove(size_t n, void* _context) {
+    event_list_t list = EVENT_LIST_INITIALIZER;
+    build_list(&list, n);
+
+    uint64_t start = monotonic_now();
+    event_list_node_t* current = event_list_head(&list);
+    while (event_list_node_has_value(current)) {
+        event_list_remove(&list, current);
+        current = event_list_node_next(current);
+    }
+    uint64_t elapsed = monotonic_now() - start;
+
+    event_list_destroy(&list);
+    return elapsed;
+}
+
+/** `n` lines in the config file format, separated by null characters */
+typedef struct config_text {
+    char* buffer;
+    size_t length;
+    const char* filename;
+} config_text_t;
+
+static void generate_config_text(config_text_t* text, size_t n) {
+    text->buffer = malloc(n * 96);
+    assert(text->buffer);
+    text->length = 0;
+
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < n; ++i) {
+        int written = sprintf(text->buffer + text->length,
+                              "%llu %llu event %zu with a description of "
+                              "a typical length",
+                              (unsigned long long)(random_next(&state) % 3600 + 1),
+                              (unsigned long long)(random_next(&state) % 86400),
+                              i);
+        assert(written > 0);
+        text->length += written + 1;
+    }
+}
+
+static uint64_t bench_parse_event(size_t n, void* context) {
+    const config_text_t* text = (const config_text_t*) context;
+    event_t event;
+
+    uint64_t start = monotonic_now();
+    const char* line = text->buffer;
+    for (size_t i = 0; i < n; ++i) {
+        bool ok = parse_event(line, &event);
+        assert(ok);
+        line += strlen(line) + 1;
+    }
+    return monotonic_now() - start;
+}
+
+static uint64_t bench_parse_config_file(size_t n, void* context) {
+    const config_text_t* text = (const config_text_t*) context;
+    event_list_t list = EVENT_LIST_INITIALIZER;
+
+    uint64_t start = monotonic_now();
+    bool ok = parse_config_file(text->filename, &list);
+    uint64_t elapsed = monotonic_now() - start;
+
+    assert(ok);
+    assert(event_list_size(&list) == n);
+    event_list_destroy(&list);
+    return elapsed;
+}
+
+static uint64_t bench_sendto(size_t n, void* context) {
+    sender_t* sender = (sender_t*) context;
+    event_t event = EVENTS[0];
+
+    uint64_t start = monotonic_now();
+    for (size_t i = 0; i < n; ++i)
+        if (sender_send(sender, &event) < 0)
+            FATAL("send: %s", strerror(errno));
+    return monotonic_now() - start;
+}
+
+/** CPU time used by the calling thread, in nanoseconds */
+static uint64_t thread_cpu_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t) now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+typedef struct segmented_context {
+    sender_t* sender;
+    const event_t* events[SENDER_MAX_GSO_SEGMENTS];
+    size_t segments;
+} segmented_context_t;
+
+/**
+ * Send `n` datagrams in `sender_send_segmented()` calls of `segments` each,
+ * and return the CPU time it took (not the wall time, GSO is about the CPU
+ * the stack spends per datagram).
+ */
+static uint64_t bench_send_segmented(size_t n, void* context) {
+    segmented_context_t* segmented = (segmented_context_t*) context;
+
+    uint64_t start = thread_cpu_now();
+    for (size_t sent = 0; sent < n; sent += segmented->segments) {
+        size_t count = n - sent < segmented->segments ? n - sent
+                                                      : segmented->segments;
+        if (sender_send_segmented(segmented->sender, segmented->events,
+                                  count) < 0)
+            FATAL("send: %s", strerror(errno));
+    }
+    return thread_cpu_now() - start;
+}
+
+/**
+ * A socket that sends to a socket on the loopback that never reads, so the
+ * cost is just the syscall and the trip through the stack (datagrams are
+ * dropped once the receive buffer fills).
+ */
+static int open_loopback_sink(int* out_sink,
+                              struct sockaddr_in* out_addr) {
+    int sink = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sink < 0)
+        return -1;
+
+    memset(out_addr, 0, sizeof(*out_addr));
+    out_addr->sin_family = AF_INET;
+    out_addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    out_addr->sin_port = 0;
+
+    socklen_t len = sizeof(*out_addr);
+    if (bind(sink, (struct sockaddr*) out_addr, len) < 0 ||
+        getsockname(sink, (struct sockaddr*) out_addr, &len) < 0)
+        goto errexit;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        goto errexit;
+
+    *out_sink = sink;
+    return sock;
+
+errexit:
+    close(sink);
+    return -1;
+}
+
+static void bench_event_list(const bench_config_t* config, uint64_t* samples) {
+    EVENTS = malloc(sizeof(event_t) * config->max_size);
+    assert(EVENTS);
+
+    uint64_t state = 0x2545f4914f6cdd1dull;
+    for (size_t i = 0; i < config->max_size; ++i) {
+        event_t event = EVENT_INITIALIZER;
+        event.repeat_after = random_next(&state) % 3600 + 1;
+        event.id = i;
+        strcpy(event.description, "event");
+        EVENTS[i] = event;
+    }
+
+    for (size_t n = 1000; n <= config->max_size; n *= 10) {
+        if (!list_fits_in_memory(n)) {
+            printf("%-28s %10zu  skipped, not enough memory\n", "event_list_*", n);
+            continue;
+        }
+
+        run(config, bench_push, n, NULL, samples);
+        report_latency("event_list_push", n, samples, config->reps);
+
+        if (n <= config->max_ordered_size) {
+            run(config, bench_push_ordered, n, NULL, samples);
+            report_latency("event_list_push_ordered", n, samples, config->reps);
+        }
+
+        run(config, bench_pop, n, NULL, samples);
+        report_latency("event_list_pop", n, samples, config->reps);
+
+        run(config, bench_remove, n, NULL, samples);
+        report_latency("event_list_remove", n / 2, samples, config->reps);
+    }
+}
+
+static void bench_parser(const bench_config_t* config, uint64_t* samples) {
+    config_text_t text;
+    generate_config_text(&text, config->config_lines);
+
+    run(config, bench_parse_event, config->config_lines, &text, samples);
+    report_throughput("parse_event", config->config_lines, text.length,
+                      samples, config->reps);
+
+    char filename[] = "/tmp/mcast-bench-XXXXXX";
+    int fd = mkstemp(filename);
+    if (fd < 0)
+        FATAL("mkstemp: %s", strerror(errno));
+
+    FILE* f = fdopen(fd, "w");
+    assert(f);
+    const char* line = text.buffer;
+    for (size_t i = 0; i < config->config_lines; ++i) {
+        fprintf(f, "%s\n", line);
+        line += strlen(line) + 1;
+    }
+    fclose(f);
+
+    // parse_config_file() inserts in order, so this is quadratic too.
+    text.filename = filename;
+    run(config, bench_parse_config_file, config->config_lines, &text, samples);
+    report_throughput("parse_config_file", config->config_lines, text.length,
+                      samples, config->reps);
+
+    unlink(filename);
+    free(text.buffer);
+}
+
+static void bench_send(const bench_config_t* config, uint64_t* samples) {
+    int sink;
+    struct sockaddr_in addr;
+    int sock = open_loopback_sink(&sink, &addr);
+    if (sock < 0)
+        FATAL("Error creating loopback sockets: %s", strerror(errno));
+
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    sender_t sender = SENDER_INITIALIZER;
+    sender.socket = sock;
+    sender.addr = (struct sockaddr*) &addr;
+    sender.addr_len = sizeof(addr);
+
+    // What event_dispatcher() does: every send takes the shared lock.
+    sender.mutex = &mutex;
+    run(config, bench_sendto, config->sends, &sender, samples);
+    report_latency("sendto (locked)", config->sends, samples, config->reps);
+
+    // And what a shard does, for comparison.
+    sender.mutex = NULL;
+    run(config, bench_sendto, config->sends, &sender, samples);
+    report_latency("sendto (unlocked)", config->sends, samples, config->reps);
+
+    // What a shard does with --gso, in CPU time per datagram.
+    segmented_context_t segmented;
+    segmented.sender = &sender;
+    segmented.segments = config->segments;
+    for (size_t i = 0; i < config->segments; ++i)
+        segmented.events[i] = &EVENTS[0];
+
+    sender.gso = false;
+    run(config, bench_send_segmented, config->sends, &segmented, samples);
+    report_latency("send_segmented (cpu, no gso)", config->sends, samples,
+                   config->reps);
+
+    sender.gso = socket_supports_gso(sock);
+    if (sender.gso) {
+        // The route may still refuse to segment, and make it fall back.
+        run(config, bench_send_segmented, config->sends, &segmented, samples);
+        report_latency(sender.gso ? "send_segmented (cpu, gso)"
+                                  : "send_segmented (cpu, fell back)",
+                       config->sends, samples, config->reps);
+    } else {
+        printf("%-28s %10zu  skipped, no UDP GSO\n", "send_segmented (gso)",
+               config->sends);
+    }
+
+    close(sock);
+    close(sink);
+}
+
+static bool read_size(int argc, char** argv, int* i, size_t* out) {
+    ++*i;
+    if (*i == argc || argv[*i][0] < '0' || argv[*i][0] > '9')
+        return false;
+    *out = strtoul(argv[*i], NULL, 10);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    bench_config_t config;
+    config.reps = 5;
+    config.max_size = 10000000;
+    config.max_ordered_size = 10000;
+    config.config_lines = 10000;
+    config.sends = 100000;
+    config.segments = 16;
+
+    LOGGER_CONFIG.log_file = stderr;
+
+    for (int i = 1; i < argc; ++i) {
+        bool ok = true;
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            show_usage(argc, argv);
+            return 1;
+        } else if (strcmp(argv[i], "--reps") == 0) {
+            ok = read_size(argc, argv, &i, &config.reps);
+        } else if (strcmp(argv[i], "--max-size") == 0) {
+            ok = read_size(argc, argv, &i, &config.max_size);
+        } else if (strcmp(argv[i], "--max-ordered-size") == 0) {
+            ok = read_size(argc, argv, &i, &config.max_ordered_size);
+        } else if (strcmp(argv[i], "--config-lines") == 0) {
+            ok = read_size(argc, argv, &i, &config.config_lines);
+        } else if (strcmp(argv[i], "--sends") == 0) {
+            ok = read_size(argc, argv, &i, &config.sends);
+        } else if (strcmp(argv[i], "--segments") == 0) {
+            ok = read_size(argc, argv, &i, &config.segments);
+        } else {
+            WARN("Unhandled option: %s", argv[i]);
+        }
+
+        if (!ok)
+            FATAL("The %s option needs a numeric value", argv[i - 1]);
+    }
+
+    if (!config.reps || !config.config_lines || !config.sends)
+        FATAL("Can't run zero repetitions, lines or sends");
+
+    if (!config.segments || config.segments > SENDER_MAX_GSO_SEGMENTS)
+        FATAL("--segments has to be between 1 and %d", SENDER_MAX_GSO_SEGMENTS);
+
+    if (config.max_size < 1000)
+        config.max_size = 1000;
+
+    uint64_t* samples = malloc(sizeof(uint64_t) * config.reps);
+    assert(samples);
+
+    printf("%-28s %10s %12s %12s\n", "benchmark", "n", "min", "median");
+    bench_event_list(&config, samples);
+    bench_parser(&config, samples);
+    bench_send(&config, samples);
+
+    free(samples);
+    free(EVENTS);
+    return 0;
+}
@@ -21,14 +21,29 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
 #include <netdb.h>
 #include <assert.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/resource.h>
 
 #include "logger.h"
 #include "socket-utils.h"
+#include "scheduler.h"
+#include "histogram.h"
+#include "wire.h"
+#include "fec.h"
+#include "nack.h"
+#include "snapshot.h"
+#include "dedup.h"
+#include "ring.h"
+#include "metrics.h"
+#include "realtime.h"
+#include "filter.h"
 
 /// Shows usage of the program
 void show_usage(int _argc, char** argv) {
@@ -38,20 +53,547 @@ void show_usage(int _argc, char** argv) {
     fprintf(stderr, "  -a, --address [address]\t IPv6 address\n");
     fprintf(stderr, "  -i, --interface [iface]\t network interface\n");
     fprintf(stderr, "  -p, --port [port]\t Listen to [port]\n");
+    fprintf(stderr, "  --source [address]\t Only receive from the sender at [address]\n"
+                    "\t\t (source-specific join, can be repeated)\n");
+    fprintf(stderr, "  --exclude-source [address]\t Receive from every sender but the\n"
+                    "\t\t one at [address] (can be repeated)\n");
     fprintf(stderr, "  -v, --verbose\t Be verbose about what is going on\n");
     fprintf(stderr, "  -l, --log [file]\t Log to [file]\n");
+    fprintf(stderr, "  --gro\t Let the kernel coalesce received datagrams (UDP_GRO)\n");
+    fprintf(stderr, "  -q, --quiet\t Don't print the received events\n");
+    fprintf(stderr, "  --nack [port]\t Ask the server (on its --repair-port [port]) for\n"
+                    "\t\t the framed events we miss\n");
+    fprintf(stderr, "  --nack-delay [ms]\t Wait up to [ms] (default 20) before asking,\n"
+                    "\t\t in case someone else already did\n");
+    fprintf(stderr, "  --snapshot [host]\t Start from a snapshot of the active events,\n"
+                    "\t\t fetched from the --snapshot-port of the server at [host]\n");
+    fprintf(stderr, "  --snapshot-port [port]\t Port of the snapshot (default 8001)\n");
+    fprintf(stderr, "  --dedup\t Only print the events that are new or have\n"
+                    "\t\t changed, not every repetition\n");
+    fprintf(stderr, "  --dedup-ttl [s]\t Forget events not seen in [s] seconds\n"
+                    "\t\t (default 10), or twice their period if longer\n");
+    fprintf(stderr, "  --ring [name]\t Also publish the payloads in a shared memory\n"
+                    "\t\t ring, for `mcast-tail [name]` and other local readers\n");
+    fprintf(stderr, "  --ring-slots [n]\t Payloads the ring holds (default 4096)\n");
+    fprintf(stderr, "  --busy-poll[=usec]\t Spin on a non-blocking socket instead of\n"
+                    "\t\t sleeping until a datagram arrives, with reads that\n"
+                    "\t\t poll the device for [usec] (default 50, SO_BUSY_POLL)\n");
+    fprintf(stderr, "  --busy-poll-idle [ms]\t Go back to sleeping after [ms] without\n"
+                    "\t\t datagrams (default 100)\n");
+    fprintf(stderr, "  --busy-poll-cpu [n]\t Pin the client to cpu [n] while spinning\n");
+    fprintf(stderr, "  --filter [expr]\t Only receive the events that match [expr],\n"
+                    "\t\t dropping the rest in the kernel (can be repeated)\n");
+    fprintf(stderr, "  --kernel-timestamps\t Split the latency of framed events at the\n"
+                    "\t\t moment our kernel got them (SO_TIMESTAMPNS)\n");
+    fprintf(stderr, "  --stats-json [file]\t Write receive counters, loss, latency (of\n"
+                    "\t\t framed events) and inter-arrival gaps to [file] on exit\n");
+    fprintf(stderr, "  --metrics [name]\t Publish counters in shared memory, for\n"
+                    "\t\t `mcast-stat [name]`\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "[expr] is one of prefix=TEXT, id=N[,N...] or stream=N[,N...].\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Author(s):\n");
     fprintf(stderr, "  Emilio Cobos Álvarez (<emiliocobos@usal.es>)\n");
 }
 
+volatile sig_atomic_t INTERRUPTED = 0;
+
 void handle_interrupt(int sig) {
-    exit(0);
+    INTERRUPTED = 1;
 }
 
 int SOCKET = -1; // Yeah, global state ftw :/
 
+/// Receive counters, reported at exit.
+struct client_stats {
+    uint64_t reads;     // Successful receive calls
+    uint64_t coalesced; // Receive calls that returned more than one payload
+    uint64_t coalesced_payloads; // Payloads that came in those
+    uint64_t payloads;  // Payloads handed to the output stage
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t framed;    // Payloads with a header (see wire.h)
+    uint64_t lost;      // Sequence numbers skipped over
+    uint64_t reordered; // Sequence numbers received after a later one
+    uint64_t parity;    // Parity datagrams (see fec.h)
+    uint64_t recovered; // Payloads rebuilt from them
+    uint64_t nacks;     // NACKs sent (see repair.h)
+    uint64_t repaired;  // Missing payloads resent by the server
+    uint64_t duplicate_repairs; // Resent payloads we didn't miss
+    uint64_t snapshot;  // Payloads from the snapshot (see snapshot.h)
+    uint64_t stitched;  // Payloads dropped because the snapshot was newer
+    uint64_t suppressed; // Payloads not forwarded by --dedup
+    uint64_t spins;     // Empty reads while busy polling
+    uint64_t sleeps;    // Times busy polling gave up and slept in poll()
+    uint64_t first_at;  // Monotonic time of the first and last payload
+    uint64_t last_at;
+} STATS = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+/// Send-to-receive latency of framed payloads, in nanoseconds. Only
+/// meaningful if both ends share a clock (i.e. on the same host).
+histogram_t LATENCY;
+
+/// Time between payloads read from the group (rebuilt and snapshot ones
+/// aside), in nanoseconds: how bursty the sender looks from here.
+histogram_t GAPS;
+uint64_t LAST_ARRIVAL = 0;
+
+/// With --kernel-timestamps, when the kernel received what we're handling now
+/// (zero for repairs, snapshots and recovered payloads), and how long
+/// payloads take from the sender's send() to our kernel, and from our kernel
+/// to us, in nanoseconds.
+bool KERNEL_TIMESTAMPS = false;
+uint64_t RECEIVED_BY_KERNEL = 0;
+histogram_t SEND_TO_KERNEL;
+histogram_t KERNEL_TO_USER;
+
+/// The next sequence number we expect from each stream we've heard from, where
+/// it comes from, and its recent datagrams once it has sent parity.
+#define CLIENT_MAX_STREAMS 256
+struct stream_state {
+    uint32_t stream;
+    uint64_t next_sequence;
+    /// Datagrams below this one are older than the snapshot.
+    uint64_t snapshot_mark;
+    bool has_source;
+    struct sockaddr_storage source;
+    fec_decoder_t* fec;
+} STREAMS[CLIENT_MAX_STREAMS];
+size_t STREAM_COUNT = 0;
+
+/// The events we want, see filter.h. The socket drops the rest, so there
+/// are gaps in the sequence numbers that aren't losses.
+filter_t FILTER = FILTER_INITIALIZER;
+bool FILTERING = false;
+
+const char* STATS_FILENAME = NULL;
+bool QUIET = false;
+
+/// With --busy-poll, keep reading from the (non-blocking) socket until it has
+/// been idle for BUSY_POLL_IDLE, and only then sleep in poll().
+bool BUSY_POLL = false;
+uint64_t BUSY_POLL_IDLE = 100 * NSEC_PER_MSEC;
+
+/// Only forward the events that are new or have changed, see dedup.h.
+bool DEDUP = false;
+dedup_set_t DEDUPS = DEDUP_SET_INITIALIZER;
+
+/// Where local readers get the payloads from, see ring.h and mcast-tail.
+const char* RING_NAME = NULL;
+ring_region_t* RING = NULL;
+
+/// Repairs: the missing datagrams are asked for to the repair port of the
+/// server, through a socket of our own.
+#define CLIENT_NACK_RETRY (100 * NSEC_PER_SEC / 1000)
+uint16_t NACK_PORT = 0;
+int NACK_SOCKET = -1;
+nack_tracker_t NACKS;
+
+/// Shared memory counters, see mcast-stat.
+const char* METRICS_NAME = NULL;
+metrics_region_t* METRICS = NULL;
+metrics_slot_t* METRICS_SLOT = NULL;
+
+/// Find the state of a stream, starting at `sequence` if it's new. Returns
+/// NULL if there are too many streams to keep track of.
+struct stream_state* find_stream(uint32_t stream, uint64_t sequence) {
+    for (size_t i = 0; i < STREAM_COUNT; ++i)
+        if (STREAMS[i].stream == stream)
+            return &STREAMS[i];
+
+    if (STREAM_COUNT == CLIENT_MAX_STREAMS)
+        return NULL;
+
+    struct stream_state* state = &STREAMS[STREAM_COUNT++];
+    state->stream = stream;
+    state->next_sequence = sequence;
+    state->snapshot_mark = 0;
+    state->has_source = false;
+    state->fec = NULL;
+    return state;
+}
+
+void track_sequence(struct stream_state* state,
+                    uint64_t sequence,
+                    bool recovered) {
+    // Too many streams to keep track of, don't guess.
+    if (!state)
+        return;
+
+    if (sequence < state->next_sequence) {
+        // We counted it as lost already.
+        if (!recovered)
+            STATS.reordered++;
+        if (STATS.lost)
+            STATS.lost--;
+        return;
+    }
+
+    if (NACK_PORT && state->has_source && sequence > state->next_sequence)
+        nack_tracker_gap(&NACKS, state->stream, state->next_sequence,
+                         sequence - state->next_sequence, &state->source,
+                         monotonic_now());
+
+    if (!FILTERING)
+        STATS.lost += sequence - state->next_sequence;
+    state->next_sequence = sequence + 1;
+}
+
+void write_stats_json() {
+    FILE* out = fopen(STATS_FILENAME, "w");
+    if (!out) {
+        WARN("Could not open \"%s\": %s", STATS_FILENAME, strerror(errno));
+        return;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    uint64_t cpu_us =
+        (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+
+    double seconds = (double)(STATS.last_at - STATS.first_at) / NSEC_PER_SEC;
+    // Only the gaps between the sequence numbers we got: we can't tell what
+    // was lost before the first one or after the last one.
+    uint64_t expected = STATS.framed + STATS.lost;
+    fprintf(out, "{\"payloads\": %llu, \"bytes\": %llu, \"reads\": %llu, "
+                 "\"coalesced\": %llu, \"coalesced_payloads\": %llu, "
+                 "\"gro_hit_rate\": %.6f, \"errors\": %llu, \"framed\": %llu, \"streams\": %zu, "
+                 "\"lost\": %llu, \"reordered\": %llu, \"parity\": %llu, "
+                 "\"recovered\": %llu, \"nacks\": %llu, \"repaired\": %llu, "
+                 "\"duplicate_repairs\": %llu, \"snapshot\": %llu, "
+                 "\"stitched\": %llu, \"suppressed\": %llu, "
+                 "\"spins\": %llu, \"sleeps\": %llu, "
+                 "\"loss\": %.6f, "
+                 "\"elapsed_sec\": %.3f, \"pps\": %.1f, "
+                 "\"cpu_us\": %llu, \"peak_rss_kb\": %ld, "
+                 "\"latency_us\": {",
+            (unsigned long long) STATS.payloads,
+            (unsigned long long) STATS.bytes,
+            (unsigned long long) STATS.reads,
+            (unsigned long long) STATS.coalesced,
+            (unsigned long long) STATS.coalesced_payloads,
+            STATS.reads ? (double) STATS.coalesced / STATS.reads : 0.0,
+            (unsigned long long) STATS.errors,
+            (unsigned long long) STATS.framed,
+            STREAM_COUNT,
+            (unsigned long long) STATS.lost,
+            (unsigned long long) STATS.reordered,
+            (unsigned long long) STATS.parity,
+            (unsigned long long) STATS.recovered,
+            (unsigned long long) STATS.nacks,
+            (unsigned long long) STATS.repaired,
+            (unsigned long long) STATS.duplicate_repairs,
+            (unsigned long long) STATS.snapshot,
+            (unsigned long long) STATS.stitched,
+            (unsigned long long) STATS.suppressed,
+            (unsigned long long) STATS.spins,
+            (unsigned long long) STATS.sleeps,
+            expected ? (double) STATS.lost / expected : 0.0,
+            seconds,
+            seconds > 0 ? STATS.payloads / seconds : 0.0,
+            (unsigned long long) cpu_us, usage.ru_maxrss);
+    histogram_print_json(&LATENCY, out, 1000.0);
+    fprintf(out, "}, \"gap_us\": {");
+    histogram_print_json(&GAPS, out, 1000.0);
+    if (KERNEL_TIMESTAMPS) {
+        fprintf(out, "}, \"send_to_kernel_us\": {");
+        histogram_print_json(&SEND_TO_KERNEL, out, 1000.0);
+        fprintf(out, "}, \"kernel_to_user_us\": {");
+        histogram_print_json(&KERNEL_TO_USER, out, 1000.0);
+    }
+    fprintf(out, "}}\n");
+    fclose(out);
+}
+
+void report_stats() {
+    LOG("stats: %llu payloads (%llu bytes) in %llu reads, "
+        "%.2f payloads/read, GRO hit rate %.1f%%, %llu errors",
+        (unsigned long long) STATS.payloads,
+        (unsigned long long) STATS.bytes,
+        (unsigned long long) STATS.reads,
+        STATS.reads ? (double) STATS.payloads / STATS.reads : 0.0,
+        STATS.reads ? 100.0 * STATS.coalesced / STATS.reads : 0.0,
+        (unsigned long long) STATS.errors);
+
+    if (STATS.framed)
+        LOG("stats: %llu framed from %zu streams, %llu lost, %llu reordered, "
+            "%llu recovered from %llu parity, %llu repaired after %llu NACKs, "
+            "latency p50 %.1fus p99 %.1fus max %.1fus",
+            (unsigned long long) STATS.framed, STREAM_COUNT,
+            (unsigned long long) STATS.lost,
+            (unsigned long long) STATS.reordered,
+            (unsigned long long) STATS.recovered,
+            (unsigned long long) STATS.parity,
+            (unsigned long long) STATS.repaired,
+            (unsigned long long) STATS.nacks,
+            histogram_percentile(&LATENCY, 50) / 1000.0,
+            histogram_percentile(&LATENCY, 99) / 1000.0,
+            LATENCY.max / 1000.0);
+
+    if (DEDUP)
+        LOG("stats: %llu suppressed as repeated, %zu events tracked, "
+            "%llu expired",
+            (unsigned long long) STATS.suppressed, DEDUPS.count,
+            (unsigned long long) DEDUPS.expired);
+
+    if (KERNEL_TIMESTAMPS)
+        LOG("stats: send to kernel p50 %.1fus p99 %.1fus, "
+            "kernel to user p50 %.1fus p99 %.1fus (%llu timestamps)",
+            histogram_percentile(&SEND_TO_KERNEL, 50) / 1000.0,
+            histogram_percentile(&SEND_TO_KERNEL, 99) / 1000.0,
+            histogram_percentile(&KERNEL_TO_USER, 50) / 1000.0,
+            histogram_percentile(&KERNEL_TO_USER, 99) / 1000.0,
+            (unsigned long long) KERNEL_TO_USER.count);
+
+    if (BUSY_POLL)
+        LOG("stats: %llu empty reads while busy polling, slept %llu times",
+            (unsigned long long) STATS.spins,
+            (unsigned long long) STATS.sleeps);
+
+    if (STATS_FILENAME)
+        write_stats_json();
+}
+
+void output_payload(char* payload,
+                    size_t len,
+                    bool recovered,
+                    const struct sockaddr_storage* source);
+
+/// Rebuild the datagram a parity datagram protects, if we lost it.
+void handle_parity(const wire_header_t* header, const char* payload) {
+    STATS.parity++;
+
+    struct stream_state* state = find_stream(header->stream,
+                                             header->sequence);
+    if (!state)
+        return;
+
+    // We only start remembering datagrams once we know the stream has
+    // parity, so this block is most likely lost anyway.
+    if (!state->fec) {
+        state->fec = malloc(sizeof(fec_decoder_t));
+        assert(state->fec);
+        fec_decoder_init(state->fec);
+        return;
+    }
+
+    static unsigned char rebuilt[FEC_MAX_PROTECTED_SIZE];
+    size_t len = fec_decoder_recover(state->fec, header,
+                                     (const unsigned char*) payload, rebuilt);
+    if (!len)
+        return;
+
+    STATS.recovered++;
+    output_payload((char*) rebuilt, len, true, NULL);
+}
+
+/// Gets every datagram of the snapshot, before the ones of the group.
+void handle_snapshot_datagram(const unsigned char* datagram,
+                              size_t length,
+                              void* _data) {
+    wire_header_t header;
+    if (!wire_decode_header(datagram, length, &header))
+        return;
+
+    switch (header.type) {
+        case WIRE_TYPE_SNAPSHOT_MARK: {
+            struct stream_state* state = find_stream(header.stream,
+                                                     header.sequence);
+            if (state) {
+                state->next_sequence = header.sequence;
+                state->snapshot_mark = header.sequence;
+            }
+            break;
+        }
+        case WIRE_TYPE_EVENT:
+            // These don't go through the socket.
+            if (FILTERING && !filter_match(&FILTER, datagram, length))
+                break;
+            output_payload((char*) datagram, length, false, NULL);
+            break;
+        default:
+            break;
+    }
+}
+
+/// Send the NACKs that are due.
+void send_nacks() {
+    nack_request_t request;
+    while (nack_tracker_pop_due(&NACKS, monotonic_now(), &request)) {
+        unsigned char nack[WIRE_NACK_SIZE];
+        wire_encode_nack(request.stream, request.first, request.count, nack);
+
+        // Same host as the stream, but the repair port.
+        if (request.source.ss_family == AF_INET6)
+            ((struct sockaddr_in6*) &request.source)->sin6_port = htons(NACK_PORT);
+        else
+            ((struct sockaddr_in*) &request.source)->sin_port = htons(NACK_PORT);
+
+        LOG("NACK for %u from %llu (%u)", request.stream,
+            (unsigned long long) request.first, request.count);
+        if (sendto(NACK_SOCKET, nack, sizeof(nack), 0,
+                   (struct sockaddr*) &request.source,
+                   socket_address_length(&request.source)) < 0)
+            WARN("NACK: %s", strerror(errno));
+        else
+            STATS.nacks++;
+    }
+}
+
+/// Wait until there's something to read from SOCKET, or just check if `block`
+/// is false. Meanwhile, handle repairs on the NACK socket and send the NACKs
+/// that are due, if we use them. Returns whether SOCKET is readable.
+bool wait_for_datagram(char* buffer, size_t capacity, bool block) {
+    struct pollfd fds[2];
+    fds[0].fd = SOCKET;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = NACK_SOCKET;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    int timeout = block ? -1 : 0;
+    if (block && NACK_PORT) {
+        // Or until the next NACK is due.
+        uint64_t due = nack_tracker_next_due(&NACKS);
+        if (due != UINT64_MAX) {
+            uint64_t now = monotonic_now();
+            timeout = due > now ? (due - now + 999999) / 1000000 : 0;
+        }
+    }
+
+    if (poll(fds, NACK_PORT ? 2 : 1, timeout) < 0 && errno != EINTR)
+        WARN("poll: %s", strerror(errno));
+
+    if (NACK_PORT) {
+        if (fds[1].revents & POLLIN) {
+            ssize_t ret = recv(NACK_SOCKET, buffer, capacity, 0);
+            if (ret >= 0)
+                output_payload(buffer, ret, false, NULL);
+        }
+
+        send_nacks();
+    }
+
+    return fds[0].revents & POLLIN;
+}
+
+/// The output stage: gets every received payload (along with where it comes
+/// from, if it's been multicast), or rebuilt from parity.
+void output_payload(char* payload,
+                    size_t len,
+                    bool recovered,
+                    const struct sockaddr_storage* source) {
+    wire_header_t header;
+    bool framed = wire_decode_header((const unsigned char*) payload, len,
+                                     &header);
+    if (framed && header.type == WIRE_TYPE_PARITY) {
+        handle_parity(&header, payload + WIRE_HEADER_SIZE);
+        return;
+    }
+
+    bool from_snapshot = framed && (header.flags & WIRE_FLAG_SNAPSHOT);
+    struct stream_state* state = framed && !from_snapshot
+                               ? find_stream(header.stream, header.sequence)
+                               : NULL;
+    if (state && header.sequence < state->snapshot_mark) {
+        // Sent before the snapshot we started from, which is newer.
+        STATS.stitched++;
+        return;
+    }
+
+    bool repaired = framed && (header.flags & WIRE_FLAG_REPAIR);
+    if (repaired) {
+        // Whether we asked for it or someone else did and it got multicast,
+        // we want it only if we're missing it. Without NACKs, there's no way
+        // to tell.
+        if (!nack_tracker_fill(&NACKS, header.stream, header.sequence)) {
+            STATS.duplicate_repairs++;
+            return;
+        }
+        STATS.repaired++;
+    } else if (framed) {
+        // Late, or rebuilt from parity: no need to ask for it.
+        nack_tracker_fill(&NACKS, header.stream, header.sequence);
+    }
+
+    uint64_t now = monotonic_now();
+    if (!recovered && !from_snapshot) {
+        if (LAST_ARRIVAL)
+            histogram_record(&GAPS, now - LAST_ARRIVAL);
+        LAST_ARRIVAL = now;
+    }
+
+    if (!STATS.payloads)
+        STATS.first_at = now;
+    STATS.last_at = now;
+    STATS.payloads++;
+    STATS.bytes += len;
+    metrics_add(METRICS_SLOT, packets_received, 1);
+    metrics_add(METRICS_SLOT, bytes_received, len);
+
+    if (from_snapshot) {
+        STATS.snapshot++;
+        payload += WIRE_HEADER_SIZE;
+        len = header.payload_length;
+    } else if (framed) {
+        uint64_t sent_at = header.timestamp;
+        uint64_t received_at = wire_now();
+
+        if (state && source) {
+            state->source = *source;
+            state->has_source = true;
+        }
+
+        if (state && state->fec && !recovered)
+            fec_decoder_remember(state->fec, header.sequence,
+                                 (const unsigned char*) payload,
+                                 WIRE_HEADER_SIZE + header.payload_length);
+
+        STATS.framed++;
+        track_sequence(state, header.sequence, recovered || repaired);
+        histogram_record(&LATENCY,
+                         received_at > sent_at ? received_at - sent_at : 0);
+
+        if (RECEIVED_BY_KERNEL && !recovered)
+            histogram_record(&SEND_TO_KERNEL, RECEIVED_BY_KERNEL > sent_at
+                                            ? RECEIVED_BY_KERNEL - sent_at : 0);
+
+        payload += WIRE_HEADER_SIZE;
+        len = header.payload_length;
+    }
+
+    if (RECEIVED_BY_KERNEL && !recovered) {
+        uint64_t received_at = wire_now();
+        histogram_record(&KERNEL_TO_USER, received_at > RECEIVED_BY_KERNEL
+                                        ? received_at - RECEIVED_BY_KERNEL : 0);
+    }
+
+    if (DEDUP) {
+        uint64_t version = dedup_hash(payload, strnlen(payload, len));
+        uint64_t key = framed ? ((uint64_t) header.stream << 32) |
+                                header.event_id
+                              : version;
+        if (!dedup_check(&DEDUPS, key, version, now)) {
+            STATS.suppressed++;
+            return;
+        }
+    }
+
+    if (RING)
+        ring_publish(RING, payload, len, wire_now());
+
+    if (QUIET)
+        return;
+
+    // The server includes the null terminator, but don't trust it.
+    printf("> %.*s\n", (int) strnlen(payload, len), payload);
+}
+
 void cleanly_dealloc_resources() {
+    report_stats();
+
     if (LOGGER_CONFIG.log_file)
         fclose(LOGGER_CONFIG.log_file);
     LOGGER_CONFIG.log_file = NULL;
@@ -59,19 +601,54 @@ void cleanly_dealloc_resources() {
     if (SOCKET != -1)
         close(SOCKET);
     SOCKET = -1;
+
+    if (NACK_SOCKET != -1)
+        close(NACK_SOCKET);
+    NACK_SOCKET = -1;
+
+    for (size_t i = 0; i < STREAM_COUNT; ++i)
+        free(STREAMS[i].fec);
+
+    dedup_destroy(&DEDUPS);
+
+    ring_destroy(RING, RING_NAME);
+    RING = NULL;
+
+    metrics_destroy(METRICS, METRICS_NAME);
+    METRICS = NULL;
+    METRICS_SLOT = NULL;
 }
 
 int main(int argc, char** argv) {
     const char* ip_address = "ff02:0:0:0:2:3:2:4";
     const char* interface = NULL;
     const char* port = "8000";
+    bool enable_gro = false;
+    uint64_t nack_delay = 20 * NSEC_PER_SEC / 1000;
+    const char* snapshot_host = NULL;
+    const char* snapshot_port = "8001";
+    uint64_t dedup_ttl = 10 * NSEC_PER_SEC;
+    size_t ring_slots = 4096;
+    int busy_poll_usec = 50;
+    int busy_poll_cpu = -1;
+    multicast_filter_t filter = MULTICAST_FILTER_INITIALIZER;
 
     LOGGER_CONFIG.log_file = stderr;
+    histogram_init(&LATENCY);
+    histogram_init(&GAPS);
+    histogram_init(&SEND_TO_KERNEL);
+    histogram_init(&KERNEL_TO_USER);
 
     atexit(cleanly_dealloc_resources);
 
-    signal(SIGINT, handle_interrupt);
-    signal(SIGTERM, handle_interrupt);
+    // Without SA_RESTART, so a blocking read returns and we can leave the
+    // loop and report from main, not from the handler.
+    struct sigaction interrupt;
+    memset(&interrupt, 0, sizeof(interrupt));
+    interrupt.sa_handler = handle_interrupt;
+    sigemptyset(&interrupt.sa_mask);
+    sigaction(SIGINT, &interrupt, NULL);
+    sigaction(SIGTERM, &interrupt, NULL);
 
     for(int i  = 1; i < argc; ++i) {
         if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
@@ -110,16 +687,124 @@ int main(int argc, char** argv) {
             if (i == argc)
                 FATAL("The %s option needs a value", argv[i - 1]);
             interface = argv[i];
+        } else if (strcmp(argv[i], "--gro") == 0) {
+            enable_gro = true;
+        } else if (strcmp(argv[i], "-q") == 0 ||
+                   strcmp(argv[i], "--quiet") == 0) {
+            QUIET = true;
+        } else if (strcmp(argv[i], "--nack") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            NACK_PORT = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--nack-delay") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            nack_delay = strtoull(argv[i], NULL, 10) * NSEC_PER_SEC / 1000;
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            snapshot_host = argv[i];
+        } else if (strcmp(argv[i], "--snapshot-port") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            snapshot_port = argv[i];
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            DEDUP = true;
+        } else if (strcmp(argv[i], "--dedup-ttl") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            dedup_ttl = strtoull(argv[i], NULL, 10) * NSEC_PER_SEC;
+        } else if (strcmp(argv[i], "--ring") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            RING_NAME = argv[i];
+        } else if (strcmp(argv[i], "--ring-slots") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            ring_slots = strtoull(argv[i], NULL, 10);
+        } else if (strcmp(argv[i], "--busy-poll") == 0) {
+            BUSY_POLL = true;
+        } else if (strncmp(argv[i], "--busy-poll=", 12) == 0) {
+            BUSY_POLL = true;
+            if (argv[i][12] < '0' || argv[i][12] > '9')
+                FATAL("The --busy-poll option needs a numeric value");
+            busy_poll_usec = atoi(argv[i] + 12);
+        } else if (strcmp(argv[i], "--busy-poll-idle") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            BUSY_POLL_IDLE = strtoull(argv[i], NULL, 10) * NSEC_PER_MSEC;
+        } else if (strcmp(argv[i], "--busy-poll-cpu") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            busy_poll_cpu = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--source") == 0 ||
+                   strcmp(argv[i], "--exclude-source") == 0) {
+            bool exclude = strcmp(argv[i], "--exclude-source") == 0;
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            if (filter.count && filter.exclude != exclude)
+                FATAL("--source and --exclude-source can't be used together");
+            if (filter.count == MULTICAST_MAX_SOURCES)
+                FATAL("At most %d sources can be given", MULTICAST_MAX_SOURCES);
+            filter.exclude = exclude;
+            filter.sources[filter.count++] = argv[i];
+        } else if (strcmp(argv[i], "--filter") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            if (!filter_parse(argv[i], &FILTER))
+                FATAL("Invalid filter \"%s\", expected prefix=TEXT (only "
+                      "one, up to %d bytes), id=N[,N...] or stream=N[,N...] "
+                      "(up to %d of each)", argv[i], FILTER_MAX_PREFIX,
+                      FILTER_MAX_VALUES);
+            FILTERING = true;
+        } else if (strcmp(argv[i], "--kernel-timestamps") == 0) {
+            KERNEL_TIMESTAMPS = true;
+        } else if (strcmp(argv[i], "--stats-json") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            STATS_FILENAME = argv[i];
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            METRICS_NAME = argv[i];
         } else {
             WARN("Unhandled option: %s", argv[i]);
         }
     }
 
+    if (FILTERING && NACK_PORT) {
+        WARN("--nack would ask for the events --filter drops, ignoring it");
+        NACK_PORT = 0;
+    }
+
+    if (FILTERING && enable_gro) {
+        WARN("--filter would only look at the first datagram of every "
+             "coalesced batch, ignoring --gro");
+        enable_gro = false;
+    }
+
     LOG("Using iface: %s, port: %s, address: %s", interface, port, ip_address);
+    for (size_t i = 0; i < filter.count; ++i)
+        LOG("%s source: %s", filter.exclude ? "Excluding" : "Only from",
+            filter.sources[i]);
 
     struct sockaddr* addr = NULL;
     socklen_t len = 0;
-    SOCKET = create_multicast_receiver(ip_address, port, interface, &addr, &len);
+    SOCKET = create_multicast_receiver(ip_address, port, interface, &filter,
+                                       &addr, &len);
     if (addr)
         free(addr); // we don't care about it
 
@@ -128,21 +813,150 @@ int main(int argc, char** argv) {
                                                       errno ? strerror(errno)
                                                             : gai_strerror(SOCKET));
 
-    char buffer[512];
-    while (true) {
-        ssize_t ret = recvfrom(SOCKET, buffer, sizeof(buffer), 0, NULL, NULL);
+    if (FILTERING) {
+        size_t instructions;
+        if (!filter_attach(SOCKET, &FILTER, &instructions))
+            FATAL("Could not attach the filter: %s", strerror(errno));
+        LOG("Filter: %zu BPF instructions", instructions);
+    }
+
+    if (METRICS_NAME) {
+        METRICS = metrics_create(METRICS_NAME, "client");
+        if (!METRICS)
+            WARN("Could not create metrics \"%s\": %s", METRICS_NAME,
+                 strerror(errno));
+        METRICS_SLOT = metrics_claim_slot(METRICS, "receiver");
+    }
+
+    dedup_init(&DEDUPS, dedup_ttl);
+
+    if (RING_NAME) {
+        RING = ring_create(RING_NAME, ring_slots);
+        if (!RING)
+            FATAL("Could not create ring \"%s\": %s", RING_NAME,
+                  strerror(errno));
+    }
+
+    nack_tracker_init(&NACKS, nack_delay, CLIENT_NACK_RETRY,
+                      wire_now() ^ getpid());
+    if (NACK_PORT) {
+        NACK_SOCKET = create_unicast_socket(ip_address, "0");
+        if (NACK_SOCKET < 0)
+            FATAL("Error creating NACK socket (%d, %d): %s", NACK_SOCKET,
+                  errno, errno ? strerror(errno) : gai_strerror(NACK_SOCKET));
+    }
+
+    // We've joined the group already, so whatever is sent after the snapshot
+    // is waiting in the socket.
+    if (snapshot_host) {
+        int error;
+        errno = 0;
+        ssize_t events = snapshot_fetch(snapshot_host, snapshot_port,
+                                        handle_snapshot_datagram, NULL,
+                                        &error);
+        if (events < 0)
+            WARN("Could not fetch the snapshot from %s:%s (%d, %d): %s",
+                 snapshot_host, snapshot_port, error, errno,
+                 errno ? strerror(errno) : gai_strerror(error));
+        else
+            LOG("Snapshot: %zd events", events);
+        fflush(stdout);
+    }
+
+    if (enable_gro && !socket_enable_gro(SOCKET)) {
+        WARN("UDP GRO not supported, receiving datagrams one by one");
+        enable_gro = false;
+    }
+
+    if (KERNEL_TIMESTAMPS && !socket_enable_rx_timestamps(SOCKET)) {
+        WARN("Kernel RX timestamps not supported: %s", strerror(errno));
+        KERNEL_TIMESTAMPS = false;
+    }
+
+    if (BUSY_POLL) {
+        // The reads spin anyway, so SO_BUSY_POLL only makes them spin closer
+        // to the device.
+        if (!socket_enable_busy_poll(SOCKET, busy_poll_usec))
+            WARN("SO_BUSY_POLL not available, spinning on reads only: %s",
+                 strerror(errno));
+
+        if (fcntl(SOCKET, F_SETFL, fcntl(SOCKET, F_GETFL) | O_NONBLOCK) != 0)
+            FATAL("Couldn't make the socket non-blocking: %s", strerror(errno));
+
+        if (busy_poll_cpu >= 0)
+            realtime_pin(busy_poll_cpu, "busy poll");
+
+        LOG("Busy polling: %dus per read, idle after %llums, cpu %d",
+            busy_poll_usec,
+            (unsigned long long)(BUSY_POLL_IDLE / NSEC_PER_MSEC),
+            busy_poll_cpu);
+    }
+
+    // With GRO a single read can return up to 64KB worth of datagrams.
+    static char buffer[1 << 16];
+    uint64_t last_datagram = monotonic_now();
+    while (!INTERRUPTED) {
+        bool spinning = BUSY_POLL &&
+                        monotonic_now() - last_datagram < BUSY_POLL_IDLE;
+        if (spinning) {
+            // Read right away, just keep an eye on the NACK socket.
+            if (NACK_PORT)
+                wait_for_datagram(buffer, sizeof(buffer), false);
+        } else if (BUSY_POLL || NACK_PORT) {
+            if (BUSY_POLL)
+                STATS.sleeps++;
+            if (!wait_for_datagram(buffer, sizeof(buffer), true))
+                continue;
+        }
+
+        size_t segment_size;
+        uint64_t received_by_kernel;
+        struct sockaddr_storage source;
+        ssize_t ret = receive_segmented(SOCKET, buffer, sizeof(buffer),
+                                        &segment_size, &received_by_kernel,
+                                        &source);
+        if (ret < 0 && BUSY_POLL && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            STATS.spins++;
+            cpu_relax();
+            continue;
+        }
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
         if (ret < 0) {
+            STATS.errors++;
+            metrics_add(METRICS_SLOT, receive_errors, 1);
             WARN("read error: %s", strerror(errno));
+            continue;
+        }
+
+        STATS.reads++;
+        if (BUSY_POLL)
+            last_datagram = monotonic_now();
+        metrics_add(METRICS_SLOT, batches, 1);
+        metrics_add(METRICS_SLOT, batched_events,
+                    segment_size ? ((size_t) ret + segment_size - 1) / segment_size
+                                 : 1);
+
+        // Only for the payloads of this read, not what they let us recover.
+        RECEIVED_BY_KERNEL = received_by_kernel;
+        if (!segment_size) {
+            output_payload(buffer, ret, false, &source);
         } else {
-            if (ret < sizeof(buffer))
-                buffer[ret] = '\0';
-            else
-                buffer[sizeof(buffer) - 1] = '\0';
-            printf("> %s\n", buffer);
+            STATS.coalesced++;
+            size_t offset = 0;
+            size_t len;
+            char* datagram;
+            while ((len = next_segment(buffer, ret, segment_size, &offset,
+                                       &datagram))) {
+                STATS.coalesced_payloads++;
+                output_payload(datagram, len, false, &source);
+            }
         }
+        RECEIVED_BY_KERNEL = 0;
     }
 
-    assert(!"Unreachable");
-
+    LOG("Interrupted, exiting...");
     return 0;
 }
@@ -0,0 +1,88 @@
+/**
+ * completion.c:
+ *   Queue where dispatcher threads post that they're done
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "completion.h"
+#include "logger.h"
+
+bool completion_queue_init(completion_queue_t* queue) {
+    queue->overflowed = 0;
+    if (pipe(queue->fds) != 0)
+        return false;
+
+    if (fcntl(queue->fds[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(queue->fds[1], F_SETFL, O_NONBLOCK) != 0) {
+        int saved_errno = errno;
+        close(queue->fds[0]);
+        close(queue->fds[1]);
+        errno = saved_errno;
+        return false;
+    }
+
+    return true;
+}
+
+bool completion_queue_post(completion_queue_t* queue, size_t index) {
+    ssize_t ret;
+    do {
+        ret = write(queue->fds[1], &index, sizeof(index));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret == sizeof(index))
+        return true;
+
+    if (ret < 0 && errno == EAGAIN) {
+        __atomic_store_n(&queue->overflowed, 1, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    WARN("Couldn't post the completion of thread %zu: %s", index,
+         ret < 0 ? strerror(errno) : "short write");
+    return false;
+}
+
+size_t completion_queue_read(completion_queue_t* queue,
+                             size_t* out,
+                             size_t capacity) {
+    ssize_t ret;
+    do {
+        ret = read(queue->fds[0], out, sizeof(size_t) * capacity);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        if (errno != EAGAIN)
+            WARN("Reading the completion queue: %s", strerror(errno));
+        return 0;
+    }
+
+    return ret / sizeof(size_t);
+}
+
+bool completion_queue_take_overflow(completion_queue_t* queue) {
+    return __atomic_exchange_n(&queue->overflowed, 0, __ATOMIC_ACQUIRE);
+}
+
+void completion_queue_destroy(completion_queue_t* queue) {
+    close(queue->fds[0]);
+    close(queue->fds[1]);
+}
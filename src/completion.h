@@ -0,0 +1,65 @@
+/**
+ * completion.h:
+ *   Queue where dispatcher threads post that they're done
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Dispatcher threads that have sent their event for the last time post their
+ * index here, and the main thread (woken up by a signal) reads them to join
+ * those threads.
+ *
+ * It's a pipe (indices are smaller than PIPE_BUF, so writes are atomic) and
+ * neither end blocks: a thread posting can't be cancelled (see
+ * `dispatcher_finished()`), so if it blocked on a full pipe, joining it would
+ * hang the main thread. When the pipe is full the main thread has plenty to
+ * read already, so the index is dropped and `overflowed` is raised instead,
+ * and the main thread has to look for the threads that are done itself.
+ */
+typedef struct completion_queue {
+    int fds[2];
+    int overflowed;
+} completion_queue_t;
+
+/** Returns false and sets errno if the pipe couldn't be created */
+bool completion_queue_init(completion_queue_t* queue);
+
+/**
+ * Post `index`. Returns false, after raising `overflowed` if the pipe was
+ * full, if it couldn't be posted.
+ */
+bool completion_queue_post(completion_queue_t* queue, size_t index);
+
+/**
+ * Read up to `capacity` posted indices into `out`. Returns how many, zero
+ * if there are none.
+ */
+size_t completion_queue_read(completion_queue_t* queue,
+                             size_t* out,
+                             size_t capacity);
+
+/** Whether an index has been dropped since the last call */
+bool completion_queue_take_overflow(completion_queue_t* queue);
+
+void completion_queue_destroy(completion_queue_t* queue);
+
+#endif
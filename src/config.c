@@ -51,6 +51,14 @@ bool parse_event(const char* str, event_t* event) {
     }
 
     const char* cursor = str;
+    event->priority = EVENT_PRIORITY_BULK;
+    if (strncmp(cursor, "high ", 5) == 0) {
+        event->priority = EVENT_PRIORITY_HIGH;
+        cursor += 5;
+    } else if (strncmp(cursor, "bulk ", 5) == 0) {
+        cursor += 5;
+    }
+
     if (!read_long(&cursor, &event->repeat_after))
         return false;
 
@@ -86,8 +94,10 @@ bool parse_config_file(const char* filename, event_list_t* out_list) {
     }
 
     event_t event = EVENT_INITIALIZER;
+    uint32_t line_number = 0;
     while (fgets(line, sizeof(line), f)) {
         size_t len = strlen(line);
+        line_number++;
 
         // Trim last newline
         if (len && line[len - 1] == '\n')
@@ -105,6 +115,7 @@ bool parse_config_file(const char* filename, event_list_t* out_list) {
             continue;
         }
 
+        event.id = line_number;
         event_list_push_ordered(out_list, &event);
     }
 
@@ -24,10 +24,11 @@
  * The config file consist of multiple lines like:
  *
  * ```
- * repeat_after repeat_until description
+ * [high|bulk] repeat_after repeat_until description
  * ```
  *
- * If repeat_after or repeat_until is zero, it never repeats.
+ * If repeat_after or repeat_until is zero, it never repeats. Events are bulk
+ * unless the line starts with "high".
  *
  * We return a linked list of event_t elements in out_list.
  */
@@ -0,0 +1,312 @@
+/**
+ * control.c:
+ *   Add, update and cancel events at runtime through a Unix socket
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "control.h"
+#include "config.h"
+#include "logger.h"
+#include "socket-utils.h"
+
+/** Drop connections that have been idle for this long */
+#define CONTROL_IDLE_TIMEOUT_SEC 60
+
+static bool read_keyword(const char** cursor, const char* keyword) {
+    size_t length = strlen(keyword);
+    if (strncmp(*cursor, keyword, length) != 0 || (*cursor)[length] != ' ')
+        return false;
+    *cursor += length + 1;
+    return true;
+}
+
+bool control_parse_command(const char* line,
+                           control_command_t* out_command,
+                           const char** out_error) {
+    const char* cursor = line;
+    if (read_keyword(&cursor, "add")) {
+        out_command->type = CONTROL_COMMAND_ADD;
+    } else if (read_keyword(&cursor, "update")) {
+        out_command->type = CONTROL_COMMAND_UPDATE;
+    } else if (read_keyword(&cursor, "cancel")) {
+        out_command->type = CONTROL_COMMAND_CANCEL;
+    } else {
+        *out_error = "expected add, update or cancel";
+        return false;
+    }
+
+    long id;
+    errno = 0;
+    if (!read_long(&cursor, &id) || id < 0 || id > UINT32_MAX) {
+        *out_error = "invalid event id";
+        return false;
+    }
+
+    out_command->event = (event_t) EVENT_INITIALIZER;
+    out_command->event.id = id;
+
+    if (out_command->type == CONTROL_COMMAND_CANCEL) {
+        if (*cursor) {
+            *out_error = "cancel only takes an id";
+            return false;
+        }
+        return true;
+    }
+
+    if (*cursor != ' ' || !parse_event(cursor + 1, &out_command->event)) {
+        *out_error = "expected [high|bulk] repeat_after repeat_during description";
+        return false;
+    }
+
+    out_command->event.id = id;
+    return true;
+}
+
+static bool reply(int client, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static bool reply(int client, const char* format, ...) {
+    char line[CONTROL_MAX_LINE_SIZE + 64];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (length < 0)
+        return false;
+    if ((size_t) length >= sizeof(line))
+        length = sizeof(line) - 1;
+
+    const char* cursor = line;
+    while (length) {
+        ssize_t ret = send(client, cursor, length, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        cursor += ret;
+        length -= ret;
+    }
+    return true;
+}
+
+typedef struct control_connection {
+    int client;
+    char buffer[CONTROL_MAX_LINE_SIZE * 16];
+    size_t length;
+    size_t line_number;
+    /// Whether we're skipping the rest of a line that was too long.
+    bool skipping;
+    control_command_t batch[CONTROL_MAX_BATCH];
+    /// The line number and the result of every command in the batch.
+    size_t lines[CONTROL_MAX_BATCH];
+    bool applied[CONTROL_MAX_BATCH];
+    size_t batch_count;
+} control_connection_t;
+
+static bool flush_batch(control_server_t* server,
+                        control_connection_t* connection) {
+    if (!connection->batch_count)
+        return true;
+
+    server->apply(connection->batch, connection->batch_count,
+                  connection->applied, server->context);
+
+    bool connected = true;
+    size_t applied = 0;
+    for (size_t i = 0; i < connection->batch_count; ++i) {
+        if (connection->applied[i]) {
+            applied++;
+            continue;
+        }
+
+        server->rejected++;
+        connected = reply(connection->client, "error %zu: unknown event id "
+                          "%" PRIu32 "\n", connection->lines[i],
+                          connection->batch[i].event.id) && connected;
+    }
+
+    server->applied += applied;
+    connection->batch_count = 0;
+    return reply(connection->client, "ok %zu\n", applied) && connected;
+}
+
+/**
+ * Parse the complete lines in the buffer, and apply them. Returns false if
+ * the client has gone away, but only after applying them anyway.
+ */
+static bool handle_lines(control_server_t* server,
+                         control_connection_t* connection) {
+    char* start = connection->buffer;
+    char* end = connection->buffer + connection->length;
+    char* newline;
+    bool connected = true;
+
+    while ((newline = memchr(start, '\n', end - start))) {
+        *newline = '\0';
+        if (newline > start && newline[-1] == '\r')
+            newline[-1] = '\0';
+
+        bool skipped = connection->skipping;
+        connection->skipping = false;
+        connection->line_number++;
+
+        const char* error = "line too long";
+        control_command_t* command =
+            &connection->batch[connection->batch_count];
+        if (*start == '\0' || *start == '#') {
+            // Empty lines and comments, like in the config file.
+        } else if (!skipped && control_parse_command(start, command, &error)) {
+            connection->lines[connection->batch_count] =
+                connection->line_number;
+            if (++connection->batch_count == CONTROL_MAX_BATCH)
+                connected = flush_batch(server, connection) && connected;
+        } else {
+            server->rejected++;
+            connected = reply(connection->client, "error %zu: %s\n",
+                              connection->line_number, error) && connected;
+        }
+
+        start = newline + 1;
+    }
+
+    connection->length = end - start;
+    memmove(connection->buffer, start, connection->length);
+
+    // A line that doesn't fit: drop it, and complain when it ends.
+    if (connection->length == sizeof(connection->buffer)) {
+        connection->length = 0;
+        connection->skipping = true;
+    }
+
+    return flush_batch(server, connection) && connected;
+}
+
+static void close_client(void* data) {
+    close(*(int*) data);
+}
+
+static void serve_connection(control_server_t* server,
+                             control_connection_t* connection) {
+    struct timeval timeout;
+    timeout.tv_sec = CONTROL_IDLE_TIMEOUT_SEC;
+    timeout.tv_usec = 0;
+    setsockopt(connection->client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+               sizeof(timeout));
+    setsockopt(connection->client, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+               sizeof(timeout));
+
+    connection->length = 0;
+    connection->line_number = 0;
+    connection->skipping = false;
+    connection->batch_count = 0;
+
+    while (true) {
+        // Only get cancelled while waiting for the client.
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        ssize_t ret = recv(connection->client,
+                           connection->buffer + connection->length,
+                           sizeof(connection->buffer) - connection->length, 0);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret < 0)
+            WARN("control: recv: %s", strerror(errno));
+
+        if (ret <= 0)
+            break;
+
+        connection->length += ret;
+        if (!handle_lines(server, connection))
+            break;
+    }
+}
+
+static void* control_server_thread(void* data) {
+    control_server_t* server = data;
+
+    // Too big for the stack of a thread.
+    control_connection_t* connection = malloc(sizeof(control_connection_t));
+    assert(connection);
+    pthread_cleanup_push(free, connection);
+
+    while (true) {
+        connection->client = accept(server->socket, NULL, NULL);
+        if (connection->client < 0) {
+            WARN("control: accept: %s", strerror(errno));
+            continue;
+        }
+
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_cleanup_push(close_client, &connection->client);
+        serve_connection(server, connection);
+        pthread_cleanup_pop(1);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+bool control_server_start(control_server_t* server,
+                          const char* path,
+                          control_apply_fn apply,
+                          void* context) {
+    server->path = path;
+    server->apply = apply;
+    server->context = context;
+    server->applied = 0;
+    server->rejected = 0;
+
+    server->socket = create_unix_listener(path);
+    if (server->socket < 0)
+        return false;
+
+    int ret = pthread_create(&server->thread, NULL, control_server_thread,
+                             server);
+    if (ret != 0) {
+        close(server->socket);
+        unlink(path);
+        errno = ret;
+        return false;
+    }
+
+    return true;
+}
+
+void control_server_stop(control_server_t* server) {
+    pthread_cancel(server->thread);
+    pthread_join(server->thread, NULL);
+    close(server->socket);
+    unlink(server->path);
+    LOG("control: applied %llu commands, rejected %llu",
+        (unsigned long long) server->applied,
+        (unsigned long long) server->rejected);
+}
@@ -0,0 +1,120 @@
+/**
+ * control.h:
+ *   Add, update and cancel events at runtime through a Unix socket
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "event.h"
+
+/** Longest line we accept, a bit more than an event in the config file */
+#define CONTROL_MAX_LINE_SIZE 512
+
+/** Most commands applied at once, even if more arrive in a single read */
+#define CONTROL_MAX_BATCH 1024
+
+/**
+ * Each line sent to the control socket is one of:
+ *
+ * ```
+ * add id [high|bulk] repeat_after repeat_during description
+ * update id [high|bulk] repeat_after repeat_during description
+ * cancel id
+ * ```
+ *
+ * With the same format as the config file (see config.h) after the id.
+ *
+ * `add` schedules a new event (replacing it if the id is taken) starting
+ * now, or after its phase offset with --spread. `update` replaces an event
+ * that's still being sent, and sends the new version right away. `cancel`
+ * stops sending it.
+ */
+typedef enum control_command_type {
+    CONTROL_COMMAND_ADD,
+    CONTROL_COMMAND_UPDATE,
+    CONTROL_COMMAND_CANCEL,
+    /// Like cancel, but the event keeps its lateness histogram. Never parsed,
+    /// it's how events move between priority lanes (see shard.h).
+    CONTROL_COMMAND_FORGET,
+    /// Like update, but it adds the event if it isn't there. Never parsed,
+    /// it's how updates move events to another priority lane.
+    CONTROL_COMMAND_MOVE,
+} control_command_type_t;
+
+typedef struct control_command {
+    control_command_type_t type;
+    /// Only the id is meaningful for CONTROL_COMMAND_CANCEL.
+    event_t event;
+} control_command_t;
+
+/**
+ * Parse a line (without the newline). Returns false, pointing
+ * `out_error` to a description of the problem, if it's not a valid command.
+ */
+bool control_parse_command(const char* line,
+                           control_command_t* out_command,
+                           const char** out_error);
+
+/**
+ * Called from the control thread with every batch of valid commands, in the
+ * order they arrived. The commands are only valid during the call.
+ *
+ * Returns once they're applied, with `out_applied[i]` telling whether the
+ * i-th one was (updates and cancels aren't if the event is unknown).
+ */
+typedef void (*control_apply_fn)(const control_command_t* commands,
+                                 size_t count,
+                                 bool* out_applied,
+                                 void* context);
+
+/**
+ * Serves one connection at a time: commands can be sent one by one or many
+ * at once, and every complete line that has arrived is applied as a single
+ * batch. Replies are a line per invalid or unapplied command (`error N:
+ * reason`, N being the line number within the connection) and a line per
+ * batch (`ok N`, N being the number of commands applied).
+ */
+typedef struct control_server {
+    int socket;
+    pthread_t thread;
+    const char* path;
+    control_apply_fn apply;
+    void* context;
+    uint64_t applied;
+    uint64_t rejected;
+} control_server_t;
+
+/**
+ * Listen on the Unix socket at `path`, and start the thread.
+ *
+ * Returns false and sets errno on failure.
+ */
+bool control_server_start(control_server_t* server,
+                          const char* path,
+                          control_apply_fn apply,
+                          void* context);
+
+/** Stop the thread and remove the socket */
+void control_server_stop(control_server_t* server);
+
+#endif
@@ -0,0 +1,138 @@
+/**
+ * dedup.c:
+ *   Forward each event only when it is new or it has changed
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+
+void dedup_init(dedup_set_t* set, uint64_t ttl) {
+    set->entries = NULL;
+    set->count = 0;
+    set->capacity = 0;
+    set->ttl = ttl;
+    set->expired = 0;
+}
+
+uint64_t dedup_hash(const void* data, size_t length) {
+    const unsigned char* bytes = data;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static inline
+bool dedup_is_expired(const dedup_set_t* set,
+                      const dedup_entry_t* entry,
+                      uint64_t now) {
+    uint64_t lifetime = 2 * entry->interval;
+    if (lifetime < set->ttl)
+        lifetime = set->ttl;
+    return now - entry->last_seen > lifetime;
+}
+
+/** Find the slot of a key, which may be unused */
+static dedup_entry_t* dedup_slot(dedup_set_t* set, uint64_t key) {
+    // The keys may be hashes already, but event ids aren't.
+    size_t i = (key * 11400714819323198485ull) >> 32 & (set->capacity - 1);
+    while (set->entries[i].used && set->entries[i].key != key)
+        i = (i + 1) & (set->capacity - 1);
+    return &set->entries[i];
+}
+
+/**
+ * Keep the set at most half full: drop the expired entries first, and only
+ * grow if that's not enough.
+ */
+static void dedup_rebuild(dedup_set_t* set, uint64_t now) {
+    if (set->count * 2 < set->capacity)
+        return;
+
+    dedup_entry_t* old_entries = set->entries;
+    size_t old_capacity = set->capacity;
+
+    size_t live = 0;
+    for (size_t i = 0; i < old_capacity; ++i)
+        if (old_entries[i].used && !dedup_is_expired(set, &old_entries[i], now))
+            live++;
+
+    set->capacity = old_capacity ? old_capacity : 64;
+    while (live * 4 >= set->capacity)
+        set->capacity *= 2;
+
+    set->entries = calloc(set->capacity, sizeof(dedup_entry_t));
+    assert(set->entries);
+
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (!old_entries[i].used)
+            continue;
+        if (dedup_is_expired(set, &old_entries[i], now)) {
+            set->expired++;
+            continue;
+        }
+        *dedup_slot(set, old_entries[i].key) = old_entries[i];
+    }
+
+    set->count = live;
+    free(old_entries);
+}
+
+bool dedup_check(dedup_set_t* set,
+                 uint64_t key,
+                 uint64_t version,
+                 uint64_t now) {
+    dedup_rebuild(set, now);
+
+    dedup_entry_t* entry = dedup_slot(set, key);
+    if (!entry->used) {
+        entry->used = true;
+        entry->key = key;
+        entry->version = version;
+        entry->last_seen = now;
+        entry->interval = 0;
+        set->count++;
+        return true;
+    }
+
+    bool expired = dedup_is_expired(set, entry, now);
+    bool forward = expired || entry->version != version;
+    if (expired) {
+        set->expired++;
+        entry->interval = 0;
+    } else if (now - entry->last_seen > entry->interval) {
+        // The longest gap, so the same payload coming from the snapshot, a
+        // repair, or a duplicate datagram doesn't make us forget too soon.
+        entry->interval = now - entry->last_seen;
+    }
+
+    entry->version = version;
+    entry->last_seen = now;
+    return forward;
+}
+
+void dedup_destroy(dedup_set_t* set) {
+    free(set->entries);
+    set->entries = NULL;
+    set->count = 0;
+    set->capacity = 0;
+}
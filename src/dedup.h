@@ -0,0 +1,76 @@
+/**
+ * dedup.h:
+ *   Forward each event only when it is new or it has changed
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct dedup_entry {
+    bool used;
+    uint64_t key;
+    uint64_t version;
+    uint64_t last_seen;
+    /// Longest time between two sightings, zero if we saw it once.
+    uint64_t interval;
+} dedup_entry_t;
+
+/**
+ * The events we've seen lately, by key (the event id and stream for framed
+ * payloads, the hash of the payload otherwise) along with their version (the
+ * hash of the payload).
+ *
+ * The server sends each event again and again while it lasts, so an event
+ * is forgotten once it hasn't been seen for twice its period (as observed),
+ * or for `ttl` if that's longer. That's also the way to learn that an
+ * event is over: if it comes back afterwards, it's new.
+ *
+ * The period is only known after the second time, so `ttl` should be longer
+ * than most periods, or those events get forwarded twice.
+ */
+typedef struct dedup_set {
+    dedup_entry_t* entries;
+    size_t count;
+    /// Always a power of two, and at least twice `count`.
+    size_t capacity;
+    uint64_t ttl;
+    uint64_t expired;
+} dedup_set_t;
+
+#define DEDUP_SET_INITIALIZER { NULL, 0, 0, 0, 0 }
+
+void dedup_init(dedup_set_t* set, uint64_t ttl);
+
+/** FNV-1a, to key and version payloads */
+uint64_t dedup_hash(const void* data, size_t length);
+
+/**
+ * We got `key` with `version` at `now`. Returns true if it has to be
+ * forwarded, that is, if it's new, it has changed, or it had expired.
+ */
+bool dedup_check(dedup_set_t* set,
+                 uint64_t key,
+                 uint64_t version,
+                 uint64_t now);
+
+void dedup_destroy(dedup_set_t* set);
+
+#endif
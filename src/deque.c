@@ -0,0 +1,144 @@
+/**
+ * deque.c:
+ *   Chase-Lev work-stealing deque
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "deque.h"
+
+// NOTE: We're stuck with C99, so we use the GCC/Clang __atomic builtins
+// instead of <stdatomic.h>.
+
+static deque_buffer_t* buffer_new(int64_t capacity) {
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    deque_buffer_t* buffer = malloc(sizeof(deque_buffer_t));
+    assert(buffer);
+    buffer->capacity = capacity;
+    buffer->items = malloc(sizeof(void*) * capacity);
+    assert(buffer->items);
+    buffer->previous = NULL;
+    return buffer;
+}
+
+static inline
+void* buffer_get(deque_buffer_t* buffer, int64_t i) {
+    return __atomic_load_n(&buffer->items[i & (buffer->capacity - 1)],
+                           __ATOMIC_RELAXED);
+}
+
+static inline
+void buffer_put(deque_buffer_t* buffer, int64_t i, void* item) {
+    __atomic_store_n(&buffer->items[i & (buffer->capacity - 1)], item,
+                     __ATOMIC_RELAXED);
+}
+
+static deque_buffer_t* buffer_grow(deque_buffer_t* old,
+                                   int64_t top,
+                                   int64_t bottom) {
+    deque_buffer_t* buffer = buffer_new(old->capacity * 2);
+    for (int64_t i = top; i < bottom; ++i)
+        buffer_put(buffer, i, buffer_get(old, i));
+    buffer->previous = old;
+    return buffer;
+}
+
+void deque_init(deque_t* deque, size_t capacity) {
+    size_t rounded = 1;
+    while (rounded < capacity)
+        rounded *= 2;
+
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->buffer = buffer_new(rounded);
+}
+
+void deque_push(deque_t* deque, void* item) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    deque_buffer_t* buffer = __atomic_load_n(&deque->buffer, __ATOMIC_RELAXED);
+
+    if (bottom - top > buffer->capacity - 1) {
+        buffer = buffer_grow(buffer, top, bottom);
+        __atomic_store_n(&deque->buffer, buffer, __ATOMIC_RELEASE);
+    }
+
+    buffer_put(buffer, bottom, item);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+void* deque_pop(deque_t* deque) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    deque_buffer_t* buffer = __atomic_load_n(&deque->buffer, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        // Empty
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    void* item = buffer_get(buffer, bottom);
+    if (top == bottom) {
+        // Last item, race against thieves for it.
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            item = NULL;
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+
+    return item;
+}
+
+void* deque_steal(deque_t* deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom)
+        return NULL;
+
+    deque_buffer_t* buffer = __atomic_load_n(&deque->buffer, __ATOMIC_ACQUIRE);
+    void* item = buffer_get(buffer, top);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+
+    return item;
+}
+
+size_t deque_size(deque_t* deque) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    return bottom > top ? (size_t)(bottom - top) : 0;
+}
+
+void deque_destroy(deque_t* deque) {
+    deque_buffer_t* buffer = deque->buffer;
+    while (buffer) {
+        deque_buffer_t* previous = buffer->previous;
+        free(buffer->items);
+        free(buffer);
+        buffer = previous;
+    }
+    deque->buffer = NULL;
+}
@@ -0,0 +1,68 @@
+/**
+ * deque.h:
+ *   Chase-Lev work-stealing deque
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct deque_buffer {
+    int64_t capacity; // Always a power of two
+    void** items;
+    /// Buffers we outgrew. Thieves could still be reading from them, so they
+    /// are only freed when the deque is destroyed.
+    struct deque_buffer* previous;
+} deque_buffer_t;
+
+/**
+ * Lock-free deque of pointers, as described in "Dynamic Circular Work-Stealing
+ * Deque" (Chase and Lev, 2005), using the memory orderings from "Correct and
+ * Efficient Work-Stealing for Weak Memory Models" (Lê et al., 2013).
+ *
+ * Only one thread (the owner) can push and pop from the bottom, any thread can
+ * steal from the top.
+ */
+typedef struct deque {
+    int64_t top;
+    int64_t bottom;
+    deque_buffer_t* buffer;
+} deque_t;
+
+void deque_init(deque_t* deque, size_t capacity);
+
+/** Push an item to the bottom. Only for the owner. */
+void deque_push(deque_t* deque, void* item);
+
+/** Pop an item from the bottom, or NULL if empty. Only for the owner. */
+void* deque_pop(deque_t* deque);
+
+/**
+ * Take an item from the top, or NULL if empty or we lost a race against
+ * another thief or the owner.
+ */
+void* deque_steal(deque_t* deque);
+
+/** Approximate number of items in the deque */
+size_t deque_size(deque_t* deque);
+
+/** Free the deque buffers. No thread may be using it. */
+void deque_destroy(deque_t* deque);
+
+#endif
@@ -21,24 +21,42 @@
 #define EVENT_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 #define MAX_EVENT_DESCRIPTION_SIZE 255
 
+/**
+ * Events of the high class are sent through their own lane (thread and
+ * socket) with --priority-lane, so they don't wait behind bulk events.
+ */
+typedef enum event_priority {
+    EVENT_PRIORITY_BULK = 0,
+    EVENT_PRIORITY_HIGH = 1,
+} event_priority_t;
+
+#define EVENT_PRIORITY_NAME(priority)                                          \
+    ((priority) == EVENT_PRIORITY_HIGH ? "high" : "bulk")
+
 /**
  * The server broadcasts events each `repeat_after`
  * seconds for `repeat_during` seconds.
  *
  * Each event contains an **owned** string, guaranteed
  * to be null-terminated, or NULL if there's no description.
+ *
+ * The id identifies the event on the wire (see wire.h). Events read from the
+ * config file get their line number.
  */
 typedef struct event {
     time_t repeat_after;
     time_t repeat_during;
+    uint32_t id;
+    event_priority_t priority;
     char description[MAX_EVENT_DESCRIPTION_SIZE];
 } event_t;
 
-#define EVENT_INITIALIZER {0, 0, {0}}
+#define EVENT_INITIALIZER {0, 0, 0, EVENT_PRIORITY_BULK, {0}}
 
 typedef struct event_list_node {
     event_t event;
@@ -0,0 +1,222 @@
+/**
+ * fec.c:
+ *   XOR parity for framed datagrams
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fec.h"
+
+bool fec_parse_spec(const char* spec,
+                    size_t* out_block_size,
+                    size_t* out_parity_count) {
+    char* end;
+    unsigned long block_size = strtoul(spec, &end, 10);
+    if (end == spec || *end != ':')
+        return false;
+
+    const char* cursor = end + 1;
+    unsigned long parity_count = strtoul(cursor, &end, 10);
+    if (end == cursor || *end != '\0')
+        return false;
+
+    if (!block_size || block_size > FEC_MAX_BLOCK_SIZE ||
+        !parity_count || parity_count > FEC_MAX_PARITY ||
+        parity_count > block_size)
+        return false;
+
+    *out_block_size = block_size;
+    *out_parity_count = parity_count;
+    return true;
+}
+
+void fec_encoder_init(fec_encoder_t* encoder,
+                      size_t block_size,
+                      size_t parity_count,
+                      uint64_t flush_after) {
+    assert(block_size && block_size <= FEC_MAX_BLOCK_SIZE);
+    assert(parity_count && parity_count <= FEC_MAX_PARITY);
+    encoder->block_size = block_size;
+    encoder->parity_count = parity_count;
+    encoder->flush_after = flush_after;
+    fec_encoder_next_block(encoder);
+}
+
+void fec_encoder_next_block(fec_encoder_t* encoder) {
+    encoder->filled = 0;
+    encoder->base_sequence = 0;
+    encoder->started = 0;
+    memset(encoder->lengths, 0, sizeof(encoder->lengths));
+    memset(encoder->parity, 0, sizeof(encoder->parity));
+}
+
+static void xor_into(unsigned char* into,
+                     const unsigned char* data,
+                     size_t length) {
+    for (size_t i = 0; i < length; ++i)
+        into[i] ^= data[i];
+}
+
+bool fec_encoder_add(fec_encoder_t* encoder,
+                     uint64_t sequence,
+                     const unsigned char* datagram,
+                     size_t length,
+                     uint64_t now) {
+    assert(length <= FEC_MAX_PROTECTED_SIZE);
+
+    if (encoder->filled &&
+        sequence != encoder->base_sequence + encoder->filled)
+        fec_encoder_next_block(encoder);
+
+    if (!encoder->filled) {
+        encoder->base_sequence = sequence;
+        encoder->started = now;
+    }
+
+    size_t index = encoder->filled % encoder->parity_count;
+    xor_into(encoder->parity[index], datagram, length);
+    if (length > encoder->lengths[index])
+        encoder->lengths[index] = length;
+
+    if (++encoder->filled == encoder->block_size)
+        return true;
+
+    uint64_t deadline = fec_encoder_flush_deadline(encoder);
+    return deadline && now >= deadline;
+}
+
+uint64_t fec_encoder_flush_deadline(const fec_encoder_t* encoder) {
+    if (!encoder->filled || !encoder->flush_after)
+        return 0;
+
+    return encoder->started + encoder->flush_after;
+}
+
+size_t fec_encoder_build_parity(const fec_encoder_t* encoder,
+                                size_t index,
+                                uint32_t stream,
+                                uint64_t timestamp,
+                                unsigned char* out) {
+    assert(index < encoder->parity_count);
+    if (index >= encoder->filled)
+        return 0;
+
+    size_t length = encoder->lengths[index];
+
+    wire_header_t header;
+    header.version = WIRE_VERSION;
+    header.type = WIRE_TYPE_PARITY;
+    header.flags = 0;
+    header.payload_length = FEC_HEADER_SIZE + length;
+    header.stream = stream;
+    header.event_id = 0;
+    header.sequence = encoder->base_sequence;
+    header.timestamp = timestamp;
+    wire_encode_header(&header, out);
+
+    unsigned char* fec_header = out + WIRE_HEADER_SIZE;
+    fec_header[0] = encoder->filled >> 8;
+    fec_header[1] = encoder->filled;
+    fec_header[2] = encoder->parity_count;
+    fec_header[3] = index;
+    memset(fec_header + 4, 0, 4);
+
+    memcpy(fec_header + FEC_HEADER_SIZE, encoder->parity[index], length);
+    return WIRE_HEADER_SIZE + FEC_HEADER_SIZE + length;
+}
+
+void fec_decoder_init(fec_decoder_t* decoder) {
+    // Nobody is going to send 2^64 datagrams.
+    memset(decoder->sequences, 0xff, sizeof(decoder->sequences));
+    memset(decoder->lengths, 0, sizeof(decoder->lengths));
+}
+
+void fec_decoder_remember(fec_decoder_t* decoder,
+                          uint64_t sequence,
+                          const unsigned char* datagram,
+                          size_t length) {
+    if (length > FEC_MAX_PROTECTED_SIZE)
+        return;
+
+    size_t slot = sequence & (FEC_WINDOW - 1);
+    decoder->sequences[slot] = sequence;
+    decoder->lengths[slot] = length;
+    memcpy(decoder->datagrams[slot], datagram, length);
+}
+
+static inline
+bool fec_decoder_has(const fec_decoder_t* decoder, uint64_t sequence) {
+    return decoder->sequences[sequence & (FEC_WINDOW - 1)] == sequence;
+}
+
+size_t fec_decoder_recover(fec_decoder_t* decoder,
+                           const wire_header_t* header,
+                           const unsigned char* payload,
+                           unsigned char* out) {
+    if (header->type != WIRE_TYPE_PARITY ||
+        header->payload_length < FEC_HEADER_SIZE ||
+        header->payload_length - FEC_HEADER_SIZE > FEC_MAX_PROTECTED_SIZE)
+        return 0;
+
+    size_t block_size = (size_t) payload[0] << 8 | payload[1];
+    size_t parity_count = payload[2];
+    size_t index = payload[3];
+    if (!block_size || block_size > FEC_MAX_BLOCK_SIZE ||
+        !parity_count || index >= parity_count)
+        return 0;
+
+    uint64_t missing = 0;
+    size_t missing_count = 0;
+    for (size_t i = index; i < block_size; i += parity_count) {
+        uint64_t sequence = header->sequence + i;
+        if (!fec_decoder_has(decoder, sequence)) {
+            missing = sequence;
+            if (++missing_count > 1)
+                return 0;
+        }
+    }
+
+    if (!missing_count)
+        return 0;
+
+    size_t length = header->payload_length - FEC_HEADER_SIZE;
+    memset(out, 0, FEC_MAX_PROTECTED_SIZE);
+    memcpy(out, payload + FEC_HEADER_SIZE, length);
+    for (size_t i = index; i < block_size; i += parity_count) {
+        uint64_t sequence = header->sequence + i;
+        if (sequence == missing)
+            continue;
+
+        size_t slot = sequence & (FEC_WINDOW - 1);
+        xor_into(out, decoder->datagrams[slot], decoder->lengths[slot]);
+    }
+
+    // The padding goes away with the header of the rebuilt datagram, which
+    // has to make sense.
+    wire_header_t recovered;
+    if (!wire_decode_header(out, length, &recovered) ||
+        recovered.type != WIRE_TYPE_EVENT ||
+        recovered.stream != header->stream ||
+        recovered.sequence != missing)
+        return 0;
+
+    length = WIRE_HEADER_SIZE + recovered.payload_length;
+    fec_decoder_remember(decoder, missing, out, length);
+    return length;
+}
@@ -0,0 +1,161 @@
+/**
+ * fec.h:
+ *   XOR parity for framed datagrams
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event.h"
+#include "wire.h"
+
+/**
+ * After every block of K framed datagrams of a stream, the sender emits M
+ * parity datagrams (WIRE_TYPE_PARITY). Parity `j` is the XOR of the whole
+ * datagrams (header included, zero-padded to the longest) with sequence
+ * numbers `base + j`, `base + j + M`, `base + j + 2M`... below `base + K`.
+ *
+ * So a receiver can rebuild, without asking anyone, any datagram of the block
+ * as long as it's the only one missing among those covered by its parity: any
+ * single loss, and bursts of up to M consecutive losses.
+ *
+ * The payload of a parity datagram is this header (network byte order)
+ * followed by the XOR:
+ *
+ * ```
+ *  0             2      3      4                           8
+ *  +-------------+------+------+---------------------------+
+ *  | block size  |  M   |  j   |         reserved          |
+ *  +-------------+------+------+---------------------------+
+ * ```
+ *
+ * The sequence number in the wire header of a parity datagram is the one of
+ * the first datagram of the block, parity datagrams don't consume any.
+ *
+ * A block that has been open for too long is closed short, so the events of a
+ * slow stream can be rebuilt before they're stale: its parity carries the
+ * number of datagrams it actually covers as the block size.
+ */
+#define FEC_HEADER_SIZE 8
+#define FEC_MAX_BLOCK_SIZE 128
+#define FEC_MAX_PARITY 16
+
+/** The biggest datagram that can be protected */
+#define FEC_MAX_PROTECTED_SIZE (WIRE_HEADER_SIZE + MAX_EVENT_DESCRIPTION_SIZE)
+
+/** The biggest parity datagram */
+#define FEC_MAX_DATAGRAM_SIZE                                                  \
+    (WIRE_HEADER_SIZE + FEC_HEADER_SIZE + FEC_MAX_PROTECTED_SIZE)
+
+/** Datagrams a decoder remembers per stream, must be a power of two */
+#define FEC_WINDOW 256
+
+typedef struct fec_encoder {
+    size_t block_size;
+    size_t parity_count;
+    /// Datagrams added to the current block.
+    size_t filled;
+    uint64_t base_sequence;
+    /// How long a block can stay open (nanoseconds, zero for forever), and
+    /// when the current one got its first datagram.
+    uint64_t flush_after;
+    uint64_t started;
+    /// Longest datagram covered by each parity.
+    size_t lengths[FEC_MAX_PARITY];
+    unsigned char parity[FEC_MAX_PARITY][FEC_MAX_PROTECTED_SIZE];
+} fec_encoder_t;
+
+/**
+ * Parse "K:M". Returns false if it's malformed or out of range (M can't be
+ * bigger than K).
+ */
+bool fec_parse_spec(const char* spec,
+                    size_t* out_block_size,
+                    size_t* out_parity_count);
+
+void fec_encoder_init(fec_encoder_t* encoder,
+                      size_t block_size,
+                      size_t parity_count,
+                      uint64_t flush_after);
+
+/**
+ * Add a datagram, sent at `now`, to the current block. Sequence numbers must
+ * be consecutive, if they aren't the current block is dropped and a new one
+ * starts.
+ *
+ * Returns true if the block is complete, or has been open for `flush_after`
+ * already, in which case the parity datagrams have to be built before the next
+ * call to `fec_encoder_next_block()`.
+ */
+bool fec_encoder_add(fec_encoder_t* encoder,
+                     uint64_t sequence,
+                     const unsigned char* datagram,
+                     size_t length,
+                     uint64_t now);
+
+/**
+ * When the current block has to be closed short if nothing else is added, or
+ * zero if it's empty or blocks are never closed short.
+ */
+uint64_t fec_encoder_flush_deadline(const fec_encoder_t* encoder);
+
+/**
+ * Build the parity datagram `index` of the current block into `out`, which
+ * must be FEC_MAX_DATAGRAM_SIZE long. Returns its length, or zero if the block
+ * is too short for that parity to cover anything.
+ */
+size_t fec_encoder_build_parity(const fec_encoder_t* encoder,
+                                size_t index,
+                                uint32_t stream,
+                                uint64_t timestamp,
+                                unsigned char* out);
+
+void fec_encoder_next_block(fec_encoder_t* encoder);
+
+/** The last FEC_WINDOW datagrams of a stream, indexed by sequence number */
+typedef struct fec_decoder {
+    uint64_t sequences[FEC_WINDOW];
+    uint16_t lengths[FEC_WINDOW];
+    unsigned char datagrams[FEC_WINDOW][FEC_MAX_PROTECTED_SIZE];
+} fec_decoder_t;
+
+void fec_decoder_init(fec_decoder_t* decoder);
+
+/** Remember a received framed datagram */
+void fec_decoder_remember(fec_decoder_t* decoder,
+                          uint64_t sequence,
+                          const unsigned char* datagram,
+                          size_t length);
+
+/**
+ * Try to rebuild the datagram missing from a parity, given its decoded wire
+ * header and its payload.
+ *
+ * Returns the length of the datagram written to `out` (which must be
+ * FEC_MAX_PROTECTED_SIZE long, and is remembered too), or 0 if nothing is
+ * missing, more than one is, or the parity is malformed.
+ */
+size_t fec_decoder_recover(fec_decoder_t* decoder,
+                           const wire_header_t* header,
+                           const unsigned char* payload,
+                           unsigned char* out);
+
+#endif
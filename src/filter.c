@@ -0,0 +1,305 @@
+/**
+ * filter.c:
+ *   Drop the datagrams a client doesn't want in the kernel, with classic BPF
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#ifdef LINUX
+#include <linux/filter.h> // struct sock_filter, BPF_*
+#endif
+
+#include "filter.h"
+#include "wire.h"
+
+/** Socket filters see the UDP header before the payload */
+#define FILTER_UDP_HEADER_SIZE 8
+
+/** The first three bytes of a framed datagram, see wire.h */
+#define FILTER_MAGIC 0x004d4300
+#define FILTER_MAGIC_MASK 0xffffff00
+
+/** Parse a comma separated list of numbers into `values` */
+static bool filter_parse_values(const char* list,
+                                uint32_t* values,
+                                size_t* count) {
+    const char* cursor = list;
+    do {
+        char* end;
+        unsigned long value = strtoul(cursor, &end, 10);
+        if (end == cursor || *cursor == '-' || value > UINT32_MAX)
+            return false;
+
+        if (*count == FILTER_MAX_VALUES)
+            return false;
+        values[(*count)++] = (uint32_t) value;
+
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return false;
+        cursor = end;
+    } while (*cursor);
+
+    return true;
+}
+
+bool filter_parse(const char* expression, filter_t* filter) {
+    if (strncmp(expression, "prefix=", 7) == 0) {
+        size_t length = strlen(expression + 7);
+        if (filter->prefix_length || !length || length > FILTER_MAX_PREFIX)
+            return false;
+        memcpy(filter->prefix, expression + 7, length);
+        filter->prefix_length = length;
+        return true;
+    }
+
+    if (strncmp(expression, "id=", 3) == 0)
+        return filter_parse_values(expression + 3, filter->ids,
+                                   &filter->id_count);
+
+    if (strncmp(expression, "stream=", 7) == 0)
+        return filter_parse_values(expression + 7, filter->streams,
+                                   &filter->stream_count);
+
+    return false;
+}
+
+static uint32_t filter_read_u32(const unsigned char* buffer) {
+    return ((uint32_t) buffer[0] << 24) | ((uint32_t) buffer[1] << 16) |
+           ((uint32_t) buffer[2] << 8) | (uint32_t) buffer[3];
+}
+
+static bool filter_contains(const uint32_t* values, size_t count,
+                            uint32_t value) {
+    for (size_t i = 0; i < count; ++i)
+        if (values[i] == value)
+            return true;
+    return false;
+}
+
+bool filter_match(const filter_t* filter,
+                  const unsigned char* datagram,
+                  size_t length) {
+    size_t description = 0;
+    if (length >= WIRE_HEADER_SIZE &&
+        (filter_read_u32(datagram) & FILTER_MAGIC_MASK) == FILTER_MAGIC) {
+        if (datagram[4] != WIRE_TYPE_EVENT)
+            return false;
+
+        if (filter->stream_count &&
+            !filter_contains(filter->streams, filter->stream_count,
+                             filter_read_u32(datagram + 8)))
+            return false;
+
+        if (filter->id_count &&
+            !filter_contains(filter->ids, filter->id_count,
+                             filter_read_u32(datagram + 12)))
+            return false;
+
+        description = WIRE_HEADER_SIZE;
+    } else if (filter->stream_count || filter->id_count) {
+        return false;
+    }
+
+    return length - description >= filter->prefix_length &&
+           memcmp(datagram + description, filter->prefix,
+                  filter->prefix_length) == 0;
+}
+
+#ifdef LINUX
+
+/** Enough for the longest prefix and every value */
+#define FILTER_MAX_INSTRUCTIONS                                                \
+    (16 + 2 * FILTER_MAX_PREFIX + 2 * FILTER_MAX_VALUES)
+
+/** Where jumps go, resolved once the whole program is there */
+typedef enum filter_label {
+    FILTER_LABEL_NEXT = 0,
+    FILTER_LABEL_UNFRAMED,
+    FILTER_LABEL_AFTER_STREAMS,
+    FILTER_LABEL_AFTER_IDS,
+    FILTER_LABEL_PREFIX,
+    FILTER_LABEL_DROP,
+    FILTER_LABEL_COUNT,
+} filter_label_t;
+
+typedef struct filter_program {
+    struct sock_filter code[FILTER_MAX_INSTRUCTIONS];
+    /// The labels of jt and jf (or k, for unconditional jumps).
+    filter_label_t targets[FILTER_MAX_INSTRUCTIONS][2];
+    size_t length;
+    size_t labels[FILTER_LABEL_COUNT];
+} filter_program_t;
+
+static void filter_emit(filter_program_t* program,
+                        uint16_t code,
+                        uint32_t k,
+                        filter_label_t jt,
+                        filter_label_t jf) {
+    size_t index = program->length++;
+    program->code[index].code = code;
+    program->code[index].jt = 0;
+    program->code[index].jf = 0;
+    program->code[index].k = k;
+    program->targets[index][0] = jt;
+    program->targets[index][1] = jf;
+}
+
+static void filter_place(filter_program_t* program, filter_label_t label) {
+    program->labels[label] = program->length;
+}
+
+/** Turn labels into offsets. Returns false if a jump is too long. */
+static bool filter_resolve(filter_program_t* program) {
+    for (size_t i = 0; i < program->length; ++i) {
+        struct sock_filter* instruction = &program->code[i];
+        size_t offsets[2] = {0, 0};
+        for (size_t j = 0; j < 2; ++j)
+            if (program->targets[i][j] != FILTER_LABEL_NEXT)
+                offsets[j] = program->labels[program->targets[i][j]] - i - 1;
+
+        if (BPF_CLASS(instruction->code) == BPF_JMP &&
+            BPF_OP(instruction->code) == BPF_JA) {
+            instruction->k = (uint32_t) offsets[0];
+            continue;
+        }
+
+        if (offsets[0] > UINT8_MAX || offsets[1] > UINT8_MAX)
+            return false;
+        instruction->jt = (uint8_t) offsets[0];
+        instruction->jf = (uint8_t) offsets[1];
+    }
+    return true;
+}
+
+/**
+ * Jump to `match` if the word loaded is one of `values`, and drop the
+ * datagram otherwise.
+ */
+static void filter_emit_set(filter_program_t* program,
+                            const uint32_t* values,
+                            size_t count,
+                            filter_label_t match) {
+    for (size_t i = 0; i < count; ++i)
+        filter_emit(program, BPF_JMP | BPF_JEQ | BPF_K, values[i], match,
+                    i + 1 == count ? FILTER_LABEL_DROP : FILTER_LABEL_NEXT);
+}
+
+/**
+ * Every load is relative to the UDP header, and the ones out of the
+ * datagram drop it, so there's no need to check lengths but for the header.
+ */
+static bool filter_compile(const filter_t* filter, filter_program_t* program) {
+    const uint32_t payload = FILTER_UDP_HEADER_SIZE;
+    program->length = 0;
+
+    filter_emit(program, BPF_LD | BPF_W | BPF_LEN, 0,
+                FILTER_LABEL_NEXT, FILTER_LABEL_NEXT);
+    filter_emit(program, BPF_JMP | BPF_JGE | BPF_K, payload + WIRE_HEADER_SIZE,
+                FILTER_LABEL_NEXT, FILTER_LABEL_UNFRAMED);
+    filter_emit(program, BPF_LD | BPF_W | BPF_ABS, payload,
+                FILTER_LABEL_NEXT, FILTER_LABEL_NEXT);
+    filter_emit(program, BPF_ALU | BPF_AND | BPF_K, FILTER_MAGIC_MASK,
+                FILTER_LABEL_NEXT, FILTER_LABEL_NEXT);
+    filter_emit(program, BPF_JMP | BPF_JEQ | BPF_K, FILTER_MAGIC,
+                FILTER_LABEL_NEXT, FILTER_LABEL_UNFRAMED);
+
+    // Framed: only events, from the streams and with the ids we want.
+    filter_emit(program, BPF_LD | BPF_B | BPF_ABS, payload + 4,
+                FILTER_LABEL_NEXT, FILTER_LABEL_NEXT);
+    filter_emit(program, BPF_JMP | BPF_JEQ | BPF_K, WIRE_TYPE_EVENT,
+                FILTER_LABEL_NEXT, FILTER_LABEL_DROP);
+
+    if (filter->stream_count) {
+        filter_emit(program, BPF_LD | BPF_W | BPF_ABS, payload + 8,
+                    FILTER_LABEL_NEXT, FILTER_LABEL_NEXT);
+        filter_emit_set(program, filter->streams, filter->stream_count,
+                        FILTER_LABEL_AFTER_STREAMS);
+    }
+    filter_place(program, FILTER_LABEL_AFTER_STREAMS);
+
+    if (filter->id_count) {
+        filter_emit(program, BPF_LD | BPF_W | BPF_ABS, payload + 12,
+                    FILTER_LABEL_NEXT, FILTER_LABEL_NEXT);
+        filter_emit_set(program, filter->ids, filter->id_count,
+                        FILTER_LABEL_AFTER_IDS);
+    }
+    filter_place(program, FILTER_LABEL_AFTER_IDS);
+
+    filter_emit(program, BPF_LDX | BPF_W | BPF_IMM, payload + WIRE_HEADER_SIZE,
+                FILTER_LABEL_NEXT, FILTER_LABEL_NEXT);
+    filter_emit(program, BPF_JMP | BPF_JA, 0,
+                FILTER_LABEL_PREFIX, FILTER_LABEL_NEXT);
+
+    // Bare descriptions have no ids nor streams.
+    filter_place(program, FILTER_LABEL_UNFRAMED);
+    if (filter->stream_count || filter->id_count)
+        filter_emit(program, BPF_JMP | BPF_JA, 0,
+                    FILTER_LABEL_DROP, FILTER_LABEL_NEXT);
+    filter_emit(program, BPF_LDX | BPF_W | BPF_IMM, payload,
+                FILTER_LABEL_NEXT, FILTER_LABEL_NEXT);
+
+    // The description starts at X.
+    filter_place(program, FILTER_LABEL_PREFIX);
+    for (size_t i = 0; i < filter->prefix_length; ++i) {
+        filter_emit(program, BPF_LD | BPF_B | BPF_IND, (uint32_t) i,
+                    FILTER_LABEL_NEXT, FILTER_LABEL_NEXT);
+        filter_emit(program, BPF_JMP | BPF_JEQ | BPF_K,
+                    (unsigned char) filter->prefix[i],
+                    FILTER_LABEL_NEXT, FILTER_LABEL_DROP);
+    }
+
+    filter_emit(program, BPF_RET | BPF_K, UINT32_MAX,
+                FILTER_LABEL_NEXT, FILTER_LABEL_NEXT);
+    filter_place(program, FILTER_LABEL_DROP);
+    filter_emit(program, BPF_RET | BPF_K, 0,
+                FILTER_LABEL_NEXT, FILTER_LABEL_NEXT);
+
+    return filter_resolve(program);
+}
+
+bool filter_attach(int sock, const filter_t* filter, size_t* out_length) {
+    filter_program_t program;
+    if (!filter_compile(filter, &program)) {
+        errno = E2BIG;
+        return false;
+    }
+
+    struct sock_fprog fprog;
+    fprog.len = (unsigned short) program.length;
+    fprog.filter = program.code;
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+                   sizeof(fprog)) != 0)
+        return false;
+
+    if (out_length)
+        *out_length = program.length;
+    return true;
+}
+
+#else
+
+bool filter_attach(int sock, const filter_t* filter, size_t* out_length) {
+    errno = ENOPROTOOPT;
+    return false;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/**
+ * filter.h:
+ *   Drop the datagrams a client doesn't want in the kernel, with classic BPF
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILTER_MAX_PREFIX 64
+#define FILTER_MAX_VALUES 16
+
+/**
+ * The events a client wants, built from expressions like:
+ *
+ *  - `prefix=TEXT`: the description starts with TEXT.
+ *  - `id=N[,N...]`: framed events with one of these event ids.
+ *  - `stream=N[,N...]`: framed events from one of these streams.
+ *
+ * An event has to match every kind of expression given, and any of the
+ * values of each. Framed datagrams that aren't events (like parity) never
+ * match, and bare descriptions never match ids or streams.
+ */
+typedef struct filter {
+    char prefix[FILTER_MAX_PREFIX];
+    size_t prefix_length;
+    uint32_t ids[FILTER_MAX_VALUES];
+    size_t id_count;
+    uint32_t streams[FILTER_MAX_VALUES];
+    size_t stream_count;
+} filter_t;
+
+#define FILTER_INITIALIZER {{0}, 0, {0}, 0, {0}, 0}
+
+/**
+ * Add `expression` to `filter`. Returns false if it's not valid, there's
+ * already a prefix, or there are too many values.
+ */
+bool filter_parse(const char* expression, filter_t* filter);
+
+/** Whether the filter lets everything through */
+#define filter_is_empty(filter)                                                \
+    (!(filter)->prefix_length && !(filter)->id_count && !(filter)->stream_count)
+
+/**
+ * Whether the UDP payload `datagram` matches, for the ones that don't go
+ * through the socket (like the ones of a snapshot). Same as the program
+ * `filter_attach()` attaches.
+ */
+bool filter_match(const filter_t* filter,
+                  const unsigned char* datagram,
+                  size_t length);
+
+/**
+ * Compile the filter into a classic BPF program and attach it to the UDP
+ * socket `sock` (SO_ATTACH_FILTER), so datagrams that don't match are
+ * dropped before being queued. `out_length`, if not NULL, gets the number
+ * of instructions.
+ *
+ * Returns false and sets errno on failure (ENOPROTOOPT if socket filters
+ * aren't available on this platform).
+ */
+bool filter_attach(int sock, const filter_t* filter, size_t* out_length);
+
+#endif
@@ -0,0 +1,113 @@
+/**
+ * histogram.c:
+ *   Lock-free log-linear histograms
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <string.h>
+
+#include "histogram.h"
+
+static inline
+unsigned bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    unsigned exponent = 63 - __builtin_clzll(value);
+    if (exponent >= HISTOGRAM_MAX_BITS)
+        return HISTOGRAM_BUCKETS - 1;
+
+    unsigned shift = exponent - HISTOGRAM_SUB_BITS;
+    unsigned sub_bucket = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return HISTOGRAM_SUB_BUCKETS + shift * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/** The largest value that falls into the bucket */
+static inline
+uint64_t bucket_upper_bound(unsigned index) {
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+
+    unsigned shift = (index - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS;
+    uint64_t sub_bucket = (index - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS;
+    uint64_t lower = (HISTOGRAM_SUB_BUCKETS + sub_bucket) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void histogram_init(histogram_t* histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+void histogram_record(histogram_t* histogram, uint64_t value) {
+    __atomic_fetch_add(&histogram->buckets[bucket_index(value)], 1,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&histogram->max, &max, value, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void histogram_merge(histogram_t* into, const histogram_t* from) {
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        into->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+
+    into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max)
+        into->max = max;
+}
+
+uint64_t histogram_percentile(const histogram_t* histogram, double percentile) {
+    uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    if (!count)
+        return 0;
+
+    uint64_t target = (uint64_t)(percentile / 100.0 * count + 0.5);
+    if (target < 1)
+        target = 1;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= target) {
+            // Don't report more than we've actually seen.
+            uint64_t bound = bucket_upper_bound(i);
+            uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+            return bound < max ? bound : max;
+        }
+    }
+
+    return __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+}
+
+void histogram_print_json(const histogram_t* histogram,
+                          FILE* out,
+                          double divisor) {
+    fprintf(out, "\"count\": %llu, \"p50\": %.3f, \"p90\": %.3f, "
+                 "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f",
+            (unsigned long long) __atomic_load_n(&histogram->count,
+                                                 __ATOMIC_RELAXED),
+            histogram_percentile(histogram, 50) / divisor,
+            histogram_percentile(histogram, 90) / divisor,
+            histogram_percentile(histogram, 99) / divisor,
+            histogram_percentile(histogram, 99.9) / divisor,
+            __atomic_load_n(&histogram->max, __ATOMIC_RELAXED) / divisor);
+}
@@ -0,0 +1,73 @@
+/**
+ * histogram.h:
+ *   Lock-free log-linear histograms
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Every power of two is split in 2^HISTOGRAM_SUB_BITS linear buckets, so the
+ * relative error of a recorded value is at most 1/2^HISTOGRAM_SUB_BITS
+ * (12.5%).
+ *
+ * Values of 2^HISTOGRAM_MAX_BITS or more (~18 minutes, if recording
+ * nanoseconds) are clamped into the last bucket.
+ */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS                                                      \
+    (HISTOGRAM_SUB_BUCKETS +                                                   \
+     (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * Recording is lock-free (relaxed atomic increments), so any number of
+ * threads can record into the same histogram while another reads it. Reads
+ * are not a consistent snapshot, but close enough for reporting.
+ */
+typedef struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+void histogram_init(histogram_t* histogram);
+
+void histogram_record(histogram_t* histogram, uint64_t value);
+
+/** Add all the values of `from` to `into` */
+void histogram_merge(histogram_t* into, const histogram_t* from);
+
+/**
+ * The value below which `percentile` percent of the recorded values are (the
+ * upper bound of the bucket where it falls), or zero if empty.
+ */
+uint64_t histogram_percentile(const histogram_t* histogram, double percentile);
+
+/**
+ * Print count, p50, p90, p99, p99.9 and max as JSON members (without the
+ * surrounding braces), with every value divided by `divisor`.
+ */
+void histogram_print_json(const histogram_t* histogram,
+                          FILE* out,
+                          double divisor);
+
+#endif
@@ -0,0 +1,234 @@
+/**
+ * lateness.c:
+ *   Per-event dispatch lateness histograms
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lateness.h"
+#include "logger.h"
+
+void lateness_registry_init(lateness_registry_t* registry, bool per_event) {
+    memset(registry, 0, sizeof(*registry));
+    pthread_mutex_init(&registry->mutex, NULL);
+    registry->per_event = per_event;
+    for (size_t i = 0; i < 2; ++i) {
+        registry->classes[i].priority = (event_priority_t) i;
+        registry->classes[i].references = 1;
+        histogram_init(&registry->classes[i].histogram);
+    }
+}
+
+histogram_t* lateness_registry_get(lateness_registry_t* registry,
+                                   const event_t* event) {
+    if (!registry->per_event) {
+        histogram_t* histogram = &registry->classes[event->priority].histogram;
+        lateness_hold(histogram);
+        return histogram;
+    }
+
+    lateness_entry_t** bucket =
+        &registry->buckets[event->id % LATENESS_BUCKETS];
+
+    pthread_mutex_lock(&registry->mutex);
+
+    lateness_entry_t* entry = *bucket;
+    while (entry && entry->id != event->id)
+        entry = entry->next_in_bucket;
+
+    if (!entry) {
+        entry = malloc(sizeof(lateness_entry_t));
+        assert(entry);
+        entry->id = event->id;
+        entry->references = 1;
+        histogram_init(&entry->histogram);
+
+        entry->next_in_bucket = *bucket;
+        *bucket = entry;
+
+        entry->next_in_order = NULL;
+        entry->previous_in_order = registry->last;
+        if (registry->last)
+            registry->last->next_in_order = entry;
+        else
+            registry->first = entry;
+        registry->last = entry;
+        registry->count++;
+    }
+
+    strcpy(entry->description, event->description);
+    entry->priority = event->priority;
+    lateness_hold(&entry->histogram);
+
+    pthread_mutex_unlock(&registry->mutex);
+    return &entry->histogram;
+}
+
+void lateness_registry_remove(lateness_registry_t* registry, uint32_t id) {
+    pthread_mutex_lock(&registry->mutex);
+
+    lateness_entry_t** link = &registry->buckets[id % LATENESS_BUCKETS];
+    while (*link && (*link)->id != id)
+        link = &(*link)->next_in_bucket;
+
+    lateness_entry_t* entry = *link;
+    if (!entry) {
+        pthread_mutex_unlock(&registry->mutex);
+        return;
+    }
+    *link = entry->next_in_bucket;
+
+    if (entry->previous_in_order)
+        entry->previous_in_order->next_in_order = entry->next_in_order;
+    else
+        registry->first = entry->next_in_order;
+    if (entry->next_in_order)
+        entry->next_in_order->previous_in_order = entry->previous_in_order;
+    else
+        registry->last = entry->previous_in_order;
+    registry->count--;
+
+    pthread_mutex_unlock(&registry->mutex);
+    lateness_release(&entry->histogram);
+}
+
+void lateness_entry_free(lateness_entry_t* entry) {
+    free(entry);
+}
+
+/** Print `str` as a JSON string */
+static void print_json_string(FILE* out, const char* str) {
+    fputc('"', out);
+    for (; *str; ++str) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+/** Merge the events of class `priority` (or all, if negative) into `out` */
+static size_t lateness_registry_total_locked(lateness_registry_t* registry,
+                                             int priority,
+                                             histogram_t* out) {
+    if (!registry->per_event) {
+        for (size_t i = 0; i < 2; ++i)
+            if (priority < 0 || (int) i == priority)
+                histogram_merge(out, &registry->classes[i].histogram);
+        return 0;
+    }
+
+    size_t count = 0;
+    for (lateness_entry_t* entry = registry->first; entry;
+         entry = entry->next_in_order) {
+        if (priority >= 0 && entry->priority != (event_priority_t) priority)
+            continue;
+        histogram_merge(out, &entry->histogram);
+        count++;
+    }
+    return count;
+}
+
+void lateness_registry_total(lateness_registry_t* registry, histogram_t* out) {
+    pthread_mutex_lock(&registry->mutex);
+    lateness_registry_total_locked(registry, -1, out);
+    pthread_mutex_unlock(&registry->mutex);
+}
+
+size_t lateness_registry_class_total(lateness_registry_t* registry,
+                                     event_priority_t priority,
+                                     histogram_t* out) {
+    pthread_mutex_lock(&registry->mutex);
+    size_t count = lateness_registry_total_locked(registry, priority, out);
+    pthread_mutex_unlock(&registry->mutex);
+    return count;
+}
+
+void lateness_registry_report(lateness_registry_t* registry) {
+    pthread_mutex_lock(&registry->mutex);
+
+    histogram_t total;
+    histogram_init(&total);
+    lateness_registry_total_locked(registry, -1, &total);
+
+    histogram_t classes[2];
+    size_t class_counts[2];
+    event_priority_t priorities[2] = {EVENT_PRIORITY_HIGH, EVENT_PRIORITY_BULK};
+    for (size_t i = 0; i < 2; ++i) {
+        histogram_init(&classes[i]);
+        class_counts[i] = lateness_registry_total_locked(registry,
+                                                         priorities[i],
+                                                         &classes[i]);
+    }
+
+    pthread_mutex_lock(&LOGGER_CONFIG.mutex);
+    FILE* out = LOGGER_CONFIG.log_file;
+    if (out) {
+        // Without per-event histograms we don't know how many events there
+        // are, just what they recorded.
+        fprintf(out, "lateness: {");
+        if (registry->per_event)
+            fprintf(out, "\"events\": %zu, ", registry->count);
+        histogram_print_json(&total, out, 1000.0);
+        fprintf(out, "}\n");
+
+        // Without high priority events, it would be the total again.
+        bool any_high = registry->per_event ? class_counts[0] != 0
+                                            : classes[0].count != 0;
+        for (size_t i = 0; any_high && i < 2; ++i) {
+            fprintf(out, "lateness: {\"class\": \"%s\", ",
+                    EVENT_PRIORITY_NAME(priorities[i]));
+            if (registry->per_event)
+                fprintf(out, "\"events\": %zu, ", class_counts[i]);
+            histogram_print_json(&classes[i], out, 1000.0);
+            fprintf(out, "}\n");
+        }
+
+        for (lateness_entry_t* entry = registry->first; entry;
+             entry = entry->next_in_order) {
+            fprintf(out, "lateness: {\"id\": %u, \"description\": ", entry->id);
+            print_json_string(out, entry->description);
+            fprintf(out, ", ");
+            histogram_print_json(&entry->histogram, out, 1000.0);
+            fprintf(out, "}\n");
+        }
+        fflush(out);
+    }
+    pthread_mutex_unlock(&LOGGER_CONFIG.mutex);
+
+    pthread_mutex_unlock(&registry->mutex);
+}
+
+void lateness_registry_destroy(lateness_registry_t* registry) {
+    lateness_entry_t* entry = registry->first;
+    while (entry) {
+        lateness_entry_t* next = entry->next_in_order;
+        free(entry);
+        entry = next;
+    }
+
+    pthread_mutex_destroy(&registry->mutex);
+    memset(registry->buckets, 0, sizeof(registry->buckets));
+    registry->first = registry->last = NULL;
+    registry->count = 0;
+}
@@ -0,0 +1,140 @@
+/**
+ * lateness.h:
+ *   Per-event dispatch lateness histograms
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LATENESS_H
+#define LATENESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "event.h"
+#include "histogram.h"
+
+#define LATENESS_BUCKETS 1024
+
+typedef struct lateness_entry {
+    uint32_t id;
+    /// The class and description of the last version of the event we've seen.
+    event_priority_t priority;
+    char description[MAX_EVENT_DESCRIPTION_SIZE];
+    /// One for the registry while it's there, and one per holder of the
+    /// histogram. Updated atomically.
+    uint32_t references;
+    histogram_t histogram;
+    struct lateness_entry* next_in_bucket;
+    struct lateness_entry* next_in_order;
+    struct lateness_entry* previous_in_order;
+} lateness_entry_t;
+
+/**
+ * How late every event has been dispatched (actual minus scheduled send
+ * time, in nanoseconds), one histogram per class of events, or one per event
+ * with `per_event` (each is a couple of kilobytes, so that's opt-in).
+ *
+ * Events are identified by their id, so an event keeps its histogram across
+ * config reloads and updates, which just relabel it. Dispatching threads keep
+ * a reference to their histogram and record into it without any lock, so an
+ * entry removed from the registry (when its event is cancelled) is only freed
+ * once the last reference is released.
+ */
+typedef struct lateness_registry {
+    pthread_mutex_t mutex;
+    bool per_event;
+    /// What every event of each class records into without `per_event`,
+    /// indexed by priority. Never freed, the registry holds them.
+    lateness_entry_t classes[2];
+    lateness_entry_t* buckets[LATENESS_BUCKETS];
+    lateness_entry_t* first;
+    lateness_entry_t* last;
+    size_t count;
+} lateness_registry_t;
+
+void lateness_registry_init(lateness_registry_t* registry, bool per_event);
+
+/**
+ * The histogram of `event`, created if it's the first time we see its id,
+ * and relabeled with its description and class otherwise. Without
+ * `per_event`, the histogram of its class. The caller gets a reference, see
+ * `lateness_release()`.
+ */
+histogram_t* lateness_registry_get(lateness_registry_t* registry,
+                                   const event_t* event);
+
+/**
+ * Remove the entry of the event with `id`, if any, so it's not reported
+ * anymore. Its memory goes with the last reference.
+ */
+void lateness_registry_remove(lateness_registry_t* registry, uint32_t id);
+
+/** Merge the histograms of every event into `out` (already initialized) */
+void lateness_registry_total(lateness_registry_t* registry, histogram_t* out);
+
+/**
+ * Merge the histograms of the events of the `priority` class into `out`
+ * (already initialized). Returns how many events there are, which is only
+ * known with `per_event` (0 otherwise).
+ */
+size_t lateness_registry_class_total(lateness_registry_t* registry,
+                                     event_priority_t priority,
+                                     histogram_t* out);
+
+/**
+ * Write the percentiles (in microseconds) of all the events together, of
+ * every class if there are high priority events, and of every event (with
+ * `per_event`), to the log as one JSON object per line.
+ */
+void lateness_registry_report(lateness_registry_t* registry);
+
+/**
+ * Free every entry still in the registry, even if there are references left.
+ * Nothing can record anymore.
+ */
+void lateness_registry_destroy(lateness_registry_t* registry);
+
+#define lateness_entry_of(histogram)                                           \
+    ((lateness_entry_t*)((char*)(histogram) -                                 \
+                         offsetof(lateness_entry_t, histogram)))
+
+/** Take another reference to a histogram of the registry (or NULL) */
+static inline void lateness_hold(histogram_t* histogram) {
+    if (histogram)
+        __atomic_add_fetch(&lateness_entry_of(histogram)->references, 1,
+                           __ATOMIC_RELAXED);
+}
+
+void lateness_entry_free(lateness_entry_t* entry);
+
+/** Drop a reference to a histogram of the registry (or NULL) */
+static inline void lateness_release(histogram_t* histogram) {
+    if (histogram &&
+        __atomic_sub_fetch(&lateness_entry_of(histogram)->references, 1,
+                           __ATOMIC_ACQ_REL) == 0)
+        lateness_entry_free(lateness_entry_of(histogram));
+}
+
+/** Record a dispatch scheduled at `deadline` that happened at `now` */
+static inline
+void lateness_record(histogram_t* histogram, uint64_t deadline, uint64_t now) {
+    if (histogram)
+        histogram_record(histogram, now > deadline ? now - deadline : 0);
+}
+
+#endif
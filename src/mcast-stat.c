@@ -0,0 +1,212 @@
+/**
+ * mcast-stat.c:
+ *   Print the rates of the counters published with --metrics, like vmstat
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "scheduler.h"
+
+void show_usage(int _argc, char** argv) {
+    fprintf(stderr, "Usage: %s [options] [name]\n", argv[0]);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -h, --help\t Display this message and exit\n");
+    fprintf(stderr, "  -n, --interval [seconds]\t Time between lines (default 1)\n");
+    fprintf(stderr, "  -c, --count [n]\t Exit after [n] lines\n");
+    fprintf(stderr, "  -t, --threads\t Print a line per thread too\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "[name] is the one given to --metrics in the server or client.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Author(s):\n");
+    fprintf(stderr, "  Emilio Cobos Álvarez (<emiliocobos@usal.es>)\n");
+}
+
+/** Take a snapshot of a slot */
+void read_slot(const metrics_slot_t* slot, metrics_slot_t* out) {
+    out->packets_sent = metrics_get(slot, packets_sent);
+    out->bytes_sent = metrics_get(slot, bytes_sent);
+    out->send_errors = metrics_get(slot, send_errors);
+    out->packets_received = metrics_get(slot, packets_received);
+    out->bytes_received = metrics_get(slot, bytes_received);
+    out->receive_errors = metrics_get(slot, receive_errors);
+    out->batches = metrics_get(slot, batches);
+    out->batched_events = metrics_get(slot, batched_events);
+    out->queue_depth = metrics_get(slot, queue_depth);
+    out->active_events = metrics_get(slot, active_events);
+    out->jobs_stolen = metrics_get(slot, jobs_stolen);
+    out->max_queue_depth = metrics_get(slot, max_queue_depth);
+}
+
+void add_slot(metrics_slot_t* into, const metrics_slot_t* slot) {
+    into->packets_sent += slot->packets_sent;
+    into->bytes_sent += slot->bytes_sent;
+    into->send_errors += slot->send_errors;
+    into->packets_received += slot->packets_received;
+    into->bytes_received += slot->bytes_received;
+    into->receive_errors += slot->receive_errors;
+    into->batches += slot->batches;
+    into->batched_events += slot->batched_events;
+    into->queue_depth += slot->queue_depth;
+    into->active_events += slot->active_events;
+    into->jobs_stolen += slot->jobs_stolen;
+    if (slot->max_queue_depth > into->max_queue_depth)
+        into->max_queue_depth = slot->max_queue_depth;
+}
+
+void print_header() {
+    printf("%-12s %10s %12s %6s %10s %12s %6s %7s %7s %7s %8s %8s\n",
+           "", "tx/s", "tx bytes/s", "txerr", "rx/s", "rx bytes/s", "rxerr",
+           "batch", "queue", "maxq", "stolen/s", "events");
+}
+
+void print_rates(const char* name,
+                 const metrics_slot_t* now,
+                 const metrics_slot_t* before,
+                 double seconds) {
+    uint64_t batches = now->batches - before->batches;
+    uint64_t batched = now->batched_events - before->batched_events;
+
+    printf("%-12s %10.0f %12.0f %6llu %10.0f %12.0f %6llu %7.1f %7llu %7llu "
+           "%8.0f %8llu\n",
+           name,
+           (now->packets_sent - before->packets_sent) / seconds,
+           (now->bytes_sent - before->bytes_sent) / seconds,
+           (unsigned long long)(now->send_errors - before->send_errors),
+           (now->packets_received - before->packets_received) / seconds,
+           (now->bytes_received - before->bytes_received) / seconds,
+           (unsigned long long)(now->receive_errors - before->receive_errors),
+           batches ? (double) batched / batches : 0.0,
+           (unsigned long long) now->queue_depth,
+           (unsigned long long) now->max_queue_depth,
+           (now->jobs_stolen - before->jobs_stolen) / seconds,
+           (unsigned long long) now->active_events);
+}
+
+int main(int argc, char** argv) {
+    const char* name = NULL;
+    double interval = 1;
+    long count = -1;
+    bool per_thread = false;
+
+    LOGGER_CONFIG.log_file = stderr;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            show_usage(argc, argv);
+            return 1;
+        } else if (strcmp(argv[i], "-n") == 0 ||
+                   strcmp(argv[i], "--interval") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            interval = strtod(argv[i], NULL);
+        } else if (strcmp(argv[i], "-c") == 0 ||
+                   strcmp(argv[i], "--count") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            count = strtol(argv[i], NULL, 10);
+        } else if (strcmp(argv[i], "-t") == 0 ||
+                   strcmp(argv[i], "--threads") == 0) {
+            per_thread = true;
+        } else if (argv[i][0] != '-' && !name) {
+            name = argv[i];
+        } else {
+            WARN("Unhandled option: %s", argv[i]);
+        }
+    }
+
+    if (!name) {
+        show_usage(argc, argv);
+        return 1;
+    }
+
+    if (interval <= 0)
+        FATAL("The interval must be positive");
+
+    const metrics_region_t* region = metrics_attach(name);
+    if (!region)
+        FATAL("Could not attach to \"%s\": %s", name,
+              errno == EPROTO ? "not a metrics segment" : strerror(errno));
+
+    printf("%s %s (pid %d)\n", name, region->role, region->pid);
+
+    metrics_slot_t before[METRICS_MAX_SLOTS];
+    metrics_slot_t now[METRICS_MAX_SLOTS];
+    memset(before, 0, sizeof(before));
+
+    uint32_t slots = __atomic_load_n(&region->slot_count, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < slots; ++i)
+        read_slot(&region->slots[i], &before[i]);
+
+    uint64_t last = monotonic_now();
+    for (long line = 0; count < 0 || line < count; ++line) {
+        if (line % 20 == 0)
+            print_header();
+
+        sleep_until(last + (uint64_t)(interval * NSEC_PER_SEC));
+
+        // Threads may have claimed slots since, those start from zero.
+        uint32_t current = __atomic_load_n(&region->slot_count,
+                                           __ATOMIC_ACQUIRE);
+        for (uint32_t i = slots; i < current; ++i)
+            memset(&before[i], 0, sizeof(before[i]));
+        slots = current;
+
+        metrics_slot_t total_now, total_before;
+        memset(&total_now, 0, sizeof(total_now));
+        memset(&total_before, 0, sizeof(total_before));
+        for (uint32_t i = 0; i < slots; ++i) {
+            read_slot(&region->slots[i], &now[i]);
+            add_slot(&total_now, &now[i]);
+            add_slot(&total_before, &before[i]);
+        }
+
+        uint64_t at = monotonic_now();
+        double seconds = (double)(at - last) / NSEC_PER_SEC;
+        last = at;
+
+        print_rates("total", &total_now, &total_before, seconds);
+        if (per_thread) {
+            for (uint32_t i = 0; i < slots; ++i) {
+                char slot_name[METRICS_NAME_SIZE];
+                memcpy(slot_name, region->slot_names[i], sizeof(slot_name));
+                slot_name[METRICS_NAME_SIZE - 1] = '\0';
+                print_rates(slot_name, &now[i], &before[i], seconds);
+            }
+        }
+        fflush(stdout);
+
+        memcpy(before, now, sizeof(metrics_slot_t) * slots);
+
+        if (kill(region->pid, 0) != 0 && errno == ESRCH) {
+            printf("%s: process %d has exited\n", name, region->pid);
+            break;
+        }
+    }
+
+    metrics_detach(region);
+    return 0;
+}
@@ -0,0 +1,153 @@
+/**
+ * mcast-tail.c:
+ *   Print the payloads a client publishes with --ring, as they arrive
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "ring.h"
+#include "scheduler.h"
+#include "wire.h"
+
+/** How long to sleep when there's nothing to read, unless --spin */
+#define TAIL_IDLE_SLEEP (100 * NSEC_PER_SEC / 1000000)
+
+/** How often to check whether the client is still there when idle */
+#define TAIL_ALIVE_CHECK NSEC_PER_SEC
+
+void show_usage(int _argc, char** argv) {
+    fprintf(stderr, "Usage: %s [options] [name]\n", argv[0]);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -h, --help\t Display this message and exit\n");
+    fprintf(stderr, "  -c, --count [n]\t Exit after [n] payloads\n");
+    fprintf(stderr, "  -q, --quiet\t Don't print the payloads, just count them\n");
+    fprintf(stderr, "  -t, --timestamps\t Print how long each payload took to\n"
+                    "\t\t get here from the client, in microseconds\n");
+    fprintf(stderr, "  --spin\t Busy-wait instead of sleeping when idle\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "[name] is the one given to --ring in the client.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Author(s):\n");
+    fprintf(stderr, "  Emilio Cobos Álvarez (<emiliocobos@usal.es>)\n");
+}
+
+volatile sig_atomic_t INTERRUPTED = 0;
+
+void handle_interrupt(int sig) {
+    INTERRUPTED = 1;
+}
+
+int main(int argc, char** argv) {
+    const char* name = NULL;
+    long count = -1;
+    bool quiet = false;
+    bool timestamps = false;
+    bool spin = false;
+
+    LOGGER_CONFIG.log_file = stderr;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            show_usage(argc, argv);
+            return 1;
+        } else if (strcmp(argv[i], "-c") == 0 ||
+                   strcmp(argv[i], "--count") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            count = strtol(argv[i], NULL, 10);
+        } else if (strcmp(argv[i], "-q") == 0 ||
+                   strcmp(argv[i], "--quiet") == 0) {
+            quiet = true;
+        } else if (strcmp(argv[i], "-t") == 0 ||
+                   strcmp(argv[i], "--timestamps") == 0) {
+            timestamps = true;
+        } else if (strcmp(argv[i], "--spin") == 0) {
+            spin = true;
+        } else if (argv[i][0] != '-' && !name) {
+            name = argv[i];
+        } else {
+            WARN("Unhandled option: %s", argv[i]);
+        }
+    }
+
+    if (!name) {
+        show_usage(argc, argv);
+        return 1;
+    }
+
+    ring_reader_t reader;
+    if (!ring_attach(&reader, name))
+        FATAL("Could not attach to \"%s\": %s", name,
+              errno == EPROTO ? "not a ring" : strerror(errno));
+
+    signal(SIGINT, handle_interrupt);
+    signal(SIGTERM, handle_interrupt);
+
+    static char payload[RING_SLOT_SIZE];
+    long read = 0;
+    uint64_t idle_since = 0;
+    while (!INTERRUPTED && (count < 0 || read < count)) {
+        size_t length;
+        uint64_t received_at;
+        if (!ring_read(&reader, payload, sizeof(payload), &length,
+                       &received_at)) {
+            uint64_t now = monotonic_now();
+            if (!idle_since) {
+                idle_since = now;
+            } else if (now - idle_since > TAIL_ALIVE_CHECK) {
+                if (kill(reader.region->pid, 0) != 0 && errno == ESRCH) {
+                    fprintf(stderr, "%s: process %d has exited\n", name,
+                            reader.region->pid);
+                    break;
+                }
+                idle_since = now;
+            }
+
+            if (!spin)
+                sleep_until(now + TAIL_IDLE_SLEEP);
+            continue;
+        }
+
+        idle_since = 0;
+        read++;
+        if (quiet)
+            continue;
+
+        if (timestamps) {
+            uint64_t now = wire_now();
+            printf("%.3f ", now > received_at
+                            ? (double)(now - received_at) / 1000 : 0.0);
+        }
+
+        printf("> %.*s\n", (int) strnlen(payload, length), payload);
+        fflush(stdout);
+    }
+
+    fprintf(stderr, "%s: %ld payloads read, %llu lost\n", name, read,
+            (unsigned long long) reader.lost);
+
+    ring_detach(&reader);
+    return 0;
+}
@@ -0,0 +1,143 @@
+/**
+ * metrics.c:
+ *   Counters published in shared memory, read by mcast-stat
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+
+/** "/mcast-<name>", as shm_open() wants it */
+static bool metrics_segment_name(const char* name, char* out, size_t len) {
+    int ret = snprintf(out, len, "/mcast-%s", name);
+    if (ret < 0 || (size_t) ret >= len || strchr(name, '/')) {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+metrics_region_t* metrics_create(const char* name, const char* role) {
+    char segment[256];
+    if (!metrics_segment_name(name, segment, sizeof(segment)))
+        return NULL;
+
+    int fd = shm_open(segment, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+
+    metrics_region_t* region = NULL;
+    if (ftruncate(fd, sizeof(metrics_region_t)) != 0)
+        goto errexit;
+
+    region = mmap(NULL, sizeof(metrics_region_t), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        region = NULL;
+        goto errexit;
+    }
+
+    close(fd);
+
+    // ftruncate() zeroed it already.
+    region->version = METRICS_VERSION;
+    region->pid = getpid();
+    strncpy(region->role, role, METRICS_NAME_SIZE - 1);
+    __atomic_store_n(&region->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+    return region;
+
+errexit:
+    {
+        int saved_errno = errno;
+        close(fd);
+        shm_unlink(segment);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+const metrics_region_t* metrics_attach(const char* name) {
+    char segment[256];
+    if (!metrics_segment_name(name, segment, sizeof(segment)))
+        return NULL;
+
+    int fd = shm_open(segment, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(metrics_region_t)) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    const metrics_region_t* region = mmap(NULL, sizeof(metrics_region_t),
+                                          PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+        return NULL;
+
+    if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC ||
+        region->version != METRICS_VERSION) {
+        metrics_detach(region);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    return region;
+}
+
+metrics_slot_t* metrics_claim_slot(metrics_region_t* region,
+                                   const char* slot_name) {
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    if (!region)
+        return NULL;
+
+    // Claiming is not on the hot path, so keep it simple.
+    pthread_mutex_lock(&mutex);
+    uint32_t index = region->slot_count;
+    if (index < METRICS_MAX_SLOTS) {
+        strncpy(region->slot_names[index], slot_name, METRICS_NAME_SIZE - 1);
+        __atomic_store_n(&region->slot_count, index + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return index < METRICS_MAX_SLOTS ? &region->slots[index] : NULL;
+}
+
+void metrics_destroy(metrics_region_t* region, const char* name) {
+    if (!region)
+        return;
+
+    munmap(region, sizeof(metrics_region_t));
+
+    char segment[256];
+    if (metrics_segment_name(name, segment, sizeof(segment)))
+        shm_unlink(segment);
+}
+
+void metrics_detach(const metrics_region_t* region) {
+    munmap((void*) region, sizeof(metrics_region_t));
+}
@@ -0,0 +1,127 @@
+/**
+ * metrics.h:
+ *   Counters published in shared memory, read by mcast-stat
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_MAGIC 0x4d435354 // "MCST"
+#define METRICS_VERSION 2
+#define METRICS_MAX_SLOTS 64
+#define METRICS_NAME_SIZE 16
+#define METRICS_CACHE_LINE_SIZE 64
+
+/**
+ * The counters of a single thread.
+ *
+ * Every slot has a single writer (or writers serialized by a lock), so the
+ * hot path just does relaxed atomic stores: no locked instructions, no
+ * syscalls. Slots are padded to cache lines so threads don't false-share.
+ *
+ * `queue_depth`, `max_queue_depth` and `active_events` are gauges, the rest
+ * only grow.
+ */
+typedef struct metrics_slot {
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+    uint64_t send_errors;
+    uint64_t packets_received;
+    uint64_t bytes_received;
+    uint64_t receive_errors;
+    /// Number of batches (dispatch rounds, or reads), and events in them.
+    uint64_t batches;
+    uint64_t batched_events;
+    uint64_t queue_depth;
+    uint64_t active_events;
+    /// Jobs a pool worker took from another worker's deque, and the deepest
+    /// any deque of the pool got (see pool.h).
+    uint64_t jobs_stolen;
+    uint64_t max_queue_depth;
+} __attribute__((aligned(METRICS_CACHE_LINE_SIZE))) metrics_slot_t;
+
+/**
+ * The shared memory segment, at /dev/shm/mcast-<name> on Linux.
+ *
+ * `slot_count` is published with release semantics after the slot name is
+ * written, so readers only look at slots that are fully set up.
+ */
+typedef struct metrics_region {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    int32_t pid;
+    char role[METRICS_NAME_SIZE];
+    char slot_names[METRICS_MAX_SLOTS][METRICS_NAME_SIZE];
+    metrics_slot_t slots[METRICS_MAX_SLOTS];
+} metrics_region_t;
+
+/** Add to a counter of a slot, which may be NULL if metrics are disabled */
+#define metrics_add(slot, field, n)                                            \
+    do {                                                                       \
+        metrics_slot_t* slot_ = (slot);                                        \
+        if (slot_)                                                             \
+            __atomic_store_n(&slot_->field,                                    \
+                             __atomic_load_n(&slot_->field, __ATOMIC_RELAXED)  \
+                                 + (n),                                        \
+                             __ATOMIC_RELAXED);                                \
+    } while (0)
+
+/** Set a gauge of a slot, which may be NULL */
+#define metrics_set(slot, field, value)                                        \
+    do {                                                                       \
+        metrics_slot_t* slot_ = (slot);                                        \
+        if (slot_)                                                             \
+            __atomic_store_n(&slot_->field, (value), __ATOMIC_RELAXED);        \
+    } while (0)
+
+/** Read a counter of a slot */
+#define metrics_get(slot, field) __atomic_load_n(&(slot)->field, __ATOMIC_RELAXED)
+
+/**
+ * Create (or replace) the segment for `name`, published by a process in the
+ * `role` ("server", "client"...).
+ *
+ * Returns NULL and sets errno on failure.
+ */
+metrics_region_t* metrics_create(const char* name, const char* role);
+
+/**
+ * Attach to an existing segment, read-only.
+ *
+ * Returns NULL and sets errno on failure (EPROTO if it's not a segment of
+ * ours).
+ */
+const metrics_region_t* metrics_attach(const char* name);
+
+/**
+ * Claim a slot for a thread. Returns NULL if `region` is NULL or there are no
+ * slots left, which is fine to pass to `metrics_add()`.
+ */
+metrics_slot_t* metrics_claim_slot(metrics_region_t* region,
+                                   const char* slot_name);
+
+/** Unmap the segment, and remove it if we created it */
+void metrics_destroy(metrics_region_t* region, const char* name);
+
+void metrics_detach(const metrics_region_t* region);
+
+#endif
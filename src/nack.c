@@ -0,0 +1,149 @@
+/**
+ * nack.c:
+ *   Keep track of the datagrams a receiver has to ask for again
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <string.h>
+
+#include "nack.h"
+
+void nack_tracker_init(nack_tracker_t* tracker,
+                       uint64_t delay,
+                       uint64_t retry,
+                       uint64_t seed) {
+    tracker->count = 0;
+    tracker->delay = delay;
+    tracker->retry = retry;
+    tracker->random = seed;
+    tracker->abandoned = 0;
+}
+
+/** Uniform in [0, delay) */
+static uint64_t nack_tracker_jitter(nack_tracker_t* tracker) {
+    if (!tracker->delay)
+        return 0;
+
+    // splitmix64
+    uint64_t z = (tracker->random += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return z % tracker->delay;
+}
+
+void nack_tracker_gap(nack_tracker_t* tracker,
+                      uint32_t stream,
+                      uint64_t first,
+                      uint64_t count,
+                      const struct sockaddr_storage* source,
+                      uint64_t now) {
+    // A huge gap is more likely a restart than a loss, don't ask for more
+    // than we could possibly track.
+    uint64_t max = (uint64_t) NACK_RANGE * NACK_MAX_PENDING;
+    if (count > max) {
+        tracker->abandoned += count - max;
+        first += count - max;
+        count = max;
+    }
+
+    while (count) {
+        uint64_t chunk = count < NACK_RANGE ? count : NACK_RANGE;
+        if (tracker->count == NACK_MAX_PENDING) {
+            tracker->abandoned += count;
+            return;
+        }
+
+        nack_entry_t* entry = &tracker->entries[tracker->count++];
+        entry->stream = stream;
+        entry->first = first;
+        entry->missing = chunk == 64 ? ~0ull : (1ull << chunk) - 1;
+        entry->due_at = now + nack_tracker_jitter(tracker);
+        entry->attempts = 0;
+        entry->source = *source;
+
+        first += chunk;
+        count -= chunk;
+    }
+}
+
+static void nack_tracker_remove(nack_tracker_t* tracker, size_t index) {
+    assert(index < tracker->count);
+    tracker->entries[index] = tracker->entries[--tracker->count];
+}
+
+bool nack_tracker_fill(nack_tracker_t* tracker,
+                       uint32_t stream,
+                       uint64_t sequence) {
+    for (size_t i = 0; i < tracker->count; ++i) {
+        nack_entry_t* entry = &tracker->entries[i];
+        if (entry->stream != stream || sequence < entry->first ||
+            sequence - entry->first >= NACK_RANGE)
+            continue;
+
+        uint64_t bit = 1ull << (sequence - entry->first);
+        if (!(entry->missing & bit))
+            return false;
+
+        entry->missing &= ~bit;
+        if (!entry->missing)
+            nack_tracker_remove(tracker, i);
+        return true;
+    }
+
+    return false;
+}
+
+uint64_t nack_tracker_next_due(const nack_tracker_t* tracker) {
+    uint64_t next = UINT64_MAX;
+    for (size_t i = 0; i < tracker->count; ++i)
+        if (tracker->entries[i].due_at < next)
+            next = tracker->entries[i].due_at;
+    return next;
+}
+
+bool nack_tracker_pop_due(nack_tracker_t* tracker,
+                          uint64_t now,
+                          nack_request_t* out_request) {
+    size_t i = 0;
+    while (i < tracker->count) {
+        nack_entry_t* entry = &tracker->entries[i];
+        if (entry->due_at > now) {
+            ++i;
+            continue;
+        }
+
+        if (entry->attempts == NACK_MAX_ATTEMPTS) {
+            tracker->abandoned += __builtin_popcountll(entry->missing);
+            nack_tracker_remove(tracker, i);
+            continue;
+        }
+
+        int low = __builtin_ctzll(entry->missing);
+        int high = 63 - __builtin_clzll(entry->missing);
+        out_request->stream = entry->stream;
+        out_request->first = entry->first + low;
+        out_request->count = high - low + 1;
+        out_request->source = entry->source;
+
+        entry->attempts++;
+        entry->due_at = now + tracker->retry + nack_tracker_jitter(tracker);
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,106 @@
+/**
+ * nack.h:
+ *   Keep track of the datagrams a receiver has to ask for again
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef NACK_H
+#define NACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/** Sequence numbers covered by a single entry (a bit mask) */
+#define NACK_RANGE 64
+
+/** Most entries pending at once, so at most 64 * 256 missing datagrams */
+#define NACK_MAX_PENDING 256
+
+/** Times we ask for the same datagrams before giving up */
+#define NACK_MAX_ATTEMPTS 3
+
+typedef struct nack_entry {
+    uint32_t stream;
+    /// Sequence number of the first bit of `missing`.
+    uint64_t first;
+    uint64_t missing;
+    uint64_t due_at;
+    unsigned attempts;
+    /// Where the stream comes from.
+    struct sockaddr_storage source;
+} nack_entry_t;
+
+/**
+ * Gaps in the streams, waiting either to be asked for (when `due_at` comes)
+ * or to be filled by a late datagram, a repair someone else asked for, or
+ * parity.
+ *
+ * The first NACK is delayed by a random time of up to `delay`, and the next
+ * ones by `retry` plus that.
+ */
+typedef struct nack_tracker {
+    nack_entry_t entries[NACK_MAX_PENDING];
+    size_t count;
+    uint64_t delay;
+    uint64_t retry;
+    uint64_t random;
+    /// Datagrams we gave up on, or didn't even have room to track.
+    uint64_t abandoned;
+} nack_tracker_t;
+
+/** A NACK to send */
+typedef struct nack_request {
+    uint32_t stream;
+    uint64_t first;
+    uint32_t count;
+    struct sockaddr_storage source;
+} nack_request_t;
+
+void nack_tracker_init(nack_tracker_t* tracker,
+                       uint64_t delay,
+                       uint64_t retry,
+                       uint64_t seed);
+
+/** Sequence numbers [first, first + count) of a stream are missing */
+void nack_tracker_gap(nack_tracker_t* tracker,
+                      uint32_t stream,
+                      uint64_t first,
+                      uint64_t count,
+                      const struct sockaddr_storage* source,
+                      uint64_t now);
+
+/**
+ * A datagram arrived. Returns true if it was missing, false if we never asked
+ * for it (or we have it already).
+ */
+bool nack_tracker_fill(nack_tracker_t* tracker,
+                       uint32_t stream,
+                       uint64_t sequence);
+
+/** When the next NACK is due, or UINT64_MAX if there are none */
+uint64_t nack_tracker_next_due(const nack_tracker_t* tracker);
+
+/**
+ * Pop a NACK that's due by `now`, from the first to the last datagram still
+ * missing of an entry. Returns false if there are none.
+ */
+bool nack_tracker_pop_due(nack_tracker_t* tracker,
+                          uint64_t now,
+                          nack_request_t* out_request);
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ * notify.c:
+ *   Tell whoever started us that we are ready to dispatch events
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "notify.h"
+#include "logger.h"
+
+static int READY_FD = -1;
+
+void notify_set_fd(int fd) {
+    READY_FD = fd;
+}
+
+bool notify_service_manager(const char* state) {
+    const char* path = getenv("NOTIFY_SOCKET");
+    if (!path || !*path)
+        return true;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    size_t length = strlen(path);
+    if (length >= sizeof(addr.sun_path) || (path[0] != '/' && path[0] != '@')) {
+        errno = EINVAL;
+        return false;
+    }
+
+    memcpy(addr.sun_path, path, length);
+    // Linux abstract namespace.
+    if (path[0] == '@')
+        addr.sun_path[0] = '\0';
+
+    int sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return false;
+
+    char message[128];
+    int message_length = snprintf(message, sizeof(message), "%s\nMAINPID=%d",
+                                  state, (int) getpid());
+
+    ssize_t ret = sendto(sock, message, message_length, MSG_NOSIGNAL,
+                         (struct sockaddr*) &addr,
+                         offsetof(struct sockaddr_un, sun_path) + length);
+
+    int saved_errno = errno;
+    close(sock);
+    errno = saved_errno;
+    return ret == message_length;
+}
+
+void notify_ready() {
+    if (READY_FD != -1) {
+        const char status = 0;
+        ssize_t ret;
+        do {
+            ret = write(READY_FD, &status, 1);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret != 1)
+            WARN("Couldn't tell the parent we're ready: %s", strerror(errno));
+
+        close(READY_FD);
+        READY_FD = -1;
+    }
+
+    if (!notify_service_manager("READY=1"))
+        WARN("Couldn't notify the service manager: %s", strerror(errno));
+}
+
+void notify_reloading() {
+    notify_service_manager("RELOADING=1");
+}
+
+void notify_stopping() {
+    notify_service_manager("STOPPING=1");
+}
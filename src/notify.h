@@ -0,0 +1,59 @@
+/**
+ * notify.h:
+ *   Tell whoever started us that we are ready to dispatch events
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <stdbool.h>
+
+/**
+ * Readiness is reported, once, to:
+ *
+ *  - The parent process, if we've been daemonized (see `notify_set_fd()`),
+ *    by writing a single byte to a pipe, so it can exit right away with the
+ *    right status instead of guessing.
+ *  - The service manager, if NOTIFY_SOCKET is set, with an sd_notify(3)
+ *    style "READY=1" datagram (along with our pid, since we may have forked).
+ *
+ * Later reloads are reported to the service manager too, with "RELOADING=1"
+ * and then "READY=1" again.
+ */
+
+/** The write end of the readiness pipe of the daemonizing parent */
+void notify_set_fd(int fd);
+
+/**
+ * We're dispatching events (again, after a reload). Only the first call
+ * tells the parent.
+ */
+void notify_ready();
+
+/** We're about to reload the events */
+void notify_reloading();
+
+/** We're shutting down */
+void notify_stopping();
+
+/**
+ * Send `state` to the service manager, if there's any. Returns false if the
+ * message couldn't be sent.
+ */
+bool notify_service_manager(const char* state);
+
+#endif
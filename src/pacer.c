@@ -0,0 +1,80 @@
+/**
+ * pacer.c:
+ *   Token-bucket send pacing
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "pacer.h"
+#include "scheduler.h"
+
+static inline
+double max_double(double a, double b) {
+    return a > b ? a : b;
+}
+
+static inline
+double min_double(double a, double b) {
+    return a < b ? a : b;
+}
+
+void pacer_init(pacer_t* pacer,
+                double packets_per_sec,
+                double bytes_per_sec,
+                uint64_t now) {
+    pacer->packets_per_sec = packets_per_sec;
+    pacer->bytes_per_sec = bytes_per_sec;
+    pacer->packet_tokens = max_double(1, packets_per_sec / 1000);
+    pacer->byte_tokens = bytes_per_sec / 1000;
+    pacer->last_refill = now;
+}
+
+uint64_t pacer_reserve(pacer_t* pacer,
+                       size_t packets,
+                       size_t bytes,
+                       uint64_t now) {
+    if (!pacer_is_enabled(pacer))
+        return 0;
+
+    // The burst is always at least a single packet, so batches accumulate debt
+    // for every packet but the first one.
+    if (now > pacer->last_refill) {
+        double elapsed = (double)(now - pacer->last_refill) / NSEC_PER_SEC;
+        pacer->packet_tokens =
+            min_double(max_double(1, pacer->packets_per_sec / 1000),
+                       pacer->packet_tokens + elapsed * pacer->packets_per_sec);
+        pacer->byte_tokens =
+            min_double(max_double(packets ? bytes / packets : bytes,
+                                  pacer->bytes_per_sec / 1000),
+                       pacer->byte_tokens + elapsed * pacer->bytes_per_sec);
+        pacer->last_refill = now;
+    }
+
+    double wait = 0;
+
+    if (pacer->packets_per_sec > 0) {
+        pacer->packet_tokens -= packets;
+        if (pacer->packet_tokens < 0)
+            wait = -pacer->packet_tokens / pacer->packets_per_sec;
+    }
+
+    if (pacer->bytes_per_sec > 0) {
+        pacer->byte_tokens -= bytes;
+        if (pacer->byte_tokens < 0)
+            wait = max_double(wait, -pacer->byte_tokens / pacer->bytes_per_sec);
+    }
+
+    return (uint64_t)(wait * NSEC_PER_SEC);
+}
@@ -0,0 +1,62 @@
+/**
+ * pacer.h:
+ *   Token-bucket send pacing
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Two token buckets (packets and bytes) that cap the send rate of a socket.
+ *
+ * The buckets are allowed to go into debt: a packet is always accounted when
+ * it's sent, and the debt is what the next sender has to wait for. The burst
+ * size is a millisecond worth of tokens (but at least one packet), so a pacer
+ * spreads packets evenly instead of letting them out in bursts.
+ *
+ * A rate of zero means no cap. Not thread-safe.
+ */
+typedef struct pacer {
+    double packets_per_sec;
+    double bytes_per_sec;
+    double packet_tokens;
+    double byte_tokens;
+    uint64_t last_refill;
+} pacer_t;
+
+void pacer_init(pacer_t* pacer,
+                double packets_per_sec,
+                double bytes_per_sec,
+                uint64_t now);
+
+#define pacer_is_enabled(p) ((p)->packets_per_sec > 0 || (p)->bytes_per_sec > 0)
+
+/**
+ * Account `packets` packets adding up to `bytes` bytes, sent at `now`, and
+ * return how many nanoseconds the caller has to wait before actually sending
+ * them.
+ */
+uint64_t pacer_reserve(pacer_t* pacer,
+                       size_t packets,
+                       size_t bytes,
+                       uint64_t now);
+
+#endif
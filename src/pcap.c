@@ -0,0 +1,571 @@
+/**
+ * pcap.c:
+ *   Minimal pcap and pcapng reader
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "pcap.h"
+#include "scheduler.h"
+
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+#define PCAPNG_SECTION_HEADER 0x0a0d0d0a
+#define PCAPNG_INTERFACE_DESCRIPTION 1
+#define PCAPNG_OBSOLETE_PACKET 2
+#define PCAPNG_SIMPLE_PACKET 3
+#define PCAPNG_ENHANCED_PACKET 6
+
+#define PCAPNG_OPTION_END 0
+#define PCAPNG_OPTION_TSRESOL 9
+#define PCAPNG_OPTION_TSOFFSET 14
+
+/** Biggest block we accept, so a corrupt length doesn't eat all the memory */
+#define PCAP_MAX_BLOCK_SIZE (16 << 20)
+
+static inline
+uint16_t swap16(uint16_t value) {
+    return (uint16_t)(value >> 8 | value << 8);
+}
+
+static inline
+uint32_t swap32(uint32_t value) {
+    return __builtin_bswap32(value);
+}
+
+static inline
+uint64_t swap64(uint64_t value) {
+    return __builtin_bswap64(value);
+}
+
+/** Read a host-order (unless the file is swapped) 16-bit integer */
+static inline
+uint16_t read16(const pcap_reader_t* reader, const unsigned char* buffer) {
+    uint16_t value;
+    memcpy(&value, buffer, sizeof(value));
+    return reader->swapped ? swap16(value) : value;
+}
+
+static inline
+uint32_t read32(const pcap_reader_t* reader, const unsigned char* buffer) {
+    uint32_t value;
+    memcpy(&value, buffer, sizeof(value));
+    return reader->swapped ? swap32(value) : value;
+}
+
+static inline
+uint64_t read64(const pcap_reader_t* reader, const unsigned char* buffer) {
+    uint64_t value;
+    memcpy(&value, buffer, sizeof(value));
+    return reader->swapped ? swap64(value) : value;
+}
+
+static inline
+uint16_t read_be16(const unsigned char* buffer) {
+    return (uint16_t) buffer[0] << 8 | buffer[1];
+}
+
+/** Read exactly `len` bytes. Returns 1, 0 at a clean EOF, or -1. */
+static int read_exactly(pcap_reader_t* reader, void* buffer, size_t len) {
+    size_t ret = fread(buffer, 1, len, reader->file);
+    if (ret == len)
+        return 1;
+
+    if (ret == 0 && feof(reader->file))
+        return 0;
+
+    errno = ferror(reader->file) ? EIO : EPROTO;
+    return -1;
+}
+
+static bool reserve(pcap_reader_t* reader, size_t len) {
+    if (len > PCAP_MAX_BLOCK_SIZE) {
+        errno = EPROTO;
+        return false;
+    }
+
+    if (len <= reader->buffer_capacity)
+        return true;
+
+    reader->buffer = realloc(reader->buffer, len);
+    assert(reader->buffer);
+    reader->buffer_capacity = len;
+    return true;
+}
+
+/** Nanoseconds since the epoch of a timestamp in `interface`'s units */
+static uint64_t interface_timestamp(const pcap_interface_t* interface,
+                                    uint64_t units) {
+    uint64_t seconds = units / interface->units_per_sec;
+    uint64_t fraction = units % interface->units_per_sec;
+    uint64_t ns = fraction * NSEC_PER_SEC / interface->units_per_sec;
+    return (seconds + interface->offset) * NSEC_PER_SEC + ns;
+}
+
+static void parse_interface_options(pcap_reader_t* reader,
+                                    pcap_interface_t* interface,
+                                    const unsigned char* options,
+                                    size_t len) {
+    while (len >= 4) {
+        uint16_t code = read16(reader, options);
+        uint16_t option_len = read16(reader, options + 2);
+        size_t padded = 4 + ((option_len + 3) & ~3u);
+        if (code == PCAPNG_OPTION_END || padded > len)
+            break;
+
+        if (code == PCAPNG_OPTION_TSRESOL && option_len >= 1) {
+            uint8_t resolution = options[4];
+            uint8_t exponent = resolution & 0x7f;
+            uint64_t units = 1;
+            for (uint8_t i = 0; i < exponent && units < NSEC_PER_SEC * 1000; ++i)
+                units *= (resolution & 0x80) ? 2 : 10;
+            interface->units_per_sec = units;
+        } else if (code == PCAPNG_OPTION_TSOFFSET && option_len >= 8) {
+            interface->offset = (int64_t) read64(reader, options + 4);
+        }
+
+        options += padded;
+        len -= padded;
+    }
+}
+
+/** Read the header of a classic pcap file, after its magic */
+static bool pcap_open_classic(pcap_reader_t* reader, uint32_t magic) {
+    unsigned char header[20];
+    if (read_exactly(reader, header, sizeof(header)) != 1) {
+        errno = EPROTO;
+        return false;
+    }
+
+    uint32_t native = reader->swapped ? swap32(magic) : magic;
+    pcap_interface_t* interface = &reader->interfaces[0];
+    interface->link_type = read32(reader, header + 16) & 0xffff;
+    interface->units_per_sec = native == PCAP_MAGIC_NSEC ? NSEC_PER_SEC
+                                                         : 1000000;
+    interface->offset = 0;
+    reader->interface_count = 1;
+    return true;
+}
+
+bool pcap_open(pcap_reader_t* reader, const char* filename) {
+    memset(reader, 0, sizeof(*reader));
+
+    reader->file = fopen(filename, "rb");
+    if (!reader->file)
+        return false;
+
+    uint32_t magic;
+    if (read_exactly(reader, &magic, sizeof(magic)) != 1)
+        goto errexit;
+
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC) {
+        if (!pcap_open_classic(reader, magic))
+            goto errexit;
+        return true;
+    }
+
+    if (swap32(magic) == PCAP_MAGIC_USEC || swap32(magic) == PCAP_MAGIC_NSEC) {
+        reader->swapped = true;
+        if (!pcap_open_classic(reader, magic))
+            goto errexit;
+        return true;
+    }
+
+    if (magic == PCAPNG_SECTION_HEADER) {
+        // The section header is handled as any other block.
+        reader->pcapng = true;
+        if (fseek(reader->file, 0, SEEK_SET) != 0)
+            goto errexit;
+        return true;
+    }
+
+    errno = EPROTO;
+
+errexit:
+    {
+        int saved_errno = errno;
+        fclose(reader->file);
+        reader->file = NULL;
+        errno = saved_errno;
+    }
+    return false;
+}
+
+static int pcap_next_classic(pcap_reader_t* reader, pcap_packet_t* out) {
+    unsigned char header[16];
+    int ret = read_exactly(reader, header, sizeof(header));
+    if (ret != 1)
+        return ret;
+
+    uint32_t seconds = read32(reader, header);
+    uint32_t fraction = read32(reader, header + 4);
+    uint32_t captured = read32(reader, header + 8);
+
+    if (!reserve(reader, captured))
+        return -1;
+
+    if (captured && read_exactly(reader, reader->buffer, captured) != 1) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    const pcap_interface_t* interface = &reader->interfaces[0];
+    out->timestamp = interface_timestamp(interface,
+                                         (uint64_t) seconds *
+                                             interface->units_per_sec +
+                                         fraction);
+    out->link_type = interface->link_type;
+    out->data = reader->buffer;
+    out->length = captured;
+    return 1;
+}
+
+static bool pcapng_interface(pcap_reader_t* reader,
+                             const unsigned char* body,
+                             size_t len) {
+    if (len < 8) {
+        errno = EPROTO;
+        return false;
+    }
+
+    // Keep reading, but we won't be able to tell apart the extra interfaces.
+    if (reader->interface_count == PCAP_MAX_INTERFACES)
+        return true;
+
+    pcap_interface_t* interface = &reader->interfaces[reader->interface_count++];
+    interface->link_type = read16(reader, body);
+    interface->units_per_sec = 1000000;
+    interface->offset = 0;
+    parse_interface_options(reader, interface, body + 8, len - 8);
+    return true;
+}
+
+static int pcap_next_pcapng(pcap_reader_t* reader, pcap_packet_t* out) {
+    while (true) {
+        unsigned char header[8];
+        int ret = read_exactly(reader, header, sizeof(header));
+        if (ret != 1)
+            return ret;
+
+        uint32_t type;
+        memcpy(&type, header, sizeof(type));
+
+        // The section header tells the byte order of the whole section.
+        if (type == PCAPNG_SECTION_HEADER) {
+            uint32_t byte_order_magic;
+            if (read_exactly(reader, &byte_order_magic, 4) != 1) {
+                errno = EPROTO;
+                return -1;
+            }
+
+            if (byte_order_magic == PCAPNG_BYTE_ORDER_MAGIC)
+                reader->swapped = false;
+            else if (swap32(byte_order_magic) == PCAPNG_BYTE_ORDER_MAGIC)
+                reader->swapped = true;
+            else {
+                errno = EPROTO;
+                return -1;
+            }
+
+            uint32_t total = read32(reader, header + 4);
+            if (total < 16 || !reserve(reader, total - 12) ||
+                read_exactly(reader, reader->buffer, total - 12) != 1) {
+                errno = EPROTO;
+                return -1;
+            }
+
+            // Interfaces are numbered per section.
+            reader->interface_count = 0;
+            continue;
+        }
+
+        type = read32(reader, header);
+        uint32_t total = read32(reader, header + 4);
+        if (total < 12 || total % 4) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        // The body, plus the trailing copy of the length.
+        size_t len = total - 8;
+        if (!reserve(reader, len))
+            return -1;
+        if (read_exactly(reader, reader->buffer, len) != 1) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        const unsigned char* body = reader->buffer;
+        len -= 4;
+
+        switch (type) {
+            case PCAPNG_INTERFACE_DESCRIPTION:
+                if (!pcapng_interface(reader, body, len))
+                    return -1;
+                continue;
+            case PCAPNG_ENHANCED_PACKET:
+            case PCAPNG_OBSOLETE_PACKET: {
+                if (len < 20) {
+                    errno = EPROTO;
+                    return -1;
+                }
+
+                uint32_t interface_id = type == PCAPNG_ENHANCED_PACKET
+                                      ? read32(reader, body)
+                                      : read16(reader, body);
+                uint64_t units = (uint64_t) read32(reader, body + 4) << 32 |
+                                 read32(reader, body + 8);
+                uint32_t captured = read32(reader, body + 12);
+
+                if (interface_id >= reader->interface_count ||
+                    captured > len - 20) {
+                    errno = EPROTO;
+                    return -1;
+                }
+
+                const pcap_interface_t* interface =
+                    &reader->interfaces[interface_id];
+                out->timestamp = interface_timestamp(interface, units);
+                out->link_type = interface->link_type;
+                out->data = body + 20;
+                out->length = captured;
+                reader->last_timestamp = out->timestamp;
+                return 1;
+            }
+            case PCAPNG_SIMPLE_PACKET: {
+                if (len < 4 || !reader->interface_count) {
+                    errno = EPROTO;
+                    return -1;
+                }
+
+                uint32_t original = read32(reader, body);
+                size_t captured = len - 4;
+                if (original < captured)
+                    captured = original;
+
+                // No timestamp, so pretend it came right after the last one.
+                out->timestamp = reader->last_timestamp;
+                out->link_type = reader->interfaces[0].link_type;
+                out->data = body + 4;
+                out->length = captured;
+                return 1;
+            }
+            default:
+                // Name resolution, statistics, custom blocks...
+                continue;
+        }
+    }
+}
+
+int pcap_next(pcap_reader_t* reader, pcap_packet_t* out_packet) {
+    assert(reader->file);
+    if (reader->pcapng)
+        return pcap_next_pcapng(reader, out_packet);
+    return pcap_next_classic(reader, out_packet);
+}
+
+void pcap_close(pcap_reader_t* reader) {
+    if (reader->file)
+        fclose(reader->file);
+    reader->file = NULL;
+
+    free(reader->buffer);
+    reader->buffer = NULL;
+    reader->buffer_capacity = 0;
+}
+
+/** Skip the link layer header. Returns the ethertype, or 0 if unknown. */
+static uint16_t skip_link_layer(const pcap_packet_t* packet,
+                                const unsigned char** out_data,
+                                size_t* out_len) {
+    const unsigned char* data = packet->data;
+    size_t len = packet->length;
+    uint16_t ethertype = 0;
+
+    switch (packet->link_type) {
+        case PCAP_LINKTYPE_ETHERNET:
+            if (len < 14)
+                return 0;
+            ethertype = read_be16(data + 12);
+            data += 14;
+            len -= 14;
+
+            // 802.1Q and 802.1ad tags.
+            while ((ethertype == 0x8100 || ethertype == 0x88a8) && len >= 4) {
+                ethertype = read_be16(data + 2);
+                data += 4;
+                len -= 4;
+            }
+            break;
+        case PCAP_LINKTYPE_LINUX_SLL:
+            if (len < 16)
+                return 0;
+            ethertype = read_be16(data + 14);
+            data += 16;
+            len -= 16;
+            break;
+        case PCAP_LINKTYPE_LINUX_SLL2:
+            if (len < 20)
+                return 0;
+            ethertype = read_be16(data);
+            data += 20;
+            len -= 20;
+            break;
+        case PCAP_LINKTYPE_NULL: {
+            // The address family, in the byte order of the capturing host.
+            if (len < 4)
+                return 0;
+            uint32_t family = data[0] | data[1] << 8 | data[2] << 16 |
+                              (uint32_t) data[3] << 24;
+            if (family > 0xffff)
+                family = swap32(family);
+            data += 4;
+            len -= 4;
+            if (family == 2)
+                ethertype = 0x0800;
+            else if (family == 10 || family == 24 || family == 28 || family == 30)
+                ethertype = 0x86dd; // Linux, OpenBSD, FreeBSD and Darwin
+            break;
+        }
+        case PCAP_LINKTYPE_RAW:
+            if (len < 1)
+                return 0;
+            ethertype = (data[0] >> 4) == 6 ? 0x86dd : 0x0800;
+            break;
+        case PCAP_LINKTYPE_IPV4:
+            ethertype = 0x0800;
+            break;
+        case PCAP_LINKTYPE_IPV6:
+            ethertype = 0x86dd;
+            break;
+    }
+
+    *out_data = data;
+    *out_len = len;
+    return ethertype;
+}
+
+static bool extract_udp_ipv4(const unsigned char* data,
+                             size_t len,
+                             pcap_udp_t* out) {
+    if (len < 20 || (data[0] >> 4) != 4)
+        return false;
+
+    size_t header_len = (data[0] & 0x0f) * 4;
+    size_t total_len = read_be16(data + 2);
+    uint16_t fragment = read_be16(data + 6);
+
+    // Not UDP, or a fragment (more fragments set, or non-zero offset).
+    if (data[9] != 17 || (fragment & 0x3fff))
+        return false;
+
+    if (header_len < 20 || total_len < header_len || total_len > len)
+        return false;
+
+    out->family = AF_INET;
+    memset(out->source, 0, sizeof(out->source));
+    memset(out->destination, 0, sizeof(out->destination));
+    memcpy(out->source, data + 12, 4);
+    memcpy(out->destination, data + 16, 4);
+
+    data += header_len;
+    len = total_len - header_len;
+    if (len < 8)
+        return false;
+
+    size_t udp_len = read_be16(data + 4);
+    if (udp_len < 8 || udp_len > len)
+        return false;
+
+    out->source_port = read_be16(data);
+    out->destination_port = read_be16(data + 2);
+    out->payload = data + 8;
+    out->length = udp_len - 8;
+    return true;
+}
+
+static bool extract_udp_ipv6(const unsigned char* data,
+                             size_t len,
+                             pcap_udp_t* out) {
+    if (len < 40 || (data[0] >> 4) != 6)
+        return false;
+
+    size_t payload_len = read_be16(data + 4);
+    uint8_t next = data[6];
+
+    out->family = AF_INET6;
+    memcpy(out->source, data + 8, 16);
+    memcpy(out->destination, data + 24, 16);
+
+    data += 40;
+    len -= 40;
+    if (payload_len < len)
+        len = payload_len;
+
+    // Hop-by-hop, routing and destination options. Fragments we can't
+    // replay, and anything else is not UDP.
+    while (next == 0 || next == 43 || next == 60) {
+        if (len < 8)
+            return false;
+        size_t extension_len = (data[1] + 1) * 8;
+        if (extension_len > len)
+            return false;
+        next = data[0];
+        data += extension_len;
+        len -= extension_len;
+    }
+
+    if (next != 17 || len < 8)
+        return false;
+
+    size_t udp_len = read_be16(data + 4);
+    // Jumbograms have a zero length, we don't bother with them.
+    if (udp_len < 8 || udp_len > len)
+        return false;
+
+    out->source_port = read_be16(data);
+    out->destination_port = read_be16(data + 2);
+    out->payload = data + 8;
+    out->length = udp_len - 8;
+    return true;
+}
+
+bool pcap_extract_udp(const pcap_packet_t* packet, pcap_udp_t* out_udp) {
+    const unsigned char* data;
+    size_t len;
+
+    switch (skip_link_layer(packet, &data, &len)) {
+        case 0x0800:
+            return extract_udp_ipv4(data, len, out_udp);
+        case 0x86dd:
+            return extract_udp_ipv6(data, len, out_udp);
+        default:
+            return false;
+    }
+}
+
+bool pcap_udp_is_multicast(const pcap_udp_t* udp) {
+    if (udp->family == AF_INET)
+        return (udp->destination[0] & 0xf0) == 0xe0;
+    return udp->destination[0] == 0xff;
+}
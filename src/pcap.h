@@ -0,0 +1,116 @@
+/**
+ * pcap.h:
+ *   Minimal pcap and pcapng reader
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PCAP_H
+#define PCAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PCAP_MAX_INTERFACES 64
+
+/** Link types we know how to strip, see http://www.tcpdump.org/linktypes.html */
+#define PCAP_LINKTYPE_NULL 0
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_LINKTYPE_RAW 101
+#define PCAP_LINKTYPE_LINUX_SLL 113
+#define PCAP_LINKTYPE_IPV4 228
+#define PCAP_LINKTYPE_IPV6 229
+#define PCAP_LINKTYPE_LINUX_SLL2 276
+
+typedef struct pcap_interface {
+    uint32_t link_type;
+    /// Timestamp units per second (1e6 unless if_tsresol says otherwise).
+    uint64_t units_per_sec;
+    /// Seconds to add to every timestamp (if_tsoffset).
+    int64_t offset;
+} pcap_interface_t;
+
+/**
+ * Reads packets one by one from a classic pcap file (any byte order,
+ * microsecond or nanosecond timestamps) or a pcapng file (any number of
+ * sections and interfaces).
+ */
+typedef struct pcap_reader {
+    FILE* file;
+    bool pcapng;
+    /// Whether the file (or current section) has the other byte order.
+    bool swapped;
+    pcap_interface_t interfaces[PCAP_MAX_INTERFACES];
+    size_t interface_count;
+    /// Timestamp of the last packet, for pcapng blocks without one.
+    uint64_t last_timestamp;
+    unsigned char* buffer;
+    size_t buffer_capacity;
+} pcap_reader_t;
+
+/** A captured packet, valid until the next call to `pcap_next()` */
+typedef struct pcap_packet {
+    /// Nanoseconds since the epoch.
+    uint64_t timestamp;
+    uint32_t link_type;
+    const unsigned char* data;
+    size_t length;
+} pcap_packet_t;
+
+/** A UDP datagram found inside a packet */
+typedef struct pcap_udp {
+    /// AF_INET or AF_INET6.
+    int family;
+    unsigned char source[16];
+    unsigned char destination[16];
+    uint16_t source_port;
+    uint16_t destination_port;
+    const unsigned char* payload;
+    size_t length;
+} pcap_udp_t;
+
+/**
+ * Open a capture.
+ *
+ * Returns false and sets errno on failure (EPROTO if it's not a capture
+ * file we understand).
+ */
+bool pcap_open(pcap_reader_t* reader, const char* filename);
+
+/**
+ * Read the next packet.
+ *
+ * Returns 1 if there's a packet, 0 at the end of the file, and -1 (with errno
+ * set) if the file is broken or truncated.
+ */
+int pcap_next(pcap_reader_t* reader, pcap_packet_t* out_packet);
+
+void pcap_close(pcap_reader_t* reader);
+
+/**
+ * Find the UDP datagram in a packet, skipping the link layer, VLAN tags and
+ * IPv6 extension headers.
+ *
+ * Returns false if it's not a UDP packet, it's an IP fragment, or it has been
+ * truncated by the capture.
+ */
+bool pcap_extract_udp(const pcap_packet_t* packet, pcap_udp_t* out_udp);
+
+/** Whether the destination of the datagram is a multicast group */
+bool pcap_udp_is_multicast(const pcap_udp_t* udp);
+
+#endif
@@ -0,0 +1,405 @@
+/**
+ * pool.c:
+ *   Work-stealing dispatch pool
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "logger.h"
+
+#define POOL_DEQUE_INITIAL_CAPACITY 256
+
+/** Whether there are jobs that `worker` could take */
+static bool pool_has_jobs(pool_t* pool, pool_worker_t* worker) {
+    if (worker == pool->lane)
+        return deque_size(&worker->deque) != 0;
+
+    for (size_t i = 0; i < pool->bulk; ++i)
+        if (deque_size(&pool->workers[i].deque))
+            return true;
+    return false;
+}
+
+/**
+ * Get a job to fill, from the timer thread. It's the only one taking jobs from
+ * the stack of returned ones, and it takes them all at once, so there's no
+ * ABA problem.
+ */
+static pool_job_t* pool_take_job(pool_t* pool) {
+    if (!pool->free_jobs)
+        pool->free_jobs = __atomic_exchange_n(&pool->returned_jobs, NULL,
+                                              __ATOMIC_ACQUIRE);
+
+    pool_job_t* job = pool->free_jobs;
+    if (job) {
+        pool->free_jobs = job->next;
+        return job;
+    }
+
+    job = malloc(sizeof(pool_job_t));
+    assert(job);
+    __atomic_store_n(&pool->jobs_allocated, pool->jobs_allocated + 1,
+                     __ATOMIC_RELAXED);
+    return job;
+}
+
+/** Give a job that has been sent back to the timer thread, from a worker */
+static void pool_return_job(pool_t* pool, pool_job_t* job) {
+    job->next = __atomic_load_n(&pool->returned_jobs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&pool->returned_jobs, &job->next, job,
+                                        true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+        ;
+}
+
+/** Free a stack of jobs */
+static void pool_free_jobs(pool_job_t* job) {
+    while (job) {
+        pool_job_t* next = job->next;
+        free(job);
+        job = next;
+    }
+}
+
+/** Dispatch function of the timer thread */
+static void pool_queue_batch(shard_t* timer,
+                             scheduled_event_t* batch,
+                             size_t count) {
+    pool_t* pool = (pool_t*) timer->context;
+
+    uint64_t max_depth = 0;
+    for (size_t i = 0; i < count; ++i) {
+        pool_job_t* job = pool_take_job(pool);
+        job->deadline = batch[i].deadline;
+        job->lateness = batch[i].lateness;
+        lateness_hold(job->lateness);
+        job->event = batch[i].event;
+
+        pool_worker_t* worker;
+        if (pool->lane && job->event.priority == EVENT_PRIORITY_HIGH) {
+            worker = pool->lane;
+        } else {
+            worker = &pool->workers[pool->next_worker];
+            pool->next_worker = (pool->next_worker + 1) % pool->bulk;
+        }
+
+        deque_push(&worker->deque, job);
+
+        uint64_t depth = deque_size(&worker->deque);
+        if (depth > worker->max_depth)
+            __atomic_store_n(&worker->max_depth, depth, __ATOMIC_RELAXED);
+        if (worker->max_depth > max_depth)
+            max_depth = worker->max_depth;
+    }
+
+    if (timer->metrics) {
+        uint64_t queued = 0;
+        for (size_t i = 0; i < pool->count; ++i)
+            queued += deque_size(&pool->workers[i].deque);
+        metrics_set(timer->metrics, queue_depth, queued);
+        if (max_depth > metrics_get(timer->metrics, max_queue_depth))
+            metrics_set(timer->metrics, max_queue_depth, max_depth);
+    }
+
+    // Pairs with the fence in `pool_worker_main()`: either the worker sees
+    // the jobs we've just pushed, or we see it's idle and wake it up.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->idle, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&pool->idle_mutex);
+        pthread_cond_broadcast(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+}
+
+/** Take a job from our deque, or steal one from another worker */
+static pool_job_t* pool_worker_take(pool_worker_t* worker) {
+    pool_t* pool = worker->pool;
+
+    pool_job_t* job = (pool_job_t*) deque_steal(&worker->deque);
+    if (job || worker == pool->lane)
+        return job;
+
+    for (size_t i = 1; i < pool->bulk; ++i) {
+        pool_worker_t* victim = &pool->workers[(worker->index + i) % pool->bulk];
+        job = (pool_job_t*) deque_steal(&victim->deque);
+        if (job) {
+            __atomic_store_n(&worker->stolen, worker->stolen + 1,
+                             __ATOMIC_RELAXED);
+            metrics_add(worker->sender.metrics, jobs_stolen, 1);
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+static void* pool_worker_main(void* arg) {
+    pool_worker_t* worker = (pool_worker_t*) arg;
+    pool_t* pool = worker->pool;
+
+    if (pool->realtime) {
+        // The timer thread gets the first cpu of the list.
+        char name[32];
+        snprintf(name, sizeof(name), "worker %zu", worker->index);
+        realtime_enter(pool->realtime,
+                       realtime_cpu(pool->realtime, worker->index + 1), name);
+    }
+
+    while (true) {
+        pool_job_t* job = pool_worker_take(worker);
+        if (job) {
+            if (sender_send(&worker->sender, &job->event) < 0)
+                FATAL("worker %zu: send: %s", worker->index, strerror(errno));
+
+            lateness_record(job->lateness, job->deadline, monotonic_now());
+            lateness_release(job->lateness);
+
+            if (LOGGER_CONFIG.verbose)
+                LOG("dispatch[w%zu]: %s (%ld, %ld)", worker->index,
+                    job->event.description,
+                    job->event.repeat_during,
+                    job->event.repeat_after);
+
+            pool_return_job(pool, job);
+            __atomic_store_n(&worker->sent, worker->sent + 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        uint64_t flush = sender_flush_parity(&worker->sender, monotonic_now());
+
+        pthread_mutex_lock(&pool->idle_mutex);
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (!pool->stopping && !pool_has_jobs(pool, worker)) {
+            if (!flush) {
+                pthread_cond_wait(&pool->idle_cond, &pool->idle_mutex);
+                continue;
+            }
+
+            struct timespec until;
+            until.tv_sec = flush / NSEC_PER_SEC;
+            until.tv_nsec = flush % NSEC_PER_SEC;
+            if (pthread_cond_timedwait(&pool->idle_cond, &pool->idle_mutex,
+                                       &until) == ETIMEDOUT)
+                break;
+        }
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+        bool done = pool->stopping && !pool_has_jobs(pool, worker);
+        pthread_mutex_unlock(&pool->idle_mutex);
+
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+/**
+ * Stop and free the first `started` workers, adding what they sent to
+ * `out_counters` and what they did to `out_stats` if they're not NULL.
+ */
+static void pool_stop_workers(pool_t* pool,
+                              size_t started,
+                              sender_counters_t* out_counters,
+                              pool_stats_t* out_stats) {
+    pthread_mutex_lock(&pool->idle_mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_mutex);
+
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+        LOG("worker %zu: joined", i);
+    }
+
+    for (size_t i = 0; i < pool->count; ++i) {
+        pool_worker_t* worker = &pool->workers[i];
+        pool_job_t* job;
+        while ((job = (pool_job_t*) deque_steal(&worker->deque))) {
+            lateness_release(job->lateness);
+            free(job);
+        }
+        deque_destroy(&worker->deque);
+        if (out_counters)
+            sender_counters_add(out_counters, &worker->sender);
+        if (out_stats) {
+            out_stats->sent += worker->sent;
+            out_stats->stolen += worker->stolen;
+            if (worker->max_depth > out_stats->max_depth)
+                out_stats->max_depth = worker->max_depth;
+        }
+        sender_close(&worker->sender);
+    }
+
+    if (out_stats)
+        out_stats->jobs_allocated += pool->jobs_allocated;
+    pool_free_jobs(pool->free_jobs);
+    pool_free_jobs(pool->returned_jobs);
+    pool->free_jobs = NULL;
+    pool->returned_jobs = NULL;
+
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->count = 0;
+    pool->bulk = 0;
+    pool->lane = NULL;
+
+    pthread_mutex_destroy(&pool->idle_mutex);
+    pthread_cond_destroy(&pool->idle_cond);
+}
+
+bool pool_start(pool_t* pool,
+                size_t count,
+                const sender_config_t* sender_config,
+                const sender_config_t* lane_config,
+                const dispatch_config_t* dispatch_config) {
+    assert(count > 0);
+
+    pool->bulk = count;
+    if (lane_config)
+        count++;
+
+    pool->count = count;
+    pool->next_worker = 0;
+    pool->free_jobs = NULL;
+    pool->returned_jobs = NULL;
+    pool->jobs_allocated = 0;
+    pool->idle = 0;
+    pool->stopping = false;
+    pool->realtime = dispatch_config->realtime;
+    pthread_mutex_init(&pool->idle_mutex, NULL);
+
+    // Idle workers with a partial parity block wait until `monotonic_now()`
+    // reaches its flush deadline at most.
+    pthread_condattr_t idle_attr;
+    pthread_condattr_init(&idle_attr);
+    pthread_condattr_setclock(&idle_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->idle_cond, &idle_attr);
+    pthread_condattr_destroy(&idle_attr);
+
+    pool->workers = malloc(sizeof(pool_worker_t) * count);
+    assert(pool->workers);
+    pool->lane = lane_config ? &pool->workers[pool->bulk] : NULL;
+
+    for (size_t i = 0; i < count; ++i) {
+        pool_worker_t* worker = &pool->workers[i];
+        worker->index = i;
+        worker->pool = pool;
+        worker->sent = 0;
+        worker->stolen = 0;
+        worker->max_depth = 0;
+        worker->sender = (sender_t) SENDER_INITIALIZER;
+        deque_init(&worker->deque, POOL_DEQUE_INITIAL_CAPACITY);
+    }
+
+    size_t started = 0;
+    for (; started < count; ++started) {
+        pool_worker_t* worker = &pool->workers[started];
+        bool lane = worker == pool->lane;
+        if (sender_open(&worker->sender, lane ? lane_config : sender_config,
+                        count) < 0)
+            goto errexit;
+
+        char name[32];
+        if (lane)
+            snprintf(name, sizeof(name), "lane");
+        else
+            snprintf(name, sizeof(name), "worker%zu", started);
+        worker->sender.metrics = metrics_claim_slot(dispatch_config->metrics,
+                                                    name);
+
+        int ret = pthread_create(&worker->thread, NULL, pool_worker_main, worker);
+        if (ret != 0) {
+            errno = ret;
+            goto errexit;
+        }
+    }
+
+    pool->timer.sender = (sender_t) SENDER_INITIALIZER;
+    pool->timer.metrics = metrics_claim_slot(dispatch_config->metrics, "timer");
+    if (!shard_start(&pool->timer, 0, dispatch_config, pool_queue_batch, pool))
+        goto errexit;
+
+    return true;
+
+errexit:
+    {
+        int saved_errno = errno;
+        pool_stop_workers(pool, started, NULL, NULL);
+        errno = saved_errno;
+    }
+    return false;
+}
+
+void pool_load(pool_t* pool, event_list_t* list) {
+    size_t count = event_list_size(list);
+    event_t* events = count ? malloc(sizeof(event_t) * count) : NULL;
+    assert(!count || events);
+
+    size_t index = 0;
+    event_list_node_t* current = event_list_head(list);
+    while (event_list_node_has_value(current)) {
+        events[index++] = *event_list_node_value(current);
+        current = event_list_node_next(current);
+    }
+
+    assert(index == count);
+    shard_load(&pool->timer, events, count);
+}
+
+void pool_apply(pool_t* pool,
+                const control_command_t* commands,
+                size_t count,
+                bool* out_applied) {
+    control_command_t* copy = malloc(sizeof(control_command_t) * count);
+    assert(copy);
+    memcpy(copy, commands, sizeof(control_command_t) * count);
+
+    shard_completion_t completion = SHARD_COMPLETION_INITIALIZER;
+    shard_apply(&pool->timer, copy, count, out_applied, &completion);
+    shard_completion_wait(&completion);
+}
+
+void pool_report(pool_t* pool) {
+    for (size_t i = 0; i < pool->count; ++i) {
+        pool_worker_t* worker = &pool->workers[i];
+        LOG("%s %zu: sent %llu, stolen %llu, depth %zu (max %llu)",
+            worker == pool->lane ? "lane" : "worker", i,
+            (unsigned long long) __atomic_load_n(&worker->sent, __ATOMIC_RELAXED),
+            (unsigned long long) __atomic_load_n(&worker->stolen, __ATOMIC_RELAXED),
+            deque_size(&worker->deque),
+            (unsigned long long) __atomic_load_n(&worker->max_depth,
+                                                 __ATOMIC_RELAXED));
+    }
+
+    LOG("pool: %llu jobs allocated",
+        (unsigned long long) __atomic_load_n(&pool->jobs_allocated,
+                                             __ATOMIC_RELAXED));
+}
+
+void pool_stop(pool_t* pool,
+               sender_counters_t* out_counters,
+               pool_stats_t* out_stats) {
+    shard_stop(&pool->timer);
+    pool_report(pool);
+    pool_stop_workers(pool, pool->count, out_counters, out_stats);
+}
@@ -0,0 +1,151 @@
+/**
+ * pool.h:
+ *   Work-stealing dispatch pool
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "deque.h"
+#include "event.h"
+#include "sender.h"
+#include "shard.h"
+
+/**
+ * An event that is due, waiting in a deque to be sent.
+ *
+ * Jobs are reused: workers push the ones they're done with to a shared stack,
+ * and the timer thread takes them back from it (see `pool_take_job()`), so
+ * no job is allocated once there are enough for the usual backlog.
+ */
+typedef struct pool_job {
+    uint64_t deadline;
+    histogram_t* lateness;
+    event_t event;
+    /// The next one in the stack it's in, if any.
+    struct pool_job* next;
+} pool_job_t;
+
+struct pool;
+
+/**
+ * A sending thread. It takes jobs from its own deque first, and steals from
+ * the other workers' deques when it runs out of them. The priority lane
+ * worker neither steals nor gets stolen from.
+ *
+ * The counters are only written by the worker itself, and read with atomic
+ * loads when reporting.
+ */
+typedef struct pool_worker {
+    size_t index;
+    pthread_t thread;
+    deque_t deque;
+    sender_t sender;
+    struct pool* pool;
+    uint64_t sent;
+    uint64_t stolen;
+    /// Written by the timer thread, which is the only one pushing.
+    uint64_t max_depth;
+} pool_worker_t;
+
+/**
+ * A timer thread (a shard whose dispatch function queues jobs instead of
+ * sending) that hands due events round-robin to the workers' deques, and
+ * a set of workers that send them.
+ *
+ * Note that the timer thread is the owner of every deque (the only one that
+ * pushes), and workers only steal, their "own" deque is just the one they
+ * look at first. This keeps each deque single-producer as Chase-Lev requires,
+ * while still letting idle workers drain a busy one.
+ */
+typedef struct pool {
+    shard_t timer;
+    /// The bulk workers and then, if there's a lane, its worker.
+    pool_worker_t* workers;
+    size_t count;
+    size_t bulk;
+    /// Sends only the high priority events, with a socket of its own.
+    pool_worker_t* lane;
+    size_t next_worker;
+    /// Jobs the timer thread can reuse right away, and the ones returned by
+    /// the workers since it last took them.
+    pool_job_t* free_jobs;
+    pool_job_t* returned_jobs;
+    /// Only written by the timer thread.
+    uint64_t jobs_allocated;
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+    size_t idle;
+    bool stopping;
+    /// See `dispatch_config_t`, the workers are real-time too.
+    const realtime_config_t* realtime;
+} pool_t;
+
+/** What the workers of a pool did, for the stats of the server */
+typedef struct pool_stats {
+    uint64_t sent;
+    uint64_t stolen;
+    /// The deepest any deque got.
+    uint64_t max_depth;
+    /// Jobs that had to be allocated, every other one reused them.
+    uint64_t jobs_allocated;
+} pool_stats_t;
+
+#define POOL_STATS_INITIALIZER {0, 0, 0, 0}
+
+/**
+ * Start the timer thread and `count` workers, each with its own socket created
+ * from `sender_config`, plus a lane worker if `lane_config` is not NULL.
+ *
+ * Returns false and sets errno on failure.
+ */
+bool pool_start(pool_t* pool,
+                size_t count,
+                const sender_config_t* sender_config,
+                const sender_config_t* lane_config,
+                const dispatch_config_t* dispatch_config);
+
+/** Replace the events of the pool with the ones in `list` */
+void pool_load(pool_t* pool, event_list_t* list);
+
+/**
+ * Apply commands to the events of the pool, and wait for them, filling
+ * `out_applied` (see `control_apply_fn`). The commands are copied.
+ */
+void pool_apply(pool_t* pool,
+                const control_command_t* commands,
+                size_t count,
+                bool* out_applied);
+
+/** Log the number of sent and stolen jobs, and the deque depths */
+void pool_report(pool_t* pool);
+
+/**
+ * Stop the timer and the workers, after the pending jobs have been sent. What
+ * they sent is added to `out_counters`, and what they did to `out_stats`,
+ * once they're done, if they're not NULL.
+ */
+void pool_stop(pool_t* pool,
+               sender_counters_t* out_counters,
+               pool_stats_t* out_stats);
+
+#endif
@@ -0,0 +1,128 @@
+/**
+ * realtime.c:
+ *   Low-jitter dispatching: real-time priority, locked memory and spinning
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "realtime.h"
+#include "logger.h"
+#include "scheduler.h"
+
+bool realtime_parse_cpus(const char* spec, realtime_config_t* config) {
+    config->cpu_count = 0;
+
+    const char* cursor = spec;
+    while (*cursor) {
+        char* end;
+        long first = strtol(cursor, &end, 10);
+        if (end == cursor || first < 0)
+            return false;
+
+        long last = first;
+        if (*end == '-') {
+            cursor = end + 1;
+            last = strtol(cursor, &end, 10);
+            if (end == cursor || last < first)
+                return false;
+        }
+
+        for (long cpu = first; cpu <= last; ++cpu) {
+            if (config->cpu_count == REALTIME_MAX_CPUS)
+                return false;
+            config->cpus[config->cpu_count++] = (int) cpu;
+        }
+
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return false;
+        cursor = end;
+    }
+
+    return config->cpu_count > 0;
+}
+
+int realtime_cpu(const realtime_config_t* config, size_t index) {
+    if (!config || !config->cpu_count)
+        return -1;
+    return config->cpus[index % config->cpu_count];
+}
+
+void realtime_lock_memory() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        WARN("realtime: couldn't lock memory: %s", strerror(errno));
+}
+
+/** Touch the stack we're going to use, so it's already mapped */
+static void prefault_stack() {
+    volatile unsigned char stack[REALTIME_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+bool realtime_pin(int cpu, const char* name) {
+#ifdef LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        WARN("%s: couldn't pin to cpu %d: %s", name, cpu, strerror(ret));
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void realtime_enter(const realtime_config_t* config, int cpu, const char* name) {
+    if (!config)
+        return;
+
+    if (cpu >= 0)
+        realtime_pin(cpu, name);
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = config->priority;
+    int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ret != 0)
+        WARN("realtime: %s: couldn't use SCHED_FIFO at priority %d: %s", name,
+             config->priority, strerror(ret));
+
+    prefault_stack();
+}
+
+void realtime_sleep_until(const realtime_config_t* config, uint64_t deadline) {
+    if (!config) {
+        sleep_until(deadline);
+        return;
+    }
+
+    if (deadline > config->spin)
+        sleep_until(deadline - config->spin);
+
+    while (monotonic_now() < deadline)
+        cpu_relax();
+}
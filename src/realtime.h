@@ -0,0 +1,102 @@
+/**
+ * realtime.h:
+ *   Low-jitter dispatching: real-time priority, locked memory and spinning
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define REALTIME_MAX_CPUS 256
+
+/** Bytes of stack every real-time thread touches before it starts */
+#define REALTIME_STACK_PREFAULT (64 * 1024)
+
+/**
+ * Stack size for the threads we create per event with --realtime. mlockall()
+ * locks all of it, so the default (usually 8MB) times thousands of events
+ * doesn't fit anywhere: just what's prefaulted plus room for the calls made
+ * while it is.
+ */
+#define REALTIME_STACK_SIZE (2 * REALTIME_STACK_PREFAULT)
+
+/**
+ * How the dispatching threads run with --realtime:
+ *
+ *  - With SCHED_FIFO at `priority`, so nothing but other real-time threads
+ *    (and the kernel) preempts them.
+ *  - Pinned to `cpus` (round-robin), ideally isolated ones (isolcpus=), if
+ *    any are given.
+ *  - With every page of the process locked in memory (mlockall()), and their
+ *    stacks touched beforehand, so no page fault happens while dispatching.
+ *  - Sleeping until `spin` nanoseconds before every deadline, and spinning on
+ *    CLOCK_MONOTONIC for the rest, since waking up from a sleep is much less
+ *    precise than that.
+ *
+ * Things that need privileges (CAP_SYS_NICE, CAP_IPC_LOCK) just warn when
+ * they fail, the rest still helps.
+ */
+typedef struct realtime_config {
+    int priority;
+    int cpus[REALTIME_MAX_CPUS];
+    size_t cpu_count;
+    uint64_t spin;
+} realtime_config_t;
+
+#define REALTIME_CONFIG_INITIALIZER {50, {0}, 0, 200 * 1000}
+
+/**
+ * Parse a list of cpus like "2,3" or "4-7,9" into `config`. Returns false if
+ * it's not a valid list.
+ */
+bool realtime_parse_cpus(const char* spec, realtime_config_t* config);
+
+/** The cpu for the thread number `index`, or -1 to leave it alone */
+int realtime_cpu(const realtime_config_t* config, size_t index);
+
+/** Tell the cpu we're spinning, if it cares */
+static inline
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/** Pin the calling thread to `cpu`. `name` is just for the warning. */
+bool realtime_pin(int cpu, const char* name);
+
+/** Lock the memory of the process, now and in the future */
+void realtime_lock_memory();
+
+/**
+ * Make the calling thread real-time, pinning it to `cpu` unless it's -1.
+ * `name` is just for the warnings.
+ */
+void realtime_enter(const realtime_config_t* config, int cpu, const char* name);
+
+/**
+ * Wait until `deadline`, sleeping and then spinning if `config` is not NULL,
+ * just sleeping otherwise.
+ */
+void realtime_sleep_until(const realtime_config_t* config, uint64_t deadline);
+
+#endif
@@ -0,0 +1,339 @@
+/**
+ * repair.c:
+ *   Resend recently sent datagrams to receivers that ask for them
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "repair.h"
+#include "logger.h"
+#include "scheduler.h"
+#include "socket-utils.h"
+
+void repair_ring_init(repair_ring_t* ring, size_t capacity) {
+    size_t rounded = 1;
+    while (rounded < capacity)
+        rounded <<= 1;
+
+    pthread_mutex_init(&ring->mutex, NULL);
+    ring->capacity = rounded;
+    ring->sequences = malloc(sizeof(uint64_t) * rounded);
+    ring->lengths = calloc(rounded, sizeof(uint16_t));
+    ring->requests = calloc(rounded, sizeof(uint32_t));
+    ring->datagrams = malloc(REPAIR_DATAGRAM_SIZE * rounded);
+    assert(ring->sequences && ring->lengths && ring->requests &&
+           ring->datagrams);
+
+    // Nobody is going to send 2^64 datagrams.
+    memset(ring->sequences, 0xff, sizeof(uint64_t) * rounded);
+}
+
+void repair_ring_store(repair_ring_t* ring,
+                       uint64_t sequence,
+                       const unsigned char* datagram,
+                       size_t length) {
+    assert(length <= REPAIR_DATAGRAM_SIZE);
+    size_t slot = sequence & (ring->capacity - 1);
+
+    pthread_mutex_lock(&ring->mutex);
+    ring->sequences[slot] = sequence;
+    ring->lengths[slot] = length;
+    ring->requests[slot] = 0;
+    memcpy(ring->datagrams + slot * REPAIR_DATAGRAM_SIZE, datagram, length);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+size_t repair_ring_lookup(repair_ring_t* ring,
+                          uint64_t sequence,
+                          unsigned char* out,
+                          uint32_t* out_requests) {
+    size_t slot = sequence & (ring->capacity - 1);
+    size_t length = 0;
+
+    pthread_mutex_lock(&ring->mutex);
+    if (ring->sequences[slot] == sequence) {
+        length = ring->lengths[slot];
+        *out_requests = ++ring->requests[slot];
+        memcpy(out, ring->datagrams + slot * REPAIR_DATAGRAM_SIZE, length);
+    }
+    pthread_mutex_unlock(&ring->mutex);
+
+    return length;
+}
+
+void repair_ring_destroy(repair_ring_t* ring) {
+    pthread_mutex_destroy(&ring->mutex);
+    free(ring->sequences);
+    free(ring->lengths);
+    free(ring->requests);
+    free(ring->datagrams);
+    ring->sequences = NULL;
+    ring->lengths = NULL;
+    ring->requests = NULL;
+    ring->datagrams = NULL;
+}
+
+/** The address of `from` as IPv6, IPv4 ones mapped. */
+static void repair_source_address(const struct sockaddr_storage* from,
+                                  unsigned char out[16]) {
+    memset(out, 0, 16);
+    if (from->ss_family == AF_INET6) {
+        memcpy(out, &((const struct sockaddr_in6*) from)->sin6_addr, 16);
+    } else if (from->ss_family == AF_INET) {
+        out[10] = out[11] = 0xff;
+        memcpy(out + 12, &((const struct sockaddr_in*) from)->sin_addr, 4);
+    }
+}
+
+/** See `repair_source_t` */
+static double repair_source_burst(const repair_server_t* server) {
+    double burst = server->source_bytes_per_sec / 10;
+    return burst < REPAIR_DATAGRAM_SIZE ? REPAIR_DATAGRAM_SIZE : burst;
+}
+
+/**
+ * The bucket of `from`. When the table is full around it, the one that's been
+ * idle the longest is given to it, full.
+ */
+static repair_source_t* repair_source_find(repair_server_t* server,
+                                           const struct sockaddr_storage* from,
+                                           uint64_t now) {
+    unsigned char address[16];
+    repair_source_address(from, address);
+
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < sizeof(address); ++i) {
+        hash ^= address[i];
+        hash *= 1099511628211ull;
+    }
+
+    repair_source_t* oldest = NULL;
+    for (size_t i = 0; i < REPAIR_SOURCE_PROBES; ++i) {
+        repair_source_t* source =
+            &server->sources[(hash + i) % REPAIR_MAX_SOURCES];
+        if (source->used && memcmp(source->address, address, 16) == 0)
+            return source;
+        if (!oldest || !source->used ||
+            (oldest->used && source->last_refill < oldest->last_refill))
+            oldest = source;
+    }
+
+    oldest->used = true;
+    memcpy(oldest->address, address, 16);
+    oldest->tokens = repair_source_burst(server);
+    oldest->last_refill = now;
+    return oldest;
+}
+
+/** Take `bytes` from the bucket of `source`, if it has them */
+static bool repair_source_take(repair_server_t* server,
+                               repair_source_t* source,
+                               size_t bytes,
+                               uint64_t now) {
+    double rate = server->source_bytes_per_sec;
+    if (rate <= 0)
+        return true;
+
+    double burst = repair_source_burst(server);
+    source->tokens += rate * (double)(now - source->last_refill) / NSEC_PER_SEC;
+    if (source->tokens > burst)
+        source->tokens = burst;
+    source->last_refill = now;
+
+    if (source->tokens < bytes)
+        return false;
+
+    source->tokens -= bytes;
+    return true;
+}
+
+/**
+ * Answer a NACK of `request_size` bytes. Must be called with the server mutex
+ * held.
+ */
+static void repair_server_answer(repair_server_t* server,
+                                 uint32_t stream,
+                                 uint64_t first_sequence,
+                                 uint32_t count,
+                                 const struct sockaddr_storage* from,
+                                 size_t request_size) {
+    repair_stream_t* entry = NULL;
+    for (size_t i = 0; i < server->stream_count; ++i) {
+        if (server->streams[i].stream == stream) {
+            entry = &server->streams[i];
+            break;
+        }
+    }
+
+    // Someone else's stream, or one from before a restart.
+    if (!entry)
+        return;
+
+    if (count > REPAIR_MAX_RANGE)
+        count = REPAIR_MAX_RANGE;
+
+    uint64_t now = monotonic_now();
+    repair_source_t* source = repair_source_find(server, from, now);
+    size_t budget = request_size * REPAIR_MAX_AMPLIFICATION;
+
+    unsigned char datagram[REPAIR_DATAGRAM_SIZE];
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t requests;
+        size_t length = repair_ring_lookup(entry->ring, first_sequence + i,
+                                           datagram, &requests);
+        if (!length) {
+            server->stats.missed++;
+            continue;
+        }
+
+        datagram[5] |= WIRE_FLAG_REPAIR;
+
+        ssize_t ret;
+        if (requests == server->multicast_after) {
+            ret = sendto(entry->socket, datagram, length, 0,
+                         entry->addr, entry->addr_len);
+            server->stats.multicast++;
+        } else if (length > budget ||
+                   !repair_source_take(server, source, length, now)) {
+            server->stats.limited++;
+            continue;
+        } else {
+            budget -= length;
+            ret = sendto(server->socket, datagram, length, 0,
+                         (const struct sockaddr*) from,
+                         socket_address_length(from));
+            server->stats.unicast++;
+        }
+
+        if (ret < 0)
+            WARN("repair: send: %s", strerror(errno));
+    }
+}
+
+static void* repair_server_thread(void* data) {
+    repair_server_t* server = data;
+    unsigned char buffer[WIRE_NACK_SIZE * 2];
+
+    while (true) {
+        struct sockaddr_storage from;
+        socklen_t from_len = sizeof(from);
+        ssize_t ret = recvfrom(server->socket, buffer, sizeof(buffer), 0,
+                               (struct sockaddr*) &from, &from_len);
+
+        // Only get cancelled while waiting, not with a lock held.
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        uint32_t stream, count;
+        uint64_t first_sequence;
+        if (ret < 0) {
+            WARN("repair: receive: %s", strerror(errno));
+        } else if (wire_decode_nack(buffer, ret, &stream, &first_sequence,
+                                    &count)) {
+            pthread_mutex_lock(&server->mutex);
+            server->stats.nacks++;
+            LOG("repair: NACK for %u from %llu (%u)", stream,
+                (unsigned long long) first_sequence, count);
+            repair_server_answer(server, stream, first_sequence, count, &from,
+                                 ret);
+            pthread_mutex_unlock(&server->mutex);
+        }
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    return NULL;
+}
+
+bool repair_server_start(repair_server_t* server,
+                         const char* group,
+                         const char* local_address,
+                         const char* port,
+                         size_t ring_size,
+                         uint32_t multicast_after,
+                         double source_bytes_per_sec,
+                         int* out_error) {
+    *out_error = 0;
+    server->stream_count = 0;
+    server->ring_size = ring_size;
+    server->multicast_after = multicast_after;
+    server->source_bytes_per_sec = source_bytes_per_sec;
+    memset(server->sources, 0, sizeof(server->sources));
+    memset(&server->stats, 0, sizeof(server->stats));
+
+    server->socket = create_unicast_socket_at(group, local_address, port);
+    if (server->socket < 0) {
+        *out_error = server->socket;
+        return false;
+    }
+
+    pthread_mutex_init(&server->mutex, NULL);
+
+    int ret = pthread_create(&server->thread, NULL, repair_server_thread,
+                             server);
+    if (ret != 0) {
+        close(server->socket);
+        pthread_mutex_destroy(&server->mutex);
+        errno = ret;
+        return false;
+    }
+
+    return true;
+}
+
+bool repair_server_register(repair_server_t* server,
+                            const repair_stream_t* stream) {
+    bool registered = false;
+
+    pthread_mutex_lock(&server->mutex);
+    if (server->stream_count < REPAIR_MAX_STREAMS) {
+        server->streams[server->stream_count++] = *stream;
+        registered = true;
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    return registered;
+}
+
+void repair_server_unregister(repair_server_t* server, uint32_t stream) {
+    pthread_mutex_lock(&server->mutex);
+    for (size_t i = 0; i < server->stream_count; ++i) {
+        if (server->streams[i].stream == stream) {
+            server->streams[i] = server->streams[--server->stream_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&server->mutex);
+}
+
+void repair_server_stop(repair_server_t* server) {
+    pthread_cancel(server->thread);
+    pthread_join(server->thread, NULL);
+    close(server->socket);
+    pthread_mutex_destroy(&server->mutex);
+
+    LOG("repair: %llu NACKs, %llu datagrams resent by unicast, "
+        "%llu by multicast, %llu no longer available, %llu rate limited",
+        (unsigned long long) server->stats.nacks,
+        (unsigned long long) server->stats.unicast,
+        (unsigned long long) server->stats.multicast,
+        (unsigned long long) server->stats.missed,
+        (unsigned long long) server->stats.limited);
+}
@@ -0,0 +1,172 @@
+/**
+ * repair.h:
+ *   Resend recently sent datagrams to receivers that ask for them
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef REPAIR_H
+#define REPAIR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "event.h"
+#include "wire.h"
+
+/**
+ * Every framed sender keeps its last datagrams in a ring, indexed by sequence
+ * number. Receivers that detect a gap send a NACK (WIRE_TYPE_NACK) to the
+ * repair port, and the repair thread answers with the datagrams it still has,
+ * flagged with WIRE_FLAG_REPAIR:
+ *
+ *  - By unicast, to whoever asked, or
+ *  - Through the multicast socket of the stream, when a datagram has been
+ *    asked for `multicast_after` times, since then it's likely that many
+ *    receivers lost it. Receivers wait a random time before asking, so the
+ *    rest of them get it before they do.
+ */
+#define REPAIR_DATAGRAM_SIZE (WIRE_HEADER_SIZE + MAX_EVENT_DESCRIPTION_SIZE)
+
+/** Most datagrams a single NACK can ask for */
+#define REPAIR_MAX_RANGE 64
+
+/** Most streams (senders) a repair server can serve */
+#define REPAIR_MAX_STREAMS 64
+
+/**
+ * Most bytes resent by unicast for every byte of a NACK. The source of a
+ * datagram can be spoofed, so without this the repair port would turn a
+ * small NACK into a lot of traffic towards someone who never asked for it.
+ * Whatever doesn't fit is asked for again when the receiver retries.
+ */
+#define REPAIR_MAX_AMPLIFICATION 16
+
+/** Sources whose unicast repair rate is tracked at once */
+#define REPAIR_MAX_SOURCES 256
+
+/** Slots of the source table a source can be in */
+#define REPAIR_SOURCE_PROBES 8
+
+typedef struct repair_ring {
+    pthread_mutex_t mutex;
+    /// Power of two.
+    size_t capacity;
+    uint64_t* sequences;
+    uint16_t* lengths;
+    /// NACKs received for every datagram.
+    uint32_t* requests;
+    unsigned char* datagrams;
+} repair_ring_t;
+
+/** Allocate a ring of at least `capacity` datagrams */
+void repair_ring_init(repair_ring_t* ring, size_t capacity);
+
+void repair_ring_store(repair_ring_t* ring,
+                       uint64_t sequence,
+                       const unsigned char* datagram,
+                       size_t length);
+
+/**
+ * Copy the datagram with that sequence number to `out` (REPAIR_DATAGRAM_SIZE
+ * long), and count a request for it in `out_requests`.
+ *
+ * Returns its length, or 0 if it's not in the ring (anymore).
+ */
+size_t repair_ring_lookup(repair_ring_t* ring,
+                          uint64_t sequence,
+                          unsigned char* out,
+                          uint32_t* out_requests);
+
+void repair_ring_destroy(repair_ring_t* ring);
+
+typedef struct repair_stream {
+    uint32_t stream;
+    repair_ring_t* ring;
+    /// The multicast socket and group of the stream.
+    int socket;
+    const struct sockaddr* addr;
+    socklen_t addr_len;
+} repair_stream_t;
+
+typedef struct repair_stats {
+    uint64_t nacks;
+    uint64_t unicast;
+    uint64_t multicast;
+    /// Datagrams asked for that weren't in the ring.
+    uint64_t missed;
+    /// Datagrams not resent because of REPAIR_MAX_AMPLIFICATION or the rate
+    /// of their source.
+    uint64_t limited;
+} repair_stats_t;
+
+/**
+ * A token bucket of the bytes we can resend by unicast to an address (any
+ * port). The burst is a tenth of a second worth, and at least a datagram.
+ */
+typedef struct repair_source {
+    bool used;
+    /// IPv4 addresses are stored mapped to IPv6.
+    unsigned char address[16];
+    double tokens;
+    uint64_t last_refill;
+} repair_source_t;
+
+typedef struct repair_server {
+    int socket;
+    pthread_t thread;
+    /// Protects the streams, so they aren't unregistered while answering.
+    pthread_mutex_t mutex;
+    repair_stream_t streams[REPAIR_MAX_STREAMS];
+    size_t stream_count;
+    size_t ring_size;
+    uint32_t multicast_after;
+    /// Unicast rate cap of every source, zero if unlimited.
+    double source_bytes_per_sec;
+    repair_source_t sources[REPAIR_MAX_SOURCES];
+    repair_stats_t stats;
+} repair_server_t;
+
+/**
+ * Bind the repair port, on `local_address` (every local address if NULL), and
+ * start answering NACKs, resending at most `source_bytes_per_sec` (if not
+ * zero) by unicast to every source.
+ *
+ * Returns false and sets errno (or returns a getaddrinfo error in
+ * `out_error`) on failure.
+ */
+bool repair_server_start(repair_server_t* server,
+                         const char* group,
+                         const char* local_address,
+                         const char* port,
+                         size_t ring_size,
+                         uint32_t multicast_after,
+                         double source_bytes_per_sec,
+                         int* out_error);
+
+/** Start answering NACKs for a stream. Returns false if there are too many. */
+bool repair_server_register(repair_server_t* server,
+                            const repair_stream_t* stream);
+
+/** Stop answering NACKs for a stream, so its ring can be freed */
+void repair_server_unregister(repair_server_t* server, uint32_t stream);
+
+/** Stop the thread and log the stats */
+void repair_server_stop(repair_server_t* server);
+
+#endif
@@ -0,0 +1,304 @@
+/**
+ * replay.c:
+ *   Re-send the multicast UDP payloads of a pcap or pcapng capture
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "logger.h"
+#include "pcap.h"
+#include "scheduler.h"
+#include "socket-utils.h"
+
+void show_usage(int _argc, char** argv) {
+    fprintf(stderr, "Usage: %s [options] -f [capture]\n", argv[0]);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -h, --help\t Display this message and exit\n");
+    fprintf(stderr, "  -f, --file [file]\t pcap or pcapng capture to replay\n");
+    fprintf(stderr, "  -a, --address [address]\t Multicast group to send to\n");
+    fprintf(stderr, "  -i, --interface [iface]\t network interface\n");
+    fprintf(stderr, "  -p, --port [port]\t Send to [port]\n");
+    fprintf(stderr, "  --ttl [ttl] \t Time to live\n");
+    fprintf(stderr, "  --disable-loopback \t Disable loopback\n");
+    fprintf(stderr, "  --speed [n]\t Replay [n] times faster than captured (default 1)\n");
+    fprintf(stderr, "  --max-rate\t Don't wait between datagrams at all\n");
+    fprintf(stderr, "  --loop [n]\t Replay the capture [n] times, 0 for forever\n");
+    fprintf(stderr, "  --match-port [port]\t Only replay datagrams sent to [port]\n");
+    fprintf(stderr, "  --dry-run\t Print the datagrams instead of sending them\n");
+    fprintf(stderr, "  -v, --verbose\t Be verbose about what is going on\n");
+    fprintf(stderr, "  -l, --log [file]\t Log to [file]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Author(s):\n");
+    fprintf(stderr, "  Emilio Cobos Álvarez (<emiliocobos@usal.es>)\n");
+}
+
+typedef struct replay_config {
+    const char* filename;
+    double speed;
+    bool max_rate;
+    int match_port;
+    bool dry_run;
+} replay_config_t;
+
+struct replay_stats {
+    uint64_t packets;  // Packets in the capture
+    uint64_t matched;  // Multicast UDP datagrams we (would) send
+    uint64_t sent;
+    uint64_t bytes;
+    uint64_t errors;
+} STATS = {0, 0, 0, 0, 0};
+
+volatile sig_atomic_t INTERRUPTED = 0;
+
+void handle_interrupt(int sig) {
+    INTERRUPTED = 1;
+}
+
+void print_datagram(const pcap_packet_t* packet, const pcap_udp_t* udp) {
+    char source[INET6_ADDRSTRLEN];
+    char destination[INET6_ADDRSTRLEN];
+    inet_ntop(udp->family, udp->source, source, sizeof(source));
+    inet_ntop(udp->family, udp->destination, destination, sizeof(destination));
+
+    printf("%llu.%09llu %s:%u > %s:%u %zu bytes: %.*s\n",
+           (unsigned long long)(packet->timestamp / NSEC_PER_SEC),
+           (unsigned long long)(packet->timestamp % NSEC_PER_SEC),
+           source, udp->source_port, destination, udp->destination_port,
+           udp->length,
+           (int) strnlen((const char*) udp->payload, udp->length),
+           (const char*) udp->payload);
+}
+
+/**
+ * Replay the capture once. Returns false if it couldn't be read.
+ */
+bool replay_once(const replay_config_t* config,
+                 int sock,
+                 const struct sockaddr* addr,
+                 socklen_t addr_len) {
+    pcap_reader_t reader;
+    if (!pcap_open(&reader, config->filename)) {
+        WARN("Could not open \"%s\": %s", config->filename,
+             errno == EPROTO ? "not a pcap or pcapng file" : strerror(errno));
+        return false;
+    }
+
+    bool first = true;
+    uint64_t capture_start = 0;
+    uint64_t replay_start = monotonic_now();
+
+    pcap_packet_t packet;
+    int ret;
+    while (!INTERRUPTED && (ret = pcap_next(&reader, &packet)) == 1) {
+        STATS.packets++;
+
+        pcap_udp_t udp;
+        if (!pcap_extract_udp(&packet, &udp) || !pcap_udp_is_multicast(&udp))
+            continue;
+
+        if (config->match_port >= 0 &&
+            udp.destination_port != config->match_port)
+            continue;
+
+        STATS.matched++;
+
+        if (first) {
+            capture_start = packet.timestamp;
+            first = false;
+        }
+
+        // Keep the original spacing (scaled), relative to the first datagram.
+        // Captures aren't always in order, so don't go back in time.
+        if (!config->max_rate && packet.timestamp > capture_start) {
+            uint64_t offset = packet.timestamp - capture_start;
+            sleep_until(replay_start + (uint64_t)(offset / config->speed));
+        }
+
+        if (config->dry_run) {
+            print_datagram(&packet, &udp);
+            continue;
+        }
+
+        ssize_t sent = sendto(sock, udp.payload, udp.length, 0, addr, addr_len);
+        if (sent < 0) {
+            STATS.errors++;
+            WARN("send: %s", strerror(errno));
+            continue;
+        }
+
+        STATS.sent++;
+        STATS.bytes += sent;
+        LOG("replay: %zu bytes", udp.length);
+    }
+
+    if (ret < 0)
+        WARN("Error reading \"%s\" after %llu packets: %s", config->filename,
+             (unsigned long long) STATS.packets,
+             errno == EPROTO ? "broken or truncated capture" : strerror(errno));
+
+    pcap_close(&reader);
+    return ret >= 0;
+}
+
+int main(int argc, char** argv) {
+    const char* ip_address = "ff02:0:0:0:2:3:2:4";
+    const char* interface = NULL;
+    const char* port = "8000";
+    int ttl = 1;
+    bool enable_loopback = true;
+    long loops = 1;
+    replay_config_t config;
+    config.filename = NULL;
+    config.speed = 1;
+    config.max_rate = false;
+    config.match_port = -1;
+    config.dry_run = false;
+
+    LOGGER_CONFIG.log_file = stderr;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            show_usage(argc, argv);
+            return 1;
+        } else if (strcmp(argv[i], "-v") == 0 ||
+                   strcmp(argv[i], "--verbose") == 0) {
+            LOGGER_CONFIG.verbose = true;
+        } else if (strcmp(argv[i], "-l") == 0 ||
+                   strcmp(argv[i], "--log") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+
+            FILE* log_file = fopen(argv[i], "w");
+            if (log_file)
+                LOGGER_CONFIG.log_file = log_file;
+            else
+                WARN("Could not open \"%s\", using stderr: %s", argv[i],
+                     strerror(errno));
+        } else if (strcmp(argv[i], "-f") == 0 ||
+                   strcmp(argv[i], "--file") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            config.filename = argv[i];
+        } else if (strcmp(argv[i], "-a") == 0 ||
+                   strcmp(argv[i], "--address") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            ip_address = argv[i];
+        } else if (strcmp(argv[i], "-i") == 0 ||
+                   strcmp(argv[i], "--interface") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            interface = argv[i];
+        } else if (strcmp(argv[i], "-p") == 0 ||
+                   strcmp(argv[i], "--port") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            port = argv[i];
+        } else if (strcmp(argv[i], "--ttl") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            ttl = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--disable-loopback") == 0) {
+            enable_loopback = false;
+        } else if (strcmp(argv[i], "--speed") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            config.speed = strtod(argv[i], NULL);
+        } else if (strcmp(argv[i], "--max-rate") == 0) {
+            config.max_rate = true;
+        } else if (strcmp(argv[i], "--loop") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            loops = strtol(argv[i], NULL, 10);
+        } else if (strcmp(argv[i], "--match-port") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            config.match_port = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--dry-run") == 0) {
+            config.dry_run = true;
+        } else {
+            WARN("Unhandled option: %s", argv[i]);
+        }
+    }
+
+    if (!config.filename)
+        FATAL("Which capture should I replay? (-f)");
+
+    if (config.speed <= 0)
+        FATAL("The speed must be positive");
+
+    LOG("capture: %s, speed: %g, max rate: %s, loops: %ld",
+        config.filename, config.speed, config.max_rate ? "y" : "n", loops);
+    LOG("iface: %s, ip: %s, port: %s, ttl: %d, loopback: %s",
+        interface, ip_address, port, ttl, enable_loopback ? "y" : "n");
+
+    signal(SIGINT, handle_interrupt);
+    signal(SIGTERM, handle_interrupt);
+
+    int sock = -1;
+    struct sockaddr* addr = NULL;
+    socklen_t addr_len = 0;
+    if (!config.dry_run) {
+        sock = create_multicast_sender(ip_address, port, interface, ttl,
+                                       enable_loopback, &addr, &addr_len);
+        if (sock < 0)
+            FATAL("Error creating sender (%d, %d): %s", sock, errno,
+                                                        errno ? strerror(errno)
+                                                              : gai_strerror(sock));
+    }
+
+    uint64_t start = monotonic_now();
+    bool ok = true;
+    for (long i = 0; ok && !INTERRUPTED && (loops == 0 || i < loops); ++i)
+        ok = replay_once(&config, sock, addr, addr_len);
+
+    double seconds = (double)(monotonic_now() - start) / NSEC_PER_SEC;
+    fprintf(stderr, "replayed %llu of %llu packets (%llu sent, %llu bytes, %llu errors) "
+         "in %.3fs, %.1f pps\n",
+         (unsigned long long) STATS.matched,
+         (unsigned long long) STATS.packets,
+         (unsigned long long) STATS.sent,
+         (unsigned long long) STATS.bytes,
+         (unsigned long long) STATS.errors,
+         seconds, seconds > 0 ? STATS.sent / seconds : 0.0);
+
+    if (sock >= 0)
+        close(sock);
+    free(addr);
+
+    if (LOGGER_CONFIG.log_file && LOGGER_CONFIG.log_file != stderr)
+        fclose(LOGGER_CONFIG.log_file);
+
+    return ok ? 0 : 1;
+}
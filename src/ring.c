@@ -0,0 +1,217 @@
+/**
+ * ring.c:
+ *   Single-producer, multi-consumer ring of payloads in shared memory
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ring.h"
+
+/** "/mcast-ring-<name>", as shm_open() wants it */
+static bool ring_segment_name(const char* name, char* out, size_t len) {
+    int ret = snprintf(out, len, "/mcast-ring-%s", name);
+    if (ret < 0 || (size_t) ret >= len || strchr(name, '/')) {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+static inline
+size_t ring_region_size(uint32_t slot_count) {
+    return sizeof(ring_region_t) + (size_t) slot_count * sizeof(ring_slot_t);
+}
+
+ring_region_t* ring_create(const char* name, size_t slot_count) {
+    char segment[256];
+    if (!ring_segment_name(name, segment, sizeof(segment)))
+        return NULL;
+
+    uint32_t count = 1;
+    while (count < slot_count && count < (1u << 30))
+        count <<= 1;
+
+    int fd = shm_open(segment, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+
+    ring_region_t* region = NULL;
+    if (ftruncate(fd, ring_region_size(count)) != 0)
+        goto errexit;
+
+    region = mmap(NULL, ring_region_size(count), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        region = NULL;
+        goto errexit;
+    }
+
+    close(fd);
+
+    // ftruncate() zeroed it already, slots included.
+    region->version = RING_VERSION;
+    region->slot_count = count;
+    region->pid = getpid();
+    __atomic_store_n(&region->magic, RING_MAGIC, __ATOMIC_RELEASE);
+    return region;
+
+errexit: {
+        int saved_errno = errno;
+        close(fd);
+        shm_unlink(segment);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+bool ring_publish(ring_region_t* region,
+                  const void* data,
+                  size_t length,
+                  uint64_t received_at) {
+    // We're the only writer, so nobody else moves the head.
+    uint64_t position = __atomic_load_n(&region->head, __ATOMIC_RELAXED);
+    ring_slot_t* slot = &region->slots[position & (region->slot_count - 1)];
+
+    bool fits = length <= sizeof(slot->data);
+    if (!fits)
+        length = sizeof(slot->data);
+
+    // Readers that are still copying the old payload have to notice.
+    __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->received_at = received_at;
+    slot->length = length;
+    slot->truncated = !fits;
+    memcpy(slot->data, data, length);
+
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&region->head, position + 1, __ATOMIC_RELEASE);
+    return fits;
+}
+
+void ring_destroy(ring_region_t* region, const char* name) {
+    if (!region)
+        return;
+
+    munmap(region, ring_region_size(region->slot_count));
+
+    char segment[256];
+    if (ring_segment_name(name, segment, sizeof(segment)))
+        shm_unlink(segment);
+}
+
+bool ring_attach(ring_reader_t* reader, const char* name) {
+    char segment[256];
+    if (!ring_segment_name(name, segment, sizeof(segment)))
+        return false;
+
+    int fd = shm_open(segment, O_RDONLY, 0);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ring_region_t)) {
+        close(fd);
+        errno = EPROTO;
+        return false;
+    }
+
+    const ring_region_t* region = mmap(NULL, st.st_size, PROT_READ,
+                                       MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+        return false;
+
+    reader->region = region;
+    reader->size = st.st_size;
+
+    if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != RING_MAGIC ||
+        region->version != RING_VERSION ||
+        ring_region_size(region->slot_count) > reader->size) {
+        ring_detach(reader);
+        errno = EPROTO;
+        return false;
+    }
+
+    reader->cursor = __atomic_load_n(&region->head, __ATOMIC_ACQUIRE);
+    reader->lost = 0;
+    return true;
+}
+
+bool ring_read(ring_reader_t* reader,
+               void* buffer,
+               size_t capacity,
+               size_t* out_length,
+               uint64_t* out_received_at) {
+    const ring_region_t* region = reader->region;
+    uint64_t slot_count = region->slot_count;
+
+    while (true) {
+        uint64_t head = __atomic_load_n(&region->head, __ATOMIC_ACQUIRE);
+        if (reader->cursor == head)
+            return false;
+
+        // Lapped: the oldest ones we haven't read are gone.
+        if (head - reader->cursor > slot_count) {
+            reader->lost += head - slot_count - reader->cursor;
+            reader->cursor = head - slot_count;
+        }
+
+        uint64_t position = reader->cursor;
+        const ring_slot_t* slot = &region->slots[position & (slot_count - 1)];
+
+        // Either it's being overwritten, or it has been already.
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1) {
+            reader->lost++;
+            reader->cursor++;
+            continue;
+        }
+
+        size_t length = slot->length;
+        if (length > sizeof(slot->data))
+            length = sizeof(slot->data);
+        if (length > capacity)
+            length = capacity;
+        uint64_t received_at = slot->received_at;
+        memcpy(buffer, slot->data, length);
+
+        // Check it hasn't changed under us while copying.
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        reader->cursor++;
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != position + 1) {
+            reader->lost++;
+            continue;
+        }
+
+        *out_length = length;
+        if (out_received_at)
+            *out_received_at = received_at;
+        return true;
+    }
+}
+
+void ring_detach(ring_reader_t* reader) {
+    munmap((void*) reader->region, reader->size);
+    reader->region = NULL;
+}
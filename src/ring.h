@@ -0,0 +1,115 @@
+/**
+ * ring.h:
+ *   Single-producer, multi-consumer ring of payloads in shared memory
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_MAGIC 0x4d435247 // "MCRG"
+#define RING_VERSION 1
+#define RING_SLOT_SIZE 512
+#define RING_CACHE_LINE_SIZE 64
+
+/**
+ * A payload in the ring.
+ *
+ * `sequence` is the position of the payload plus one once it's written, and
+ * zero while it's being (over)written, so readers can tell if what they
+ * copied is consistent (like a seqlock).
+ */
+typedef struct ring_slot {
+    uint64_t sequence;
+    /// Wall clock time (see wire_now()) at which the client got it.
+    uint64_t received_at;
+    uint32_t length;
+    uint32_t truncated;
+    unsigned char data[RING_SLOT_SIZE - 24];
+} __attribute__((aligned(RING_CACHE_LINE_SIZE))) ring_slot_t;
+
+/**
+ * The shared memory segment, at /dev/shm/mcast-ring-<name> on Linux.
+ *
+ * There's a single writer (the client), which never waits for readers:
+ * `head` is the position of the next payload, and a reader that falls more
+ * than `slot_count` payloads behind loses the oldest ones, and knows how
+ * many.
+ */
+typedef struct ring_region {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    int32_t pid;
+    uint64_t head __attribute__((aligned(RING_CACHE_LINE_SIZE)));
+    ring_slot_t slots[];
+} ring_region_t;
+
+/** The cursor of a reader, private to it */
+typedef struct ring_reader {
+    const ring_region_t* region;
+    size_t size;
+    uint64_t cursor;
+    /// Payloads overwritten before we got to them.
+    uint64_t lost;
+} ring_reader_t;
+
+/**
+ * Create (or replace) the ring `name`, with room for `slot_count` payloads
+ * (rounded up to a power of two).
+ *
+ * Returns NULL and sets errno on failure.
+ */
+ring_region_t* ring_create(const char* name, size_t slot_count);
+
+/**
+ * Publish a payload, truncated if it doesn't fit in a slot. Returns false if
+ * it had to be truncated.
+ */
+bool ring_publish(ring_region_t* region,
+                  const void* data,
+                  size_t length,
+                  uint64_t received_at);
+
+/** Unmap the ring and remove it */
+void ring_destroy(ring_region_t* region, const char* name);
+
+/**
+ * Attach to the ring `name`, read-only, to read from its next payload on.
+ *
+ * Returns false and sets errno on failure (EPROTO if it's not a ring of
+ * ours).
+ */
+bool ring_attach(ring_reader_t* reader, const char* name);
+
+/**
+ * Copy the next payload into `buffer` (truncated to `capacity`).
+ *
+ * Returns false if there's nothing new. Never blocks.
+ */
+bool ring_read(ring_reader_t* reader,
+               void* buffer,
+               size_t capacity,
+               size_t* out_length,
+               uint64_t* out_received_at);
+
+void ring_detach(ring_reader_t* reader);
+
+#endif
@@ -0,0 +1,299 @@
+/**
+ * scheduler.c:
+ *   Deadline-ordered event scheduling
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "scheduler.h"
+
+uint64_t monotonic_now() {
+    struct timespec ts;
+    int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(ret == 0);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void sleep_until(uint64_t deadline) {
+    uint64_t now;
+    while ((now = monotonic_now()) < deadline) {
+        struct timespec ts;
+        ts.tv_sec = (deadline - now) / NSEC_PER_SEC;
+        ts.tv_nsec = (deadline - now) % NSEC_PER_SEC;
+        nanosleep(&ts, NULL);
+    }
+}
+
+uint64_t event_phase_offset(const event_t* event) {
+    if (!event->repeat_after)
+        return 0;
+
+    // FNV-1a over everything that identifies the event.
+    uint64_t hash = 14695981039346656037ull;
+    const unsigned char* c = (const unsigned char*) event->description;
+    for (; *c; ++c) {
+        hash ^= *c;
+        hash *= 1099511628211ull;
+    }
+
+    hash ^= (uint64_t)event->repeat_after;
+    hash *= 1099511628211ull;
+    hash ^= (uint64_t)event->repeat_during;
+    hash *= 1099511628211ull;
+
+    return hash % ((uint64_t)event->repeat_after * NSEC_PER_SEC);
+}
+
+bool event_next_deadline(const event_t* event,
+                         uint64_t initial,
+                         uint64_t* deadline) {
+    if (!event->repeat_after)
+        return false;
+
+    *deadline += (uint64_t)event->repeat_after * NSEC_PER_SEC;
+    return !event->repeat_during ||
+           *deadline - initial < (uint64_t)event->repeat_during * NSEC_PER_SEC;
+}
+
+/** Slots that have never been used, and slots of removed events */
+#define SLOT_EMPTY SIZE_MAX
+#define SLOT_REMOVED (SIZE_MAX - 1)
+
+static inline
+size_t slot_hash(uint32_t id, size_t capacity) {
+    return (id * 2654435761u) & (capacity - 1);
+}
+
+/** Point a free slot of the index to the entry at `position` */
+static void index_insert(scheduler_t* s, size_t position) {
+    size_t i = slot_hash(s->entries[position].event.id, s->slot_capacity);
+    while (s->slots[i].position != SLOT_EMPTY &&
+           s->slots[i].position != SLOT_REMOVED)
+        i = (i + 1) & (s->slot_capacity - 1);
+
+    if (s->slots[i].position == SLOT_REMOVED)
+        s->removed_slots--;
+
+    s->slots[i].id = s->entries[position].event.id;
+    s->slots[i].position = position;
+    s->entries[position].slot = i;
+}
+
+static void index_remove(scheduler_t* s, size_t position) {
+    s->slots[s->entries[position].slot].position = SLOT_REMOVED;
+    s->removed_slots++;
+}
+
+/**
+ * Make room for one more entry in the index, keeping it at most half full.
+ * Rebuilding also drops the removed slots, so it doesn't always grow.
+ */
+static void index_reserve(scheduler_t* s) {
+    if ((s->size + s->removed_slots + 1) * 2 <= s->slot_capacity)
+        return;
+
+    size_t capacity = s->slot_capacity ? s->slot_capacity : 16;
+    while ((s->size + 1) * 4 > capacity)
+        capacity *= 2;
+
+    free(s->slots);
+    s->slots = malloc(capacity * sizeof(scheduler_slot_t));
+    assert(s->slots);
+    s->slot_capacity = capacity;
+    s->removed_slots = 0;
+
+    for (size_t i = 0; i < capacity; ++i)
+        s->slots[i].position = SLOT_EMPTY;
+
+    for (size_t i = 0; i < s->size; ++i)
+        index_insert(s, i);
+}
+
+static size_t index_find(const scheduler_t* s, uint32_t id) {
+    if (!s->slot_capacity)
+        return SLOT_EMPTY;
+
+    size_t i = slot_hash(id, s->slot_capacity);
+    while (s->slots[i].position != SLOT_EMPTY) {
+        if (s->slots[i].position != SLOT_REMOVED && s->slots[i].id == id)
+            return s->slots[i].position;
+        i = (i + 1) & (s->slot_capacity - 1);
+    }
+
+    return SLOT_EMPTY;
+}
+
+/** Put `entry` at `position`, and tell the index */
+static inline
+void place_entry(scheduler_t* s, size_t position, const scheduled_event_t* entry) {
+    s->entries[position] = *entry;
+    s->slots[entry->slot].position = position;
+}
+
+static inline
+void swap_entries(scheduler_t* s, size_t a, size_t b) {
+    scheduled_event_t tmp = s->entries[a];
+    place_entry(s, a, &s->entries[b]);
+    place_entry(s, b, &tmp);
+}
+
+static void sift_up(scheduler_t* s, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (s->entries[parent].deadline <= s->entries[i].deadline)
+            break;
+        swap_entries(s, parent, i);
+        i = parent;
+    }
+}
+
+static void sift_down(scheduler_t* s, size_t i) {
+    while (true) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+
+        if (left < s->size &&
+            s->entries[left].deadline < s->entries[smallest].deadline)
+            smallest = left;
+
+        if (right < s->size &&
+            s->entries[right].deadline < s->entries[smallest].deadline)
+            smallest = right;
+
+        if (smallest == i)
+            break;
+
+        swap_entries(s, smallest, i);
+        i = smallest;
+    }
+}
+
+void scheduler_push(scheduler_t* s, const scheduled_event_t* entry) {
+    assert(entry);
+    if (s->size == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 16;
+        s->entries = realloc(s->entries, s->capacity * sizeof(scheduled_event_t));
+        assert(s->entries);
+    }
+
+    index_reserve(s);
+    s->entries[s->size] = *entry;
+    index_insert(s, s->size);
+    sift_up(s, s->size);
+    s->size++;
+}
+
+static void set_schedule(scheduled_event_t* entry,
+                         const event_t* event,
+                         uint64_t at) {
+    entry->deadline = at;
+    entry->expires_at = event->repeat_during
+                      ? at + (uint64_t)event->repeat_during * NSEC_PER_SEC
+                      : 0;
+    entry->event = *event;
+}
+
+void scheduler_add(scheduler_t* s,
+                   const event_t* event,
+                   uint64_t at,
+                   histogram_t* lateness) {
+    scheduled_event_t entry;
+    entry.lateness = lateness;
+    set_schedule(&entry, event, at);
+    scheduler_push(s, &entry);
+}
+
+/** Take the entry at `position` out of the heap */
+static void remove_at(scheduler_t* s, size_t position) {
+    index_remove(s, position);
+
+    s->size--;
+    if (position == s->size)
+        return;
+
+    place_entry(s, position, &s->entries[s->size]);
+    sift_down(s, position);
+    sift_up(s, position);
+}
+
+bool scheduler_pop(scheduler_t* s, scheduled_event_t* out_entry) {
+    if (scheduler_is_empty(s))
+        return false;
+
+    if (out_entry)
+        *out_entry = s->entries[0];
+
+    remove_at(s, 0);
+    return true;
+}
+
+scheduled_event_t* scheduler_find(scheduler_t* s, uint32_t id) {
+    size_t position = index_find(s, id);
+    return position == SLOT_EMPTY ? NULL : &s->entries[position];
+}
+
+bool scheduler_replace(scheduler_t* s, const event_t* event, uint64_t at) {
+    size_t position = index_find(s, event->id);
+    if (position == SLOT_EMPTY)
+        return false;
+
+    set_schedule(&s->entries[position], event, at);
+    sift_down(s, position);
+    sift_up(s, position);
+    return true;
+}
+
+bool scheduler_remove(scheduler_t* s, uint32_t id, scheduled_event_t* out_entry) {
+    size_t position = index_find(s, id);
+    if (position == SLOT_EMPTY)
+        return false;
+
+    if (out_entry)
+        *out_entry = s->entries[position];
+
+    remove_at(s, position);
+    return true;
+}
+
+bool scheduler_reschedule(scheduler_t* s, scheduled_event_t* entry) {
+    // As documented in config.h, a zero period means it never repeats.
+    if (!entry->event.repeat_after)
+        return false;
+
+    entry->deadline += (uint64_t)entry->event.repeat_after * NSEC_PER_SEC;
+    if (entry->expires_at && entry->deadline >= entry->expires_at)
+        return false;
+
+    scheduler_push(s, entry);
+    return true;
+}
+
+void scheduler_destroy(scheduler_t* s) {
+    free(s->entries);
+    s->entries = NULL;
+    s->size = 0;
+    s->capacity = 0;
+
+    free(s->slots);
+    s->slots = NULL;
+    s->slot_capacity = 0;
+    s->removed_slots = 0;
+}
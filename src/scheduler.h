@@ -0,0 +1,151 @@
+/**
+ * scheduler.h:
+ *   Deadline-ordered event scheduling
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event.h"
+#include "histogram.h"
+
+#define NSEC_PER_SEC 1000000000ull
+#define NSEC_PER_MSEC 1000000ull
+#define NSEC_PER_USEC 1000ull
+
+/** Current CLOCK_MONOTONIC time, in nanoseconds */
+uint64_t monotonic_now();
+
+/** Sleep until `monotonic_now()` reaches `deadline` */
+void sleep_until(uint64_t deadline);
+
+/**
+ * A deterministic offset within the period of the event, derived from its
+ * contents.
+ *
+ * Delaying the first dispatch of each event by this spreads events with
+ * a common period across the whole period, instead of having all of them fire
+ * in the same millisecond forever.
+ */
+uint64_t event_phase_offset(const event_t* event);
+
+/**
+ * Move `deadline` to the next dispatch of `event`, whose first dispatch was
+ * due at `initial`. Returns false if there's none: it doesn't repeat (a zero
+ * period, see config.h), or it's been repeating for `repeat_during` already.
+ */
+bool event_next_deadline(const event_t* event,
+                         uint64_t initial,
+                         uint64_t* deadline);
+
+/**
+ * An event with the time it has to be sent next, and the time after which it
+ * must not be sent anymore (zero if it repeats forever).
+ */
+typedef struct scheduled_event {
+    uint64_t deadline;
+    uint64_t expires_at;
+    /// Where to record how late it's dispatched, if anywhere.
+    histogram_t* lateness;
+    /// Slot of the index pointing to it, only meaningful inside the heap.
+    size_t slot;
+    event_t event;
+} scheduled_event_t;
+
+/** Where the event with `id` is in the heap */
+typedef struct scheduler_slot {
+    uint32_t id;
+    size_t position;
+} scheduler_slot_t;
+
+/**
+ * Binary min-heap of events, ordered by deadline.
+ *
+ * This is the "keep a list of events sorted by when they should be dispatched"
+ * strategy that `create_dispatchers()` mentions, with O(log n) insertion and
+ * removal instead of the linear insertion of `event_list_push_ordered()`.
+ *
+ * Events can also be found, replaced and removed by id in O(log n), through
+ * an open addressing index from event id to heap position, which is kept up
+ * to date as entries move. Ids don't need to be unique, but then any of the
+ * events with the id may be the one found.
+ *
+ * It's not thread-safe: the idea is that every scheduler is owned by the
+ * thread that dispatches its events.
+ */
+typedef struct scheduler {
+    scheduled_event_t* entries;
+    size_t size;
+    size_t capacity;
+    scheduler_slot_t* slots;
+    /// Always a power of two (or zero), at least twice the used slots.
+    size_t slot_capacity;
+    /// Removed slots, which still count towards the load of the index.
+    size_t removed_slots;
+} scheduler_t;
+
+#define SCHEDULER_INITIALIZER {NULL, 0, 0, NULL, 0, 0}
+
+#define scheduler_size(s) ((s)->size)
+#define scheduler_is_empty(s) ((s)->size == 0)
+/** The next event to dispatch. The scheduler must not be empty. */
+#define scheduler_peek(s) (&(s)->entries[0])
+
+/** Push an already scheduled event into the heap */
+void scheduler_push(scheduler_t* s, const scheduled_event_t* entry);
+
+/**
+ * Schedule an event for the first time, with its first dispatch at `at`.
+ * `lateness` may be NULL.
+ */
+void scheduler_add(scheduler_t* s,
+                   const event_t* event,
+                   uint64_t at,
+                   histogram_t* lateness);
+
+/** Pop the event with the earliest deadline */
+bool scheduler_pop(scheduler_t* s, scheduled_event_t* out_entry);
+
+/**
+ * Push back an event that has just been dispatched, if it has to be repeated.
+ *
+ * Returns false if the event has expired (or doesn't repeat at all).
+ */
+bool scheduler_reschedule(scheduler_t* s, scheduled_event_t* entry);
+
+/** The (or an) event with `id`, or NULL. Valid until the heap changes. */
+scheduled_event_t* scheduler_find(scheduler_t* s, uint32_t id);
+
+/**
+ * Replace the event with the id of `event` (keeping its lateness histogram),
+ * and schedule it again as if it had just been added at `at`.
+ *
+ * Returns false if there's no such event.
+ */
+bool scheduler_replace(scheduler_t* s, const event_t* event, uint64_t at);
+
+/** Remove the event with `id`. Returns false if there's no such event. */
+bool scheduler_remove(scheduler_t* s, uint32_t id, scheduled_event_t* out_entry);
+
+/** Remove every event, and free the heap memory */
+void scheduler_destroy(scheduler_t* s);
+
+#endif
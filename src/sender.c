@@ -0,0 +1,508 @@
+/**
+ * sender.c:
+ *   Event sending over a multicast socket
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sender.h"
+#include "socket-utils.h"
+#include "scheduler.h"
+#include "logger.h"
+#include "wire.h"
+
+/**
+ * A stream id that is unlikely to collide with the one of other senders, even
+ * across restarts or hosts.
+ */
+static uint32_t new_stream_id() {
+    static uint32_t counter = 0;
+    uint64_t seed = monotonic_now() ^ wire_now() ^
+                    ((uint64_t)getpid() << 32) ^
+                    __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+
+    // splitmix64 finalizer
+    seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ull;
+    seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebull;
+    seed ^= seed >> 31;
+    return (uint32_t) seed;
+}
+
+int sender_open(sender_t* sender, const sender_config_t* config, size_t share) {
+    sender->mutex = NULL;
+    sender->pacer = NULL;
+    sender->gso = false;
+    sender->framed = config->framed;
+    sender->stream = new_stream_id();
+    sender->sequence = 0;
+    memset(&sender->counters, 0, sizeof(sender->counters));
+    sender->metrics = NULL;
+    sender->fec = NULL;
+    sender->repair = NULL;
+    sender->repair_server = NULL;
+    assert(!config->snapshot || config->framed);
+    sender->snapshot = config->snapshot;
+    sender->tx_delay = NULL;
+    sender->socket = create_multicast_sender(config->ip_address,
+                                             config->port,
+                                             config->interface,
+                                             config->ttl,
+                                             config->enable_loopback,
+                                             &sender->addr,
+                                             &sender->addr_len);
+    if (sender->socket < 0)
+        return sender->socket;
+
+    if (config->max_packets_per_sec > 0 || config->max_bytes_per_sec > 0) {
+        sender->pacer = malloc(sizeof(pacer_t));
+        assert(sender->pacer);
+        pacer_init(sender->pacer,
+                   config->max_packets_per_sec / share,
+                   config->max_bytes_per_sec / share,
+                   monotonic_now());
+    }
+
+    if (config->fec_block_size) {
+        assert(config->framed);
+        sender->fec = malloc(sizeof(fec_encoder_t));
+        assert(sender->fec);
+        fec_encoder_init(sender->fec, config->fec_block_size,
+                         config->fec_parity_count, config->fec_flush_after);
+    }
+
+    if (config->repair) {
+        assert(config->framed);
+        sender->repair = malloc(sizeof(repair_ring_t));
+        assert(sender->repair);
+        repair_ring_init(sender->repair, config->repair->ring_size);
+
+        repair_stream_t stream;
+        stream.stream = sender->stream;
+        stream.ring = sender->repair;
+        stream.socket = sender->socket;
+        stream.addr = sender->addr;
+        stream.addr_len = sender->addr_len;
+        if (repair_server_register(config->repair, &stream)) {
+            sender->repair_server = config->repair;
+        } else {
+            WARN("Too many streams to repair, not keeping datagrams of %u",
+                 sender->stream);
+            repair_ring_destroy(sender->repair);
+            free(sender->repair);
+            sender->repair = NULL;
+        }
+    }
+
+    if (config->traffic_class >= 0 &&
+        !socket_set_traffic_class(sender->socket, sender->addr->sa_family,
+                                  config->traffic_class))
+        WARN("Couldn't set traffic class %d: %s", config->traffic_class,
+             strerror(errno));
+
+    if (config->socket_priority >= 0 &&
+        !socket_set_priority(sender->socket, config->socket_priority))
+        WARN("Couldn't set socket priority %d: %s", config->socket_priority,
+             strerror(errno));
+
+    if (config->tx_delay) {
+        assert(config->framed);
+        if (socket_enable_tx_timestamps(sender->socket))
+            sender->tx_delay = config->tx_delay;
+        else
+            WARN("Kernel TX timestamps not supported: %s", strerror(errno));
+    }
+
+    if (config->enable_gso) {
+        sender->gso = socket_supports_gso(sender->socket);
+        if (!sender->gso)
+            WARN("UDP GSO not supported, sending events one by one");
+    }
+
+    return sender->socket;
+}
+
+// NB: We have to call pthread_setcancelstate(DISABLE) before the lock and
+// ENABLE afterwards, because `sendto()` is required to be a cancellation
+// point[1], so we could leave the mutex in a bad state (don't know how
+// pthread handles this internally, but better be safe than sorry).
+//
+// [1]: http://man7.org/linux/man-pages/man7/pthreads.7.html
+static inline
+void sender_lock(sender_t* sender) {
+    if (sender->mutex) {
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_mutex_lock(sender->mutex);
+    }
+}
+
+static inline
+void sender_unlock(sender_t* sender) {
+    if (sender->mutex) {
+        pthread_mutex_unlock(sender->mutex);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+}
+
+/**
+ * Take the lock once the pacer lets `packets` datagrams adding up to `bytes`
+ * out. The slot is reserved with the lock held, but the wait happens without
+ * it, so threads sharing the sender can reserve theirs meanwhile instead of
+ * queueing behind a sleeping one.
+ */
+static void sender_lock_paced(sender_t* sender, size_t packets, size_t bytes) {
+    sender_lock(sender);
+    if (!sender->pacer)
+        return;
+
+    uint64_t now = monotonic_now();
+    uint64_t wait = pacer_reserve(sender->pacer, packets, bytes, now);
+    if (!wait)
+        return;
+
+    sender_unlock(sender);
+    sleep_until(now + wait);
+    sender_lock(sender);
+}
+
+/** Length of the datagram that carries `event` */
+static inline
+size_t sender_datagram_length(sender_t* sender, const event_t* event) {
+    size_t length = strlen(event->description) + 1;
+    if (sender->framed)
+        length += WIRE_HEADER_SIZE;
+    return length;
+}
+
+/**
+ * Write the datagram for `event` into `buffer`, consuming a sequence number
+ * if framed. Must be called with the lock held.
+ */
+static size_t sender_build_datagram(sender_t* sender,
+                                    const event_t* event,
+                                    unsigned char* buffer,
+                                    uint64_t timestamp) {
+    size_t description_length = strlen(event->description) + 1;
+    if (!sender->framed) {
+        memcpy(buffer, event->description, description_length);
+        return description_length;
+    }
+
+    wire_header_t header;
+    header.version = WIRE_VERSION;
+    header.type = WIRE_TYPE_EVENT;
+    header.flags = 0;
+    header.payload_length = description_length;
+    header.stream = sender->stream;
+    header.event_id = event->id;
+    header.sequence = sender->sequence++;
+    header.timestamp = timestamp;
+
+    wire_encode_header(&header, buffer);
+    memcpy(buffer + WIRE_HEADER_SIZE, event->description, description_length);
+    return WIRE_HEADER_SIZE + description_length;
+}
+
+/** Account a send. Must be called with the lock held. */
+static inline
+void sender_account(sender_t* sender, ssize_t ret, size_t packets) {
+    sender_counters_t* counters = &sender->counters;
+    if (ret < 0) {
+        __atomic_store_n(&counters->errors, counters->errors + 1,
+                         __ATOMIC_RELAXED);
+        metrics_add(sender->metrics, send_errors, 1);
+        return;
+    }
+
+    __atomic_store_n(&counters->packets, counters->packets + packets,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&counters->bytes, counters->bytes + ret,
+                     __ATOMIC_RELAXED);
+    metrics_add(sender->metrics, packets_sent, packets);
+    metrics_add(sender->metrics, bytes_sent, ret);
+}
+
+/**
+ * Find our header in a packet from the error queue, which has every header
+ * below it too (how many depends on the link layer, so just look for it).
+ */
+static bool sender_find_header(sender_t* sender,
+                               const unsigned char* packet,
+                               size_t length,
+                               bool truncated,
+                               wire_header_t* out_header) {
+    for (size_t offset = 0; offset < 128 && offset + WIRE_HEADER_SIZE <= length;
+         ++offset) {
+        if (!wire_decode_header(packet + offset, length - offset, out_header) ||
+            out_header->stream != sender->stream)
+            continue;
+
+        // A GSO send may come back whole, and not fit.
+        size_t end = offset + WIRE_HEADER_SIZE + out_header->payload_length;
+        if (end == length || (truncated && end <= length))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Record the delay of the kernel timestamps of the datagrams we've sent so
+ * far. Software timestamps are taken as the packet leaves the stack, which on
+ * most devices is during the `sendto()` itself, so there's usually one or none
+ * each time. Must be called with the lock held.
+ */
+static void sender_collect_tx_timestamps(sender_t* sender) {
+    if (!sender->tx_delay)
+        return;
+
+    unsigned char packet[256 + SENDER_MAX_DATAGRAM_SIZE];
+    uint64_t timestamp;
+    bool truncated;
+    ssize_t ret;
+    while ((ret = receive_tx_timestamp(sender->socket, packet, sizeof(packet),
+                                       &timestamp, &truncated)) >= 0) {
+        wire_header_t header;
+        if (!timestamp ||
+            !sender_find_header(sender, packet, ret, truncated, &header))
+            continue;
+
+        // Repairs carry the time of the original send.
+        if (header.flags & WIRE_FLAG_REPAIR)
+            continue;
+
+        histogram_record(sender->tx_delay, timestamp > header.timestamp
+                                         ? timestamp - header.timestamp : 0);
+    }
+}
+
+/**
+ * Send the parity datagrams of the current block and start the next one. Must
+ * be called with the lock held.
+ */
+static void sender_send_parity(sender_t* sender) {
+    unsigned char buffer[FEC_MAX_DATAGRAM_SIZE];
+    for (size_t i = 0; i < sender->fec->parity_count; ++i) {
+        size_t parity_length = fec_encoder_build_parity(sender->fec, i,
+                                                        sender->stream,
+                                                        wire_now(), buffer);
+        if (!parity_length)
+            break;
+
+        // It goes right behind its block, we can't let go of the lock here.
+        // Whoever sends next waits for it instead.
+        if (sender->pacer)
+            pacer_reserve(sender->pacer, 1, parity_length, monotonic_now());
+
+        ssize_t ret = sendto(sender->socket,
+                             buffer,
+                             parity_length, 0,
+                             sender->addr,
+                             sender->addr_len);
+        sender_account(sender, ret, 1);
+        if (ret >= 0)
+            __atomic_store_n(&sender->counters.parity,
+                             sender->counters.parity + 1, __ATOMIC_RELAXED);
+    }
+
+    fec_encoder_next_block(sender->fec);
+}
+
+/**
+ * Keep the datagram that has been built (and hopefully sent) for `event` for
+ * repairs and snapshots, and add it to the parity, sending the parity
+ * datagrams if that completes a block. Must be called with the lock held.
+ */
+static void sender_protect(sender_t* sender,
+                           const event_t* event,
+                           const unsigned char* datagram,
+                           size_t length) {
+    if (!sender->fec && !sender->repair && !sender->snapshot)
+        return;
+
+    wire_header_t header;
+    bool framed = wire_decode_header(datagram, length, &header);
+    assert(framed);
+
+    if (sender->snapshot)
+        snapshot_store_put(sender->snapshot, event, &header, datagram, length,
+                           monotonic_now());
+
+    if (sender->repair)
+        repair_ring_store(sender->repair, header.sequence, datagram, length);
+
+    if (sender->fec &&
+        fec_encoder_add(sender->fec, header.sequence, datagram, length,
+                        monotonic_now()))
+        sender_send_parity(sender);
+}
+
+uint64_t sender_flush_parity(sender_t* sender, uint64_t now) {
+    if (!sender->fec)
+        return 0;
+
+    sender_lock(sender);
+
+    uint64_t deadline = fec_encoder_flush_deadline(sender->fec);
+    if (deadline && deadline <= now) {
+        sender_send_parity(sender);
+        deadline = 0;
+    }
+
+    sender_unlock(sender);
+
+    return deadline;
+}
+
+/** Send `event` on its own, with the lock held and the send already paced */
+static ssize_t sender_send_locked(sender_t* sender, const event_t* event) {
+    unsigned char buffer[SENDER_MAX_DATAGRAM_SIZE];
+
+    size_t length = sender_build_datagram(sender, event, buffer, wire_now());
+    ssize_t ret = sendto(sender->socket,
+                         buffer,
+                         length, 0,
+                         sender->addr,
+                         sender->addr_len);
+    sender_account(sender, ret, 1);
+
+    // Even if it failed: the sequence number is gone, so the parity may as
+    // well let receivers rebuild it.
+    sender_protect(sender, event, buffer, length);
+
+    return ret;
+}
+
+ssize_t sender_send(sender_t* sender, const event_t* event) {
+    sender_lock_paced(sender, 1, sender_datagram_length(sender, event));
+
+    ssize_t ret = sender_send_locked(sender, event);
+    sender_collect_tx_timestamps(sender);
+
+    sender_unlock(sender);
+
+    return ret;
+}
+
+ssize_t sender_send_segmented(sender_t* sender,
+                              const event_t* const* events,
+                              size_t count) {
+    assert(count <= SENDER_MAX_GSO_SEGMENTS);
+
+    if (sender->gso && count > 1) {
+        unsigned char buffer[SENDER_MAX_GSO_SEGMENTS * SENDER_MAX_DATAGRAM_SIZE];
+        size_t segment_size = sender_datagram_length(sender, events[0]);
+
+        sender_lock_paced(sender, count, count * segment_size);
+
+        uint64_t timestamp = wire_now();
+        uint64_t first_sequence = sender->sequence;
+        for (size_t i = 0; i < count; ++i) {
+            size_t length = sender_build_datagram(sender, events[i],
+                                                  buffer + i * segment_size,
+                                                  timestamp);
+            assert(length == segment_size);
+        }
+
+        ssize_t ret = send_segmented(sender->socket, buffer, segment_size,
+                                     count, sender->addr, sender->addr_len);
+
+        // The socket said it supported it, but the route or the device may
+        // not (EIO for devices without checksum offload, for example). Then
+        // they're sent one by one, which isn't an error.
+        bool unsupported = ret < 0 && (errno == EIO || errno == EINVAL ||
+                                       errno == ENOPROTOOPT ||
+                                       errno == EOPNOTSUPP);
+        int saved_errno = errno;
+
+        // Nothing went out, so don't leave a gap in the sequence numbers.
+        if (ret < 0)
+            sender->sequence = first_sequence;
+
+        if (unsupported) {
+            WARN("UDP GSO send failed (%s), sending events one by one",
+                 strerror(saved_errno));
+            sender->gso = false;
+
+            // Still under the lock and the reservation of the whole burst,
+            // so they aren't paced twice.
+            ret = count;
+            for (size_t i = 0; i < count && ret >= 0; ++i)
+                if (sender_send_locked(sender, events[i]) < 0)
+                    ret = -1;
+            saved_errno = errno;
+        } else {
+            sender_account(sender, ret, count);
+            if (ret >= 0)
+                for (size_t i = 0; i < count; ++i)
+                    sender_protect(sender, events[i],
+                                   buffer + i * segment_size, segment_size);
+        }
+        sender_collect_tx_timestamps(sender);
+
+        sender_unlock(sender);
+
+        errno = saved_errno;
+        return ret < 0 ? -1 : (ssize_t) count;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+        if (sender_send(sender, events[i]) < 0)
+            return -1;
+
+    return count;
+}
+
+void sender_counters_add(sender_counters_t* into, const sender_t* sender) {
+    into->packets += __atomic_load_n(&sender->counters.packets,
+                                     __ATOMIC_RELAXED);
+    into->bytes += __atomic_load_n(&sender->counters.bytes, __ATOMIC_RELAXED);
+    into->errors += __atomic_load_n(&sender->counters.errors,
+                                    __ATOMIC_RELAXED);
+    into->parity += __atomic_load_n(&sender->counters.parity,
+                                    __ATOMIC_RELAXED);
+}
+
+void sender_close(sender_t* sender) {
+    if (sender->repair) {
+        // Make sure the repair thread is done with it (and with the socket
+        // and address) first.
+        repair_server_unregister(sender->repair_server, sender->stream);
+        repair_ring_destroy(sender->repair);
+        free(sender->repair);
+    }
+    sender->repair = NULL;
+    sender->repair_server = NULL;
+
+    if (sender->socket != -1)
+        close(sender->socket);
+    sender->socket = -1;
+
+    if (sender->addr)
+        free(sender->addr);
+    sender->addr = NULL;
+
+    if (sender->pacer)
+        free(sender->pacer);
+    sender->pacer = NULL;
+
+    if (sender->fec)
+        free(sender->fec);
+    sender->fec = NULL;
+}
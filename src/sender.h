@@ -0,0 +1,185 @@
+/**
+ * sender.h:
+ *   Event sending over a multicast socket
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SENDER_H
+#define SENDER_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "event.h"
+#include "fec.h"
+#include "histogram.h"
+#include "repair.h"
+#include "snapshot.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "wire.h"
+
+/**
+ * Everything needed to create a socket with `create_multicast_sender()`, so
+ * that more than one can be created for the same group.
+ */
+typedef struct sender_config {
+    const char* ip_address;
+    const char* port;
+    const char* interface;
+    int ttl;
+    bool enable_loopback;
+    /// Rate caps for the group, zero if unlimited.
+    double max_packets_per_sec;
+    double max_bytes_per_sec;
+    /// Try to send bursts of equal-sized events with UDP_SEGMENT.
+    bool enable_gso;
+    /// Prefix every event with a header (see wire.h).
+    bool framed;
+    /// Send `fec_parity_count` parity datagrams after every
+    /// `fec_block_size` events (see fec.h), zero to disable. Needs `framed`.
+    size_t fec_block_size;
+    size_t fec_parity_count;
+    /// Close a block short after this long (nanoseconds, zero for never), see
+    /// `sender_flush_parity()`.
+    uint64_t fec_flush_after;
+    /// Keep recent datagrams in a ring registered with this server, to answer
+    /// NACKs (see repair.h), if not NULL. Needs `framed`.
+    repair_server_t* repair;
+    /// Record the last datagram of every event here, for late joiners (see
+    /// snapshot.h), if not NULL. Needs `framed`.
+    snapshot_store_t* snapshot;
+    /// Record how long datagrams take from `sendto()` to leaving the stack,
+    /// according to kernel timestamps (see `socket_enable_tx_timestamps()`),
+    /// here, if not NULL. Needs `framed`.
+    histogram_t* tx_delay;
+    /// The TOS / traffic class byte (see `socket_set_traffic_class()`) and the
+    /// SO_PRIORITY of the socket, or -1 to leave the defaults.
+    int traffic_class;
+    int socket_priority;
+} sender_config_t;
+
+/**
+ * Send counters. Only written by whoever sends (with the lock held, if any),
+ * and read with relaxed atomic loads.
+ */
+typedef struct sender_counters {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t errors;
+    /// Parity datagrams, also counted in `packets`.
+    uint64_t parity;
+} sender_counters_t;
+
+#define SENDER_COUNTERS_INITIALIZER {0, 0, 0, 0}
+
+/**
+ * A socket along with its destination.
+ *
+ * If `mutex` is not NULL, the socket is shared between threads, and every send
+ * is done while holding it.
+ *
+ * If `pacer` is not NULL, every send waits for it. The pacer is protected by
+ * the mutex too, but the wait isn't done holding it: the send is reserved
+ * with the mutex held, which is released while sleeping until its turn, so
+ * other threads can reserve theirs meanwhile.
+ */
+typedef struct sender {
+    int socket;
+    struct sockaddr* addr;
+    socklen_t addr_len;
+    pthread_mutex_t* mutex;
+    pacer_t* pacer;
+    bool gso;
+    bool framed;
+    uint32_t stream;
+    uint64_t sequence;
+    sender_counters_t counters;
+    /// Shared memory counters of the sending thread, if any.
+    metrics_slot_t* metrics;
+    /// Parity of the datagrams sent, if enabled (protected by the mutex too).
+    fec_encoder_t* fec;
+    /// Recent datagrams, if repairs are enabled, and who answers with them.
+    repair_ring_t* repair;
+    repair_server_t* repair_server;
+    /// Where to record the last datagram of every event, if anywhere.
+    snapshot_store_t* snapshot;
+    /// Where to record the delay of the kernel timestamps, if anywhere.
+    histogram_t* tx_delay;
+} sender_t;
+
+#define SENDER_INITIALIZER                                                     \
+    {-1, NULL, 0, NULL, NULL, false, false, 0, 0,                              \
+     SENDER_COUNTERS_INITIALIZER, NULL, NULL, NULL, NULL, NULL, NULL}
+
+/** The biggest datagram we'll send for an event */
+#define SENDER_MAX_DATAGRAM_SIZE (WIRE_HEADER_SIZE + MAX_EVENT_DESCRIPTION_SIZE)
+
+/** Maximum number of segments the kernel accepts in a single GSO send */
+#define SENDER_MAX_GSO_SEGMENTS 64
+
+/**
+ * Create a new socket for `sender` with the given config.
+ *
+ * `share` is the number of senders that will be sending to the same group
+ * concurrently, the rate caps of the config are split evenly between them.
+ *
+ * Returns the same as `create_multicast_sender()`: the socket, or a negative
+ * value on error.
+ */
+int sender_open(sender_t* sender, const sender_config_t* config, size_t share);
+
+/**
+ * Send the event description (including the null terminator), after a header
+ * if the sender is framed.
+ */
+ssize_t sender_send(sender_t* sender, const event_t* event);
+
+/**
+ * Send events with the same description length in a single segmented send
+ * (see `send_segmented()`), or one by one if GSO is not enabled.
+ *
+ * If the kernel refuses to segment them, GSO is disabled for this sender and
+ * they're sent one by one.
+ *
+ * Returns the number of events sent, or -1 on error.
+ */
+ssize_t sender_send_segmented(sender_t* sender,
+                              const event_t* const* events,
+                              size_t count);
+
+/**
+ * Send the parity of the current block if it's been open for
+ * `fec_flush_after` at `now`, so receivers of slow streams don't wait for a
+ * whole block to rebuild an event.
+ *
+ * Returns when it has to be called next, or zero if there's no block pending.
+ * Whoever sends with it has to call it while idle.
+ */
+uint64_t sender_flush_parity(sender_t* sender, uint64_t now);
+
+/** Add the counters of `sender` to `into` */
+void sender_counters_add(sender_counters_t* into, const sender_t* sender);
+
+/**
+ * Close the socket and free the address, pacer, parity and repair ring, if
+ * owned
+ */
+void sender_close(sender_t* sender);
+
+#endif
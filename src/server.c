@@ -27,11 +27,22 @@
 #include <unistd.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 
 #include "logger.h"
 #include "config.h"
 #include "socket-utils.h"
+#include "sender.h"
+#include "shard.h"
+#include "pool.h"
+#include "synthetic.h"
+#include "repair.h"
+#include "snapshot.h"
+#include "control.h"
+#include "notify.h"
+#include "completion.h"
+#include "realtime.h"
 
 void show_usage(int _argc, char** argv) {
     fprintf(stderr, "Usage: %s [options]\n", argv[0]);
@@ -46,6 +57,70 @@ void show_usage(int _argc, char** argv) {
     fprintf(stderr, "  -l, --log [file]\t Log to [file]\n");
     fprintf(stderr, "  -f, --file [file]\t Use [file] as event data source\n");
     fprintf(stderr, "  --disable-loopback \t Disable loopback\n");
+    fprintf(stderr, "  --shards [n]\t Dispatch from [n] threads pinned to cores, each\n"
+                    "\t\t with its own socket, instead of a thread per event\n");
+    fprintf(stderr, "  --gso\t With --shards, send events of the same size that are\n"
+                    "\t\t due at the same time with UDP segmentation offload\n");
+    fprintf(stderr, "  --spread\t Spread the first dispatch of each event within its\n"
+                    "\t\t period, so events don't all fire at once\n");
+    fprintf(stderr, "  --max-pps [n]\t Send at most [n] packets per second\n");
+    fprintf(stderr, "  --max-bytes-per-sec [n]\t Send at most [n] bytes per second\n");
+    fprintf(stderr, "  --framed\t Prefix events with a header carrying a sequence\n"
+                    "\t\t number and the send time\n");
+    fprintf(stderr, "  --fec [k:m]\t After every [k] events send [m] parity datagrams,\n"
+                    "\t\t so clients can rebuild lost ones (implies --framed)\n");
+    fprintf(stderr, "  --fec-flush [ms]\t Send the parity of a block that isn't\n"
+                    "\t\t complete after [ms] milliseconds anyway (default 100,\n"
+                    "\t\t 0 to always wait for [k] events)\n");
+    fprintf(stderr, "  --repair-port [port]\t Resend recent events to clients that ask\n"
+                    "\t\t for them on [port] (off by default, implies --framed)\n");
+    fprintf(stderr, "  --repair-bind [address]\t Only accept NACKs on the local\n"
+                    "\t\t [address] (default every address)\n");
+    fprintf(stderr, "  --repair-rate [n]\t Resend at most [n] bytes per second by\n"
+                    "\t\t unicast to every client (default 262144, 0 for no cap)\n");
+    fprintf(stderr, "  --repair-ring [n]\t Keep the last [n] events of every socket for\n"
+                    "\t\t repairs (default 4096)\n");
+    fprintf(stderr, "  --repair-multicast-after [n]\t Resend an event to the whole group\n"
+                    "\t\t when [n] clients have asked for it (default 3)\n");
+    fprintf(stderr, "  --snapshot-port [port]\t Serve the last datagram of every active\n"
+                    "\t\t event over TCP on [port], for clients that just\n"
+                    "\t\t started (implies --framed)\n");
+    fprintf(stderr, "  --control [path]\t With --shards or --pool, add, update and\n"
+                    "\t\t cancel events through a Unix socket at [path]\n");
+    fprintf(stderr, "  --kernel-timestamps\t Measure how long datagrams take to leave\n"
+                    "\t\t the stack, with kernel TX timestamps (implies --framed)\n");
+    fprintf(stderr, "  --realtime\t Dispatch with SCHED_FIFO threads, locked memory,\n"
+                    "\t\t and spinning for the last moments before every\n"
+                    "\t\t deadline, for less jitter (needs privileges)\n");
+    fprintf(stderr, "  --realtime-priority [n]\t SCHED_FIFO priority (default 50)\n");
+    fprintf(stderr, "  --realtime-cpus [list]\t Pin dispatching threads to [list] of\n"
+                    "\t\t (ideally isolated) cpus, like 2,3 or 2-5\n");
+    fprintf(stderr, "  --realtime-spin [us]\t Spin for the last [us] microseconds\n"
+                    "\t\t before every deadline (default 200)\n");
+    fprintf(stderr, "  --stats-json [file]\t Write send counters to [file] on exit\n");
+    fprintf(stderr, "  --lateness\t Keep a lateness histogram per event, not just\n"
+                    "\t\t per class, and report them on SIGUSR1 and exit\n");
+    fprintf(stderr, "  --metrics [name]\t Publish counters in shared memory, for\n"
+                    "\t\t `mcast-stat [name]`\n");
+    fprintf(stderr, "  --pool [n]\t Hand due events to a pool of [n] work-stealing\n"
+                    "\t\t threads, instead of a thread per event\n");
+    fprintf(stderr, "  --priority-lane\t Send high priority events from a thread and\n"
+                    "\t\t socket of their own, so they don't wait behind bulk ones\n");
+    fprintf(stderr, "  --high-dscp [n]\t DSCP of the priority lane (default 46, EF)\n");
+    fprintf(stderr, "  --bulk-dscp [n]\t DSCP of every other socket (default none)\n");
+    fprintf(stderr, "  --synthetic [n]\t Generate [n] events instead of reading them\n"
+                    "\t\t from a file\n");
+    fprintf(stderr, "  --synthetic-period [dist]\t Periods of the generated events, in\n"
+                    "\t\t seconds (default fixed:1)\n");
+    fprintf(stderr, "  --synthetic-size [dist]\t Description sizes of the generated\n"
+                    "\t\t events, in bytes (default fixed:32)\n");
+    fprintf(stderr, "  --synthetic-duration [s]\t Repeat the generated events during [s]\n"
+                    "\t\t seconds (default 0, forever)\n");
+    fprintf(stderr, "  --synthetic-seed [n]\t Seed of the generator (default 1)\n");
+    fprintf(stderr, "  --synthetic-high [n]\t Make every [n]th generated event high\n"
+                    "\t\t priority (default 0, none)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "[dist] is one of fixed:N, uniform:MIN-MAX or zipf:MIN-MAX[:EXPONENT].\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Author(s):\n");
     fprintf(stderr, "  Emilio Cobos Álvarez (<emiliocobos@usal.es>)\n");
@@ -57,18 +132,15 @@ typedef enum daemon_action {
     DAEMON_ACTION_EXIT,
 } daemon_action_t;
 
-const int HANDLED_SIGNALS[] = { SIGINT, SIGHUP, SIGALRM, SIGTERM };
-#define HANDLED_SIGNALS_COUNT (sizeof(HANDLED_SIGNALS) / sizeof(*HANDLED_SIGNALS))
+/**
+ * SIGUSR2 is how dispatcher threads wake up the main thread when they finish
+ * (see `dispatcher_finished()`), it's not meant to be sent from outside.
+ */
+#define SIGNAL_DISPATCHER_FINISHED SIGUSR2
 
-void daemonize_sig_handler(int signal) {
-    switch (signal) {
-        case SIGCHLD: // The daemon died
-            FATAL("Daemon has died on startup");
-        case SIGALRM:
-            LOG("Daemon timed out waiting for children, they're probably fine");
-            exit(0);
-    }
-}
+const int HANDLED_SIGNALS[] = { SIGINT, SIGHUP, SIGALRM, SIGTERM, SIGUSR1,
+                                SIGNAL_DISPATCHER_FINISHED };
+#define HANDLED_SIGNALS_COUNT (sizeof(HANDLED_SIGNALS) / sizeof(*HANDLED_SIGNALS))
 
 void setup_signal_handlers() {
     sigset_t set;
@@ -100,50 +172,93 @@ void cancel_all_threads(pthread_t* threads,
     }
 }
 
+/**
+ * Join the threads whose index is in the completion queue, or that are done
+ * anyway if some didn't fit in it. Returns how many of them were still
+ * running.
+ */
+size_t reap_finished_threads(completion_queue_t* completions,
+                             pthread_t* threads,
+                             bool* thread_statuses,
+                             size_t length) {
+    size_t reaped = 0;
+    size_t indices[64];
+    size_t count;
+    while ((count = completion_queue_read(completions, indices, 64)) > 0) {
+        for (size_t i = 0; i < count; ++i) {
+            size_t index = indices[i];
+            if (index >= length || !thread_statuses[index])
+                continue;
+
+            LOG("Cleaning up exited thread %zu", index);
+            pthread_join(threads[index], NULL);
+            thread_statuses[index] = false;
+            reaped++;
+        }
+    }
+
+    // Whoever didn't fit has signalled us anyway, so we get here after they
+    // raised the flag.
+    if (!completion_queue_take_overflow(completions))
+        return reaped;
+
+#ifdef LINUX
+    for (size_t i = 0; i < length; ++i) {
+        if (!thread_statuses[i] || pthread_tryjoin_np(threads[i], NULL) != 0)
+            continue;
+
+        LOG("Cleaning up exited thread %zu", i);
+        thread_statuses[i] = false;
+        reaped++;
+    }
+#else
+    WARN("Completion queue overflowed, finished threads are joined on reload");
+#endif
+
+    return reaped;
+}
+
 daemon_action_t wait_and_cleanup(event_list_t* list,
                                  pthread_t* threads,
-                                 bool* thread_statuses) {
+                                 bool* thread_statuses,
+                                 completion_queue_t* completions,
+                                 size_t* running,
+                                 lateness_registry_t* lateness) {
     sigset_t set;
     sigemptyset(&set);
 
     for (size_t i = 0; i < HANDLED_SIGNALS_COUNT; ++i)
         sigaddset(&set, HANDLED_SIGNALS[i]);
 
-    // 1 second timeout for cleaning up.
-    //
-    // TODO: This shouldn't (but could) interfere with sleep() calls in other
-    // threads. After a few runs it seems it doesn't, but it could in other
-    // systems perhaps? Be sure about it.
-    alarm(1);
+    // Nothing to do until a signal arrives: dispatchers that finish tell us
+    // so themselves, so there's no need to go look for them.
     int sig;
     int ret = sigwait(&set, &sig);
     assert(ret == 0);
 
     size_t length = event_list_size(list);
-    size_t i;
     switch (sig) {
         case SIGINT:
         case SIGTERM:
             WARN("Got interrupt signal, exiting...");
             cancel_all_threads(threads, thread_statuses, length);
+            *running = 0;
             return DAEMON_ACTION_EXIT;
+        case SIGNAL_DISPATCHER_FINISHED:
+            *running -= reap_finished_threads(completions, threads,
+                                              thread_statuses, length);
+            return DAEMON_ACTION_CONTINUE;
         case SIGALRM:
-            LOG("Alarm, cleaning up possibly exited threads");
-            for (i = 0; i < length; ++i) {
-                if (!thread_statuses[i])
-                    continue;
-
-                if (pthread_kill(threads[i], 0) != 0) {
-                    LOG("Cleaning up exiting thread %zu", i);
-                    pthread_join(threads[i], NULL);
-                    thread_statuses[i] = false;
-                }
-            }
-
+            return DAEMON_ACTION_CONTINUE;
+        case SIGUSR1:
+            if (lateness)
+                lateness_registry_report(lateness);
             return DAEMON_ACTION_CONTINUE;
         case SIGHUP:
             LOG("Got hangup signal, trying to rebuild configuration...");
+            notify_reloading();
             cancel_all_threads(threads, thread_statuses, length);
+            *running = 0;
             return DAEMON_ACTION_REBUILD;
         default:
             assert(!"Invalid signal caught?");
@@ -151,13 +266,43 @@ daemon_action_t wait_and_cleanup(event_list_t* list,
 }
 
 typedef struct dispatcher_data {
-    int socket;
+    sender_t* sender;
     event_t event;
-    pthread_mutex_t* socket_mutex;
-    struct sockaddr* addr;
-    socklen_t addr_len;
+    histogram_t* lateness;
+    const dispatch_config_t* config;
+    /// Where to post our index when we're done, see `dispatcher_finished()`.
+    size_t index;
+    completion_queue_t* completions;
 } dispatcher_data_t;
 
+/**
+ * Post the index of a dispatcher that has sent its event for the last time to
+ * the completion queue, and wake up the main thread to join it.
+ */
+void dispatcher_finished(const dispatcher_data_t* data) {
+    // Don't get cancelled halfway, the main thread would join us anyway.
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    // Even if it doesn't fit: then the main thread looks for us.
+    completion_queue_post(data->completions, data->index);
+    kill(getpid(), SIGNAL_DISPATCHER_FINISHED);
+}
+
+/**
+ * Sleep until `deadline`, sending the partial parity block of the sender when
+ * it's due in between.
+ */
+void dispatcher_sleep_until(const dispatcher_data_t* data, uint64_t deadline) {
+    const realtime_config_t* realtime = data->config->realtime;
+
+    uint64_t flush;
+    while ((flush = sender_flush_parity(data->sender, monotonic_now())) &&
+           flush < deadline)
+        sleep_until(flush);
+
+    realtime_sleep_until(realtime, deadline);
+}
+
 void* event_dispatcher(void* arg) {
     // Copy into the stack our heap data to free it and prevent the leak if this
     // thread is cancelled.
@@ -168,50 +313,67 @@ void* event_dispatcher(void* arg) {
     dispatcher_data_t data = *heap_data;
     free(heap_data);
 
+    const realtime_config_t* realtime = data.config->realtime;
+    realtime_enter(realtime, realtime_cpu(realtime, data.index), "dispatcher");
 
-    time_t initial = time(NULL);
-    time_t current_time;
-
-    size_t description_length = strlen(data.event.description);
+    // We sleep until absolute deadlines instead of sleeping for the period
+    // after each send, so the time spent sending doesn't accumulate as drift.
+    uint64_t deadline = monotonic_now();
+    if (data.config->spread_phases) {
+        deadline += event_phase_offset(&data.event);
+        realtime_sleep_until(realtime, deadline);
+    }
 
-    // NB: We have to call pthread_setcancelstate(DISABLE) before the lock and
-    // ENABLE afterwards, because `sendto()` is required to be a cancellation
-    // point[1], so we could leave the mutex in a bad state (don't know how
-    // pthread handles this internally, but better be safe than sorry).
-    //
-    // [1]: http://man7.org/linux/man-pages/man7/pthreads.7.html
-    do {
-        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-        pthread_mutex_lock(data.socket_mutex);
-        int ret = sendto(data.socket,
-                         data.event.description,
-                         description_length + 1, 0,
-                         data.addr,
-                         data.addr_len);
-        pthread_mutex_unlock(data.socket_mutex);
-        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-
-        if (ret < 0)
+    uint64_t initial = deadline;
+    while (true) {
+        if (sender_send(data.sender, &data.event) < 0)
             FATAL("send: %s", strerror(errno));
 
+        lateness_record(data.lateness, deadline, monotonic_now());
+
         LOG("dispatch: %s (%ld, %ld)", data.event.description,
                                        data.event.repeat_during,
                                        data.event.repeat_after);
 
+        if (!event_next_deadline(&data.event, initial, &deadline))
+            break;
+        dispatcher_sleep_until(&data, deadline);
+    }
 
-        // TODO: Sleep is not super-accurate, but it's probably close enough for
-        // this, and I don't think we're expected to do something more
-        // sophisticated.
-        sleep(data.event.repeat_after);
-        current_time = time(NULL);
-    } while (!data.event.repeat_during ||
-             current_time - initial < data.event.repeat_during);
-
+    dispatcher_finished(&data);
     return NULL;
 }
 
+/** Where the events come from: a config file, or a synthetic catalog */
+typedef struct event_source {
+    const char* filename;
+    /// If not NULL, `filename` is ignored.
+    const synthetic_config_t* synthetic;
+} event_source_t;
+
 /**
- * This function creates a thread per event and dispatchs it.
+ * Load the events into `out_list`, which must be empty.
+ *
+ * Synthetic catalogs skip `parse_config_file()` altogether, and are the same
+ * on every reload.
+ */
+bool load_events(const event_source_t* source, event_list_t* out_list) {
+    if (source->synthetic)
+        return synthetic_generate(source->synthetic, out_list);
+
+    return parse_config_file(source->filename, out_list);
+}
+
+/**
+ * SO_PRIORITY of the priority lane: TC_PRIO_INTERACTIVE, the highest one that
+ * doesn't need CAP_NET_ADMIN.
+ */
+#define PRIORITY_LANE_SOCKET_PRIORITY 6
+
+/**
+ * This function creates a thread per event and dispatchs it. High priority
+ * events go through `lane` instead, if it's not NULL, so they don't wait for
+ * the lock of the bulk ones.
  *
  * This is **extremely** inefficient, I know, but it was a requisite stated in
  * the statement of the practice.
@@ -224,19 +386,38 @@ void* event_dispatcher(void* arg) {
  * I possibly make that strategy gated by an #ifdef, but I don't have a lot of
  * time so...
  */
-int create_dispatchers(int socket,
-                       const char* events_src_filename,
-                       struct sockaddr* addr,
-                       socklen_t len) {
+int create_dispatchers(sender_t* sender,
+                       sender_t* lane,
+                       const event_source_t* source,
+                       const dispatch_config_t* config) {
     pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_t lane_mutex = PTHREAD_MUTEX_INITIALIZER;
+    sender->mutex = &mutex;
+    if (lane)
+        lane->mutex = &lane_mutex;
 
     event_list_t list = EVENT_LIST_INITIALIZER;
     pthread_t* threads = NULL;
     bool* statuses = NULL;
+    size_t running = 0;
     daemon_action_t next_action = DAEMON_ACTION_REBUILD;
 
+    completion_queue_t completions;
+    if (!completion_queue_init(&completions))
+        FATAL("Error creating completion queue: %s", strerror(errno));
+
+    // Memory is locked with --realtime, stacks included, so keep them small.
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (config->realtime &&
+        pthread_attr_setstacksize(&attr, REALTIME_STACK_SIZE) != 0)
+        WARN("realtime: couldn't set the dispatcher stack size");
+
     while (next_action != DAEMON_ACTION_EXIT) {
         if (next_action == DAEMON_ACTION_REBUILD) {
+            // Every thread has been joined already, so whatever they posted
+            // refers to the old threads.
+            reap_finished_threads(&completions, threads, statuses, 0);
 
             // Only freeing the heap memory, the cleanup function takes care of
             // terminating them.
@@ -248,8 +429,8 @@ int create_dispatchers(int socket,
 
             event_list_destroy(&list);
 
-            if (!parse_config_file(events_src_filename, &list))
-                WARN("Failed to parse config file, continuing with empty list");
+            if (!load_events(source, &list))
+                WARN("Failed to load events, continuing with empty list");
 
             if (event_list_is_empty(&list)) {
                 threads = NULL;
@@ -270,14 +451,18 @@ int create_dispatchers(int socket,
                 assert(data);
                 event_t* event = event_list_node_value(current);
 
-                data->socket = socket;
+                data->sender = lane && event->priority == EVENT_PRIORITY_HIGH
+                             ? lane : sender;
                 data->event = *event;
-                data->socket_mutex = &mutex;
-                data->addr = addr;
-                data->addr_len = len;
+                data->lateness = config->lateness
+                               ? lateness_registry_get(config->lateness, event)
+                               : NULL;
+                data->config = config;
+                data->index = index;
+                data->completions = &completions;
 
                 statuses[index] = true;
-                int result = pthread_create(threads + index, NULL, event_dispatcher, data);
+                int result = pthread_create(threads + index, &attr, event_dispatcher, data);
                 if (result != 0)
                     FATAL("Unable to create thread to dispatch event: %s", event->description);
 
@@ -286,13 +471,22 @@ int create_dispatchers(int socket,
             }
 
             assert(index == length);
+            running = length;
+            metrics_set(sender->metrics, active_events, running);
+            notify_ready();
         } // DAEMON_ACTION_REBUILD
 
-        next_action = wait_and_cleanup(&list, threads, statuses);
+        next_action = wait_and_cleanup(&list, threads, statuses,
+                                       &completions, &running,
+                                       config->lateness);
+        metrics_set(sender->metrics, active_events, running);
     }
 
+    completion_queue_destroy(&completions);
+    pthread_attr_destroy(&attr);
+
     LOG("Terminating");
-    close(socket);
+    notify_stopping();
 
     event_list_destroy(&list);
 
@@ -302,9 +496,225 @@ int create_dispatchers(int socket,
     if (statuses)
         free(statuses);
 
+    sender->mutex = NULL;
+    if (lane)
+        lane->mutex = NULL;
     return 0;
 }
 
+/**
+ * Wait for one of the handled signals, for the dispatch modes that don't need
+ * to clean up any thread.
+ */
+daemon_action_t wait_for_signal(lateness_registry_t* lateness) {
+    sigset_t set;
+    sigemptyset(&set);
+
+    for (size_t i = 0; i < HANDLED_SIGNALS_COUNT; ++i)
+        sigaddset(&set, HANDLED_SIGNALS[i]);
+
+    int sig;
+    int ret = sigwait(&set, &sig);
+    assert(ret == 0);
+
+    switch (sig) {
+        case SIGINT:
+        case SIGTERM:
+            WARN("Got interrupt signal, exiting...");
+            return DAEMON_ACTION_EXIT;
+        case SIGHUP:
+            LOG("Got hangup signal, trying to rebuild configuration...");
+            notify_reloading();
+            return DAEMON_ACTION_REBUILD;
+        case SIGALRM:
+        // There are no dispatcher threads here, but it can still be sent to
+        // us from outside.
+        case SIGNAL_DISPATCHER_FINISHED:
+            return DAEMON_ACTION_CONTINUE;
+        case SIGUSR1:
+            if (lateness)
+                lateness_registry_report(lateness);
+            return DAEMON_ACTION_CONTINUE;
+        default:
+            assert(!"Invalid signal caught?");
+    }
+}
+
+/** Where the commands of the control socket go */
+typedef struct control_target {
+    shard_set_t* shards;
+    pool_t* pool;
+} control_target_t;
+
+void apply_control_commands(const control_command_t* commands,
+                            size_t count,
+                            bool* out_applied,
+                            void* context) {
+    control_target_t* target = context;
+    if (target->shards)
+        shard_set_apply(target->shards, commands, count, out_applied);
+    else
+        pool_apply(target->pool, commands, count, out_applied);
+}
+
+/**
+ * Same as `create_dispatchers()`, but instead of creating a thread per event,
+ * either:
+ *
+ *  - Partition the events across `shard_count` threads pinned to cores, each
+ *    one with its own socket and scheduler, or
+ *  - Have a single timer thread hand due events to a work-stealing pool of
+ *    `pool_size` sending threads, so a burst of events due at the same time is
+ *    spread across all of them.
+ *
+ * Reloading doesn't kill any thread: the new events are handed to the
+ * scheduling threads through their message queues. So are the commands of
+ * the control socket at `control_path`, if any, which change single events
+ * in place. A reload drops those changes, though.
+ *
+ * What was sent goes to `out_counters`, and what the pool did, if there's
+ * one, to `out_pool_stats`.
+ */
+int create_scheduled_dispatchers(const sender_config_t* sender_config,
+                                 const sender_config_t* lane_config,
+                                 const dispatch_config_t* dispatch_config,
+                                 const event_source_t* source,
+                                 size_t shard_count,
+                                 size_t pool_size,
+                                 const char* control_path,
+                                 sender_counters_t* out_counters,
+                                 pool_stats_t* out_pool_stats) {
+    shard_set_t shards = SHARD_SET_INITIALIZER;
+    pool_t pool;
+
+    assert(!shard_count != !pool_size);
+    if (shard_count &&
+        !shard_set_start(&shards, shard_count, sender_config, lane_config,
+                         dispatch_config))
+        FATAL("Error creating shards (%d): %s", errno, strerror(errno));
+
+    if (pool_size &&
+        !pool_start(&pool, pool_size, sender_config, lane_config,
+                    dispatch_config))
+        FATAL("Error creating dispatch pool (%d): %s", errno, strerror(errno));
+
+    control_target_t target;
+    target.shards = shard_count ? &shards : NULL;
+    target.pool = pool_size ? &pool : NULL;
+
+    control_server_t control;
+    if (control_path &&
+        !control_server_start(&control, control_path, apply_control_commands,
+                              &target))
+        FATAL("Error creating control socket \"%s\": %s", control_path,
+              strerror(errno));
+
+    event_list_t list = EVENT_LIST_INITIALIZER;
+    daemon_action_t next_action = DAEMON_ACTION_REBUILD;
+    bool loaded = false;
+
+    while (next_action != DAEMON_ACTION_EXIT) {
+        if (next_action == DAEMON_ACTION_REBUILD) {
+            if (!load_events(source, &list))
+                WARN("Failed to load events, continuing with empty list");
+
+            if (shard_count) {
+                shard_set_load(&shards, &list);
+            } else {
+                // How the old events went, there's nothing to tell before.
+                if (loaded)
+                    pool_report(&pool);
+                pool_load(&pool, &list);
+            }
+            loaded = true;
+            event_list_destroy(&list);
+            notify_ready();
+        }
+
+        next_action = wait_for_signal(dispatch_config->lateness);
+    }
+
+    LOG("Terminating");
+    notify_stopping();
+    if (control_path)
+        control_server_stop(&control);
+
+    // Only once they're done: they may still be sending what was due.
+    if (shard_count)
+        shard_set_stop(&shards, out_counters);
+    else
+        pool_stop(&pool, out_counters, out_pool_stats);
+
+    return 0;
+}
+
+/**
+ * Write what we've sent, what the pool did (if `pool_stats` isn't NULL), and
+ * how late (in microseconds), as a JSON object to `filename`, for benchmarks.
+ */
+void write_stats_json(const char* filename,
+                      const sender_counters_t* counters,
+                      const pool_stats_t* pool_stats,
+                      lateness_registry_t* lateness,
+                      const histogram_t* tx_delay,
+                      uint64_t elapsed) {
+    FILE* out = fopen(filename, "w");
+    if (!out) {
+        WARN("Could not open \"%s\": %s", filename, strerror(errno));
+        return;
+    }
+
+    // Every thread we've had, including the ones already joined.
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    uint64_t cpu_us =
+        (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+
+    double seconds = (double) elapsed / NSEC_PER_SEC;
+    fprintf(out, "{\"packets\": %llu, \"bytes\": %llu, \"errors\": %llu, "
+                 "\"parity\": %llu, \"elapsed_sec\": %.3f, \"pps\": %.1f, "
+                 "\"cpu_us\": %llu, \"peak_rss_kb\": %ld, ",
+            (unsigned long long) counters->packets,
+            (unsigned long long) counters->bytes,
+            (unsigned long long) counters->errors,
+            (unsigned long long) counters->parity,
+            seconds, seconds > 0 ? counters->packets / seconds : 0,
+            (unsigned long long) cpu_us, usage.ru_maxrss);
+
+    if (pool_stats)
+        fprintf(out, "\"pool\": {\"sent\": %llu, \"stolen\": %llu, "
+                     "\"max_depth\": %llu, \"jobs_allocated\": %llu}, ",
+                (unsigned long long) pool_stats->sent,
+                (unsigned long long) pool_stats->stolen,
+                (unsigned long long) pool_stats->max_depth,
+                (unsigned long long) pool_stats->jobs_allocated);
+
+    histogram_t total;
+    histogram_init(&total);
+    lateness_registry_total(lateness, &total);
+    if (tx_delay) {
+        fprintf(out, "\"tx_delay_us\": {");
+        histogram_print_json(tx_delay, out, 1000.0);
+        fprintf(out, "}, ");
+    }
+
+    event_priority_t priorities[2] = {EVENT_PRIORITY_HIGH, EVENT_PRIORITY_BULK};
+    for (size_t i = 0; i < 2; ++i) {
+        histogram_t class_total;
+        histogram_init(&class_total);
+        lateness_registry_class_total(lateness, priorities[i], &class_total);
+        fprintf(out, "\"lateness_%s_us\": {", EVENT_PRIORITY_NAME(priorities[i]));
+        histogram_print_json(&class_total, out, 1000.0);
+        fprintf(out, "}, ");
+    }
+
+    fprintf(out, "\"lateness_us\": {");
+    histogram_print_json(&total, out, 1000.0);
+    fprintf(out, "}}\n");
+    fclose(out);
+}
+
 int main(int argc, char** argv) {
     const char* events_src_filename = "etc/events.txt";
     const char* ip_address = "ff02:0:0:0:2:3:2:4";
@@ -313,6 +723,34 @@ int main(int argc, char** argv) {
     int ttl = 1;
     bool daemonize = false;
     bool enable_loopback = true;
+    size_t shard_count = 0;
+    size_t pool_size = 0;
+    double max_packets_per_sec = 0;
+    double max_bytes_per_sec = 0;
+    bool enable_gso = false;
+    bool framed = false;
+    size_t fec_block_size = 0;
+    size_t fec_parity_count = 0;
+    uint64_t fec_flush_after = 100 * NSEC_PER_MSEC;
+    const char* repair_port = NULL;
+    const char* repair_bind = NULL;
+    double repair_rate = 262144;
+    size_t repair_ring_size = 4096;
+    uint32_t repair_multicast_after = 3;
+    const char* snapshot_port = NULL;
+    const char* control_path = NULL;
+    bool kernel_timestamps = false;
+    bool priority_lane = false;
+    int high_dscp = 46;
+    int bulk_dscp = -1;
+    const char* stats_filename = NULL;
+    const char* metrics_name = NULL;
+    dispatch_config_t dispatch_config = DISPATCH_CONFIG_INITIALIZER;
+    realtime_config_t realtime = REALTIME_CONFIG_INITIALIZER;
+    lateness_registry_t lateness;
+    bool lateness_per_event = false;
+    synthetic_config_t synthetic = SYNTHETIC_CONFIG_INITIALIZER;
+    bool use_synthetic = false;
 
     LOGGER_CONFIG.log_file = stderr;
 
@@ -369,46 +807,269 @@ int main(int argc, char** argv) {
             if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
                 FATAL("The %s option needs a numeric value", argv[i - 1]);
             ttl = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--shards") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            shard_count = strtoul(argv[i], NULL, 10);
+        } else if (strcmp(argv[i], "--pool") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            pool_size = strtoul(argv[i], NULL, 10);
+        } else if (strcmp(argv[i], "--gso") == 0) {
+            enable_gso = true;
+        } else if (strcmp(argv[i], "--framed") == 0) {
+            framed = true;
+        } else if (strcmp(argv[i], "--fec") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            if (!fec_parse_spec(argv[i], &fec_block_size, &fec_parity_count))
+                FATAL("Invalid --fec %s, expected k:m with 0 < m <= k <= %d "
+                      "and m <= %d", argv[i], FEC_MAX_BLOCK_SIZE,
+                      FEC_MAX_PARITY);
+        } else if (strcmp(argv[i], "--fec-flush") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            fec_flush_after = (uint64_t)(strtod(argv[i], NULL) * NSEC_PER_MSEC);
+        } else if (strcmp(argv[i], "--repair-port") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            repair_port = argv[i];
+        } else if (strcmp(argv[i], "--repair-bind") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            repair_bind = argv[i];
+        } else if (strcmp(argv[i], "--repair-rate") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            repair_rate = strtod(argv[i], NULL);
+        } else if (strcmp(argv[i], "--repair-ring") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            repair_ring_size = strtoul(argv[i], NULL, 10);
+        } else if (strcmp(argv[i], "--repair-multicast-after") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            repair_multicast_after = strtoul(argv[i], NULL, 10);
+        } else if (strcmp(argv[i], "--snapshot-port") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            snapshot_port = argv[i];
+        } else if (strcmp(argv[i], "--control") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            control_path = argv[i];
+        } else if (strcmp(argv[i], "--stats-json") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            stats_filename = argv[i];
+        } else if (strcmp(argv[i], "--lateness") == 0) {
+            lateness_per_event = true;
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            metrics_name = argv[i];
+        } else if (strcmp(argv[i], "--spread") == 0) {
+            dispatch_config.spread_phases = true;
+        } else if (strcmp(argv[i], "--kernel-timestamps") == 0) {
+            kernel_timestamps = true;
+        } else if (strcmp(argv[i], "--priority-lane") == 0) {
+            priority_lane = true;
+        } else if (strcmp(argv[i], "--high-dscp") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            high_dscp = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--bulk-dscp") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            bulk_dscp = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--realtime") == 0) {
+            dispatch_config.realtime = &realtime;
+        } else if (strcmp(argv[i], "--realtime-priority") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            realtime.priority = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--realtime-cpus") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            if (!realtime_parse_cpus(argv[i], &realtime))
+                FATAL("Invalid cpu list: %s", argv[i]);
+        } else if (strcmp(argv[i], "--realtime-spin") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            realtime.spin = (uint64_t)(strtod(argv[i], NULL) * NSEC_PER_USEC);
+        } else if (strcmp(argv[i], "--max-pps") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            max_packets_per_sec = strtod(argv[i], NULL);
+        } else if (strcmp(argv[i], "--max-bytes-per-sec") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            max_bytes_per_sec = strtod(argv[i], NULL);
+        } else if (strcmp(argv[i], "--synthetic") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            synthetic.events = strtoul(argv[i], NULL, 10);
+            use_synthetic = true;
+        } else if (strcmp(argv[i], "--synthetic-period") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            if (!synthetic_parse_distribution(argv[i], &synthetic.period))
+                FATAL("Invalid distribution for %s: %s", argv[i - 1], argv[i]);
+        } else if (strcmp(argv[i], "--synthetic-size") == 0) {
+            ++i;
+            if (i == argc)
+                FATAL("The %s option needs a value", argv[i - 1]);
+            if (!synthetic_parse_distribution(argv[i], &synthetic.size))
+                FATAL("Invalid distribution for %s: %s", argv[i - 1], argv[i]);
+        } else if (strcmp(argv[i], "--synthetic-duration") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            synthetic.duration = strtol(argv[i], NULL, 10);
+        } else if (strcmp(argv[i], "--synthetic-seed") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            synthetic.seed = strtoull(argv[i], NULL, 10);
+        } else if (strcmp(argv[i], "--synthetic-high") == 0) {
+            ++i;
+            if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+                FATAL("The %s option needs a numeric value", argv[i - 1]);
+            synthetic.high_every = strtoul(argv[i], NULL, 10);
         } else {
             WARN("Unhandled option: %s", argv[i]);
         }
     }
 
-    LOG("events: %s", events_src_filename);
-    LOG("iface: %s, ip: %s, port: %s daemonize: %s, ttl: %d, loopback: %s",
+    if (shard_count && pool_size)
+        FATAL("--shards and --pool can't be used together");
+
+    if (fec_block_size && !framed) {
+        LOG("--fec needs sequence numbers, enabling --framed");
+        framed = true;
+    }
+
+    if (repair_port && !framed) {
+        LOG("--repair-port needs sequence numbers, enabling --framed");
+        framed = true;
+    }
+
+    if (snapshot_port && !framed) {
+        LOG("--snapshot-port needs sequence numbers, enabling --framed");
+        framed = true;
+    }
+
+    if (kernel_timestamps && !framed) {
+        LOG("--kernel-timestamps needs send times, enabling --framed");
+        framed = true;
+    }
+
+    if (high_dscp > 63 || bulk_dscp > 63)
+        FATAL("DSCP values go from 0 to 63");
+
+    if (repair_port && !repair_ring_size)
+        FATAL("The repair ring can't be empty");
+
+    if (control_path && !shard_count && !pool_size) {
+        WARN("--control needs --shards or --pool, ignoring it");
+        control_path = NULL;
+    }
+
+    if (enable_gso && !shard_count) {
+        WARN("--gso only batches events with --shards, ignoring it");
+        enable_gso = false;
+    }
+
+    if (use_synthetic) {
+        if (!synthetic_config_is_valid(&synthetic))
+            FATAL("Synthetic periods must be positive, and sizes below %d",
+                  MAX_EVENT_DESCRIPTION_SIZE);
+
+        LOG("synthetic: %zu events, period: %ld-%ld, size: %ld-%ld, "
+            "duration: %ld, seed: %llu, high every: %zu",
+            synthetic.events, synthetic.period.min, synthetic.period.max,
+            synthetic.size.min, synthetic.size.max, synthetic.duration,
+            (unsigned long long) synthetic.seed, synthetic.high_every);
+    }
+
+    event_source_t source;
+    source.filename = events_src_filename;
+    source.synthetic = use_synthetic ? &synthetic : NULL;
+
+    LOG("events: %s, spread: %s, max pps: %g, max bytes/s: %g",
+        use_synthetic ? "(synthetic)" : events_src_filename,
+        dispatch_config.spread_phases ? "y" : "n",
+        max_packets_per_sec, max_bytes_per_sec);
+    if (dispatch_config.realtime)
+        LOG("realtime: priority: %d, cpus: %zu, spin: %lluus",
+            realtime.priority, realtime.cpu_count,
+            (unsigned long long)(realtime.spin / NSEC_PER_USEC));
+    LOG("iface: %s, ip: %s, port: %s daemonize: %s, ttl: %d, loopback: %s, "
+        "shards: %zu, pool: %zu",
         interface, ip_address, port, daemonize ? "y" : "n", ttl,
-        enable_loopback ? "y" : "n");
+        enable_loopback ? "y" : "n", shard_count, pool_size);
+    if (priority_lane)
+        LOG("priority lane: high dscp: %d, bulk dscp: %d", high_dscp, bulk_dscp);
 
     if (daemonize) {
-        if (signal(SIGCHLD, daemonize_sig_handler) == SIG_ERR)
-            FATAL("Error registering SIGCHLD: %s", strerror(errno));
-
-        if (signal(SIGALRM, daemonize_sig_handler) == SIG_ERR)
-            FATAL("Error registering SIGALRM: %s", strerror(errno));
+        // The daemon writes a byte here once it's dispatching events, see
+        // notify.h. If it dies before, we get EOF instead.
+        int ready[2];
+        if (pipe(ready) != 0)
+            FATAL("Error creating readiness pipe: %s", strerror(errno));
 
         pid_t child_pid;
         switch ((child_pid = fork())) {
         case 0:
-            if (signal(SIGALRM, SIG_IGN) == SIG_ERR)
-                FATAL("Error ignoring SIGHUP: %s", strerror(errno));
-
-            if (signal(SIGCHLD, SIG_IGN) == SIG_ERR)
-                FATAL("Error ignoring SIGCHLD: %s", strerror(errno));
-
+            close(ready[0]);
+            notify_set_fd(ready[1]);
             setup_signal_handlers();
             break;
         case -1:
             FATAL("Fork error: %s", strerror(errno));
             break;
-        default:
-            // NOTE: this is an educated guess, and does not guarantee
-            // that the server is fine. We assume that if after two seconds
-            // it's fine, it will be fine forever, but this does not have to
-            // be true.
-            alarm(2);
-            waitpid(child_pid, NULL, 0); // Either SIGCHLD (if the daemon
-                                         // dies) or SIGALRM will arrive
-            return 0;
+        default: {
+            close(ready[1]);
+
+            char status;
+            ssize_t ret;
+            do {
+                ret = read(ready[0], &status, 1);
+            } while (ret < 0 && errno == EINTR);
+
+            if (ret == 1) {
+                LOG("Daemon %d is ready", (int) child_pid);
+                return 0;
+            }
+
+            int child_status = 0;
+            waitpid(child_pid, &child_status, 0);
+            WARN("Daemon has died on startup");
+            return WIFEXITED(child_status) && WEXITSTATUS(child_status)
+                 ? WEXITSTATUS(child_status) : 1;
+        }
         }
     } else {
         // If we don't want to make this a daemon, we setup the normal signal
@@ -416,22 +1077,145 @@ int main(int argc, char** argv) {
         setup_signal_handlers();
     }
 
-    struct sockaddr* addr;
-    socklen_t len;
-    int socket = create_multicast_sender(ip_address, port,
-                                         interface, ttl,
-                                         enable_loopback,
-                                         &addr, &len);
-    if (socket < 0)
-        FATAL("Error creating sender (%d, %d): %s", socket, errno,
-                                                    errno ? strerror(errno)
-                                                          : gai_strerror(socket));
+    sender_config_t sender_config;
+    sender_config.ip_address = ip_address;
+    sender_config.port = port;
+    sender_config.interface = interface;
+    sender_config.ttl = ttl;
+    sender_config.enable_loopback = enable_loopback;
+    sender_config.max_packets_per_sec = max_packets_per_sec;
+    sender_config.max_bytes_per_sec = max_bytes_per_sec;
+    sender_config.enable_gso = enable_gso;
+    sender_config.framed = framed;
+    sender_config.fec_block_size = fec_block_size;
+    sender_config.fec_parity_count = fec_parity_count;
+    sender_config.fec_flush_after = fec_flush_after;
+    sender_config.repair = NULL;
+
+    // From sendto() to leaving the stack, as the kernel saw it.
+    histogram_t tx_delay;
+    histogram_init(&tx_delay);
+    sender_config.tx_delay = kernel_timestamps ? &tx_delay : NULL;
+    sender_config.traffic_class = bulk_dscp >= 0 ? bulk_dscp << 2 : -1;
+    sender_config.socket_priority = -1;
+
+    repair_server_t repair;
+    if (repair_port) {
+        int error;
+        errno = 0;
+        if (!repair_server_start(&repair, ip_address, repair_bind, repair_port,
+                                 repair_ring_size, repair_multicast_after,
+                                 repair_rate, &error))
+            FATAL("Error creating repair socket (%d, %d): %s", error, errno,
+                  errno ? strerror(errno) : gai_strerror(error));
+        sender_config.repair = &repair;
+    }
+
+    sender_config.snapshot = NULL;
+    snapshot_store_t snapshot;
+    snapshot_server_t snapshot_server;
+    if (snapshot_port) {
+        int error;
+        errno = 0;
+        snapshot_store_init(&snapshot);
+        if (!snapshot_server_start(&snapshot_server, &snapshot, ip_address,
+                                   snapshot_port, &error))
+            FATAL("Error creating snapshot socket (%d, %d): %s", error, errno,
+                  errno ? strerror(errno) : gai_strerror(error));
+        sender_config.snapshot = &snapshot;
+    }
+
+    // How late every event is dispatched, dumped on SIGUSR1 and on exit.
+    lateness_registry_init(&lateness, lateness_per_event);
+    dispatch_config.lateness = &lateness;
+
+    metrics_region_t* metrics = NULL;
+    if (metrics_name) {
+        metrics = metrics_create(metrics_name, "server");
+        if (!metrics)
+            WARN("Could not create metrics \"%s\": %s", metrics_name,
+                 strerror(errno));
+    }
+    dispatch_config.metrics = metrics;
+
+    // After forking (locks aren't inherited), and before the dispatching
+    // threads start, so their stacks are locked too.
+    if (dispatch_config.realtime)
+        realtime_lock_memory();
+
+    // The same, but marked so the network (and our own qdisc) puts it first.
+    sender_config_t lane_config = sender_config;
+    lane_config.traffic_class = high_dscp << 2;
+    lane_config.socket_priority = PRIORITY_LANE_SOCKET_PRIORITY;
+
+    sender_counters_t counters = SENDER_COUNTERS_INITIALIZER;
+    pool_stats_t pool_stats = POOL_STATS_INITIALIZER;
+    uint64_t start = monotonic_now();
+
+    int ret;
+    if (shard_count || pool_size) {
+        ret = create_scheduled_dispatchers(&sender_config,
+                                           priority_lane ? &lane_config : NULL,
+                                           &dispatch_config, &source,
+                                           shard_count, pool_size,
+                                           control_path, &counters,
+                                           &pool_stats);
+    } else {
+        sender_t sender;
+        int socket = sender_open(&sender, &sender_config, 1);
+        if (socket < 0)
+            FATAL("Error creating sender (%d, %d): %s", socket, errno,
+                                                        errno ? strerror(errno)
+                                                              : gai_strerror(socket));
+
+        sender_t lane;
+        if (priority_lane) {
+            socket = sender_open(&lane, &lane_config, 1);
+            if (socket < 0)
+                FATAL("Error creating lane sender (%d, %d): %s", socket, errno,
+                      errno ? strerror(errno) : gai_strerror(socket));
+            lane.metrics = metrics_claim_slot(metrics, "lane");
+        }
+
+        // Every thread sends under the same lock, so they can share a slot.
+        sender.metrics = metrics_claim_slot(metrics, "dispatchers");
+        ret = create_dispatchers(&sender, priority_lane ? &lane : NULL, &source,
+                                 &dispatch_config);
+        sender_counters_add(&counters, &sender);
+        sender_close(&sender);
+        if (priority_lane) {
+            sender_counters_add(&counters, &lane);
+            sender_close(&lane);
+        }
+    }
+
+    if (repair_port)
+        repair_server_stop(&repair);
+
+    if (snapshot_port) {
+        snapshot_server_stop(&snapshot_server);
+        snapshot_store_destroy(&snapshot);
+    }
+
+    if (kernel_timestamps)
+        LOG("tx: %llu kernel timestamps, delay p50 %.1fus p99 %.1fus "
+            "max %.1fus",
+            (unsigned long long) tx_delay.count,
+            histogram_percentile(&tx_delay, 50) / 1000.0,
+            histogram_percentile(&tx_delay, 99) / 1000.0,
+            tx_delay.max / 1000.0);
+
+    if (stats_filename)
+        write_stats_json(stats_filename, &counters,
+                         pool_size ? &pool_stats : NULL, &lateness,
+                         sender_config.tx_delay, monotonic_now() - start);
 
-    int ret = create_dispatchers(socket, events_src_filename, addr, len);
+    lateness_registry_report(&lateness);
+    lateness_registry_destroy(&lateness);
+    metrics_destroy(metrics, metrics_name);
 
     if (LOGGER_CONFIG.log_file)
         fclose(LOGGER_CONFIG.log_file);
 
-    free(addr);
     return ret;
 }
@@ -0,0 +1,771 @@
+/**
+ * shard.c:
+ *   Per-core dispatchers, each with its own socket and scheduler
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shard.h"
+#include "logger.h"
+#include "realtime.h"
+
+/**
+ * Maximum number of due events handed to the dispatch function at once, so
+ * a huge burst doesn't grow the batch without bounds.
+ */
+#define SHARD_MAX_BATCH 1024
+
+/** When an event should be dispatched first, if it's scheduled at `now` */
+static uint64_t shard_first_deadline(shard_t* shard,
+                                     const event_t* event,
+                                     uint64_t now) {
+    if (shard->config->spread_phases)
+        return now + event_phase_offset(event);
+    return now;
+}
+
+/**
+ * Point the lateness entry of `event` to its new description and class, and
+ * move it to the histogram of its new class if there's one per class.
+ */
+static void shard_relabel(shard_t* shard, const event_t* event) {
+    if (!shard->config->lateness)
+        return;
+
+    scheduled_event_t* entry = scheduler_find(&shard->scheduler, event->id);
+    assert(entry);
+    histogram_t* lateness = lateness_registry_get(shard->config->lateness,
+                                                  event);
+    lateness_release(entry->lateness);
+    entry->lateness = lateness;
+}
+
+/** Remove every event, releasing their lateness histograms */
+static void shard_clear(shard_t* shard) {
+    for (size_t i = 0; i < scheduler_size(&shard->scheduler); ++i)
+        lateness_release(shard->scheduler.entries[i].lateness);
+    scheduler_destroy(&shard->scheduler);
+}
+
+static void shard_apply_commands(shard_t* shard,
+                                 const control_command_t* commands,
+                                 size_t count,
+                                 bool* out_applied) {
+    uint64_t now = monotonic_now();
+    size_t unknown = 0;
+    scheduled_event_t removed;
+
+    for (size_t i = 0; i < count; ++i) {
+        const event_t* event = &commands[i].event;
+        out_applied[i] = true;
+        switch (commands[i].type) {
+            case CONTROL_COMMAND_ADD: {
+                uint64_t first = shard_first_deadline(shard, event, now);
+                if (scheduler_replace(&shard->scheduler, event, first)) {
+                    shard_relabel(shard, event);
+                    break;
+                }
+
+                histogram_t* lateness = NULL;
+                if (shard->config->lateness)
+                    lateness = lateness_registry_get(shard->config->lateness,
+                                                     event);
+                scheduler_add(&shard->scheduler, event, first, lateness);
+                break;
+            }
+            case CONTROL_COMMAND_UPDATE:
+                // The new version goes out right away.
+                if (scheduler_replace(&shard->scheduler, event, now))
+                    shard_relabel(shard, event);
+                else
+                    out_applied[i] = false;
+                break;
+            case CONTROL_COMMAND_MOVE:
+                if (scheduler_replace(&shard->scheduler, event, now)) {
+                    shard_relabel(shard, event);
+                } else {
+                    histogram_t* lateness = NULL;
+                    if (shard->config->lateness)
+                        lateness = lateness_registry_get(
+                            shard->config->lateness, event);
+                    scheduler_add(&shard->scheduler, event, now, lateness);
+                }
+                break;
+            case CONTROL_COMMAND_CANCEL:
+                if (!scheduler_remove(&shard->scheduler, event->id, &removed)) {
+                    out_applied[i] = false;
+                    break;
+                }
+                lateness_release(removed.lateness);
+                if (shard->config->lateness)
+                    lateness_registry_remove(shard->config->lateness,
+                                             event->id);
+                break;
+            case CONTROL_COMMAND_FORGET:
+                // It's moving to another shard, which keeps its lateness.
+                if (scheduler_remove(&shard->scheduler, event->id, &removed))
+                    lateness_release(removed.lateness);
+                else
+                    out_applied[i] = false;
+                break;
+        }
+
+        if (!out_applied[i])
+            unknown++;
+    }
+
+    metrics_set(shard->metrics, active_events,
+                scheduler_size(&shard->scheduler));
+
+    // Whoever sent them is told about unknown events, no need to warn.
+    LOG("shard %zu: applied %zu of %zu commands", shard->index,
+        count - unknown, count);
+}
+
+void shard_completion_wait(shard_completion_t* completion) {
+    pthread_mutex_lock(&completion->mutex);
+    while (completion->pending)
+        pthread_cond_wait(&completion->cond, &completion->mutex);
+    pthread_mutex_unlock(&completion->mutex);
+}
+
+static void shard_completion_done(shard_completion_t* completion) {
+    pthread_mutex_lock(&completion->mutex);
+    if (--completion->pending == 0)
+        pthread_cond_broadcast(&completion->cond);
+    pthread_mutex_unlock(&completion->mutex);
+}
+
+/**
+ * Handle a message from the queue. Returns false if the shard has to stop.
+ */
+static bool shard_handle_message(shard_t* shard) {
+    shard_message_t message;
+    ssize_t ret = read(shard->queue[0], &message, sizeof(message));
+    if (ret < 0 && errno == EINTR)
+        return true;
+
+    if (ret != sizeof(message))
+        FATAL("shard %zu: bad read from queue: %s", shard->index,
+              ret < 0 ? strerror(errno) : "short read");
+
+    switch (message.type) {
+        case SHARD_MESSAGE_LOAD: {
+            shard_clear(shard);
+            uint64_t now = monotonic_now();
+            for (size_t i = 0; i < message.count; ++i) {
+                event_t* event = &message.events[i];
+                uint64_t first = shard_first_deadline(shard, event, now);
+
+                histogram_t* lateness = NULL;
+                if (shard->config->lateness)
+                    lateness = lateness_registry_get(shard->config->lateness,
+                                                     event);
+                scheduler_add(&shard->scheduler, event, first, lateness);
+            }
+            free(message.events);
+            metrics_set(shard->metrics, active_events,
+                        scheduler_size(&shard->scheduler));
+            LOG("shard %zu: loaded %zu events", shard->index, message.count);
+            return true;
+        }
+        case SHARD_MESSAGE_APPLY:
+            shard_apply_commands(shard, message.commands, message.count,
+                                 message.applied);
+            free(message.commands);
+            shard_completion_done(message.completion);
+            return true;
+        case SHARD_MESSAGE_STOP:
+            return false;
+    }
+
+    assert(!"Invalid shard message");
+    return false;
+}
+
+static void shard_log_dispatch(shard_t* shard, const event_t* event) {
+    // Avoid even taking the logger lock when it's not going to print.
+    if (LOGGER_CONFIG.verbose)
+        LOG("dispatch[%zu]: %s (%ld, %ld)", shard->index,
+            event->description,
+            event->repeat_during,
+            event->repeat_after);
+}
+
+/**
+ * Order events by description length, and then by position in the batch, so
+ * events with the same length are contiguous but still in deadline order.
+ */
+static int compare_by_length(const void* a, const void* b) {
+    const event_t* left = *(const event_t* const*) a;
+    const event_t* right = *(const event_t* const*) b;
+    size_t left_length = strlen(left->description);
+    size_t right_length = strlen(right->description);
+
+    if (left_length != right_length)
+        return left_length < right_length ? -1 : 1;
+
+    return left < right ? -1 : left > right;
+}
+
+/** Send the batch grouping events with the same length in GSO sends */
+static void shard_send_segmented(shard_t* shard,
+                                 scheduled_event_t* batch,
+                                 size_t count) {
+    const event_t* events[SHARD_MAX_BATCH];
+    assert(count <= SHARD_MAX_BATCH);
+
+    for (size_t i = 0; i < count; ++i)
+        events[i] = &batch[i].event;
+
+    qsort(events, count, sizeof(*events), compare_by_length);
+
+    size_t start = 0;
+    while (start < count) {
+        size_t length = strlen(events[start]->description);
+        size_t end = start + 1;
+        while (end < count && end - start < SENDER_MAX_GSO_SEGMENTS &&
+               strlen(events[end]->description) == length)
+            end++;
+
+        if (sender_send_segmented(&shard->sender, events + start,
+                                  end - start) < 0)
+            FATAL("shard %zu: send: %s", shard->index, strerror(errno));
+
+        for (size_t i = start; i < end; ++i)
+            shard_log_dispatch(shard, events[i]);
+
+        start = end;
+    }
+}
+
+void shard_send_batch(shard_t* shard, scheduled_event_t* batch, size_t count) {
+    if (shard->sender.gso && count > 1) {
+        shard_send_segmented(shard, batch, count);
+
+        uint64_t now = monotonic_now();
+        for (size_t i = 0; i < count; ++i)
+            lateness_record(batch[i].lateness, batch[i].deadline, now);
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (sender_send(&shard->sender, &batch[i].event) < 0)
+            FATAL("shard %zu: send: %s", shard->index, strerror(errno));
+
+        lateness_record(batch[i].lateness, batch[i].deadline, monotonic_now());
+        shard_log_dispatch(shard, &batch[i].event);
+    }
+}
+
+/** Dispatch every event whose deadline has already passed */
+static void shard_dispatch_due(shard_t* shard, uint64_t now) {
+    while (!scheduler_is_empty(&shard->scheduler) &&
+           scheduler_peek(&shard->scheduler)->deadline <= now) {
+        size_t count = 0;
+        while (count < SHARD_MAX_BATCH &&
+               !scheduler_is_empty(&shard->scheduler) &&
+               scheduler_peek(&shard->scheduler)->deadline <= now) {
+            if (count == shard->batch_capacity) {
+                shard->batch_capacity = shard->batch_capacity
+                                      ? shard->batch_capacity * 2 : 16;
+                shard->batch = realloc(shard->batch,
+                                       sizeof(scheduled_event_t) *
+                                           shard->batch_capacity);
+                assert(shard->batch);
+            }
+            scheduler_pop(&shard->scheduler, &shard->batch[count++]);
+        }
+
+        shard->dispatch(shard, shard->batch, count);
+        metrics_add(shard->metrics, batches, 1);
+        metrics_add(shard->metrics, batched_events, count);
+
+        for (size_t i = 0; i < count; ++i)
+            if (!scheduler_reschedule(&shard->scheduler, &shard->batch[i]))
+                lateness_release(shard->batch[i].lateness);
+
+        metrics_set(shard->metrics, active_events,
+                    scheduler_size(&shard->scheduler));
+    }
+}
+
+static void* shard_main(void* arg) {
+    shard_t* shard = (shard_t*) arg;
+    char name[32];
+    snprintf(name, sizeof(name), "shard %zu", shard->index);
+    realtime_pin(shard->cpu, name);
+
+    const realtime_config_t* realtime = shard->config->realtime;
+    uint64_t spin = realtime ? realtime->spin : 0;
+    if (realtime)
+        realtime_enter(realtime, -1, name);
+
+    struct pollfd queue;
+    queue.fd = shard->queue[0];
+    queue.events = POLLIN;
+
+    bool running = true;
+    while (running) {
+        uint64_t now = monotonic_now();
+        shard_dispatch_due(shard, now);
+
+        int timeout = -1;
+        if (!scheduler_is_empty(&shard->scheduler)) {
+            uint64_t deadline = scheduler_peek(&shard->scheduler)->deadline;
+            uint64_t wait_ms;
+            if (!realtime) {
+                wait_ms = deadline > now
+                        ? (deadline - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC
+                        : 0;
+            } else {
+                // poll() only has millisecond resolution, so wake up early
+                // (rounding down) and spin the rest. Once that close, the
+                // queue can wait until the event is out.
+                uint64_t wake = deadline > spin ? deadline - spin : 0;
+                if (wake <= now) {
+                    realtime_sleep_until(realtime, deadline);
+                    continue;
+                }
+                wait_ms = (wake - now) / NSEC_PER_MSEC;
+            }
+            timeout = wait_ms > INT_MAX ? INT_MAX : (int)wait_ms;
+        }
+
+        // A partial parity block can't wait for the next event forever.
+        uint64_t flush = sender_flush_parity(&shard->sender, now);
+        if (flush) {
+            uint64_t wait_ms = flush > now
+                             ? (flush - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC
+                             : 0;
+            if (timeout < 0 || wait_ms < (uint64_t) timeout)
+                timeout = (int) wait_ms;
+        }
+
+        queue.revents = 0;
+        int ret = poll(&queue, 1, timeout);
+        if (ret < 0 && errno != EINTR)
+            FATAL("shard %zu: poll: %s", shard->index, strerror(errno));
+
+        if (ret > 0)
+            running = shard_handle_message(shard);
+    }
+
+    shard_clear(shard);
+    free(shard->batch);
+    shard->batch = NULL;
+    shard->batch_capacity = 0;
+    return NULL;
+}
+
+static void shard_post(shard_t* shard, const shard_message_t* message) {
+    ssize_t ret;
+    do {
+        ret = write(shard->queue[1], message, sizeof(*message));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != sizeof(*message))
+        FATAL("shard %zu: couldn't post message: %s", shard->index,
+              strerror(errno));
+}
+
+bool shard_start(shard_t* shard,
+                 size_t index,
+                 const dispatch_config_t* config,
+                 shard_dispatch_fn dispatch,
+                 void* context) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        cpus = 1;
+
+    shard->index = index;
+    shard->cpu = realtime_cpu(config->realtime, index);
+    if (shard->cpu < 0)
+        shard->cpu = (int)(index % cpus);
+    shard->scheduler = (scheduler_t) SCHEDULER_INITIALIZER;
+    shard->batch = NULL;
+    shard->batch_capacity = 0;
+    shard->dispatch = dispatch;
+    shard->context = context;
+    shard->config = config;
+
+    if (pipe(shard->queue) != 0)
+        return false;
+
+    int ret = pthread_create(&shard->thread, NULL, shard_main, shard);
+    if (ret != 0) {
+        close(shard->queue[0]);
+        close(shard->queue[1]);
+        errno = ret;
+        return false;
+    }
+
+    LOG("shard %zu: started on cpu %d", index, shard->cpu);
+    return true;
+}
+
+void shard_load(shard_t* shard, event_t* events, size_t count) {
+    shard_message_t message;
+    message.type = SHARD_MESSAGE_LOAD;
+    message.events = events;
+    message.commands = NULL;
+    message.count = count;
+    message.applied = NULL;
+    message.completion = NULL;
+    shard_post(shard, &message);
+}
+
+void shard_apply(shard_t* shard,
+                 control_command_t* commands,
+                 size_t count,
+                 bool* out_applied,
+                 shard_completion_t* completion) {
+    pthread_mutex_lock(&completion->mutex);
+    completion->pending++;
+    pthread_mutex_unlock(&completion->mutex);
+
+    shard_message_t message;
+    message.type = SHARD_MESSAGE_APPLY;
+    message.events = NULL;
+    message.commands = commands;
+    message.count = count;
+    message.applied = out_applied;
+    message.completion = completion;
+    shard_post(shard, &message);
+}
+
+void shard_stop(shard_t* shard) {
+    shard_message_t stop;
+    stop.type = SHARD_MESSAGE_STOP;
+    stop.events = NULL;
+    stop.commands = NULL;
+    stop.count = 0;
+    stop.applied = NULL;
+    stop.completion = NULL;
+    shard_post(shard, &stop);
+
+    pthread_join(shard->thread, NULL);
+    LOG("shard %zu: joined", shard->index);
+
+    close(shard->queue[0]);
+    close(shard->queue[1]);
+}
+
+/** Number of shards including the lane */
+#define shard_set_total(set) ((set)->count + ((set)->lane ? 1 : 0))
+
+static bool shard_set_start_one(shard_t* shard,
+                                size_t index,
+                                const char* name,
+                                size_t share,
+                                const sender_config_t* sender_config,
+                                const dispatch_config_t* dispatch_config) {
+    if (sender_open(&shard->sender, sender_config, share) < 0)
+        return false;
+
+    shard->metrics = metrics_claim_slot(dispatch_config->metrics, name);
+    shard->sender.metrics = shard->metrics;
+
+    if (!shard_start(shard, index, dispatch_config, shard_send_batch, NULL)) {
+        int saved_errno = errno;
+        sender_close(&shard->sender);
+        errno = saved_errno;
+        return false;
+    }
+
+    return true;
+}
+
+bool shard_set_start(shard_set_t* set,
+                     size_t count,
+                     const sender_config_t* sender_config,
+                     const sender_config_t* lane_config,
+                     const dispatch_config_t* dispatch_config) {
+    assert(count > 0);
+
+    // The lane gets its share of the rate caps like any other shard.
+    size_t share = lane_config ? count + 1 : count;
+
+    set->count = 0;
+    set->lane = NULL;
+    set->shards = malloc(sizeof(shard_t) * share);
+    assert(set->shards);
+
+    for (size_t i = 0; i < count; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "shard%zu", i);
+        if (!shard_set_start_one(&set->shards[i], i, name, share,
+                                 sender_config, dispatch_config))
+            goto errexit;
+
+        set->count++;
+    }
+
+    if (lane_config) {
+        if (!shard_set_start_one(&set->shards[count], count, "lane", share,
+                                 lane_config, dispatch_config))
+            goto errexit;
+
+        set->lane = &set->shards[count];
+    }
+
+    return true;
+
+errexit:
+    {
+        int saved_errno = errno;
+        shard_set_stop(set, NULL);
+        errno = saved_errno;
+    }
+    return false;
+}
+
+void shard_set_load(shard_set_t* set, event_list_t* list) {
+    size_t length = event_list_size(list);
+    size_t total = shard_set_total(set);
+    size_t* counts = calloc(total, sizeof(size_t));
+    assert(counts);
+
+    event_list_node_t* current = event_list_head(list);
+    while (event_list_node_has_value(current)) {
+        counts[shard_set_owner(set, event_list_node_value(current))->index]++;
+        current = event_list_node_next(current);
+    }
+
+    shard_message_t* messages = malloc(sizeof(shard_message_t) * total);
+    assert(messages);
+
+    for (size_t i = 0; i < total; ++i) {
+        messages[i].count = 0;
+        messages[i].events = counts[i] ? malloc(sizeof(event_t) * counts[i])
+                                       : NULL;
+        assert(!counts[i] || messages[i].events);
+    }
+
+    // By id instead of round-robin, so commands for an event later on can be
+    // sent straight to its shard. Ids are mostly consecutive, so it's just as
+    // even.
+    size_t index = 0;
+    current = event_list_head(list);
+    while (event_list_node_has_value(current)) {
+        event_t* event = event_list_node_value(current);
+        shard_message_t* message =
+            &messages[shard_set_owner(set, event)->index];
+        message->events[message->count++] = *event;
+        index++;
+        current = event_list_node_next(current);
+    }
+
+    assert(index == length);
+
+    for (size_t i = 0; i < total; ++i)
+        shard_load(&set->shards[i], messages[i].events, messages[i].count);
+
+    free(messages);
+    free(counts);
+}
+
+/**
+ * Send `commands[i]` to the shard with index `targets[i]` for every `i`, wait
+ * for all of them, and fill `out_applied` in the same order.
+ */
+static void shard_set_send(shard_set_t* set,
+                           const control_command_t* commands,
+                           const size_t* targets,
+                           size_t count,
+                           bool* out_applied) {
+    size_t total = shard_set_total(set);
+    size_t* counts = calloc(total, sizeof(size_t));
+    control_command_t** batches = calloc(total, sizeof(control_command_t*));
+    bool** results = calloc(total, sizeof(bool*));
+    size_t** origins = calloc(total, sizeof(size_t*));
+    assert(counts && batches && results && origins);
+
+    for (size_t i = 0; i < count; ++i)
+        counts[targets[i]]++;
+
+    for (size_t i = 0; i < total; ++i) {
+        if (counts[i]) {
+            batches[i] = malloc(sizeof(control_command_t) * counts[i]);
+            results[i] = malloc(sizeof(bool) * counts[i]);
+            origins[i] = malloc(sizeof(size_t) * counts[i]);
+            assert(batches[i] && results[i] && origins[i]);
+        }
+        counts[i] = 0;
+    }
+
+    // Keep the order of the commands of every event.
+    for (size_t i = 0; i < count; ++i) {
+        size_t target = targets[i];
+        origins[target][counts[target]] = i;
+        batches[target][counts[target]++] = commands[i];
+    }
+
+    shard_completion_t completion = SHARD_COMPLETION_INITIALIZER;
+    for (size_t i = 0; i < total; ++i)
+        if (counts[i])
+            shard_apply(&set->shards[i], batches[i], counts[i], results[i],
+                        &completion);
+    shard_completion_wait(&completion);
+
+    for (size_t i = 0; i < total; ++i) {
+        for (size_t j = 0; j < counts[i]; ++j)
+            out_applied[origins[i][j]] = results[i][j];
+        free(results[i]);
+        free(origins[i]);
+    }
+
+    free(origins);
+    free(results);
+    free(batches);
+    free(counts);
+}
+
+/** Whether the event of `commands[end]` has a command in [start, end) */
+static bool shard_set_repeats(const control_command_t* commands,
+                              size_t start,
+                              size_t end) {
+    for (size_t i = start; i < end; ++i)
+        if (commands[i].event.id == commands[end].event.id)
+            return true;
+    return false;
+}
+
+/**
+ * Apply `count` commands for different events with a lane, see
+ * `shard_set_apply()`. The rest of the arguments are scratch space for
+ * `count` elements.
+ */
+static void shard_set_apply_lane(shard_set_t* set,
+                                 const control_command_t* commands,
+                                 size_t count,
+                                 bool* out_applied,
+                                 control_command_t* routed,
+                                 size_t* targets,
+                                 size_t* origins,
+                                 bool* found) {
+    // First, take the event away from where it shouldn't be.
+    for (size_t i = 0; i < count; ++i) {
+        const event_t* event = &commands[i].event;
+        shard_t* bulk = &set->shards[event->id % set->count];
+        shard_t* owner = shard_set_owner(set, event);
+
+        routed[i] = commands[i];
+        if (commands[i].type == CONTROL_COMMAND_CANCEL ||
+            commands[i].type == CONTROL_COMMAND_FORGET) {
+            targets[i] = set->lane->index;
+        } else {
+            routed[i].type = CONTROL_COMMAND_FORGET;
+            targets[i] = (owner == bulk ? set->lane : bulk)->index;
+        }
+    }
+    shard_set_send(set, routed, targets, count, found);
+
+    // Then, give it to where it should.
+    size_t pending = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const event_t* event = &commands[i].event;
+        routed[pending] = commands[i];
+        targets[pending] = shard_set_owner(set, event)->index;
+
+        switch (commands[i].type) {
+            case CONTROL_COMMAND_ADD:
+                break;
+            case CONTROL_COMMAND_UPDATE:
+            case CONTROL_COMMAND_MOVE:
+                if (found[i])
+                    routed[pending].type = CONTROL_COMMAND_MOVE;
+                break;
+            case CONTROL_COMMAND_CANCEL:
+            case CONTROL_COMMAND_FORGET:
+                if (found[i]) {
+                    out_applied[i] = true;
+                    continue;
+                }
+                targets[pending] = set->shards[event->id % set->count].index;
+                break;
+        }
+        origins[pending++] = i;
+    }
+    shard_set_send(set, routed, targets, pending, found);
+
+    for (size_t i = 0; i < pending; ++i)
+        out_applied[origins[i]] = found[i];
+}
+
+void shard_set_apply(shard_set_t* set,
+                     const control_command_t* commands,
+                     size_t count,
+                     bool* out_applied) {
+    control_command_t* routed = malloc(sizeof(control_command_t) * count);
+    size_t* targets = malloc(sizeof(size_t) * count);
+    assert(routed && targets);
+
+    if (!set->lane) {
+        for (size_t i = 0; i < count; ++i)
+            targets[i] = shard_set_owner(set, &commands[i].event)->index;
+        shard_set_send(set, commands, targets, count, out_applied);
+        free(targets);
+        free(routed);
+        return;
+    }
+
+    size_t* origins = malloc(sizeof(size_t) * count);
+    bool* found = malloc(sizeof(bool) * count);
+    assert(origins && found);
+
+    // Each round applies a command per event in two steps, so a command for
+    // an event that already has one in the round goes to the next. Batches
+    // are at most CONTROL_MAX_BATCH long, so the quadratic check is cheap.
+    size_t start = 0;
+    while (start < count) {
+        size_t end = start + 1;
+        while (end < count && !shard_set_repeats(commands, start, end))
+            end++;
+
+        shard_set_apply_lane(set, commands + start, end - start,
+                             out_applied + start, routed, targets, origins,
+                             found);
+        start = end;
+    }
+
+    free(found);
+    free(origins);
+    free(targets);
+    free(routed);
+}
+
+void shard_set_stop(shard_set_t* set, sender_counters_t* out_counters) {
+    for (size_t i = 0; i < shard_set_total(set); ++i) {
+        shard_stop(&set->shards[i]);
+        if (out_counters)
+            sender_counters_add(out_counters, &set->shards[i].sender);
+        sender_close(&set->shards[i].sender);
+    }
+
+    free(set->shards);
+    set->shards = NULL;
+    set->count = 0;
+    set->lane = NULL;
+}
@@ -0,0 +1,231 @@
+/**
+ * shard.h:
+ *   Per-core dispatchers, each with its own socket and scheduler
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "control.h"
+#include "event.h"
+#include "lateness.h"
+#include "metrics.h"
+#include "realtime.h"
+#include "scheduler.h"
+#include "sender.h"
+
+/**
+ * Options about how events are dispatched, shared (read-only) by every
+ * dispatching thread.
+ */
+typedef struct dispatch_config {
+    /// Delay the first dispatch of every event by `event_phase_offset()`.
+    bool spread_phases;
+    /// Where to record how late every event is dispatched, if anywhere.
+    lateness_registry_t* lateness;
+    /// Where to claim the shared memory counters of every thread, if anywhere.
+    metrics_region_t* metrics;
+    /// How to make the dispatching threads real-time (--realtime), if at all.
+    const realtime_config_t* realtime;
+} dispatch_config_t;
+
+#define DISPATCH_CONFIG_INITIALIZER {false, NULL, NULL, NULL}
+
+typedef enum shard_message_type {
+    /// Replace the whole set of events of the shard.
+    SHARD_MESSAGE_LOAD,
+    /// Add, update or cancel some of the events of the shard.
+    SHARD_MESSAGE_APPLY,
+    /// Stop dispatching and exit the thread.
+    SHARD_MESSAGE_STOP,
+} shard_message_type_t;
+
+/**
+ * Lets whoever sends commands wait until every shard they went to has applied
+ * them.
+ */
+typedef struct shard_completion {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t pending;
+} shard_completion_t;
+
+#define SHARD_COMPLETION_INITIALIZER                                           \
+    {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0}
+
+/** Wait until every shard_apply() made with `completion` is done */
+void shard_completion_wait(shard_completion_t* completion);
+
+/**
+ * A message sent from the main thread to a shard through its queue.
+ *
+ * For SHARD_MESSAGE_LOAD, `events` is a heap-allocated array of `count`
+ * events, and for SHARD_MESSAGE_APPLY `commands` is one of `count` commands.
+ * Either way its ownership is transferred to the shard. The results of the
+ * commands go to `applied`, which the sender keeps, and then `completion` is
+ * signalled.
+ */
+typedef struct shard_message {
+    shard_message_type_t type;
+    event_t* events;
+    control_command_t* commands;
+    size_t count;
+    bool* applied;
+    shard_completion_t* completion;
+} shard_message_t;
+
+struct shard;
+
+/**
+ * Called by the shard thread with every event that is due, in deadline order.
+ *
+ * The events are rescheduled after this returns.
+ */
+typedef void (*shard_dispatch_fn)(struct shard* shard,
+                                  scheduled_event_t* batch,
+                                  size_t count);
+
+/**
+ * A dispatcher thread pinned to a core.
+ *
+ * Everything here except `queue[1]` is only touched by the shard thread once
+ * it's running, so the dispatch path doesn't share any mutable state with
+ * other threads. The main thread talks to it through the queue, which is
+ * a pipe (messages are smaller than PIPE_BUF, so writes are atomic).
+ *
+ * By default due events are sent through `sender`, but `dispatch` can be
+ * replaced to do something else with them (see pool.h).
+ */
+typedef struct shard {
+    size_t index;
+    int cpu;
+    pthread_t thread;
+    int queue[2];
+    sender_t sender;
+    scheduler_t scheduler;
+    scheduled_event_t* batch;
+    size_t batch_capacity;
+    shard_dispatch_fn dispatch;
+    void* context;
+    const dispatch_config_t* config;
+    /// Batches and the number of scheduled events. May be NULL.
+    metrics_slot_t* metrics;
+} shard_t;
+
+/** The default dispatch function: send every event through the shard socket */
+void shard_send_batch(shard_t* shard, scheduled_event_t* batch, size_t count);
+
+/**
+ * Start the thread of a single shard, with no events.
+ *
+ * The caller sets up `sender` if `dispatch` needs it, and `metrics`. Returns
+ * false and sets errno on failure.
+ */
+bool shard_start(shard_t* shard,
+                 size_t index,
+                 const dispatch_config_t* config,
+                 shard_dispatch_fn dispatch,
+                 void* context);
+
+/** Hand `count` events to the shard, replacing the ones it had */
+void shard_load(shard_t* shard, event_t* events, size_t count);
+
+/**
+ * Hand `count` commands to the shard, to be applied in order to the events it
+ * has, in O(log n) each.
+ *
+ * Doesn't wait for them: `out_applied` is filled (see `control_apply_fn`) by
+ * the time `shard_completion_wait(completion)` returns.
+ */
+void shard_apply(shard_t* shard,
+                 control_command_t* commands,
+                 size_t count,
+                 bool* out_applied,
+                 shard_completion_t* completion);
+
+/** Stop a single shard and wait for it. Doesn't close its sender. */
+void shard_stop(shard_t* shard);
+
+/**
+ * `count` shards for bulk events and, if `lane` is not NULL, one more (right
+ * after them in `shards`) only for high priority events, with a socket of its
+ * own.
+ */
+typedef struct shard_set {
+    shard_t* shards;
+    size_t count;
+    shard_t* lane;
+} shard_set_t;
+
+#define SHARD_SET_INITIALIZER {NULL, 0, NULL}
+
+/**
+ * Create `count` shards, each with its own socket created from
+ * `sender_config`, plus the priority lane if `lane_config` is not NULL, and
+ * start their threads with no events.
+ *
+ * Returns false and sets errno on failure.
+ */
+bool shard_set_start(shard_set_t* set,
+                     size_t count,
+                     const sender_config_t* sender_config,
+                     const sender_config_t* lane_config,
+                     const dispatch_config_t* dispatch_config);
+
+/**
+ * Partition the events in `list` across the shards (see `shard_set_owner()`),
+ * and send each shard its part. The list is left untouched.
+ */
+void shard_set_load(shard_set_t* set, event_list_t* list);
+
+/**
+ * The shard that dispatches `event`: the lane if it's of the high priority
+ * class and there's one, the one for its id otherwise.
+ */
+#define shard_set_owner(set, event)                                            \
+    ((set)->lane && (event)->priority == EVENT_PRIORITY_HIGH                   \
+         ? (set)->lane                                                         \
+         : &(set)->shards[(event)->id % (set)->count])
+
+/**
+ * Send each command to the shard of its event, and wait for them to be
+ * applied, filling `out_applied` (see `control_apply_fn`). The commands are
+ * copied.
+ *
+ * With a lane, an add or update can move an event between classes, so first
+ * the shard of the other class forgets it, and then the shard of its class
+ * gets the add, or the update (as a move if the other one had it, so an
+ * update of an unknown event is still rejected). Cancels don't know the class
+ * of the event, so they go to the lane first, and then to its bulk shard if
+ * the lane didn't have it.
+ */
+void shard_set_apply(shard_set_t* set,
+                     const control_command_t* commands,
+                     size_t count,
+                     bool* out_applied);
+
+/**
+ * Stop all the shards, wait for them, and release their resources. What they
+ * sent is added to `out_counters` once they're done, if it's not NULL.
+ */
+void shard_set_stop(shard_set_t* set, sender_counters_t* out_counters);
+
+#endif
@@ -0,0 +1,357 @@
+/**
+ * snapshot.c:
+ *   Serve the current state of every event to clients that just started
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "snapshot.h"
+#include "logger.h"
+#include "scheduler.h"
+#include "socket-utils.h"
+
+/** Don't let a stuck client hold the server thread forever */
+#define SNAPSHOT_IO_TIMEOUT_SEC 5
+
+void snapshot_store_init(snapshot_store_t* store) {
+    pthread_mutex_init(&store->mutex, NULL);
+    store->entries = NULL;
+    store->count = 0;
+    store->capacity = 0;
+    store->index = NULL;
+    store->index_capacity = 0;
+    store->mark_count = 0;
+}
+
+static inline
+size_t snapshot_hash(uint32_t event_id, size_t capacity) {
+    return (event_id * 2654435761u) & (capacity - 1);
+}
+
+/** Find the slot of the index for an event, which may be empty */
+static size_t* snapshot_store_slot(snapshot_store_t* store,
+                                   uint32_t event_id) {
+    size_t i = snapshot_hash(event_id, store->index_capacity);
+    while (store->index[i] &&
+           store->entries[store->index[i] - 1].event_id != event_id)
+        i = (i + 1) & (store->index_capacity - 1);
+    return &store->index[i];
+}
+
+/** Keep the index at most half full */
+static void snapshot_store_grow(snapshot_store_t* store) {
+    if (store->count * 2 < store->index_capacity)
+        return;
+
+    size_t* old_index = store->index;
+    size_t old_capacity = store->index_capacity;
+
+    store->index_capacity = old_capacity ? old_capacity * 2 : 64;
+    store->index = calloc(store->index_capacity, sizeof(size_t));
+    assert(store->index);
+
+    for (size_t i = 0; i < old_capacity; ++i)
+        if (old_index[i])
+            *snapshot_store_slot(store,
+                                 store->entries[old_index[i] - 1].event_id) =
+                old_index[i];
+
+    free(old_index);
+}
+
+void snapshot_store_put(snapshot_store_t* store,
+                        const event_t* event,
+                        const wire_header_t* header,
+                        const unsigned char* datagram,
+                        size_t length,
+                        uint64_t now) {
+    assert(length <= SNAPSHOT_DATAGRAM_SIZE);
+
+    pthread_mutex_lock(&store->mutex);
+
+    snapshot_store_grow(store);
+    size_t* slot = snapshot_store_slot(store, event->id);
+    if (!*slot) {
+        if (store->count == store->capacity) {
+            store->capacity = store->capacity ? store->capacity * 2 : 64;
+            store->entries = realloc(store->entries,
+                                     store->capacity * sizeof(snapshot_entry_t));
+            assert(store->entries);
+        }
+        store->entries[store->count].event_id = event->id;
+        *slot = ++store->count;
+    }
+
+    snapshot_entry_t* entry = &store->entries[*slot - 1];
+    entry->expires_at = now + ((uint64_t) event->repeat_after + 1) * NSEC_PER_SEC;
+    entry->length = length;
+    memcpy(entry->datagram, datagram, length);
+
+    size_t i;
+    for (i = 0; i < store->mark_count; ++i)
+        if (store->marks[i].stream == header->stream)
+            break;
+
+    if (i == store->mark_count && i < SNAPSHOT_MAX_STREAMS) {
+        store->marks[i].stream = header->stream;
+        store->marks[i].next_sequence = 0;
+        store->mark_count++;
+    }
+
+    if (i < store->mark_count &&
+        header->sequence + 1 > store->marks[i].next_sequence)
+        store->marks[i].next_sequence = header->sequence + 1;
+
+    pthread_mutex_unlock(&store->mutex);
+}
+
+static size_t put_record(unsigned char* buffer,
+                         const unsigned char* datagram,
+                         size_t length) {
+    buffer[0] = length >> 8;
+    buffer[1] = length;
+    memcpy(buffer + SNAPSHOT_RECORD_HEADER_SIZE, datagram, length);
+    return SNAPSHOT_RECORD_HEADER_SIZE + length;
+}
+
+static size_t put_control_record(unsigned char* buffer,
+                                 uint8_t type,
+                                 uint32_t stream,
+                                 uint64_t sequence) {
+    unsigned char datagram[WIRE_HEADER_SIZE];
+    wire_header_t header;
+    header.version = WIRE_VERSION;
+    header.type = type;
+    header.flags = WIRE_FLAG_SNAPSHOT;
+    header.payload_length = 0;
+    header.stream = stream;
+    header.event_id = 0;
+    header.sequence = sequence;
+    header.timestamp = wire_now();
+    wire_encode_header(&header, datagram);
+    return put_record(buffer, datagram, sizeof(datagram));
+}
+
+size_t snapshot_store_serialize(snapshot_store_t* store,
+                                uint64_t now,
+                                unsigned char** out_buffer) {
+    const size_t control_size = SNAPSHOT_RECORD_HEADER_SIZE + WIRE_HEADER_SIZE;
+
+    pthread_mutex_lock(&store->mutex);
+
+    size_t capacity = control_size * (store->mark_count + 1) +
+                      (SNAPSHOT_RECORD_HEADER_SIZE + SNAPSHOT_DATAGRAM_SIZE) *
+                          store->count;
+    unsigned char* buffer = malloc(capacity);
+    assert(buffer);
+
+    size_t length = 0;
+    for (size_t i = 0; i < store->mark_count; ++i)
+        length += put_control_record(buffer + length, WIRE_TYPE_SNAPSHOT_MARK,
+                                     store->marks[i].stream,
+                                     store->marks[i].next_sequence);
+
+    uint64_t events = 0;
+    for (size_t i = 0; i < store->count; ++i) {
+        const snapshot_entry_t* entry = &store->entries[i];
+        if (entry->expires_at <= now)
+            continue;
+
+        size_t start = length;
+        length += put_record(buffer + length, entry->datagram, entry->length);
+        buffer[start + SNAPSHOT_RECORD_HEADER_SIZE + 5] |= WIRE_FLAG_SNAPSHOT;
+        events++;
+    }
+
+    pthread_mutex_unlock(&store->mutex);
+
+    length += put_control_record(buffer + length, WIRE_TYPE_SNAPSHOT_END, 0,
+                                 events);
+    assert(length <= capacity);
+
+    *out_buffer = buffer;
+    return length;
+}
+
+void snapshot_store_destroy(snapshot_store_t* store) {
+    pthread_mutex_destroy(&store->mutex);
+    free(store->entries);
+    free(store->index);
+    store->entries = NULL;
+    store->index = NULL;
+    store->count = store->capacity = store->index_capacity = 0;
+}
+
+static void set_io_timeout(int sock) {
+    struct timeval timeout;
+    timeout.tv_sec = SNAPSHOT_IO_TIMEOUT_SEC;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+static bool write_all(int sock, const unsigned char* buffer, size_t length) {
+    while (length) {
+        ssize_t ret = send(sock, buffer, length, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buffer += ret;
+        length -= ret;
+    }
+    return true;
+}
+
+static void* snapshot_server_thread(void* data) {
+    snapshot_server_t* server = data;
+
+    while (true) {
+        int client = accept(server->socket, NULL, NULL);
+
+        // Only get cancelled while waiting, not with a lock held.
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (client < 0) {
+            WARN("snapshot: accept: %s", strerror(errno));
+        } else {
+            unsigned char* buffer;
+            size_t length = snapshot_store_serialize(server->store,
+                                                     monotonic_now(), &buffer);
+            set_io_timeout(client);
+            if (write_all(client, buffer, length)) {
+                server->served++;
+                LOG("snapshot: served %zu bytes", length);
+            } else {
+                WARN("snapshot: send: %s", strerror(errno));
+            }
+            free(buffer);
+            close(client);
+        }
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    return NULL;
+}
+
+bool snapshot_server_start(snapshot_server_t* server,
+                           snapshot_store_t* store,
+                           const char* group,
+                           const char* port,
+                           int* out_error) {
+    *out_error = 0;
+    server->store = store;
+    server->served = 0;
+
+    server->socket = create_stream_listener(group, port);
+    if (server->socket < 0) {
+        *out_error = server->socket;
+        return false;
+    }
+
+    int ret = pthread_create(&server->thread, NULL, snapshot_server_thread,
+                             server);
+    if (ret != 0) {
+        close(server->socket);
+        errno = ret;
+        return false;
+    }
+
+    return true;
+}
+
+void snapshot_server_stop(snapshot_server_t* server) {
+    pthread_cancel(server->thread);
+    pthread_join(server->thread, NULL);
+    close(server->socket);
+    LOG("snapshot: served %llu snapshots",
+        (unsigned long long) server->served);
+}
+
+static bool read_all(int sock, unsigned char* buffer, size_t length) {
+    while (length) {
+        ssize_t ret = recv(sock, buffer, length, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            if (ret == 0)
+                errno = EPIPE;
+            return false;
+        }
+        buffer += ret;
+        length -= ret;
+    }
+    return true;
+}
+
+ssize_t snapshot_fetch(const char* host,
+                       const char* port,
+                       snapshot_callback_t callback,
+                       void* data,
+                       int* out_error) {
+    *out_error = 0;
+    int sock = create_stream_connection(host, port);
+    if (sock < 0) {
+        *out_error = sock;
+        return -1;
+    }
+
+    set_io_timeout(sock);
+
+    ssize_t events = -1;
+    unsigned char datagram[SNAPSHOT_DATAGRAM_SIZE];
+    while (true) {
+        unsigned char length_buffer[SNAPSHOT_RECORD_HEADER_SIZE];
+        if (!read_all(sock, length_buffer, sizeof(length_buffer)))
+            break;
+
+        size_t length = (size_t) length_buffer[0] << 8 | length_buffer[1];
+        if (length > sizeof(datagram)) {
+            errno = EPROTO;
+            break;
+        }
+
+        if (!read_all(sock, datagram, length))
+            break;
+
+        wire_header_t header;
+        if (!wire_decode_header(datagram, length, &header)) {
+            errno = EPROTO;
+            break;
+        }
+
+        callback(datagram, length, data);
+
+        if (header.type == WIRE_TYPE_SNAPSHOT_END) {
+            events = header.sequence;
+            break;
+        }
+    }
+
+    int saved_errno = errno;
+    close(sock);
+    errno = saved_errno;
+    return events;
+}
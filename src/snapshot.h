@@ -0,0 +1,138 @@
+/**
+ * snapshot.h:
+ *   Serve the current state of every event to clients that just started
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "event.h"
+#include "wire.h"
+
+/**
+ * Framed senders record the last datagram they sent for every event, and
+ * the next sequence number of their stream, both under the same lock.
+ *
+ * A snapshot, served over TCP, is a sequence of records, each one a 16-bit
+ * length (network byte order) followed by a framed datagram:
+ *
+ *  - A WIRE_TYPE_SNAPSHOT_MARK per stream, with its next sequence number.
+ *  - The last datagram of every active event, flagged with
+ *    WIRE_FLAG_SNAPSHOT.
+ *  - A WIRE_TYPE_SNAPSHOT_END.
+ *
+ * A client that joins the group *before* asking for the snapshot can then
+ * drop every datagram of the group below the mark of its stream, since the
+ * snapshot is newer, and keep the rest: no gaps, no duplicates.
+ *
+ * An event is active while it's still being sent, that is, until a period
+ * (plus a second of slack) has gone by since it was last sent.
+ */
+#define SNAPSHOT_DATAGRAM_SIZE (WIRE_HEADER_SIZE + MAX_EVENT_DESCRIPTION_SIZE)
+#define SNAPSHOT_RECORD_HEADER_SIZE 2
+#define SNAPSHOT_MAX_STREAMS 64
+
+typedef struct snapshot_entry {
+    uint32_t event_id;
+    /// Monotonic time after which the event is not active anymore.
+    uint64_t expires_at;
+    uint16_t length;
+    unsigned char datagram[SNAPSHOT_DATAGRAM_SIZE];
+} snapshot_entry_t;
+
+typedef struct snapshot_mark {
+    uint32_t stream;
+    uint64_t next_sequence;
+} snapshot_mark_t;
+
+typedef struct snapshot_store {
+    pthread_mutex_t mutex;
+    snapshot_entry_t* entries;
+    size_t count;
+    size_t capacity;
+    /// Open addressing from event id to entry index plus one (zero is empty).
+    size_t* index;
+    size_t index_capacity;
+    snapshot_mark_t marks[SNAPSHOT_MAX_STREAMS];
+    size_t mark_count;
+} snapshot_store_t;
+
+void snapshot_store_init(snapshot_store_t* store);
+
+/** Record the datagram that has just been built for `event` */
+void snapshot_store_put(snapshot_store_t* store,
+                        const event_t* event,
+                        const wire_header_t* header,
+                        const unsigned char* datagram,
+                        size_t length,
+                        uint64_t now);
+
+/**
+ * Serialize a snapshot of the active events at `now` into a new buffer,
+ * which the caller has to free. Returns its length.
+ */
+size_t snapshot_store_serialize(snapshot_store_t* store,
+                                uint64_t now,
+                                unsigned char** out_buffer);
+
+void snapshot_store_destroy(snapshot_store_t* store);
+
+typedef struct snapshot_server {
+    int socket;
+    pthread_t thread;
+    snapshot_store_t* store;
+    uint64_t served;
+} snapshot_server_t;
+
+/**
+ * Listen on `port` (TCP) and serve snapshots of `store` to whoever connects.
+ *
+ * Returns false and sets errno (or returns a getaddrinfo error in
+ * `out_error`) on failure.
+ */
+bool snapshot_server_start(snapshot_server_t* server,
+                           snapshot_store_t* store,
+                           const char* group,
+                           const char* port,
+                           int* out_error);
+
+void snapshot_server_stop(snapshot_server_t* server);
+
+/** Called for every datagram of a fetched snapshot */
+typedef void (*snapshot_callback_t)(const unsigned char* datagram,
+                                    size_t length,
+                                    void* data);
+
+/**
+ * Fetch a snapshot from `host` and `port`, calling `callback` for each
+ * datagram, including the marks and the end.
+ *
+ * Returns the number of events, or -1 on error (with errno set, or a
+ * getaddrinfo error in `out_error`), including a snapshot without an end.
+ */
+ssize_t snapshot_fetch(const char* host,
+                       const char* port,
+                       snapshot_callback_t callback,
+                       void* data,
+                       int* out_error);
+
+#endif
@@ -30,6 +30,14 @@
 #include <ifaddrs.h>
 
 #include <net/if.h> // if_nametoindex
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <netinet/udp.h> // UDP_SEGMENT
+#include <time.h>
+
+#ifdef LINUX
+#include <linux/net_tstamp.h> // SOF_TIMESTAMPING_*
+#endif
 
 #include "socket-utils.h"
 
@@ -162,9 +170,456 @@ errexit:
 
 
 
+bool socket_supports_gso(int sock) {
+#ifdef UDP_SEGMENT
+    int segment_size = 0;
+    socklen_t len = sizeof(segment_size);
+    return getsockopt(sock, IPPROTO_UDP, UDP_SEGMENT, &segment_size, &len) == 0;
+#else
+    return false;
+#endif
+}
+
+ssize_t send_segmented(int sock,
+                       const void* buffer,
+                       size_t segment_size,
+                       size_t count,
+                       const struct sockaddr* addr,
+                       socklen_t addr_len) {
+#ifdef UDP_SEGMENT
+    struct iovec iov;
+    iov.iov_base = (void*) buffer;
+    iov.iov_len = segment_size * count;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*) addr;
+    msg.msg_namelen = addr_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t size = (uint16_t) segment_size;
+    memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+
+    return sendmsg(sock, &msg, 0);
+#else
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
+
+bool socket_enable_gro(int sock) {
+#ifdef UDP_GRO
+    int yes = 1;
+    return setsockopt(sock, IPPROTO_UDP, UDP_GRO, &yes, sizeof(yes)) == 0;
+#else
+    return false;
+#endif
+}
+
+bool socket_enable_busy_poll(int sock, int usec) {
+#ifdef SO_BUSY_POLL
+    if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) != 0)
+        return false;
+
+#ifdef SO_PREFER_BUSY_POLL
+    // Only a hint (and only since Linux 5.11), so don't mind if it fails.
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &yes, sizeof(yes));
+#endif
+    return true;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+bool socket_set_traffic_class(int sock, int family, int traffic_class) {
+    if (family == AF_INET6)
+        return setsockopt(sock, IPPROTO_IPV6, IPV6_TCLASS, &traffic_class,
+                          sizeof(traffic_class)) == 0;
+
+    return setsockopt(sock, IPPROTO_IP, IP_TOS, &traffic_class,
+                      sizeof(traffic_class)) == 0;
+}
+
+bool socket_set_priority(int sock, int priority) {
+#ifdef SO_PRIORITY
+    return setsockopt(sock, SOL_SOCKET, SO_PRIORITY, &priority,
+                      sizeof(priority)) == 0;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+bool socket_enable_tx_timestamps(int sock) {
+#if defined(SO_TIMESTAMPING) && defined(LINUX)
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING,
+                      &flags, sizeof(flags)) == 0;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+ssize_t receive_tx_timestamp(int sock,
+                             void* buffer,
+                             size_t len,
+                             uint64_t* out_timestamp,
+                             bool* out_truncated) {
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = len;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(struct timespec) * 3) + 64];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    *out_timestamp = 0;
+
+    ssize_t ret;
+    do {
+        ret = recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0)
+        return ret;
+
+    *out_truncated = (msg.msg_flags & MSG_TRUNC) != 0;
+
+#if defined(SO_TIMESTAMPING) && defined(LINUX)
+    // ICMP errors end up in the same queue, but without a timestamp.
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    for (; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            // Software timestamps come first, then legacy and hardware ones.
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            *out_timestamp = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+            break;
+        }
+    }
+#endif
+
+    return ret;
+}
+
+bool socket_enable_rx_timestamps(int sock) {
+#ifdef SO_TIMESTAMPNS
+    int yes = 1;
+    return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(yes)) == 0;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+ssize_t receive_segmented(int sock,
+                          void* buffer,
+                          size_t len,
+                          size_t* out_segment_size,
+                          uint64_t* out_timestamp,
+                          struct sockaddr_storage* out_source) {
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = len;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (out_source) {
+        msg.msg_name = out_source;
+        msg.msg_namelen = sizeof(*out_source);
+    }
+
+    *out_segment_size = 0;
+    if (out_timestamp)
+        *out_timestamp = 0;
+
+    ssize_t ret = recvmsg(sock, &msg, 0);
+    if (ret < 0)
+        return ret;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    for (; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+#ifdef UDP_GRO
+        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int segment_size;
+            memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+            if (segment_size > 0 && segment_size < ret)
+                *out_segment_size = segment_size;
+        }
+#endif
+#ifdef SO_TIMESTAMPNS
+        if (out_timestamp && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            *out_timestamp = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        }
+#endif
+    }
+
+    return ret;
+}
+
+size_t next_segment(char* buffer,
+                    size_t length,
+                    size_t segment_size,
+                    size_t* offset,
+                    char** out_datagram) {
+    assert(segment_size > 0);
+    if (*offset >= length)
+        return 0;
+
+    // Every datagram is `segment_size` long but the last, which may be
+    // shorter.
+    size_t remaining = length - *offset;
+    size_t datagram_length = remaining < segment_size ? remaining
+                                                      : segment_size;
+    *out_datagram = buffer + *offset;
+    *offset += datagram_length;
+    return datagram_length;
+}
+
+/**
+ * Create a socket of `type`, of the same family as `like_address`, bound to
+ * `port` on `local` (every local address if NULL).
+ */
+static int create_bound_socket(const char* like_address,
+                               const char* local,
+                               const char* port,
+                               int type) {
+    int sock = -1;
+    struct addrinfo* remote_address = NULL;
+    struct addrinfo* local_address = NULL;
+    int ret;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = type;
+    ret = getaddrinfo(like_address, NULL, &hints, &remote_address);
+    if (ret != 0)
+        return ret;
+
+    hints.ai_family = remote_address->ai_family;
+    hints.ai_flags = AI_PASSIVE;
+    ret = getaddrinfo(local, port, &hints, &local_address);
+    if (ret != 0) {
+        freeaddrinfo(remote_address);
+        return ret;
+    }
+
+    sock = socket(local_address->ai_family, local_address->ai_socktype, 0);
+    if (sock == -1)
+        goto errexit;
+
+    if (type == SOCK_STREAM) {
+        // Don't make restarts wait for TIME_WAIT.
+        int yes = 1;
+        ret = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (ret != 0)
+            goto errexit;
+    }
+
+    ret = bind(sock, local_address->ai_addr, local_address->ai_addrlen);
+    if (ret != 0)
+        goto errexit;
+
+    freeaddrinfo(remote_address);
+    freeaddrinfo(local_address);
+    return sock;
+
+errexit:
+    if (sock != -1)
+        close(sock);
+
+    freeaddrinfo(remote_address);
+    freeaddrinfo(local_address);
+    return -1;
+}
+
+int create_unicast_socket(const char* like_address, const char* port) {
+    return create_bound_socket(like_address, NULL, port, SOCK_DGRAM);
+}
+
+int create_unicast_socket_at(const char* like_address,
+                             const char* local_address,
+                             const char* port) {
+    return create_bound_socket(like_address, local_address, port, SOCK_DGRAM);
+}
+
+int create_stream_listener(const char* like_address, const char* port) {
+    int sock = create_bound_socket(like_address, NULL, port, SOCK_STREAM);
+    if (sock < 0)
+        return sock;
+
+    if (listen(sock, 16) != 0) {
+        int saved_errno = errno;
+        close(sock);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return sock;
+}
+
+int create_stream_connection(const char* host, const char* port) {
+    struct addrinfo* info = NULL;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int ret = getaddrinfo(host, port, &hints, &info);
+    if (ret != 0)
+        return ret;
+
+    int sock = -1;
+    for (struct addrinfo* current = info; current; current = current->ai_next) {
+        sock = socket(current->ai_family, current->ai_socktype, 0);
+        if (sock == -1)
+            continue;
+
+        if (connect(sock, current->ai_addr, current->ai_addrlen) == 0)
+            break;
+
+        int saved_errno = errno;
+        close(sock);
+        errno = saved_errno;
+        sock = -1;
+    }
+
+    freeaddrinfo(info);
+    return sock;
+}
+
+int create_unix_listener(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+
+    // A stale socket from a previous run would make bind() fail.
+    unlink(path);
+
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+        listen(sock, 16) != 0) {
+        int saved_errno = errno;
+        close(sock);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return sock;
+}
+
+socklen_t socket_address_length(const struct sockaddr_storage* addr) {
+    return addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                       : sizeof(struct sockaddr_in);
+}
+
+/**
+ * Join `group` on `interface` with the protocol-independent API of RFC 3678,
+ * either only for the sources in `filter`, or for every source but them.
+ *
+ * Returns false and sets errno on failure.
+ */
+static bool join_source_filtered(int sock,
+                                 const struct addrinfo* group,
+                                 const char* interface,
+                                 const multicast_filter_t* filter) {
+    int level = group->ai_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+    unsigned int interface_index = 0;
+    if (interface) {
+        interface_index = if_nametoindex(interface);
+        if (!interface_index)
+            return false;
+    }
+
+    if (filter->exclude) {
+        struct group_req request;
+        memset(&request, 0, sizeof(request));
+        request.gr_interface = interface_index;
+        memcpy(&request.gr_group, group->ai_addr, group->ai_addrlen);
+        if (setsockopt(sock, level, MCAST_JOIN_GROUP, &request,
+                       sizeof(request)) != 0)
+            return false;
+    }
+
+    for (size_t i = 0; i < filter->count; ++i) {
+        struct group_source_req request;
+        memset(&request, 0, sizeof(request));
+        request.gsr_interface = interface_index;
+        memcpy(&request.gsr_group, group->ai_addr, group->ai_addrlen);
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = group->ai_family;
+        hints.ai_flags = AI_NUMERICHOST;
+
+        struct addrinfo* source = NULL;
+        if (getaddrinfo(filter->sources[i], NULL, &hints, &source) != 0) {
+            errno = EINVAL;
+            return false;
+        }
+        memcpy(&request.gsr_source, source->ai_addr, source->ai_addrlen);
+        freeaddrinfo(source);
+
+        if (setsockopt(sock, level,
+                       filter->exclude ? MCAST_BLOCK_SOURCE
+                                       : MCAST_JOIN_SOURCE_GROUP,
+                       &request, sizeof(request)) != 0)
+            return false;
+    }
+
+    return true;
+}
+
 int create_multicast_receiver(const char* ip_address,
                               const char* port,
                               const char* interface,
+                              const multicast_filter_t* filter,
                               struct sockaddr** out_addr,
                               socklen_t* out_len) {
     int sock = -1;
@@ -216,8 +671,11 @@ int create_multicast_receiver(const char* ip_address,
     if (ret != 0)
         goto errexit;
 
-    // IPv4
-    if (remote_address->ai_family  == AF_INET) {
+    if (filter && filter->count) {
+        if (!join_source_filtered(sock, remote_address, interface, filter))
+            goto errexit;
+    } else if (remote_address->ai_family  == AF_INET) {
+        // IPv4
         assert(remote_address->ai_addrlen == sizeof(struct sockaddr_in));
         struct ip_mreq request;
 
@@ -19,6 +19,8 @@
  */
 #ifndef SOCKET_UTILS_H
 #define SOCKET_UTILS_H
+#include <stdbool.h>
+#include <stdint.h>
 #include <arpa/inet.h>
 
 int create_multicast_sender(const char* ip_address,
@@ -29,9 +31,199 @@ int create_multicast_sender(const char* ip_address,
                             struct sockaddr** out_addr,
                             socklen_t* out_len);
 
+/**
+ * Whether the kernel can segment UDP sends on this socket (UDP_SEGMENT).
+ */
+bool socket_supports_gso(int sock);
+
+/**
+ * Send `count` datagrams of `segment_size` bytes each, laid out contiguously
+ * in `buffer`, with a single `sendmsg()` call, and let the kernel split them
+ * (UDP generic segmentation offload).
+ *
+ * Returns the same as `sendmsg()`. Fails with ENOPROTOOPT if UDP_SEGMENT isn't
+ * available on this platform.
+ */
+ssize_t send_segmented(int sock,
+                       const void* buffer,
+                       size_t segment_size,
+                       size_t count,
+                       const struct sockaddr* addr,
+                       socklen_t addr_len);
+
+/**
+ * Ask the kernel to coalesce received datagrams of the same flow (UDP_GRO).
+ *
+ * Returns false if it's not supported.
+ */
+bool socket_enable_gro(int sock);
+
+/**
+ * Make reads on an empty socket poll the device queue for up to `usec`
+ * microseconds instead of sleeping (SO_BUSY_POLL), and prefer that over
+ * interrupts (SO_PREFER_BUSY_POLL) where supported.
+ *
+ * Returns false and sets errno if it's not supported or allowed (going over
+ * net.core.busy_read needs CAP_NET_ADMIN).
+ */
+bool socket_enable_busy_poll(int sock, int usec);
+
+/**
+ * Set the traffic class (IPV6_TCLASS) or type of service (IP_TOS) byte of the
+ * datagrams sent through `sock`, depending on `family`. The DSCP goes in the
+ * upper six bits.
+ *
+ * Returns false and sets errno on failure.
+ */
+bool socket_set_traffic_class(int sock, int family, int traffic_class);
+
+/**
+ * Set the priority of the datagrams of `sock` in the local queueing
+ * disciplines (SO_PRIORITY). Going over 6 needs CAP_NET_ADMIN.
+ *
+ * Returns false and sets errno on failure.
+ */
+bool socket_set_priority(int sock, int priority);
+
+/**
+ * Ask the kernel to timestamp every datagram sent through `sock` when it
+ * leaves the stack (SO_TIMESTAMPING, software timestamps), and queue the
+ * timestamps in the error queue of the socket.
+ *
+ * Returns false and sets errno if it's not supported.
+ */
+bool socket_enable_tx_timestamps(int sock);
+
+/**
+ * Take the next sent datagram from the error queue of `sock`, without
+ * blocking, along with its timestamp (CLOCK_REALTIME, in nanoseconds, or zero
+ * if it has none).
+ *
+ * The kernel hands back the whole packet, headers from the link layer down
+ * included. `*out_truncated` says if it didn't fit in `buffer`.
+ *
+ * Returns the same as `recvmsg()`, so -1 with EAGAIN once there's nothing
+ * else.
+ */
+ssize_t receive_tx_timestamp(int sock,
+                             void* buffer,
+                             size_t len,
+                             uint64_t* out_timestamp,
+                             bool* out_truncated);
+
+/**
+ * Ask the kernel to timestamp every received datagram (SO_TIMESTAMPNS), see
+ * `receive_segmented()`.
+ *
+ * Returns false and sets errno if it's not supported.
+ */
+bool socket_enable_rx_timestamps(int sock);
+
+/**
+ * Receive a (possibly coalesced) datagram into `buffer`.
+ *
+ * If the kernel coalesced several datagrams, `*out_segment_size` is set to the
+ * size of each of them (the last one may be shorter), otherwise it's zero.
+ *
+ * If `out_timestamp` is not NULL, it's set to when the kernel received the
+ * datagram (CLOCK_REALTIME, in nanoseconds) if the socket has timestamps
+ * enabled, or zero.
+ *
+ * If `out_source` is not NULL, the address of the sender is written to it.
+ *
+ * Returns the same as `recvmsg()`.
+ */
+ssize_t receive_segmented(int sock,
+                          void* buffer,
+                          size_t len,
+                          size_t* out_segment_size,
+                          uint64_t* out_timestamp,
+                          struct sockaddr_storage* out_source);
+
+/**
+ * Walk the datagrams a coalesced read of `length` bytes (see
+ * `receive_segmented()`) is made of: points `*out_datagram` to the one at
+ * `*offset`, moves `*offset` past it, and returns its length, or zero once
+ * there are no more. `*offset` starts at zero.
+ */
+size_t next_segment(char* buffer,
+                    size_t length,
+                    size_t segment_size,
+                    size_t* offset,
+                    char** out_datagram);
+
+/**
+ * Create a UDP socket for unicast traffic, of the same family as
+ * `like_address`, bound to `port` on every local address ("0" for any free
+ * port).
+ *
+ * Returns the same as `create_multicast_sender()`: the socket, or a negative
+ * value on error.
+ */
+int create_unicast_socket(const char* like_address, const char* port);
+
+/**
+ * Same as `create_unicast_socket()`, but bound only to `local_address` (every
+ * local address if NULL), which has to be of the same family.
+ */
+int create_unicast_socket_at(const char* like_address,
+                             const char* local_address,
+                             const char* port);
+
+/**
+ * Create a TCP socket listening on `port` on every local address, of the same
+ * family as `like_address`.
+ *
+ * Returns the same as `create_unicast_socket()`.
+ */
+int create_stream_listener(const char* like_address, const char* port);
+
+/**
+ * Connect a TCP socket to `host` and `port`.
+ *
+ * Returns the same as `create_unicast_socket()`.
+ */
+int create_stream_connection(const char* host, const char* port);
+
+/**
+ * Create a Unix stream socket listening on `path`, replacing whatever socket
+ * was there.
+ *
+ * Returns -1 and sets errno on failure.
+ */
+int create_unix_listener(const char* path);
+
+/** Length of a sockaddr_in or sockaddr_in6, depending on its family */
+socklen_t socket_address_length(const struct sockaddr_storage* addr);
+
+#define MULTICAST_MAX_SOURCES 16
+
+/**
+ * Which senders of a group we want (RFC 3678 source filters), so the kernel,
+ * and IGMPv3/MLDv2 routers, drop the rest before they reach us.
+ */
+typedef struct multicast_filter {
+    /// Whether `sources` are the senders we don't want, instead of the only
+    /// ones we do.
+    bool exclude;
+    const char* sources[MULTICAST_MAX_SOURCES];
+    size_t count;
+} multicast_filter_t;
+
+#define MULTICAST_FILTER_INITIALIZER {false, {NULL}, 0}
+
+/**
+ * Create a socket bound to `port` and joined to the group at `ip_address`,
+ * on `interface` (if not NULL) and from the senders `filter` allows (any if
+ * NULL or empty).
+ *
+ * Returns the same as `create_unicast_socket()`. Sources that aren't numeric
+ * addresses of the family of the group fail with EINVAL.
+ */
 int create_multicast_receiver(const char* ip_address,
                               const char* port,
                               const char* interface,
+                              const multicast_filter_t* filter,
                               struct sockaddr** out_addr,
                               socklen_t* out_len);
 #endif
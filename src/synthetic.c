@@ -0,0 +1,205 @@
+/**
+ * synthetic.c:
+ *   Synthetic event catalogs, for load testing
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "synthetic.h"
+
+/** Zipf has to precompute its CDF, don't let it get silly */
+#define SYNTHETIC_MAX_ZIPF_VALUES (1 << 20)
+
+bool synthetic_parse_distribution(const char* spec,
+                                  synthetic_distribution_t* out) {
+    const char* cursor;
+    char* end;
+
+    if (strncmp(spec, "fixed:", 6) == 0) {
+        out->kind = SYNTHETIC_FIXED;
+        cursor = spec + 6;
+    } else if (strncmp(spec, "uniform:", 8) == 0) {
+        out->kind = SYNTHETIC_UNIFORM;
+        cursor = spec + 8;
+    } else if (strncmp(spec, "zipf:", 5) == 0) {
+        out->kind = SYNTHETIC_ZIPF;
+        cursor = spec + 5;
+    } else {
+        return false;
+    }
+
+    out->min = strtol(cursor, &end, 10);
+    if (end == cursor)
+        return false;
+
+    out->max = out->min;
+    out->exponent = 1.0;
+
+    if (out->kind == SYNTHETIC_FIXED)
+        return *end == '\0';
+
+    if (*end != '-')
+        return false;
+
+    cursor = end + 1;
+    out->max = strtol(cursor, &end, 10);
+    if (end == cursor || out->max < out->min)
+        return false;
+
+    if (out->kind == SYNTHETIC_ZIPF && *end == ':') {
+        cursor = end + 1;
+        out->exponent = strtod(cursor, &end);
+        if (end == cursor || out->exponent <= 0)
+            return false;
+    }
+
+    return *end == '\0';
+}
+
+/** splitmix64 */
+static uint64_t random_next(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/** Uniform in [0, 1) */
+static double random_unit(uint64_t* state) {
+    return (random_next(state) >> 11) * (1.0 / (1ull << 53));
+}
+
+/** A distribution ready to be sampled */
+typedef struct sampler {
+    const synthetic_distribution_t* distribution;
+    /// Cumulative probabilities, for Zipf.
+    double* cdf;
+    size_t values;
+} sampler_t;
+
+static void sampler_init(sampler_t* sampler,
+                         const synthetic_distribution_t* distribution) {
+    sampler->distribution = distribution;
+    sampler->cdf = NULL;
+    sampler->values = distribution->max - distribution->min + 1;
+
+    if (distribution->kind != SYNTHETIC_ZIPF)
+        return;
+
+    sampler->cdf = malloc(sizeof(double) * sampler->values);
+    assert(sampler->cdf);
+
+    double total = 0;
+    for (size_t k = 0; k < sampler->values; ++k) {
+        total += 1.0 / pow((double)(k + 1), distribution->exponent);
+        sampler->cdf[k] = total;
+    }
+
+    for (size_t k = 0; k < sampler->values; ++k)
+        sampler->cdf[k] /= total;
+}
+
+static long sampler_next(const sampler_t* sampler, uint64_t* state) {
+    const synthetic_distribution_t* distribution = sampler->distribution;
+
+    switch (distribution->kind) {
+        case SYNTHETIC_FIXED:
+            return distribution->min;
+        case SYNTHETIC_UNIFORM:
+            return distribution->min +
+                   (long)(random_next(state) % sampler->values);
+        case SYNTHETIC_ZIPF: {
+            // First value whose cumulative probability is above u.
+            double u = random_unit(state);
+            size_t low = 0, high = sampler->values - 1;
+            while (low < high) {
+                size_t middle = low + (high - low) / 2;
+                if (sampler->cdf[middle] <= u)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            return distribution->min + (long) low;
+        }
+    }
+
+    assert(!"Invalid distribution");
+    return distribution->min;
+}
+
+static void sampler_destroy(sampler_t* sampler) {
+    free(sampler->cdf);
+    sampler->cdf = NULL;
+}
+
+static bool distribution_in_range(const synthetic_distribution_t* distribution,
+                                  long min,
+                                  long max) {
+    if (distribution->min < min || distribution->max > max)
+        return false;
+
+    return distribution->kind != SYNTHETIC_ZIPF ||
+           distribution->max - distribution->min < SYNTHETIC_MAX_ZIPF_VALUES;
+}
+
+bool synthetic_config_is_valid(const synthetic_config_t* config) {
+    return distribution_in_range(&config->period, 1, 1L << 30) &&
+           distribution_in_range(&config->size, 0,
+                                 MAX_EVENT_DESCRIPTION_SIZE - 1) &&
+           config->duration >= 0;
+}
+
+bool synthetic_generate(const synthetic_config_t* config,
+                        event_list_t* out_list) {
+    if (!synthetic_config_is_valid(config))
+        return false;
+
+    sampler_t periods, sizes;
+    sampler_init(&periods, &config->period);
+    sampler_init(&sizes, &config->size);
+
+    uint64_t state = config->seed;
+    for (size_t i = 0; i < config->events; ++i) {
+        event_t event = EVENT_INITIALIZER;
+        event.id = i + 1;
+        event.repeat_after = sampler_next(&periods, &state);
+        event.repeat_during = config->duration;
+        if (config->high_every && event.id % config->high_every == 0)
+            event.priority = EVENT_PRIORITY_HIGH;
+
+        // "syn-<id>-" padded to the size, so every description is different
+        // and easy to tell apart in the client.
+        size_t size = sampler_next(&sizes, &state);
+        int prefix = snprintf(event.description, size + 1, "syn-%zu-", i + 1);
+        assert(prefix >= 0);
+        if ((size_t) prefix < size)
+            memset(event.description + prefix, 'x', size - prefix);
+        event.description[size] = '\0';
+
+        // Not in order: the schedulers don't need it, and event_list's
+        // ordered insertion is quadratic.
+        event_list_push(out_list, &event);
+    }
+
+    sampler_destroy(&periods);
+    sampler_destroy(&sizes);
+    return true;
+}
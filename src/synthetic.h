@@ -0,0 +1,90 @@
+/**
+ * synthetic.h:
+ *   Synthetic event catalogs, for load testing
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event.h"
+
+typedef enum synthetic_kind {
+    /// Always `min`.
+    SYNTHETIC_FIXED,
+    /// Uniform over [min, max].
+    SYNTHETIC_UNIFORM,
+    /// Zipf over [min, max]: `min` is the most frequent value, `min + 1` the
+    /// second one, etc, with P(min + k - 1) proportional to 1 / k^exponent.
+    SYNTHETIC_ZIPF,
+} synthetic_kind_t;
+
+/**
+ * A distribution of integers, parsed from "fixed:N", "uniform:MIN-MAX" or
+ * "zipf:MIN-MAX[:EXPONENT]" (the exponent defaults to 1).
+ */
+typedef struct synthetic_distribution {
+    synthetic_kind_t kind;
+    long min;
+    long max;
+    double exponent;
+} synthetic_distribution_t;
+
+/**
+ * How to generate the catalog: `events` events with periods (in seconds) and
+ * description sizes (in bytes, without the null terminator) drawn from the
+ * distributions, each repeated during `duration` seconds (0 for forever).
+ *
+ * Every `high_every`th event (by id) is of the high priority class, none if
+ * it's zero.
+ *
+ * The same seed always generates the same catalog.
+ */
+typedef struct synthetic_config {
+    size_t events;
+    synthetic_distribution_t period;
+    synthetic_distribution_t size;
+    long duration;
+    uint64_t seed;
+    size_t high_every;
+} synthetic_config_t;
+
+#define SYNTHETIC_CONFIG_INITIALIZER                                           \
+    {0, {SYNTHETIC_FIXED, 1, 1, 1.0}, {SYNTHETIC_FIXED, 32, 32, 1.0}, 0, 1, 0}
+
+/** Parse a distribution. Returns false if it's malformed. */
+bool synthetic_parse_distribution(const char* spec,
+                                  synthetic_distribution_t* out);
+
+/**
+ * Whether the distributions are in range: periods must be positive, sizes must
+ * fit in an event description, and the duration can't be negative.
+ */
+bool synthetic_config_is_valid(const synthetic_config_t* config);
+
+/**
+ * Append the generated events to `out_list`, with ids from 1 to `events`.
+ *
+ * Returns false if the config isn't valid.
+ */
+bool synthetic_generate(const synthetic_config_t* config,
+                        event_list_t* out_list);
+
+#endif
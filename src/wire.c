@@ -0,0 +1,142 @@
+/**
+ * wire.c:
+ *   Framed wire format
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <time.h>
+
+#include "wire.h"
+
+uint64_t wire_now() {
+    struct timespec ts;
+    int ret = clock_gettime(CLOCK_REALTIME, &ts);
+    assert(ret == 0);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline
+void put_u16(unsigned char* buffer, uint16_t value) {
+    buffer[0] = value >> 8;
+    buffer[1] = value;
+}
+
+static inline
+void put_u32(unsigned char* buffer, uint32_t value) {
+    for (int i = 0; i < 4; ++i)
+        buffer[i] = value >> (8 * (3 - i));
+}
+
+static inline
+void put_u64(unsigned char* buffer, uint64_t value) {
+    for (int i = 0; i < 8; ++i)
+        buffer[i] = value >> (8 * (7 - i));
+}
+
+static inline
+uint16_t get_u16(const unsigned char* buffer) {
+    return (uint16_t)buffer[0] << 8 | buffer[1];
+}
+
+static inline
+uint32_t get_u32(const unsigned char* buffer) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i)
+        value = value << 8 | buffer[i];
+    return value;
+}
+
+static inline
+uint64_t get_u64(const unsigned char* buffer) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value = value << 8 | buffer[i];
+    return value;
+}
+
+void wire_encode_header(const wire_header_t* header, unsigned char* buffer) {
+    buffer[0] = 0;
+    buffer[1] = 'M';
+    buffer[2] = 'C';
+    buffer[3] = header->version;
+    buffer[4] = header->type;
+    buffer[5] = header->flags;
+    put_u16(buffer + 6, header->payload_length);
+    put_u32(buffer + 8, header->stream);
+    put_u32(buffer + 12, header->event_id);
+    put_u64(buffer + 16, header->sequence);
+    put_u64(buffer + 24, header->timestamp);
+}
+
+bool wire_decode_header(const unsigned char* buffer,
+                        size_t len,
+                        wire_header_t* out_header) {
+    if (len < WIRE_HEADER_SIZE)
+        return false;
+
+    if (buffer[0] != 0 || buffer[1] != 'M' || buffer[2] != 'C')
+        return false;
+
+    out_header->version = buffer[3];
+    out_header->type = buffer[4];
+    out_header->flags = buffer[5];
+    out_header->payload_length = get_u16(buffer + 6);
+    out_header->stream = get_u32(buffer + 8);
+    out_header->event_id = get_u32(buffer + 12);
+    out_header->sequence = get_u64(buffer + 16);
+    out_header->timestamp = get_u64(buffer + 24);
+
+    if (out_header->version != WIRE_VERSION)
+        return false;
+
+    return out_header->payload_length <= len - WIRE_HEADER_SIZE;
+}
+
+void wire_encode_nack(uint32_t stream,
+                      uint64_t first_sequence,
+                      uint32_t count,
+                      unsigned char* buffer) {
+    wire_header_t header;
+    header.version = WIRE_VERSION;
+    header.type = WIRE_TYPE_NACK;
+    header.flags = 0;
+    header.payload_length = WIRE_NACK_SIZE - WIRE_HEADER_SIZE;
+    header.stream = stream;
+    header.event_id = 0;
+    header.sequence = first_sequence;
+    header.timestamp = wire_now();
+
+    wire_encode_header(&header, buffer);
+    put_u32(buffer + WIRE_HEADER_SIZE, count);
+}
+
+bool wire_decode_nack(const unsigned char* buffer,
+                      size_t len,
+                      uint32_t* out_stream,
+                      uint64_t* out_first_sequence,
+                      uint32_t* out_count) {
+    wire_header_t header;
+    if (!wire_decode_header(buffer, len, &header) ||
+        header.type != WIRE_TYPE_NACK ||
+        header.payload_length < WIRE_NACK_SIZE - WIRE_HEADER_SIZE)
+        return false;
+
+    *out_stream = header.stream;
+    *out_first_sequence = header.sequence;
+    *out_count = get_u32(buffer + WIRE_HEADER_SIZE);
+    return true;
+}
@@ -0,0 +1,117 @@
+/**
+ * wire.h:
+ *   Framed wire format
+ *
+ * Copyright (C) 2015 Emilio Cobos Álvarez (70912324N) <emiliocobos@usal.es>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * By default the server sends the bare event description. When framing is
+ * enabled, every datagram starts with this header (all fields in network
+ * byte order):
+ *
+ * ```
+ *  0      1      2      3      4      5      6             8
+ *  +------+------+------+------+------+------+-------------+
+ *  | 0x00 | 'M'  | 'C'  | ver  | type | flags| payload len |
+ *  +------+------+------+------+------+------+-------------+
+ *  |        stream id          |         event id          |
+ *  +---------------------------+---------------------------+
+ *  |                   sequence number                     |
+ *  +-------------------------------------------------------+
+ *  |          send time (CLOCK_REALTIME, nanoseconds)      |
+ *  +-------------------------------------------------------+
+ * ```
+ *
+ * The leading zero byte means that a client that doesn't know about framing
+ * just sees an empty description, instead of garbage.
+ *
+ * The stream id identifies a sending socket (there's one per shard or
+ * worker), and the sequence number increases by one for every datagram sent
+ * through it.
+ */
+#define WIRE_HEADER_SIZE 32
+#define WIRE_VERSION 1
+
+typedef enum wire_type {
+    WIRE_TYPE_EVENT = 1,
+    /// Forward error correction for the previous events, see fec.h.
+    WIRE_TYPE_PARITY = 2,
+    /// Sent by a receiver to the repair port of the server, asking for
+    /// `count` datagrams of a stream starting at `sequence`. The payload is
+    /// the count (32 bits).
+    WIRE_TYPE_NACK = 3,
+    /// In a snapshot (see snapshot.h), the next sequence number of a stream.
+    WIRE_TYPE_SNAPSHOT_MARK = 4,
+    /// The end of a snapshot, with the number of events in `sequence`.
+    WIRE_TYPE_SNAPSHOT_END = 5,
+} wire_type_t;
+
+/** An event sent again because someone asked for it (see repair.h) */
+#define WIRE_FLAG_REPAIR 0x01
+/** An event that comes from a snapshot, not from the group */
+#define WIRE_FLAG_SNAPSHOT 0x02
+
+/** The size of a NACK datagram */
+#define WIRE_NACK_SIZE (WIRE_HEADER_SIZE + 4)
+
+typedef struct wire_header {
+    uint8_t version;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t payload_length;
+    uint32_t stream;
+    uint32_t event_id;
+    uint64_t sequence;
+    uint64_t timestamp;
+} wire_header_t;
+
+/** Current CLOCK_REALTIME time, in nanoseconds */
+uint64_t wire_now();
+
+/** Write the header into `buffer`, which must be WIRE_HEADER_SIZE long */
+void wire_encode_header(const wire_header_t* header, unsigned char* buffer);
+
+/**
+ * Read a header from a datagram of `len` bytes.
+ *
+ * Returns false if the datagram is not framed (or the payload length doesn't
+ * match), in which case the whole datagram is a bare description.
+ */
+bool wire_decode_header(const unsigned char* buffer,
+                        size_t len,
+                        wire_header_t* out_header);
+
+/** Write a NACK into `buffer`, which must be WIRE_NACK_SIZE long */
+void wire_encode_nack(uint32_t stream,
+                      uint64_t first_sequence,
+                      uint32_t count,
+                      unsigned char* buffer);
+
+/** Read a NACK. Returns false if the datagram is not one. */
+bool wire_decode_nack(const unsigned char* buffer,
+                      size_t len,
+                      uint32_t* out_stream,
+                      uint64_t* out_first_sequence,
+                      uint32_t* out_count);
+
+#endif
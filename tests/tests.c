@@ -17,11 +17,40 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "tests.h"
 #include "event.h"
 #include "config.h"
+#include "scheduler.h"
+#include "deque.h"
+#include "pacer.h"
+#include "wire.h"
+#include "histogram.h"
+#include "lateness.h"
+#include "metrics.h"
+#include "pcap.h"
+#include "synthetic.h"
+#include "fec.h"
+#include "nack.h"
+#include "repair.h"
+#include "snapshot.h"
+#include "dedup.h"
+#include "ring.h"
+#include "control.h"
+#include "shard.h"
+#include "pool.h"
+#include "completion.h"
+#include "realtime.h"
+#include "socket-utils.h"
+#include "sender.h"
+#include "filter.h"
 
 event_list_t mock_list(size_t event_count) {
     event_list_t list = EVENT_LIST_INITIALIZER;
@@ -136,6 +165,1597 @@ TEST(event_parsing, {
     ASSERT(strcmp(event.description, "abc") == 0);
 })
 
+TEST(scheduler_ordering, {
+    scheduler_t scheduler = SCHEDULER_INITIALIZER;
+    event_t event = EVENT_INITIALIZER;
+
+    const uint64_t deadlines[] = { 50, 10, 40, 20, 30, 0 };
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(deadlines); ++i) {
+        event.repeat_after = i;
+        scheduler_add(&scheduler, &event, deadlines[i], NULL);
+    }
+
+    ASSERT(scheduler_size(&scheduler) == STATIC_ARRAY_SIZE(deadlines));
+
+    scheduled_event_t entry;
+    uint64_t last = 0;
+    while (scheduler_pop(&scheduler, &entry)) {
+        ASSERT(entry.deadline >= last);
+        last = entry.deadline;
+    }
+
+    ASSERT(last == 50);
+    ASSERT(scheduler_is_empty(&scheduler));
+    scheduler_destroy(&scheduler);
+})
+
+TEST(scheduler_reschedule, {
+    scheduler_t scheduler = SCHEDULER_INITIALIZER;
+    event_t event = EVENT_INITIALIZER;
+    event.repeat_after = 4;
+    event.repeat_during = 8;
+
+    scheduler_add(&scheduler, &event, 0, NULL);
+
+    // Sent at 0 and 4, but not at 8.
+    scheduled_event_t entry;
+    ASSERT(scheduler_pop(&scheduler, &entry));
+    ASSERT(entry.deadline == 0);
+    ASSERT(scheduler_reschedule(&scheduler, &entry));
+
+    ASSERT(scheduler_pop(&scheduler, &entry));
+    ASSERT(entry.deadline == 4 * NSEC_PER_SEC);
+    ASSERT_FALSE(scheduler_reschedule(&scheduler, &entry));
+    ASSERT(scheduler_is_empty(&scheduler));
+
+    // Never repeated without a period.
+    event.repeat_after = 0;
+    event.repeat_during = 0;
+    scheduler_add(&scheduler, &event, 0, NULL);
+    ASSERT(scheduler_pop(&scheduler, &entry));
+    ASSERT_FALSE(scheduler_reschedule(&scheduler, &entry));
+
+    scheduler_destroy(&scheduler);
+})
+
+TEST(scheduler_find_replace_remove, {
+    scheduler_t scheduler = SCHEDULER_INITIALIZER;
+    event_t event = EVENT_INITIALIZER;
+    event.repeat_after = 1;
+
+    // Ids 1 to 200, due in a scrambled order.
+    for (uint32_t id = 1; id <= 200; ++id) {
+        event.id = id;
+        scheduler_add(&scheduler, &event, (id * 7919) % 211, NULL);
+    }
+
+    // Every other one goes away, and a few get a new deadline.
+    for (uint32_t id = 2; id <= 200; id += 2)
+        ASSERT(scheduler_remove(&scheduler, id, NULL));
+    ASSERT_FALSE(scheduler_remove(&scheduler, 2, NULL));
+    ASSERT_FALSE(scheduler_find(&scheduler, 4));
+
+    event.id = 101;
+    strcpy(event.description, "new");
+    ASSERT(scheduler_replace(&scheduler, &event, 1000));
+    event.id = 102;
+    ASSERT_FALSE(scheduler_replace(&scheduler, &event, 0));
+
+    scheduled_event_t* found = scheduler_find(&scheduler, 101);
+    ASSERT(found && found->deadline == 1000);
+    ASSERT(strcmp(found->event.description, "new") == 0);
+    ASSERT(scheduler_size(&scheduler) == 100);
+
+    // Still a heap, and the index still points to the right entries.
+    scheduled_event_t entry;
+    uint64_t last = 0;
+    size_t popped = 0;
+    while (scheduler_pop(&scheduler, &entry)) {
+        ASSERT(entry.deadline >= last);
+        ASSERT(entry.event.id % 2 == 1);
+        ASSERT_FALSE(scheduler_find(&scheduler, entry.event.id));
+        last = entry.deadline;
+        popped++;
+    }
+
+    ASSERT(popped == 100);
+    ASSERT(last == 1000);
+    scheduler_destroy(&scheduler);
+})
+
+TEST(control_commands, {
+    control_command_t command;
+    const char* error = NULL;
+
+    ASSERT(control_parse_command("add 7 5 10 hello world", &command, &error));
+    ASSERT(command.type == CONTROL_COMMAND_ADD);
+    ASSERT(command.event.id == 7);
+    ASSERT(command.event.repeat_after == 5);
+    ASSERT(command.event.repeat_during == 10);
+    ASSERT(strcmp(command.event.description, "hello world") == 0);
+
+    ASSERT(control_parse_command("cancel 7", &command, &error));
+    ASSERT(command.type == CONTROL_COMMAND_CANCEL && command.event.id == 7);
+
+    ASSERT_FALSE(control_parse_command("update 7", &command, &error));
+    ASSERT_FALSE(control_parse_command("cancel 7 8", &command, &error));
+    ASSERT_FALSE(control_parse_command("delete 7", &command, &error));
+    ASSERT_FALSE(control_parse_command("add x 1 1 a", &command, &error));
+    ASSERT(error);
+})
+
+static void apply_to_shards(const control_command_t* commands,
+                            size_t count,
+                            bool* out_applied,
+                            void* context) {
+    shard_set_apply(context, commands, count, out_applied);
+}
+
+/** Send `lines` to the control socket at `path`, and read until the `ok` */
+static bool control_roundtrip(const char* path,
+                              const char* lines,
+                              char* reply,
+                              size_t reply_size) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+        send(sock, lines, strlen(lines), 0) != (ssize_t) strlen(lines))
+        return false;
+
+    size_t length = 0;
+    reply[0] = '\0';
+    while (!strstr(reply, "ok ") || reply[length - 1] != '\n') {
+        ssize_t ret = recv(sock, reply + length, reply_size - length - 1, 0);
+        if (ret <= 0)
+            break;
+        length += ret;
+        reply[length] = '\0';
+    }
+
+    close(sock);
+    return length > 0;
+}
+
+TEST(control_applied_commands, {
+    sender_config_t sender_config;
+    memset(&sender_config, 0, sizeof(sender_config));
+    sender_config.ip_address = "239.1.2.10";
+    sender_config.port = "9120";
+    sender_config.interface = "lo";
+    sender_config.ttl = 1;
+    sender_config.traffic_class = -1;
+    sender_config.socket_priority = -1;
+
+    dispatch_config_t dispatch_config = DISPATCH_CONFIG_INITIALIZER;
+    shard_set_t shards = SHARD_SET_INITIALIZER;
+    ASSERT(shard_set_start(&shards, 2, &sender_config, NULL,
+                           &dispatch_config));
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/tests-control-%d.sock", (int) getpid());
+    control_server_t control;
+    ASSERT(control_server_start(&control, path, apply_to_shards, &shards));
+
+    // Only the add, the first update and the last cancel find their event.
+    char reply[512];
+    ASSERT(control_roundtrip(path,
+                             "add 1 1 60 one\n"
+                             "update 1 1 60 uno\n"
+                             "update 2 1 60 ghost\n"
+                             "cancel 3\n"
+                             "bogus\n"
+                             "cancel 1\n",
+                             reply, sizeof(reply)));
+    ASSERT(strcmp(reply, "error 5: expected add, update or cancel\n"
+                         "error 3: unknown event id 2\n"
+                         "error 4: unknown event id 3\n"
+                         "ok 3\n") == 0);
+
+    ASSERT(control_roundtrip(path, "cancel 1\n", reply, sizeof(reply)));
+    ASSERT(strcmp(reply, "error 1: unknown event id 1\nok 0\n") == 0);
+
+    control_server_stop(&control);
+    ASSERT(control.applied == 3 && control.rejected == 4);
+    shard_set_stop(&shards, NULL);
+})
+
+static control_command_t lane_command(control_command_type_t type,
+                                      uint32_t id,
+                                      event_priority_t priority,
+                                      const char* description) {
+    control_command_t command;
+    command.type = type;
+    command.event = (event_t) EVENT_INITIALIZER;
+    command.event.id = id;
+    command.event.priority = priority;
+    command.event.repeat_after = 60;
+    command.event.repeat_during = 600;
+    strcpy(command.event.description, description);
+    return command;
+}
+
+/** Apply a single command to `set`, returning whether it was */
+static bool apply_one(shard_set_t* set,
+                      control_command_type_t type,
+                      uint32_t id,
+                      event_priority_t priority,
+                      const char* description) {
+    control_command_t command = lane_command(type, id, priority, description);
+    bool applied;
+    shard_set_apply(set, &command, 1, &applied);
+    return applied;
+}
+
+TEST(shard_set_lane_commands, {
+    sender_config_t sender_config;
+    memset(&sender_config, 0, sizeof(sender_config));
+    sender_config.ip_address = "239.1.2.11";
+    sender_config.port = "9121";
+    sender_config.interface = "lo";
+    sender_config.ttl = 1;
+    sender_config.enable_loopback = true;
+    sender_config.traffic_class = -1;
+    sender_config.socket_priority = -1;
+
+    struct sockaddr* ignored;
+    socklen_t ignored_len;
+    int receiver = create_multicast_receiver("239.1.2.11", "9121", "lo", NULL,
+                                             &ignored, &ignored_len);
+    ASSERT(receiver >= 0);
+    free(ignored);
+
+    // Adds wait for their phase offset, but updates don't.
+    lateness_registry_t lateness;
+    lateness_registry_init(&lateness, true);
+    dispatch_config_t dispatch_config = DISPATCH_CONFIG_INITIALIZER;
+    dispatch_config.spread_phases = true;
+    dispatch_config.lateness = &lateness;
+    shard_set_t shards = SHARD_SET_INITIALIZER;
+    ASSERT(shard_set_start(&shards, 2, &sender_config, &sender_config,
+                           &dispatch_config));
+
+    ASSERT(apply_one(&shards, CONTROL_COMMAND_ADD, 1, EVENT_PRIORITY_BULK, "a"));
+    ASSERT(apply_one(&shards, CONTROL_COMMAND_ADD, 2, EVENT_PRIORITY_HIGH, "b"));
+
+    // Unknown events aren't created by updates, whatever their class.
+    ASSERT_FALSE(apply_one(&shards, CONTROL_COMMAND_UPDATE, 7,
+                           EVENT_PRIORITY_HIGH, "ghost"));
+    ASSERT_FALSE(apply_one(&shards, CONTROL_COMMAND_UPDATE, 8,
+                           EVENT_PRIORITY_BULK, "ghost"));
+    ASSERT_FALSE(apply_one(&shards, CONTROL_COMMAND_CANCEL, 7,
+                           EVENT_PRIORITY_BULK, ""));
+    ASSERT(lateness.count == 2);
+
+    // Moving to the lane and back, sent right away each time (the adds of
+    // both would wait for a while). Ignore anything else that is due.
+    char buffer[64];
+    const char* moves[] = { "moved up", "moved down" };
+    for (size_t i = 0; i < 2; ++i) {
+        control_command_t move = lane_command(CONTROL_COMMAND_UPDATE, 1,
+                                              i ? EVENT_PRIORITY_BULK
+                                                : EVENT_PRIORITY_HIGH,
+                                              moves[i]);
+        ASSERT(event_phase_offset(&move.event) > 2 * NSEC_PER_SEC);
+
+        bool applied;
+        shard_set_apply(&shards, &move, 1, &applied);
+        ASSERT(applied);
+
+        bool received = false;
+        struct pollfd readable = { receiver, POLLIN, 0 };
+        while (!received && poll(&readable, 1, 1000) == 1) {
+            ssize_t ret = recv(receiver, buffer, sizeof(buffer) - 1, 0);
+            ASSERT(ret > 0);
+            buffer[ret] = '\0';
+            received = strcmp(buffer, moves[i]) == 0;
+        }
+        ASSERT(received);
+    }
+    ASSERT(lateness.count == 2);
+
+    // Commands for the same event in a batch still apply in order.
+    control_command_t batch[4];
+    bool applied[4];
+    for (size_t i = 0; i < 4; ++i)
+        batch[i] = lane_command(CONTROL_COMMAND_ADD, 3, EVENT_PRIORITY_BULK,
+                                "c");
+    batch[0].event.priority = EVENT_PRIORITY_HIGH;
+    batch[1].type = CONTROL_COMMAND_UPDATE;
+    batch[2].type = CONTROL_COMMAND_CANCEL;
+    batch[3].type = CONTROL_COMMAND_UPDATE;
+    shard_set_apply(&shards, batch, 4, applied);
+    ASSERT(applied[0] && applied[1] && applied[2] && !applied[3]);
+
+    ASSERT(apply_one(&shards, CONTROL_COMMAND_CANCEL, 1, EVENT_PRIORITY_BULK, ""));
+    ASSERT(apply_one(&shards, CONTROL_COMMAND_CANCEL, 2, EVENT_PRIORITY_BULK, ""));
+    ASSERT_FALSE(apply_one(&shards, CONTROL_COMMAND_CANCEL, 2,
+                           EVENT_PRIORITY_BULK, ""));
+    ASSERT(lateness.count == 0);
+
+    shard_set_stop(&shards, NULL);
+    lateness_registry_destroy(&lateness);
+    close(receiver);
+})
+
+TEST(deque_push_pop_steal, {
+    deque_t deque;
+    int items[100];
+
+    // Small initial capacity, so it has to grow.
+    deque_init(&deque, 4);
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(items); ++i)
+        deque_push(&deque, &items[i]);
+
+    ASSERT(deque_size(&deque) == STATIC_ARRAY_SIZE(items));
+
+    // Thieves take from the top, the owner from the bottom.
+    ASSERT(deque_steal(&deque) == &items[0]);
+    ASSERT(deque_steal(&deque) == &items[1]);
+    ASSERT(deque_pop(&deque) == &items[99]);
+    ASSERT(deque_pop(&deque) == &items[98]);
+    ASSERT(deque_size(&deque) == 96);
+
+    while (deque_pop(&deque))
+        ;
+
+    ASSERT(deque_size(&deque) == 0);
+    ASSERT(deque_steal(&deque) == NULL);
+    ASSERT(deque_pop(&deque) == NULL);
+
+    deque_destroy(&deque);
+})
+
+TEST(event_phase_offset, {
+    event_t event = EVENT_INITIALIZER;
+    event.repeat_after = 5;
+    strcpy(event.description, "abc");
+
+    uint64_t offset = event_phase_offset(&event);
+    ASSERT(offset < 5 * NSEC_PER_SEC);
+    ASSERT(offset == event_phase_offset(&event));
+
+    strcpy(event.description, "abd");
+    ASSERT(offset != event_phase_offset(&event));
+
+    event.repeat_after = 0;
+    ASSERT(event_phase_offset(&event) == 0);
+})
+
+TEST(event_next_deadline, {
+    event_t event = EVENT_INITIALIZER;
+    uint64_t deadline = 100;
+
+    // A zero period never repeats, whatever the duration.
+    event.repeat_during = 2;
+    ASSERT_FALSE(event_next_deadline(&event, 100, &deadline));
+
+    // Every second, during three seconds.
+    event.repeat_after = 1;
+    event.repeat_during = 3;
+    ASSERT(event_next_deadline(&event, 100, &deadline));
+    ASSERT(deadline == 100 + NSEC_PER_SEC);
+    ASSERT(event_next_deadline(&event, 100, &deadline));
+    ASSERT_FALSE(event_next_deadline(&event, 100, &deadline));
+
+    // Forever.
+    event.repeat_during = 0;
+    ASSERT(event_next_deadline(&event, 100, &deadline));
+})
+
+TEST(pacer_packet_rate, {
+    pacer_t pacer;
+    pacer_init(&pacer, 100, 0, 0);
+
+    // The first packet goes right away, then one each 10ms.
+    ASSERT(pacer_reserve(&pacer, 1, 10, 0) == 0);
+    ASSERT(pacer_reserve(&pacer, 1, 10, 0) == 10 * NSEC_PER_MSEC);
+    ASSERT(pacer_reserve(&pacer, 1, 10, 0) == 20 * NSEC_PER_MSEC);
+
+    // After a long idle period we don't get more than the burst.
+    ASSERT(pacer_reserve(&pacer, 1, 10, NSEC_PER_SEC) == 0);
+    ASSERT(pacer_reserve(&pacer, 1, 10, NSEC_PER_SEC) == 10 * NSEC_PER_MSEC);
+})
+
+TEST(pacer_byte_rate, {
+    pacer_t pacer;
+    pacer_init(&pacer, 0, 1000, 0);
+
+    ASSERT(pacer_reserve(&pacer, 1, 1, 0) == 0);
+    // 1 byte of burst minus 1 byte sent, so 100 bytes are 100ms.
+    ASSERT(pacer_reserve(&pacer, 1, 100, 0) == 100 * NSEC_PER_MSEC);
+})
+
+static void* send_three(void* sender) {
+    event_t event = EVENT_INITIALIZER;
+    strcpy(event.description, "paced");
+    for (size_t i = 0; i < 3; ++i)
+        sender_send(sender, &event);
+    return NULL;
+}
+
+TEST(paced_sender_waits_unlocked, {
+    sender_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.ip_address = "239.1.2.13";
+    config.port = "9123";
+    config.interface = "lo";
+    config.ttl = 1;
+    config.max_packets_per_sec = 10;
+    config.traffic_class = -1;
+    config.socket_priority = -1;
+
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    sender_t sender = SENDER_INITIALIZER;
+    ASSERT(sender_open(&sender, &config, 1) >= 0);
+    sender.mutex = &mutex;
+
+    // The thread spends ~200ms waiting for the pacer, but not with the lock.
+    pthread_t thread;
+    uint64_t start = monotonic_now();
+    ASSERT(pthread_create(&thread, NULL, send_three, &sender) == 0);
+    sleep_until(start + 50 * NSEC_PER_MSEC);
+
+    uint64_t before_lock = monotonic_now();
+    pthread_mutex_lock(&mutex);
+    uint64_t waited = monotonic_now() - before_lock;
+    pthread_mutex_unlock(&mutex);
+
+    pthread_join(thread, NULL);
+    ASSERT(waited < 20 * NSEC_PER_MSEC);
+    ASSERT(monotonic_now() - start >= 190 * NSEC_PER_MSEC);
+    ASSERT(sender.counters.packets == 3);
+
+    sender_close(&sender);
+})
+
+TEST(wire_header_roundtrip, {
+    wire_header_t header;
+    header.version = WIRE_VERSION;
+    header.type = WIRE_TYPE_EVENT;
+    header.flags = 0;
+    header.payload_length = 4;
+    header.stream = 0xdeadbeef;
+    header.event_id = 42;
+    header.sequence = 0x0102030405060708ull;
+    header.timestamp = 1234567890123456789ull;
+
+    unsigned char buffer[WIRE_HEADER_SIZE + 4];
+    wire_encode_header(&header, buffer);
+    memcpy(buffer + WIRE_HEADER_SIZE, "abc", 4);
+
+    ASSERT(buffer[0] == 0);
+    ASSERT(buffer[16] == 0x01 && buffer[23] == 0x08);
+
+    wire_header_t decoded;
+    ASSERT(wire_decode_header(buffer, sizeof(buffer), &decoded));
+    ASSERT(decoded.stream == header.stream);
+    ASSERT(decoded.event_id == 42);
+    ASSERT(decoded.sequence == header.sequence);
+    ASSERT(decoded.timestamp == header.timestamp);
+    ASSERT(decoded.payload_length == 4);
+
+    // Truncated payload, and bare descriptions.
+    ASSERT_FALSE(wire_decode_header(buffer, sizeof(buffer) - 1, &decoded));
+    ASSERT_FALSE(wire_decode_header((const unsigned char*) "abc", 4, &decoded));
+})
+
+TEST(histogram_percentiles, {
+    histogram_t histogram;
+    histogram_init(&histogram);
+
+    ASSERT(histogram_percentile(&histogram, 50) == 0);
+
+    for (uint64_t i = 1; i <= 1000; ++i)
+        histogram_record(&histogram, i * 1000);
+
+    ASSERT(histogram.count == 1000);
+    ASSERT(histogram.max == 1000000);
+
+    // Within the 12.5% bucket error.
+    uint64_t p50 = histogram_percentile(&histogram, 50);
+    ASSERT(p50 >= 500000 && p50 <= 500000 * 1.125);
+    uint64_t p99 = histogram_percentile(&histogram, 99);
+    ASSERT(p99 >= 990000 && p99 <= 1000000);
+
+    histogram_t merged;
+    histogram_init(&merged);
+    histogram_merge(&merged, &histogram);
+    histogram_merge(&merged, &histogram);
+    ASSERT(merged.count == 2000);
+    ASSERT(histogram_percentile(&merged, 50) == p50);
+})
+
+TEST(lateness_registry_lookup, {
+    lateness_registry_t registry;
+    lateness_registry_init(&registry, true);
+
+    event_t event = EVENT_INITIALIZER;
+    event.id = 3;
+    strcpy(event.description, "abc");
+
+    histogram_t* histogram = lateness_registry_get(&registry, &event);
+    ASSERT(histogram == lateness_registry_get(&registry, &event));
+
+    lateness_record(histogram, 100, 50);
+    lateness_record(histogram, 100, 300);
+    ASSERT(histogram->count == 2);
+    ASSERT(histogram->max == 200);
+
+    // Updates relabel the same entry, instead of adding one per version.
+    strcpy(event.description, "abd");
+    event.priority = EVENT_PRIORITY_HIGH;
+    ASSERT(histogram == lateness_registry_get(&registry, &event));
+    ASSERT(registry.count == 1);
+    ASSERT(strcmp(registry.first->description, "abd") == 0);
+    ASSERT(registry.first->priority == EVENT_PRIORITY_HIGH);
+
+    event.id = 3 + LATENESS_BUCKETS;
+    histogram_t* other = lateness_registry_get(&registry, &event);
+    ASSERT(histogram != other);
+    ASSERT(registry.count == 2);
+
+    // Cancelled: gone from the registry, but still ours until released.
+    lateness_registry_remove(&registry, 3);
+    lateness_registry_remove(&registry, 3);
+    ASSERT(registry.count == 1 && registry.first == registry.last);
+    ASSERT(registry.first->histogram.count == 0);
+    lateness_record(histogram, 100, 300);
+    ASSERT(lateness_entry_of(histogram)->references == 3);
+    for (size_t i = 0; i < 3; ++i)
+        lateness_release(histogram);
+
+    lateness_registry_remove(&registry, 3 + LATENESS_BUCKETS);
+    ASSERT(!registry.first && !registry.last && registry.count == 0);
+    lateness_release(other);
+
+    lateness_registry_destroy(&registry);
+})
+
+TEST(event_priority_classes, {
+    event_t event = EVENT_INITIALIZER;
+
+    ASSERT(parse_event("high 1 2 abc", &event));
+    ASSERT(event.priority == EVENT_PRIORITY_HIGH);
+    ASSERT(event.repeat_after == 1);
+    ASSERT(strcmp(event.description, "abc") == 0);
+
+    ASSERT(parse_event("1 2 high", &event));
+    ASSERT(event.priority == EVENT_PRIORITY_BULK);
+    ASSERT(strcmp(event.description, "high") == 0);
+
+    ASSERT(parse_event("bulk 3 4 x", &event));
+    ASSERT(event.priority == EVENT_PRIORITY_BULK);
+    ASSERT(!parse_event("urgent 3 4 x", &event));
+
+    lateness_registry_t registry;
+    lateness_registry_init(&registry, true);
+
+    event.id = 1;
+    lateness_record(lateness_registry_get(&registry, &event), 0, 1000);
+    event.id = 2;
+    event.priority = EVENT_PRIORITY_HIGH;
+    lateness_record(lateness_registry_get(&registry, &event), 0, 10);
+
+    histogram_t high, bulk;
+    histogram_init(&high);
+    histogram_init(&bulk);
+    ASSERT(lateness_registry_class_total(&registry, EVENT_PRIORITY_HIGH,
+                                         &high) == 1);
+    ASSERT(lateness_registry_class_total(&registry, EVENT_PRIORITY_BULK,
+                                         &bulk) == 1);
+    ASSERT(high.max == 10);
+    ASSERT(bulk.max == 1000);
+
+    lateness_registry_destroy(&registry);
+})
+
+TEST(lateness_registry_per_class, {
+    lateness_registry_t registry;
+    lateness_registry_init(&registry, false);
+
+    // Every event of a class shares its histogram, and nothing is tracked
+    // per event.
+    event_t event = EVENT_INITIALIZER;
+    event.id = 1;
+    histogram_t* bulk = lateness_registry_get(&registry, &event);
+    event.id = 2;
+    ASSERT(lateness_registry_get(&registry, &event) == bulk);
+    event.priority = EVENT_PRIORITY_HIGH;
+    histogram_t* high = lateness_registry_get(&registry, &event);
+    ASSERT(high != bulk);
+    ASSERT(registry.count == 0);
+
+    lateness_record(bulk, 0, 1000);
+    lateness_record(high, 0, 10);
+    lateness_registry_remove(&registry, 2);
+    lateness_release(bulk);
+    lateness_release(bulk);
+    lateness_release(high);
+
+    histogram_t total, high_total;
+    histogram_init(&total);
+    histogram_init(&high_total);
+    lateness_registry_total(&registry, &total);
+    ASSERT(lateness_registry_class_total(&registry, EVENT_PRIORITY_HIGH,
+                                         &high_total) == 0);
+    ASSERT(total.count == 2);
+    ASSERT(total.max == 1000);
+    ASSERT(high_total.count == 1);
+    ASSERT(high_total.max == 10);
+
+    lateness_registry_destroy(&registry);
+})
+
+TEST(metrics_shared_memory, {
+    char name[64];
+    snprintf(name, sizeof(name), "test-%d", (int) getpid());
+
+    metrics_region_t* region = metrics_create(name, "test");
+    ASSERT(region);
+
+    metrics_slot_t* slot = metrics_claim_slot(region, "thread");
+    ASSERT(slot);
+    ASSERT(((uintptr_t) slot) % METRICS_CACHE_LINE_SIZE == 0);
+    metrics_add(slot, packets_sent, 2);
+    metrics_add(slot, packets_sent, 3);
+    metrics_set(slot, active_events, 7);
+    metrics_add((metrics_slot_t*) NULL, packets_sent, 1);
+
+    const metrics_region_t* reader = metrics_attach(name);
+    ASSERT(reader);
+    ASSERT(reader->slot_count == 1);
+    ASSERT(strcmp(reader->slot_names[0], "thread") == 0);
+    ASSERT(metrics_get(&reader->slots[0], packets_sent) == 5);
+    ASSERT(metrics_get(&reader->slots[0], active_events) == 7);
+    metrics_detach(reader);
+
+    metrics_destroy(region, name);
+    ASSERT_FALSE(metrics_attach(name));
+})
+
+TEST(pcap_classic_vlan_udp, {
+    // Ethernet + 802.1Q + IPv4 + UDP to 239.1.2.3:8000 carrying "abc".
+    const unsigned char frame[] = {
+        0x01, 0x00, 0x5e, 0x01, 0x02, 0x03, 0x02, 0, 0, 0, 0, 1,
+        0x81, 0x00, 0x00, 0x05, 0x08, 0x00,
+        0x45, 0, 0, 32, 0, 0, 0x40, 0, 1, 17, 0, 0,
+        10, 0, 0, 1, 239, 1, 2, 3,
+        0x9c, 0x40, 0x1f, 0x40, 0, 12, 0, 0,
+        'a', 'b', 'c', 0,
+    };
+    uint32_t header[6] = { 0xa1b2c3d4, 0x00040002, 0, 0, 65535, 1 };
+    uint32_t record[4] = { 10, 500, sizeof(frame), sizeof(frame) };
+
+    char filename[] = "/tmp/mcast-test-XXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT(fd >= 0);
+    FILE* f = fdopen(fd, "wb");
+    fwrite(header, sizeof(header), 1, f);
+    fwrite(record, sizeof(record), 1, f);
+    fwrite(frame, sizeof(frame), 1, f);
+    fclose(f);
+
+    pcap_reader_t reader;
+    ASSERT(pcap_open(&reader, filename));
+    unlink(filename);
+
+    pcap_packet_t packet;
+    ASSERT(pcap_next(&reader, &packet) == 1);
+    ASSERT(packet.timestamp == 10 * NSEC_PER_SEC + 500000);
+    ASSERT(packet.link_type == PCAP_LINKTYPE_ETHERNET);
+
+    pcap_udp_t udp;
+    ASSERT(pcap_extract_udp(&packet, &udp));
+    ASSERT(pcap_udp_is_multicast(&udp));
+    ASSERT(udp.destination_port == 8000);
+    ASSERT(udp.length == 4);
+    ASSERT(strcmp((const char*) udp.payload, "abc") == 0);
+
+    ASSERT(pcap_next(&reader, &packet) == 0);
+    pcap_close(&reader);
+})
+
+TEST(pcapng_capture, {
+    pcap_reader_t reader;
+    ASSERT(pcap_open(&reader, "docs/captures/connect-disconnect-ipv4.pcapng"));
+
+    size_t packets = 0, events = 0;
+    pcap_packet_t packet;
+    int ret;
+    while ((ret = pcap_next(&reader, &packet)) == 1) {
+        pcap_udp_t udp;
+        packets++;
+        if (pcap_extract_udp(&packet, &udp) && pcap_udp_is_multicast(&udp) &&
+            udp.destination_port == 8000)
+            events++;
+    }
+
+    ASSERT(ret == 0);
+    ASSERT(packets == 27);
+    ASSERT(events == 22);
+    pcap_close(&reader);
+})
+
+TEST(synthetic_catalog, {
+    synthetic_config_t config = SYNTHETIC_CONFIG_INITIALIZER;
+    ASSERT(synthetic_parse_distribution("zipf:1-100:1.2", &config.period));
+    ASSERT(config.period.kind == SYNTHETIC_ZIPF);
+    ASSERT(config.period.exponent == 1.2);
+    ASSERT(synthetic_parse_distribution("uniform:8-64", &config.size));
+    ASSERT(!synthetic_parse_distribution("uniform:64-8", &config.size));
+    ASSERT(!synthetic_parse_distribution("fixed:8-64", &config.size));
+    ASSERT(!synthetic_parse_distribution("normal:8", &config.size));
+    config.events = 1000;
+
+    event_list_t list = EVENT_LIST_INITIALIZER;
+    ASSERT(synthetic_generate(&config, &list));
+    ASSERT(event_list_size(&list) == 1000);
+
+    size_t shortest = 0;
+    uint32_t id = 0;
+    event_list_node_t* current = event_list_head(&list);
+    while (event_list_node_has_value(current)) {
+        event_t* event = event_list_node_value(current);
+        size_t size = strlen(event->description);
+        ASSERT(event->id == ++id);
+        ASSERT(event->repeat_after >= 1 && event->repeat_after <= 100);
+        ASSERT(size >= 8 && size <= 64);
+        shortest += event->repeat_after == 1;
+        current = event_list_node_next(current);
+    }
+
+    // P(1) is about 0.28 with this exponent, way more than uniform's 0.01.
+    ASSERT(shortest > 200 && shortest < 350);
+
+    // Same seed, same catalog.
+    event_list_t again = EVENT_LIST_INITIALIZER;
+    ASSERT(synthetic_generate(&config, &again));
+    ASSERT(strcmp(event_list_node_value(event_list_head(&list))->description,
+                  event_list_node_value(event_list_head(&again))->description) == 0);
+
+    config.size.max = MAX_EVENT_DESCRIPTION_SIZE;
+    ASSERT(!synthetic_config_is_valid(&config));
+
+    event_list_destroy(&list);
+    event_list_destroy(&again);
+})
+
+TEST(fec_xor_recovery, {
+    fec_encoder_t* encoder = malloc(sizeof(fec_encoder_t));
+    fec_decoder_t* decoder = malloc(sizeof(fec_decoder_t));
+    fec_encoder_init(encoder, 4, 2, 0);
+    fec_decoder_init(decoder);
+
+    size_t block_size, parity_count;
+    ASSERT(fec_parse_spec("8:2", &block_size, &parity_count));
+    ASSERT(block_size == 8 && parity_count == 2);
+    ASSERT(!fec_parse_spec("2:8", &block_size, &parity_count));
+    ASSERT(!fec_parse_spec("8", &block_size, &parity_count));
+
+    // Sequences 10 to 13, with different lengths. 11 and 12 get lost, each
+    // one is covered by a different parity.
+    unsigned char datagrams[4][FEC_MAX_PROTECTED_SIZE];
+    size_t lengths[4];
+    for (size_t i = 0; i < 4; ++i) {
+        const char* descriptions[] = { "a", "bbbbbbbb", "cc", "dddd" };
+        wire_header_t header = { WIRE_VERSION, WIRE_TYPE_EVENT, 0,
+                                 strlen(descriptions[i]) + 1, 7, i + 1,
+                                 10 + i, 1000 + i };
+        wire_encode_header(&header, datagrams[i]);
+        strcpy((char*) datagrams[i] + WIRE_HEADER_SIZE, descriptions[i]);
+        lengths[i] = WIRE_HEADER_SIZE + header.payload_length;
+
+        ASSERT(fec_encoder_add(encoder, 10 + i, datagrams[i], lengths[i],
+                               i * NSEC_PER_SEC) == (i == 3));
+        if (i == 0 || i == 3)
+            fec_decoder_remember(decoder, 10 + i, datagrams[i], lengths[i]);
+    }
+
+    for (size_t j = 0; j < 2; ++j) {
+        unsigned char parity[FEC_MAX_DATAGRAM_SIZE];
+        size_t length = fec_encoder_build_parity(encoder, j, 7, 2000, parity);
+
+        wire_header_t header;
+        ASSERT(wire_decode_header(parity, length, &header));
+        ASSERT(header.type == WIRE_TYPE_PARITY);
+        ASSERT(header.sequence == 10);
+
+        unsigned char rebuilt[FEC_MAX_PROTECTED_SIZE];
+        size_t rebuilt_length = fec_decoder_recover(
+            decoder, &header, parity + WIRE_HEADER_SIZE, rebuilt);
+        // Parity 0 covers 10 and 12, parity 1 covers 11 and 13.
+        size_t lost = j == 0 ? 2 : 1;
+        ASSERT(rebuilt_length == lengths[lost]);
+        ASSERT(memcmp(rebuilt, datagrams[lost], rebuilt_length) == 0);
+
+        // Nothing is missing anymore.
+        ASSERT(!fec_decoder_recover(decoder, &header,
+                                    parity + WIRE_HEADER_SIZE, rebuilt));
+    }
+
+    free(encoder);
+    free(decoder);
+})
+
+static size_t fec_test_datagram(uint64_t sequence,
+                                const char* description,
+                                unsigned char* out) {
+    wire_header_t header = { WIRE_VERSION, WIRE_TYPE_EVENT, 0,
+                             strlen(description) + 1, 7, 1, sequence, 1000 };
+    wire_encode_header(&header, out);
+    strcpy((char*) out + WIRE_HEADER_SIZE, description);
+    return WIRE_HEADER_SIZE + header.payload_length;
+}
+
+TEST(fec_flush_partial_block, {
+    fec_encoder_t* encoder = malloc(sizeof(fec_encoder_t));
+    fec_decoder_t* decoder = malloc(sizeof(fec_decoder_t));
+    fec_encoder_init(encoder, 8, 2, 1000);
+    fec_decoder_init(decoder);
+    ASSERT(!fec_encoder_flush_deadline(encoder));
+
+    // The third datagram comes after the deadline of the block, so it's closed
+    // with three instead of eight, and the lost one is rebuilt right away.
+    const char* descriptions[] = { "slow", "and", "steady" };
+    unsigned char datagrams[3][FEC_MAX_PROTECTED_SIZE];
+    size_t lengths[3];
+    uint64_t times[] = { 100, 600, 1100 };
+    for (size_t i = 0; i < 3; ++i) {
+        lengths[i] = fec_test_datagram(20 + i, descriptions[i], datagrams[i]);
+        ASSERT(fec_encoder_add(encoder, 20 + i, datagrams[i], lengths[i],
+                               times[i]) == (i == 2));
+        ASSERT(fec_encoder_flush_deadline(encoder) == 1100);
+        if (i != 2)
+            fec_decoder_remember(decoder, 20 + i, datagrams[i], lengths[i]);
+    }
+
+    unsigned char parity[FEC_MAX_DATAGRAM_SIZE];
+    size_t length = fec_encoder_build_parity(encoder, 0, 7, 2000, parity);
+    wire_header_t header;
+    ASSERT(wire_decode_header(parity, length, &header));
+    ASSERT(header.sequence == 20);
+    ASSERT(parity[WIRE_HEADER_SIZE] == 0 && parity[WIRE_HEADER_SIZE + 1] == 3);
+
+    unsigned char rebuilt[FEC_MAX_PROTECTED_SIZE];
+    ASSERT(fec_decoder_recover(decoder, &header, parity + WIRE_HEADER_SIZE,
+                               rebuilt) == lengths[2]);
+    ASSERT(memcmp(rebuilt, datagrams[2], lengths[2]) == 0);
+
+    // A block of one only has something for the first parity to cover.
+    fec_encoder_next_block(encoder);
+    ASSERT(!fec_encoder_add(encoder, 23, datagrams[0], lengths[0], 5000));
+    ASSERT(fec_encoder_flush_deadline(encoder) == 6000);
+    ASSERT(fec_encoder_build_parity(encoder, 0, 7, 2000, parity));
+    ASSERT(!fec_encoder_build_parity(encoder, 1, 7, 2000, parity));
+
+    free(encoder);
+    free(decoder);
+
+    // Without more events, whoever owns the sender flushes it when idle.
+    sender_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.ip_address = "239.1.2.14";
+    config.port = "9124";
+    config.interface = "lo";
+    config.ttl = 1;
+    config.enable_loopback = true;
+    config.framed = true;
+    config.fec_block_size = 8;
+    config.fec_parity_count = 2;
+    config.fec_flush_after = 20 * NSEC_PER_MSEC;
+    config.traffic_class = -1;
+    config.socket_priority = -1;
+
+    struct sockaddr* ignored;
+    socklen_t ignored_len;
+    int receiver = create_multicast_receiver("239.1.2.14", "9124", "lo", NULL,
+                                             &ignored, &ignored_len);
+    ASSERT(receiver >= 0);
+    free(ignored);
+
+    sender_t sender = SENDER_INITIALIZER;
+    ASSERT(sender_open(&sender, &config, 1) >= 0);
+    ASSERT(!sender_flush_parity(&sender, monotonic_now()));
+
+    event_t event = EVENT_INITIALIZER;
+    event.id = 1;
+    strcpy(event.description, "lonely");
+    ASSERT(sender_send(&sender, &event) > 0);
+
+    uint64_t deadline = sender_flush_parity(&sender, monotonic_now());
+    ASSERT(deadline);
+    ASSERT(sender.counters.parity == 0);
+    ASSERT(!sender_flush_parity(&sender, deadline));
+    ASSERT(sender.counters.parity == 1);
+
+    unsigned char buffer[FEC_MAX_DATAGRAM_SIZE];
+    ASSERT(recv(receiver, buffer, sizeof(buffer), 0) > 0);
+    ssize_t ret = recv(receiver, buffer, sizeof(buffer), 0);
+    ASSERT(ret > 0);
+    ASSERT(wire_decode_header(buffer, ret, &header));
+    ASSERT(header.type == WIRE_TYPE_PARITY && header.sequence == 0);
+    ASSERT(buffer[WIRE_HEADER_SIZE + 1] == 1);
+
+    sender_close(&sender);
+    close(receiver);
+})
+
+TEST(nack_tracker_ranges, {
+    nack_tracker_t* tracker = malloc(sizeof(nack_tracker_t));
+    nack_tracker_init(tracker, 10, 100, 1);
+
+    struct sockaddr_storage source;
+    memset(&source, 0, sizeof(source));
+    source.ss_family = AF_INET;
+
+    // 70 missing: two entries, due within the delay.
+    nack_tracker_gap(tracker, 5, 1000, 70, &source, 0);
+    ASSERT(tracker->count == 2);
+    ASSERT(nack_tracker_next_due(tracker) < 10);
+
+    // Late arrivals and repairs someone else asked for shrink the range.
+    ASSERT(nack_tracker_fill(tracker, 5, 1000));
+    ASSERT(!nack_tracker_fill(tracker, 5, 1000));
+    ASSERT(nack_tracker_fill(tracker, 5, 1063));
+    ASSERT(!nack_tracker_fill(tracker, 6, 1001));
+
+    nack_request_t request;
+    ASSERT(nack_tracker_pop_due(tracker, 10, &request));
+    ASSERT(request.stream == 5);
+    if (request.first == 1001) {
+        ASSERT(request.count == 62);
+    } else {
+        ASSERT(request.first == 1064 && request.count == 6);
+    }
+    ASSERT(nack_tracker_pop_due(tracker, 10, &request));
+    ASSERT(!nack_tracker_pop_due(tracker, 10, &request));
+
+    // Filling the second entry entirely removes it.
+    for (uint64_t sequence = 1064; sequence < 1070; ++sequence)
+        ASSERT(nack_tracker_fill(tracker, 5, sequence));
+    ASSERT(tracker->count == 1);
+
+    // Retried after `retry`, and given up after NACK_MAX_ATTEMPTS.
+    uint64_t now = 10;
+    for (int i = 1; i < NACK_MAX_ATTEMPTS; ++i) {
+        ASSERT(!nack_tracker_pop_due(tracker, now + 99, &request));
+        now += 110;
+        ASSERT(nack_tracker_pop_due(tracker, now, &request));
+        ASSERT(request.first == 1001);
+    }
+    ASSERT(!nack_tracker_pop_due(tracker, now + 1000, &request));
+    ASSERT(tracker->count == 0);
+    ASSERT(tracker->abandoned == 62);
+
+    free(tracker);
+})
+
+/** Count the datagrams that arrive at `sock` until it's quiet for a while */
+static size_t count_datagrams(int sock) {
+    unsigned char buffer[REPAIR_DATAGRAM_SIZE];
+    struct pollfd readable = { sock, POLLIN, 0 };
+    size_t count = 0;
+    while (poll(&readable, 1, 200) == 1 &&
+           recv(sock, buffer, sizeof(buffer), 0) > 0)
+        count++;
+    return count;
+}
+
+TEST(repair_amplification_limits, {
+    repair_server_t server;
+    int error;
+    ASSERT(repair_server_start(&server, "127.0.0.1", "127.0.0.1", "0", 64,
+                               UINT32_MAX, 0, &error));
+
+    repair_ring_t ring;
+    repair_ring_init(&ring, 64);
+    unsigned char datagram[REPAIR_DATAGRAM_SIZE];
+    memset(datagram, 'x', sizeof(datagram));
+    for (uint64_t i = 0; i < 64; ++i)
+        repair_ring_store(&ring, i, datagram, sizeof(datagram));
+
+    repair_stream_t stream = { 7, &ring, -1, NULL, 0 };
+    ASSERT(repair_server_register(&server, &stream));
+
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    ASSERT(getsockname(server.socket, (struct sockaddr*) &addr, &len) == 0);
+    int client = create_unicast_socket_at("127.0.0.1", "127.0.0.1", "0");
+    ASSERT(client >= 0);
+
+    // A NACK for everything only gets as much as it's worth.
+    unsigned char nack[WIRE_NACK_SIZE];
+    wire_encode_nack(7, 0, 64, nack);
+    size_t worth = WIRE_NACK_SIZE * REPAIR_MAX_AMPLIFICATION /
+                   REPAIR_DATAGRAM_SIZE;
+    ASSERT(worth > 0 && worth < REPAIR_MAX_RANGE);
+    ASSERT(sendto(client, nack, sizeof(nack), 0, (struct sockaddr*) &addr,
+                  len) == sizeof(nack));
+    ASSERT(count_datagrams(client) == worth);
+
+    // And however many NACKs, a source gets a datagram per second here.
+    pthread_mutex_lock(&server.mutex);
+    server.source_bytes_per_sec = REPAIR_DATAGRAM_SIZE;
+    pthread_mutex_unlock(&server.mutex);
+    for (size_t i = 0; i < 4; ++i)
+        ASSERT(sendto(client, nack, sizeof(nack), 0, (struct sockaddr*) &addr,
+                      len) == sizeof(nack));
+    ASSERT(count_datagrams(client) == 1);
+
+    repair_server_unregister(&server, 7);
+    repair_server_stop(&server);
+    ASSERT(server.stats.nacks == 5 && server.stats.unicast == worth + 1);
+    ASSERT(server.stats.limited == 5 * 64 - worth - 1);
+    repair_ring_destroy(&ring);
+    close(client);
+})
+
+TEST(snapshot_store_active, {
+    snapshot_store_t store;
+    snapshot_store_init(&store);
+
+    // Event 1 every second, event 2 every ten, both on stream 3. Event 1 is
+    // sent twice, only the last one counts.
+    event_t events[2] = { { 1, 60, 1, EVENT_PRIORITY_BULK, "one" },
+                          { 10, 60, 2, EVENT_PRIORITY_BULK, "two" } };
+    uint64_t sent_at[3] = { 0, 1, 2 };
+    size_t which[3] = { 0, 1, 0 };
+    for (size_t i = 0; i < 3; ++i) {
+        const event_t* event = &events[which[i]];
+        unsigned char datagram[SNAPSHOT_DATAGRAM_SIZE];
+        wire_header_t header = { WIRE_VERSION, WIRE_TYPE_EVENT, 0,
+                                 strlen(event->description) + 1, 3, event->id,
+                                 20 + i, i };
+        wire_encode_header(&header, datagram);
+        strcpy((char*) datagram + WIRE_HEADER_SIZE, event->description);
+        snapshot_store_put(&store, event, &header, datagram,
+                           WIRE_HEADER_SIZE + header.payload_length,
+                           sent_at[i] * NSEC_PER_SEC);
+    }
+
+    // At 5s event 1 (last sent at 2s, every second) is not active anymore.
+    unsigned char* buffer;
+    size_t length = snapshot_store_serialize(&store, 5 * NSEC_PER_SEC, &buffer);
+
+    wire_header_t headers[3];
+    size_t records = 0;
+    for (size_t offset = 0; offset < length;) {
+        size_t record = (buffer[offset] << 8) | buffer[offset + 1];
+        offset += SNAPSHOT_RECORD_HEADER_SIZE;
+        ASSERT(records < 3);
+        ASSERT(wire_decode_header(buffer + offset, record, &headers[records++]));
+        offset += record;
+    }
+
+    ASSERT(records == 3);
+    ASSERT(headers[0].type == WIRE_TYPE_SNAPSHOT_MARK);
+    ASSERT(headers[0].stream == 3 && headers[0].sequence == 23);
+    ASSERT(headers[1].type == WIRE_TYPE_EVENT);
+    ASSERT(headers[1].event_id == 2 && headers[1].sequence == 21);
+    ASSERT(headers[1].flags & WIRE_FLAG_SNAPSHOT);
+    ASSERT(headers[2].type == WIRE_TYPE_SNAPSHOT_END);
+    ASSERT(headers[2].sequence == 1);
+
+    free(buffer);
+    snapshot_store_destroy(&store);
+})
+
+TEST(dedup_repeated_events, {
+    dedup_set_t set = DEDUP_SET_INITIALIZER;
+    dedup_init(&set, 6 * NSEC_PER_SEC);
+
+    // A hundred events, repeated every 5s: only the first round goes through.
+    for (uint64_t round = 0; round < 4; ++round)
+        for (uint64_t id = 1; id <= 100; ++id)
+            ASSERT(dedup_check(&set, id, id * 7, round * 5 * NSEC_PER_SEC) ==
+                   (round == 0));
+    ASSERT(set.count == 100);
+
+    // A new version goes through once.
+    ASSERT(dedup_check(&set, 1, 1234, 16 * NSEC_PER_SEC));
+    ASSERT(!dedup_check(&set, 1, 1234, 17 * NSEC_PER_SEC));
+
+    // After missing two periods the event was over, so it's new again.
+    ASSERT(dedup_check(&set, 2, 14, 26 * NSEC_PER_SEC));
+    ASSERT(set.expired == 1);
+
+    ASSERT(dedup_hash("abc", 3) != dedup_hash("abd", 3));
+
+    dedup_destroy(&set);
+})
+
+TEST(ring_readers_and_overruns, {
+    char name[64];
+    snprintf(name, sizeof(name), "test-%d", (int) getpid());
+
+    ring_region_t* region = ring_create(name, 5);
+    ASSERT(region);
+    ASSERT(region->slot_count == 8);
+
+    ring_reader_t first, second;
+    ASSERT(ring_attach(&first, name));
+
+    char payload[16];
+    for (int i = 0; i < 4; ++i) {
+        snprintf(payload, sizeof(payload), "p%d", i);
+        ASSERT(ring_publish(region, payload, strlen(payload) + 1, i));
+    }
+
+    // The second one starts from here.
+    ASSERT(ring_attach(&second, name));
+
+    char buffer[RING_SLOT_SIZE];
+    size_t length;
+    uint64_t received_at;
+    ASSERT(ring_read(&first, buffer, sizeof(buffer), &length, &received_at));
+    ASSERT(strcmp(buffer, "p0") == 0 && length == 3 && received_at == 0);
+    ASSERT_FALSE(ring_read(&second, buffer, sizeof(buffer), &length, NULL));
+
+    // 20 more: the first one is lapped and loses 24 - 8 - 1 of them.
+    for (int i = 4; i < 24; ++i) {
+        snprintf(payload, sizeof(payload), "p%d", i);
+        ring_publish(region, payload, strlen(payload) + 1, i);
+    }
+
+    size_t read = 0;
+    while (ring_read(&first, buffer, sizeof(buffer), &length, &received_at)) {
+        if (!read)
+            ASSERT(strcmp(buffer, "p16") == 0 && received_at == 16);
+        read++;
+    }
+    ASSERT(read == 8);
+    ASSERT(first.lost == 15);
+
+    char large[RING_SLOT_SIZE * 2];
+    memset(large, 'x', sizeof(large));
+    ASSERT_FALSE(ring_publish(region, large, sizeof(large), 0));
+
+    ring_detach(&first);
+    ring_detach(&second);
+    ring_destroy(region, name);
+    ASSERT_FALSE(ring_attach(&first, name));
+})
+
+TEST(realtime_cpu_lists, {
+    realtime_config_t config = REALTIME_CONFIG_INITIALIZER;
+    ASSERT(realtime_cpu(&config, 3) == -1);
+    ASSERT(realtime_cpu(NULL, 0) == -1);
+
+    ASSERT(realtime_parse_cpus("2-4,7", &config));
+    ASSERT(config.cpu_count == 4);
+    ASSERT(realtime_cpu(&config, 0) == 2);
+    ASSERT(realtime_cpu(&config, 2) == 4);
+    ASSERT(realtime_cpu(&config, 3) == 7);
+    ASSERT(realtime_cpu(&config, 4) == 2);
+
+    ASSERT(realtime_parse_cpus("5", &config));
+    ASSERT(config.cpu_count == 1 && config.cpus[0] == 5);
+
+    ASSERT_FALSE(realtime_parse_cpus("", &config));
+    ASSERT_FALSE(realtime_parse_cpus("3-1", &config));
+    ASSERT_FALSE(realtime_parse_cpus("1,x", &config));
+    ASSERT_FALSE(realtime_parse_cpus("0-100000", &config));
+
+    // Without a config it just sleeps, with one it spins at the end. Either
+    // way it doesn't return early.
+    uint64_t deadline = monotonic_now() + NSEC_PER_MSEC;
+    realtime_sleep_until(NULL, deadline);
+    ASSERT(monotonic_now() >= deadline);
+
+    deadline = monotonic_now() + NSEC_PER_MSEC;
+    realtime_sleep_until(&config, deadline);
+    ASSERT(monotonic_now() >= deadline);
+})
+
+TEST(kernel_timestamps_loopback, {
+    int sink = socket(AF_INET, SOCK_DGRAM, 0);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT(sink >= 0 && sock >= 0);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    ASSERT(bind(sink, (struct sockaddr*) &addr, len) == 0);
+    ASSERT(getsockname(sink, (struct sockaddr*) &addr, &len) == 0);
+
+    ASSERT(socket_enable_rx_timestamps(sink));
+    ASSERT(socket_enable_tx_timestamps(sock));
+
+    uint64_t before = wire_now();
+    const char payload[] = "timestamped";
+    ASSERT(sendto(sock, payload, sizeof(payload), 0,
+                  (struct sockaddr*) &addr, len) == sizeof(payload));
+
+    // The sent packet comes back with every header, the payload at the end.
+    unsigned char packet[256];
+    uint64_t sent_at;
+    bool truncated;
+    ssize_t ret = receive_tx_timestamp(sock, packet, sizeof(packet), &sent_at,
+                                       &truncated);
+    ASSERT(ret >= (ssize_t) sizeof(payload) && !truncated);
+    ASSERT(memcmp(packet + ret - sizeof(payload), payload,
+                  sizeof(payload)) == 0);
+    ASSERT(sent_at >= before && sent_at <= wire_now());
+    ASSERT(receive_tx_timestamp(sock, packet, sizeof(packet), &sent_at,
+                                &truncated) < 0);
+
+    char buffer[64];
+    size_t segment_size;
+    uint64_t received_at;
+    ASSERT(receive_segmented(sink, buffer, sizeof(buffer), &segment_size,
+                             &received_at, NULL) == sizeof(payload));
+    ASSERT(received_at >= before && received_at <= wire_now());
+
+    close(sock);
+    close(sink);
+})
+
+/**
+ * Send five framed events of the same length with `sender_send_segmented()`,
+ * and check they arrive at `receiver` as five datagrams, in order.
+ */
+TEST(completion_queue_never_blocks, {
+    completion_queue_t queue;
+    ASSERT(completion_queue_init(&queue));
+    ASSERT_FALSE(completion_queue_take_overflow(&queue));
+
+    // With nobody reading, the pipe fills up, and then posting fails instead
+    // of blocking.
+    size_t posted = 0;
+    while (posted < 1000000 && completion_queue_post(&queue, posted))
+        posted++;
+    ASSERT(posted > 0 && posted < 1000000);
+    ASSERT_FALSE(completion_queue_post(&queue, posted));
+    ASSERT(completion_queue_take_overflow(&queue));
+    ASSERT_FALSE(completion_queue_take_overflow(&queue));
+
+    // What fit comes out in order.
+    size_t indices[64];
+    size_t read = 0;
+    size_t count;
+    bool ordered = true;
+    while ((count = completion_queue_read(&queue, indices, 64)) > 0) {
+        for (size_t i = 0; i < count; ++i)
+            ordered = ordered && indices[i] == read + i;
+        read += count;
+    }
+    ASSERT(ordered);
+    ASSERT(read == posted);
+
+    ASSERT(completion_queue_post(&queue, 7));
+    ASSERT(completion_queue_read(&queue, indices, 64) == 1 && indices[0] == 7);
+
+    completion_queue_destroy(&queue);
+})
+
+/**
+ * Add the events `first` to `first + count - 1` (up to 50) to `pool`, due
+ * right away.
+ */
+static void add_pool_events(pool_t* pool, uint32_t first, size_t count) {
+    control_command_t commands[50];
+    bool applied[50];
+    for (size_t i = 0; i < count; ++i) {
+        commands[i] = lane_command(CONTROL_COMMAND_ADD, first + i,
+                                   EVENT_PRIORITY_BULK, "pooled");
+        snprintf(commands[i].event.description,
+                 sizeof(commands[i].event.description), "pooled %zu", i);
+    }
+    pool_apply(pool, commands, count, applied);
+}
+
+TEST(pool_reuses_jobs, {
+    sender_config_t sender_config;
+    memset(&sender_config, 0, sizeof(sender_config));
+    sender_config.ip_address = "239.1.2.15";
+    sender_config.port = "9125";
+    sender_config.interface = "lo";
+    sender_config.ttl = 1;
+    sender_config.enable_loopback = true;
+    sender_config.traffic_class = -1;
+    sender_config.socket_priority = -1;
+
+    struct sockaddr* ignored;
+    socklen_t ignored_len;
+    int receiver = create_multicast_receiver("239.1.2.15", "9125", "lo", NULL,
+                                             &ignored, &ignored_len);
+    ASSERT(receiver >= 0);
+    free(ignored);
+
+    dispatch_config_t dispatch_config = DISPATCH_CONFIG_INITIALIZER;
+    pool_t pool;
+    ASSERT(pool_start(&pool, 2, &sender_config, NULL, &dispatch_config));
+
+    // Once the first ones are sent, the second ones reuse their jobs.
+    add_pool_events(&pool, 1, 50);
+    ASSERT(count_datagrams(receiver) == 50);
+    add_pool_events(&pool, 51, 50);
+    ASSERT(count_datagrams(receiver) == 50);
+
+    sender_counters_t counters = SENDER_COUNTERS_INITIALIZER;
+    pool_stats_t stats = POOL_STATS_INITIALIZER;
+    pool_stop(&pool, &counters, &stats);
+    ASSERT(counters.packets == 100);
+    ASSERT(stats.sent == 100);
+    ASSERT(stats.jobs_allocated > 0 && stats.jobs_allocated <= 50);
+    ASSERT(stats.max_depth > 0);
+    ASSERT(stats.stolen <= stats.sent);
+
+    close(receiver);
+})
+
+static bool send_five_segmented(sender_t* sender, int receiver) {
+    event_t events[5];
+    const event_t* pointers[5];
+    for (size_t i = 0; i < 5; ++i) {
+        events[i] = (event_t) EVENT_INITIALIZER;
+        events[i].id = i + 1;
+        snprintf(events[i].description, sizeof(events[i].description),
+                 "segment %zu", i);
+        pointers[i] = &events[i];
+    }
+
+    uint64_t first_sequence = sender->sequence;
+    if (sender_send_segmented(sender, pointers, 5) != 5)
+        return false;
+
+    unsigned char buffer[SENDER_MAX_DATAGRAM_SIZE * 2];
+    for (size_t i = 0; i < 5; ++i) {
+        struct pollfd readable = { receiver, POLLIN, 0 };
+        if (poll(&readable, 1, 1000) != 1)
+            return false;
+
+        ssize_t ret = recv(receiver, buffer, sizeof(buffer), 0);
+        wire_header_t header;
+        // The description goes with its null terminator.
+        if (ret != (ssize_t)(WIRE_HEADER_SIZE +
+                             strlen(events[i].description) + 1) ||
+            !wire_decode_header(buffer, ret, &header) ||
+            header.sequence != first_sequence + i ||
+            header.event_id != events[i].id ||
+            memcmp(buffer + WIRE_HEADER_SIZE, events[i].description,
+                   ret - WIRE_HEADER_SIZE) != 0)
+            return false;
+    }
+
+    return recv(receiver, buffer, sizeof(buffer), MSG_DONTWAIT) < 0;
+}
+
+TEST(gso_segments_and_fallback, {
+    sender_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.ip_address = "239.1.2.12";
+    config.port = "9122";
+    config.interface = "lo";
+    config.ttl = 1;
+    config.enable_loopback = true;
+    config.enable_gso = true;
+    config.framed = true;
+    config.traffic_class = -1;
+    config.socket_priority = -1;
+
+    struct sockaddr* ignored;
+    socklen_t ignored_len;
+    int receiver = create_multicast_receiver("239.1.2.12", "9122", "lo", NULL,
+                                             &ignored, &ignored_len);
+    ASSERT(receiver >= 0);
+    free(ignored);
+
+    sender_t sender = SENDER_INITIALIZER;
+    ASSERT(sender_open(&sender, &config, 1) >= 0);
+    ASSERT(sender.gso);
+
+    // Each segment is a datagram of its own, framed on its own.
+    ASSERT(send_five_segmented(&sender, receiver));
+    ASSERT(sender.gso);
+    ASSERT(sender.counters.packets == 5 && sender.counters.errors == 0);
+
+    // Without UDP checksums the kernel refuses to segment (EINVAL), so the
+    // sender has to go one by one, without a gap in the sequence numbers.
+    int yes = 1;
+    ASSERT(setsockopt(sender.socket, SOL_SOCKET, SO_NO_CHECK, &yes,
+                      sizeof(yes)) == 0);
+    ASSERT(send_five_segmented(&sender, receiver));
+    ASSERT_FALSE(sender.gso);
+    ASSERT(sender.counters.packets == 10 && sender.counters.errors == 0);
+
+    sender_close(&sender);
+    close(receiver);
+})
+
+TEST(gro_coalesced_reads, {
+    // The last datagram of a coalesced read may be shorter.
+    char buffer[4096];
+    size_t offset = 0;
+    char* datagram = NULL;
+    ASSERT(next_segment(buffer, 250, 100, &offset, &datagram) == 100);
+    ASSERT(datagram == buffer && offset == 100);
+    ASSERT(next_segment(buffer, 250, 100, &offset, &datagram) == 100);
+    ASSERT(datagram == buffer + 100);
+    ASSERT(next_segment(buffer, 250, 100, &offset, &datagram) == 50);
+    ASSERT(datagram == buffer + 200);
+    ASSERT(next_segment(buffer, 250, 100, &offset, &datagram) == 0);
+
+    int sink = socket(AF_INET, SOCK_DGRAM, 0);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT(sink >= 0 && sock >= 0);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    ASSERT(bind(sink, (struct sockaddr*) &addr, len) == 0);
+    ASSERT(getsockname(sink, (struct sockaddr*) &addr, &len) == 0);
+    ASSERT(socket_enable_gro(sink));
+    ASSERT(socket_supports_gso(sock));
+
+    // A segmented send stays coalesced through the loopback.
+    char sent[4 * 100];
+    for (size_t i = 0; i < sizeof(sent); ++i)
+        sent[i] = 'a' + i / 100;
+    ASSERT(send_segmented(sock, sent, 100, 4, (struct sockaddr*) &addr, len) ==
+           sizeof(sent));
+
+    size_t segment_size;
+    ssize_t ret = receive_segmented(sink, buffer, sizeof(buffer),
+                                    &segment_size, NULL, NULL);
+    ASSERT(ret == sizeof(sent) && segment_size == 100);
+
+    size_t count = 0;
+    size_t length;
+    offset = 0;
+    while ((length = next_segment(buffer, ret, segment_size, &offset,
+                                  &datagram))) {
+        ASSERT(length == 100);
+        ASSERT(datagram[0] == 'a' + (char) count &&
+               datagram[99] == 'a' + (char) count);
+        count++;
+    }
+    ASSERT(count == 4);
+
+    close(sock);
+    close(sink);
+})
+
+TEST(filter_programs, {
+    filter_t filter = FILTER_INITIALIZER;
+    ASSERT(filter_is_empty(&filter));
+    ASSERT(filter_parse("prefix=ab", &filter));
+    ASSERT(!filter_parse("prefix=cd", &filter));
+    ASSERT(filter_parse("id=3,5", &filter));
+    ASSERT(!filter_parse("id=x", &filter));
+    ASSERT(!filter_parse("port=1", &filter));
+    ASSERT(filter.id_count == 2 && filter.prefix_length == 2);
+
+    // Event 5 with the prefix, event 4, event 5 without the prefix, parity
+    // for event 5, a bare description, and event 5 again.
+    unsigned char datagrams[6][WIRE_HEADER_SIZE + 8];
+    size_t lengths[6];
+    const uint32_t ids[6] = { 5, 4, 5, 5, 0, 5 };
+    const char* descriptions[6] = { "abcdefg", "abcdefg", "xbcdefg",
+                                    "abcdefg", "abc", "abc" };
+    const bool expected[6] = { true, false, false, false, false, true };
+    for (size_t i = 0; i < 6; ++i) {
+        size_t length = strlen(descriptions[i]) + 1;
+        if (i == 4) {
+            memcpy(datagrams[i], descriptions[i], length);
+            lengths[i] = length;
+        } else {
+            wire_header_t header = { WIRE_VERSION,
+                                     i == 3 ? WIRE_TYPE_PARITY : WIRE_TYPE_EVENT,
+                                     0, length, 7, ids[i], i, 0 };
+            wire_encode_header(&header, datagrams[i]);
+            memcpy(datagrams[i] + WIRE_HEADER_SIZE, descriptions[i], length);
+            lengths[i] = WIRE_HEADER_SIZE + length;
+        }
+        ASSERT(filter_match(&filter, datagrams[i], lengths[i]) == expected[i]);
+    }
+
+    filter_t prefix_only = FILTER_INITIALIZER;
+    ASSERT(filter_parse("prefix=abc", &prefix_only));
+    ASSERT(filter_match(&prefix_only, datagrams[4], lengths[4]));
+    ASSERT(!filter_match(&prefix_only, (const unsigned char*) "ab", 2));
+
+    // The kernel has to drop the same ones.
+    int sink = socket(AF_INET, SOCK_DGRAM, 0);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT(sink >= 0 && sock >= 0);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    ASSERT(bind(sink, (struct sockaddr*) &addr, len) == 0);
+    ASSERT(getsockname(sink, (struct sockaddr*) &addr, &len) == 0);
+
+    size_t instructions = 0;
+    ASSERT(filter_attach(sink, &filter, &instructions));
+    ASSERT(instructions > 0);
+
+    for (size_t i = 0; i < 6; ++i)
+        ASSERT(sendto(sock, datagrams[i], lengths[i], 0,
+                      (struct sockaddr*) &addr, len) == (ssize_t) lengths[i]);
+
+    // The last one matches, so everything before it has been filtered.
+    unsigned char buffer[64];
+    size_t received = 0;
+    ssize_t ret;
+    do {
+        struct pollfd readable = { sink, POLLIN, 0 };
+        ASSERT(poll(&readable, 1, 1000) == 1);
+        ret = recv(sink, buffer, sizeof(buffer), 0);
+        ASSERT(ret > 0);
+        received++;
+    } while (ret != (ssize_t) lengths[5] ||
+             memcmp(buffer, datagrams[5], lengths[5]) != 0);
+    ASSERT(received == 2);
+
+    close(sock);
+    close(sink);
+})
+
+TEST(source_filtered_receivers, {
+    struct sockaddr* addr = NULL;
+    socklen_t len = 0;
+    int sender = create_multicast_sender("239.1.2.9", "9119", "lo", 1, true,
+                                         &addr, &len);
+    ASSERT(sender >= 0);
+
+    // Sending through lo, our source is 127.0.0.1.
+    multicast_filter_t filter = MULTICAST_FILTER_INITIALIZER;
+    filter.sources[filter.count++] = "127.0.0.2";
+
+    int receivers[3];
+    struct sockaddr* ignored;
+    socklen_t ignored_len;
+    receivers[0] = create_multicast_receiver("239.1.2.9", "9119", "lo",
+                                             &filter, &ignored, &ignored_len);
+    free(ignored);
+    filter.exclude = true;
+    receivers[1] = create_multicast_receiver("239.1.2.9", "9119", "lo",
+                                             &filter, &ignored, &ignored_len);
+    free(ignored);
+    filter.exclude = false;
+    filter.sources[0] = "127.0.0.1";
+    receivers[2] = create_multicast_receiver("239.1.2.9", "9119", "lo",
+                                             &filter, &ignored, &ignored_len);
+    free(ignored);
+    ASSERT(receivers[0] >= 0 && receivers[1] >= 0 && receivers[2] >= 0);
+
+    filter.sources[0] = "not-an-address";
+    errno = 0;
+    ASSERT(create_multicast_receiver("239.1.2.9", "9119", "lo", &filter,
+                                     &ignored, &ignored_len) < 0);
+    ASSERT(errno == EINVAL && !ignored);
+
+    const char payload[] = "filtered";
+    ASSERT(sendto(sender, payload, sizeof(payload), 0, addr, len) ==
+           sizeof(payload));
+
+    char buffer[64];
+    for (size_t i = 1; i < 3; ++i) {
+        struct pollfd readable = { receivers[i], POLLIN, 0 };
+        ASSERT(poll(&readable, 1, 1000) == 1);
+        ASSERT(recv(receivers[i], buffer, sizeof(buffer), 0) ==
+               sizeof(payload));
+    }
+    ASSERT(recv(receivers[0], buffer, sizeof(buffer), MSG_DONTWAIT) < 0);
+    ASSERT(errno == EAGAIN || errno == EWOULDBLOCK);
+
+    for (size_t i = 0; i < 3; ++i)
+        close(receivers[i]);
+    close(sender);
+    free(addr);
+})
+
 TEST_MAIN({
     RUN_TEST(event_list_push_pop);
     RUN_TEST(event_list_del_middle);
@@ -143,4 +1763,46 @@ TEST_MAIN({
     RUN_TEST(event_list_push_ordered);
 
     RUN_TEST(event_parsing);
+
+    RUN_TEST(scheduler_ordering);
+    RUN_TEST(scheduler_reschedule);
+    RUN_TEST(scheduler_find_replace_remove);
+    RUN_TEST(control_commands);
+    RUN_TEST(control_applied_commands);
+    RUN_TEST(shard_set_lane_commands);
+
+    RUN_TEST(deque_push_pop_steal);
+
+    RUN_TEST(event_phase_offset);
+    RUN_TEST(event_next_deadline);
+    RUN_TEST(pacer_packet_rate);
+    RUN_TEST(pacer_byte_rate);
+    RUN_TEST(paced_sender_waits_unlocked);
+
+    RUN_TEST(wire_header_roundtrip);
+    RUN_TEST(histogram_percentiles);
+    RUN_TEST(lateness_registry_lookup);
+    RUN_TEST(event_priority_classes);
+    RUN_TEST(lateness_registry_per_class);
+    RUN_TEST(realtime_cpu_lists);
+    RUN_TEST(metrics_shared_memory);
+
+    RUN_TEST(pcap_classic_vlan_udp);
+    RUN_TEST(pcapng_capture);
+
+    RUN_TEST(synthetic_catalog);
+    RUN_TEST(fec_xor_recovery);
+    RUN_TEST(fec_flush_partial_block);
+    RUN_TEST(nack_tracker_ranges);
+    RUN_TEST(repair_amplification_limits);
+    RUN_TEST(snapshot_store_active);
+    RUN_TEST(dedup_repeated_events);
+    RUN_TEST(ring_readers_and_overruns);
+    RUN_TEST(kernel_timestamps_loopback);
+    RUN_TEST(completion_queue_never_blocks);
+    RUN_TEST(pool_reuses_jobs);
+    RUN_TEST(gso_segments_and_fallback);
+    RUN_TEST(gro_coalesced_reads);
+    RUN_TEST(source_filtered_receivers);
+    RUN_TEST(filter_programs);
 })